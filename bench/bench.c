@@ -0,0 +1,562 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "workload.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * shoreline-bench is a load generator for reproducible pixelflut benchmarks.
+ * Every worker thread renders its workload into a command buffer once and
+ * then streams that buffer over its connections in a loop. Generating
+ * traffic costs nothing but send() calls, the client should never be the
+ * bottleneck.
+ *
+ * Connections are non-blocking and multiplexed with poll(). Responses to PX
+ * reads are drained as they arrive so the server never stalls on a full
+ * send buffer.
+ *
+ * Throughput is reported once per second and summarized at the end. Pixel
+ * rates are derived from the bytes sent and the pixel density of the command
+ * buffers. The summary line is meant to be parsed by scripts.
+ */
+
+#define BENCH_PORT_DEFAULT "1234"
+#define BENCH_HOST_DEFAULT "localhost"
+#define BENCH_CONNECTIONS_DEFAULT 8
+#define BENCH_DURATION_DEFAULT 10
+#define BENCH_BUFFER_SIZE_DEFAULT (4 * 1024 * 1024)
+#define BENCH_SEED_DEFAULT 1
+
+#define BENCH_MAX_CPUS 1024
+#define BENCH_RECV_BUFFER_SIZE 65536
+
+
+struct bench_connection {
+	int socket;
+	size_t offset;
+};
+
+struct bench;
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench* bench;
+	int cpu;
+	unsigned int num_connections;
+	struct bench_connection* connections;
+	struct workload_buffer buffer;
+
+	// Only written by the thread itself
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t responses;
+	int err;
+};
+
+struct bench {
+	const char* host;
+	const char* port;
+	const char* unix_path;
+	struct addrinfo* addr_list;
+
+	enum workload_type workload;
+	unsigned int width;
+	unsigned int height;
+	unsigned int num_connections;
+	unsigned int num_threads;
+	unsigned int duration;
+	size_t buffer_size;
+	uint64_t seed;
+
+	int cpus[BENCH_MAX_CPUS];
+	unsigned int num_cpus;
+
+	bool exit;
+	struct bench_thread* threads;
+};
+
+static volatile sig_atomic_t do_exit = 0;
+
+static void bench_doshutdown(int sig) {
+	do_exit = 1;
+}
+
+static int bench_connect(struct bench* bench) {
+	int err, sock;
+	struct addrinfo* addr;
+
+	if(bench->unix_path) {
+		struct sockaddr_un addr_un = { .sun_family = AF_UNIX };
+
+		strncpy(addr_un.sun_path, bench->unix_path, sizeof(addr_un.sun_path) - 1);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(sock < 0) {
+			return -errno;
+		}
+		if(connect(sock, (struct sockaddr*)&addr_un, sizeof(addr_un))) {
+			err = -errno;
+			close(sock);
+			return err;
+		}
+		return sock;
+	}
+
+	err = -ENOENT;
+	for(addr = bench->addr_list; addr; addr = addr->ai_next) {
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if(sock < 0) {
+			err = -errno;
+			continue;
+		}
+		if(!connect(sock, addr->ai_addr, addr->ai_addrlen)) {
+			return sock;
+		}
+		err = -errno;
+		close(sock);
+	}
+	return err;
+}
+
+// Ask the server for its canvas size, needs shoreline built with SIZE
+static int bench_query_size(struct bench* bench) {
+	int err, sock;
+	char response[64];
+	size_t len = 0;
+	ssize_t read_len;
+
+	sock = bench_connect(bench);
+	if(sock < 0) {
+		return sock;
+	}
+	if(write(sock, "SIZE\n", 5) != 5) {
+		err = -EIO;
+		goto fail;
+	}
+	while(len < sizeof(response) - 1 && !memchr(response, '\n', len)) {
+		read_len = read(sock, response + len, sizeof(response) - 1 - len);
+		if(read_len <= 0) {
+			err = read_len < 0 ? -errno : -EPIPE;
+			goto fail;
+		}
+		len += read_len;
+	}
+	response[len] = 0;
+	if(sscanf(response, "SIZE %u %u", &bench->width, &bench->height) != 2 || !bench->width || !bench->height) {
+		err = -EPROTO;
+		goto fail;
+	}
+	close(sock);
+	return 0;
+
+fail:
+	close(sock);
+	return err;
+}
+
+static void bench_counter_add(uint64_t* counter, uint64_t val) {
+	__atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
+static uint64_t bench_counter_read(uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int bench_drain(struct bench_thread* thread, struct bench_connection* conn) {
+	char buf[BENCH_RECV_BUFFER_SIZE];
+	ssize_t len;
+
+	while(1) {
+		len = recv(conn->socket, buf, sizeof(buf), MSG_DONTWAIT);
+		if(len < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+		}
+		if(len == 0) {
+			return -EPIPE;
+		}
+		bench_counter_add(&thread->bytes_received, len);
+		if(thread->buffer.reads) {
+			unsigned long long responses = 0;
+			char* cursor = buf;
+
+			while((cursor = memchr(cursor, '\n', buf + len - cursor))) {
+				responses++;
+				cursor++;
+			}
+			bench_counter_add(&thread->responses, responses);
+		}
+	}
+}
+
+static int bench_send(struct bench_thread* thread, struct bench_connection* conn) {
+	struct workload_buffer* buf = &thread->buffer;
+	ssize_t len;
+
+	len = send(conn->socket, buf->data + conn->offset, buf->len - conn->offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(len < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+	}
+	bench_counter_add(&thread->bytes_sent, len);
+	conn->offset += len;
+	if(conn->offset >= buf->len) {
+		conn->offset = 0;
+	}
+	return 0;
+}
+
+static void* bench_thread_run(void* args) {
+	struct bench_thread* thread = args;
+	struct bench* bench = thread->bench;
+	struct pollfd* pollfds;
+	unsigned int i;
+	int err = 0;
+
+	if(thread->cpu >= 0) {
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(thread->cpu, &cpuset);
+		if((err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))) {
+			fprintf(stderr, "Failed to pin thread to cpu %d, continuing without: %s (%d)\n", thread->cpu, strerror(err), err);
+		}
+	}
+
+	pollfds = calloc(thread->num_connections, sizeof(struct pollfd));
+	if(!pollfds) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	for(i = 0; i < thread->num_connections; i++) {
+		pollfds[i].fd = thread->connections[i].socket;
+		pollfds[i].events = POLLIN | POLLOUT;
+	}
+
+	while(!__atomic_load_n(&bench->exit, __ATOMIC_RELAXED)) {
+		if(poll(pollfds, thread->num_connections, 100) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			err = -errno;
+			goto fail_pollfds;
+		}
+		for(i = 0; i < thread->num_connections; i++) {
+			struct bench_connection* conn = &thread->connections[i];
+			short revents = pollfds[i].revents;
+
+			if(revents & (POLLIN | POLLERR | POLLHUP)) {
+				if((err = bench_drain(thread, conn))) {
+					goto fail_pollfds;
+				}
+			}
+			if(revents & POLLOUT) {
+				if((err = bench_send(thread, conn))) {
+					goto fail_pollfds;
+				}
+			}
+		}
+	}
+
+fail_pollfds:
+	free(pollfds);
+fail:
+	if(err) {
+		fprintf(stderr, "Worker thread failed: %s (%d)\n", strerror(-err), err);
+		__atomic_store_n(&bench->exit, true, __ATOMIC_RELAXED);
+	}
+	thread->err = err;
+	return NULL;
+}
+
+static int bench_parse_cpus(struct bench* bench, const char* list) {
+	const char* cursor = list;
+	char* end;
+	long first, last;
+
+	bench->num_cpus = 0;
+	while(*cursor) {
+		first = strtol(cursor, &end, 10);
+		if(end == cursor || first < 0) {
+			return -EINVAL;
+		}
+		last = first;
+		if(*end == '-') {
+			cursor = end + 1;
+			last = strtol(cursor, &end, 10);
+			if(end == cursor || last < first) {
+				return -EINVAL;
+			}
+		}
+		for(; first <= last; first++) {
+			if(bench->num_cpus >= BENCH_MAX_CPUS) {
+				return -E2BIG;
+			}
+			bench->cpus[bench->num_cpus++] = first;
+		}
+		if(*end == ',') {
+			end++;
+		} else if(*end) {
+			return -EINVAL;
+		}
+		cursor = end;
+	}
+	return bench->num_cpus ? 0 : -EINVAL;
+}
+
+struct bench_totals {
+	unsigned long long bytes;
+	double pixels;
+	unsigned long long responses;
+};
+
+static void bench_get_totals(struct bench* bench, struct bench_totals* totals) {
+	unsigned int i;
+
+	memset(totals, 0, sizeof(*totals));
+	for(i = 0; i < bench->num_threads; i++) {
+		struct bench_thread* thread = &bench->threads[i];
+		unsigned long long bytes = bench_counter_read(&thread->bytes_sent);
+
+		totals->bytes += bytes;
+		totals->pixels += (double)bytes * thread->buffer.pixels / thread->buffer.len;
+		totals->responses += bench_counter_read(&thread->responses);
+	}
+}
+
+static double timespec_diff(struct timespec* a, struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1000000000.0;
+}
+
+static void show_usage(char* binary) {
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-h <host>] [-p <port>] [-u <unix socket>] [-c <connections>] [-t <threads>] "\
+		"[-w <workload>] [-d <duration>] [-C <cpu list>] [-W <width>] [-H <height>] [-b <buffer size>] [-S <seed>] [-?]\n", binary);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -h <host>         Host to connect to (default %s)\n", BENCH_HOST_DEFAULT);
+	fprintf(stderr, "  -p <port>         Port to connect to (default %s)\n", BENCH_PORT_DEFAULT);
+	fprintf(stderr, "  -u <path>         Connect to unix socket <path> instead\n");
+	fprintf(stderr, "  -c <connections>  Number of connections (default %u)\n", BENCH_CONNECTIONS_DEFAULT);
+	fprintf(stderr, "  -t <threads>      Number of threads, connections are distributed evenly (default one per connection)\n");
+	fprintf(stderr, "  -w <workload>     Workload to send (default %s)\n", workloads[WORKLOAD_RANDOM].name);
+	fprintf(stderr, "  -d <duration>     Duration in seconds (default %u)\n", BENCH_DURATION_DEFAULT);
+	fprintf(stderr, "  -C <cpu list>     Pin threads round robin to cpus, e.g. 0-3,8\n");
+	fprintf(stderr, "  -W <width>        Canvas width, queried using SIZE by default\n");
+	fprintf(stderr, "  -H <height>       Canvas height, queried using SIZE by default\n");
+	fprintf(stderr, "  -b <buffer size>  Size of the command buffer of each thread in bytes (default %u)\n", BENCH_BUFFER_SIZE_DEFAULT);
+	fprintf(stderr, "  -S <seed>         Seed for workload generation (default %u)\n", BENCH_SEED_DEFAULT);
+	fprintf(stderr, "  -?                Show this help\n");
+	fprintf(stderr, "Workloads:\n");
+	for(i = 0; i < WORKLOAD_NUM_TYPES; i++) {
+		fprintf(stderr, "  %-8s %s\n", workloads[i].name, workloads[i].description);
+	}
+}
+
+int main(int argc, char** argv) {
+	int opt, err = 0;
+	unsigned int i, j, elapsed;
+	struct bench bench = {
+		.host = BENCH_HOST_DEFAULT,
+		.port = BENCH_PORT_DEFAULT,
+		.workload = WORKLOAD_RANDOM,
+		.num_connections = BENCH_CONNECTIONS_DEFAULT,
+		.duration = BENCH_DURATION_DEFAULT,
+		.buffer_size = BENCH_BUFFER_SIZE_DEFAULT,
+		.seed = BENCH_SEED_DEFAULT,
+	};
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct bench_totals totals, last_totals = { 0 };
+	struct timespec start, last, now;
+	struct timespec interval = { .tv_sec = 1, .tv_nsec = 0 };
+	double duration;
+
+	while((opt = getopt(argc, argv, "h:p:u:c:t:w:d:C:W:H:b:S:?")) != -1) {
+		switch(opt) {
+			case('h'):
+				bench.host = optarg;
+				break;
+			case('p'):
+				bench.port = optarg;
+				break;
+			case('u'):
+				bench.unix_path = optarg;
+				break;
+			case('c'):
+				bench.num_connections = atoi(optarg);
+				break;
+			case('t'):
+				bench.num_threads = atoi(optarg);
+				break;
+			case('w'):
+				if((err = workload_find(optarg)) < 0) {
+					fprintf(stderr, "Unknown workload '%s'\n", optarg);
+					show_usage(argv[0]);
+					return 1;
+				}
+				bench.workload = err;
+				err = 0;
+				break;
+			case('d'):
+				bench.duration = atoi(optarg);
+				break;
+			case('C'):
+				if(bench_parse_cpus(&bench, optarg)) {
+					fprintf(stderr, "Invalid cpu list '%s'\n", optarg);
+					return 1;
+				}
+				break;
+			case('W'):
+				bench.width = atoi(optarg);
+				break;
+			case('H'):
+				bench.height = atoi(optarg);
+				break;
+			case('b'):
+				bench.buffer_size = strtoul(optarg, NULL, 10);
+				break;
+			case('S'):
+				bench.seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(!bench.num_threads || bench.num_threads > bench.num_connections) {
+		bench.num_threads = bench.num_connections;
+	}
+	if(!bench.num_connections || !bench.duration || bench.buffer_size < 1024) {
+		fprintf(stderr, "Connections and duration must be > 0, buffer size must be >= 1024\n");
+		return 1;
+	}
+
+	if(!bench.unix_path && (err = -getaddrinfo(bench.host, bench.port, &hints, &bench.addr_list))) {
+		fprintf(stderr, "Failed to resolve '%s', %d => %s\n", bench.host, err, gai_strerror(-err));
+		return 1;
+	}
+
+	if(!bench.width || !bench.height) {
+		if((err = bench_query_size(&bench))) {
+			fprintf(stderr, "Failed to query canvas size, pass -W and -H: %s (%d)\n", strerror(-err), err);
+			goto fail_addrinfo;
+		}
+	}
+
+	bench.threads = calloc(bench.num_threads, sizeof(struct bench_thread));
+	if(!bench.threads) {
+		err = -ENOMEM;
+		goto fail_addrinfo;
+	}
+
+	for(i = 0; i < bench.num_threads; i++) {
+		struct bench_thread* thread = &bench.threads[i];
+
+		thread->bench = &bench;
+		thread->cpu = bench.num_cpus ? bench.cpus[i % bench.num_cpus] : -1;
+		thread->num_connections = bench.num_connections / bench.num_threads + (i < bench.num_connections % bench.num_threads);
+		thread->connections = calloc(thread->num_connections, sizeof(struct bench_connection));
+		if(!thread->connections) {
+			err = -ENOMEM;
+			goto fail_threads;
+		}
+		for(j = 0; j < thread->num_connections; j++) {
+			thread->connections[j].socket = -1;
+		}
+		if((err = workload_generate(&thread->buffer, bench.workload, bench.width, bench.height, bench.buffer_size, bench.seed + i))) {
+			goto fail_threads;
+		}
+		for(j = 0; j < thread->num_connections; j++) {
+			int sock = bench_connect(&bench);
+			if(sock < 0) {
+				err = sock;
+				fprintf(stderr, "Failed to connect: %s (%d)\n", strerror(-err), err);
+				goto fail_threads;
+			}
+			thread->connections[j].socket = sock;
+		}
+	}
+
+	printf("Workload %s, %ux%u canvas, %u connections, %u threads\n", workloads[bench.workload].name,
+		bench.width, bench.height, bench.num_connections, bench.num_threads);
+
+	signal(SIGINT, bench_doshutdown);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+	for(i = 0; i < bench.num_threads; i++) {
+		if((err = -pthread_create(&bench.threads[i].thread, NULL, bench_thread_run, &bench.threads[i]))) {
+			fprintf(stderr, "Failed to create thread: %s (%d)\n", strerror(-err), err);
+			__atomic_store_n(&bench.exit, true, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	for(elapsed = 0; !err && elapsed < bench.duration && !do_exit && !__atomic_load_n(&bench.exit, __ATOMIC_RELAXED); elapsed++) {
+		nanosleep(&interval, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		bench_get_totals(&bench, &totals);
+		duration = timespec_diff(&now, &last);
+		printf("%4us: %10.3f MB/s %8.3f Gbit/s %10.3f Mpixels/s", elapsed + 1,
+			(totals.bytes - last_totals.bytes) / duration / 1e6,
+			(totals.bytes - last_totals.bytes) * 8 / duration / 1e9,
+			(totals.pixels - last_totals.pixels) / duration / 1e6);
+		if(bench.threads[0].buffer.reads) {
+			printf(" %10.3f Mreads/s", (totals.responses - last_totals.responses) / duration / 1e6);
+		}
+		printf("\n");
+		fflush(stdout);
+		last_totals = totals;
+		last = now;
+	}
+
+	__atomic_store_n(&bench.exit, true, __ATOMIC_RELAXED);
+	// Threads that were not created have a zeroed handle and are skipped
+	for(j = 0; j < i; j++) {
+		pthread_join(bench.threads[j].thread, NULL);
+		if(bench.threads[j].err && !err) {
+			err = bench.threads[j].err;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bench_get_totals(&bench, &totals);
+	duration = timespec_diff(&now, &start);
+	printf("summary: workload=%s connections=%u threads=%u duration=%.3f bytes=%llu bytes_per_second=%.0f "\
+		"pixels_per_second=%.0f reads_per_second=%.0f\n",
+		workloads[bench.workload].name, bench.num_connections, bench.num_threads, duration, totals.bytes,
+		totals.bytes / duration, totals.pixels / duration, totals.responses / duration);
+
+fail_threads:
+	for(j = 0; j < bench.num_threads; j++) {
+		struct bench_thread* thread = &bench.threads[j];
+		unsigned int k;
+
+		for(k = 0; thread->connections && k < thread->num_connections; k++) {
+			if(thread->connections[k].socket >= 0) {
+				close(thread->connections[k].socket);
+			}
+		}
+		free(thread->connections);
+		workload_buffer_free(&thread->buffer);
+	}
+	free(bench.threads);
+fail_addrinfo:
+	if(bench.addr_list) {
+		freeaddrinfo(bench.addr_list);
+	}
+	return err ? 1 : 0;
+}
@@ -0,0 +1,624 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../framebuffer.h"
+#include "../llist.h"
+#include "../util.h"
+#include "../workqueue.h"
+#ifdef FEATURE_FBDEV
+#include <fcntl.h>
+#include <linux/fb.h>
+#include "../linuxfb.h"
+#endif
+#ifdef FEATURE_TTF
+#include "../textrender.h"
+#endif
+#ifdef FEATURE_VNC
+#include "../vnc.h"
+#endif
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * shoreline-compositor-bench times everything between the network threads
+ * and the display: merging the per node framebuffers, alpha blending and the
+ * per frame work of the frontends. It is built with the same FEATURES as
+ * shoreline, cases for frontends that are not compiled in are left out.
+ *
+ * Every case runs an untimed setup, e.g. scribbling into the node
+ * framebuffers, followed by the timed operation. Cases repeat for at least
+ * -T milliseconds and three iterations. Results go to stdout as a single JSON
+ * document, progress goes to stderr:
+ *
+ * {
+ *   "version": 1, "timestamp": <unix time>, "cpus": <online cpus>, "workers": <workqueue workers on node 0>,
+ *   "features": [ "STATISTICS", ... ],
+ *   "results": [
+ *     { "name": "fb_coalesce", "params": { "width": 1920, ... }, "iterations": 100,
+ *       "ns_per_op": 1234.5, "ns_min": 1200, "pixels_per_second": 1.6e9 },
+ *     ...
+ *   ]
+ * }
+ *
+ * The throughput key is named after what the case processes, e.g. pixels or
+ * chars. Names and params are stable so results can be compared between
+ * releases.
+ */
+
+#define COMPOSITOR_BENCH_VERSION 1
+#define COMPOSITOR_BENCH_MIN_TIME_MS_DEFAULT 200
+#define COMPOSITOR_BENCH_MIN_ITERATIONS 3
+#define COMPOSITOR_BENCH_BLEND_PIXELS (1024 * 1024)
+
+struct canvas_size {
+	unsigned int width;
+	unsigned int height;
+};
+
+static const struct canvas_size canvas_sizes[] = {
+	{ 640, 480 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+static const unsigned int coalesce_nodes[] = { 1, 2, 4 };
+// Fraction of pixels written to each node framebuffer between two coalesces
+static const double coalesce_densities[] = { 0.0, 0.001, 0.01, 0.1, 1.0 };
+
+#ifdef FEATURE_FBDEV
+static const unsigned int linuxfb_bpps[] = { 8, 16, 24, 32 };
+#endif
+
+#ifdef FEATURE_TTF
+static const unsigned int text_sizes[] = { 12, 24, 48 };
+// About what the statistics line in the lower left corner looks like
+static const char* text = "Traffic: 123.456 GB / 7.890 GPixels Throughput: 9.876 Gb/s / 54.321 MPixels/s FPS: 60 frames/s 42 connections";
+#endif
+
+typedef int (*bench_cb)(void* priv);
+
+struct compositor_bench {
+	long long min_time_ns;
+	const char* filter;
+	unsigned int num_results;
+	uint64_t random_state;
+};
+
+static uint64_t bench_random(struct compositor_bench* bench) {
+	bench->random_state ^= bench->random_state >> 12;
+	bench->random_state ^= bench->random_state << 25;
+	bench->random_state ^= bench->random_state >> 27;
+	return bench->random_state * 2685821657736338717ULL;
+}
+
+static bool bench_selected(struct compositor_bench* bench, const char* name) {
+	return !bench->filter || strstr(name, bench->filter);
+}
+
+/*
+ * Run setup and op until min_time_ns of op have been spent, then print a
+ * result object. params is the body of the JSON params object.
+ */
+static int bench_measure(struct compositor_bench* bench, const char* name, const char* params,
+	bench_cb setup, bench_cb op, void* priv, double items_per_op, const char* items) {
+	int err;
+	unsigned long long iterations = 0;
+	long long total_ns = 0, min_ns = 0, ns;
+	struct timespec before, after;
+	double ns_per_op;
+
+	fprintf(stderr, "%s %s\n", name, params);
+	// Warm up caches and lazily initialized state
+	if(setup && (err = setup(priv))) {
+		goto fail;
+	}
+	if((err = op(priv))) {
+		goto fail;
+	}
+
+	while(total_ns < bench->min_time_ns || iterations < COMPOSITOR_BENCH_MIN_ITERATIONS) {
+		if(setup && (err = setup(priv))) {
+			goto fail;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		if((err = op(priv))) {
+			goto fail;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &after);
+		ns = get_timespec_diff(&after, &before);
+		if(!iterations || ns < min_ns) {
+			min_ns = ns;
+		}
+		total_ns += ns;
+		iterations++;
+	}
+
+	ns_per_op = (double)total_ns / iterations;
+	printf("%s\n    { \"name\": \"%s\", \"params\": { %s }, \"iterations\": %llu, \"ns_per_op\": %.1f, "\
+		"\"ns_min\": %lld, \"%s_per_second\": %.6g }",
+		bench->num_results ? "," : "", name, params, iterations, ns_per_op, min_ns, items,
+		ns_per_op > 0 ? items_per_op * 1e9 / ns_per_op : 0.0);
+	bench->num_results++;
+	return 0;
+
+fail:
+	fprintf(stderr, "Benchmark %s failed: %s (%d)\n", name, strerror(-err), err);
+	return err;
+}
+
+struct coalesce_ctx {
+	struct compositor_bench* bench;
+	struct fb* fb;
+	struct llist fbs;
+	uint32_t* tile_writes;
+	double density;
+	bool alpha;
+};
+
+static void coalesce_scribble(struct coalesce_ctx* ctx, struct fb* fb) {
+	union fb_pixel pixel;
+	size_t i, num_pixels = (size_t)fb->size.width * fb->size.height;
+	size_t writes = num_pixels * ctx->density;
+	uint64_t rnd;
+
+	for(i = 0; i < writes; i++) {
+		rnd = bench_random(ctx->bench);
+		pixel.abgr = rnd >> 32;
+		if(!ctx->alpha || !pixel.color.alpha) {
+			pixel.color.alpha = 0xff;
+		}
+		// Every pixel once at full density, random ones below
+		fb->pixels[writes == num_pixels ? i : (rnd & 0xffffffff) % num_pixels] = pixel;
+	}
+}
+
+static int coalesce_setup(void* priv) {
+	struct coalesce_ctx* ctx = priv;
+	struct llist_entry* cursor;
+
+	llist_for_each(&ctx->fbs, cursor) {
+		coalesce_scribble(ctx, llist_entry_get_value(cursor, struct fb, list));
+	}
+	fb_clear_dirty(ctx->fb);
+	return 0;
+}
+
+static int coalesce_op(void* priv) {
+	struct coalesce_ctx* ctx = priv;
+
+	return fb_coalesce(ctx->fb, &ctx->fbs, ctx->tile_writes);
+}
+
+static int bench_coalesce_one(struct compositor_bench* bench, const char* name, const struct canvas_size* size,
+	unsigned int nodes, double density, bool alpha) {
+	int err;
+	unsigned int i;
+	struct fb* node_fb;
+	char params[256];
+	struct coalesce_ctx ctx = {
+		.bench = bench,
+		.density = density,
+		.alpha = alpha,
+	};
+
+	llist_init(&ctx.fbs);
+	if((err = fb_alloc(&ctx.fb, size->width, size->height))) {
+		goto fail;
+	}
+	for(i = 0; i < nodes; i++) {
+		if((err = fb_alloc(&node_fb, size->width, size->height))) {
+			goto fail_fbs;
+		}
+		llist_append(&ctx.fbs, &node_fb->list);
+	}
+	// Like the main loop with statistics enabled
+	ctx.tile_writes = calloc((size_t)ctx.fb->tiles.width * ctx.fb->tiles.height, sizeof(*ctx.tile_writes));
+	if(!ctx.tile_writes) {
+		err = -ENOMEM;
+		goto fail_fbs;
+	}
+	// New node framebuffers are opaque, get them to their usual mostly transparent state
+	if((err = fb_coalesce(ctx.fb, &ctx.fbs, NULL))) {
+		goto fail_tile_writes;
+	}
+
+	snprintf(params, sizeof(params), "\"width\": %u, \"height\": %u, \"nodes\": %u, \"density\": %g",
+		size->width, size->height, nodes, density);
+	err = bench_measure(bench, name, params, coalesce_setup, coalesce_op, &ctx,
+		(double)size->width * size->height * nodes, "pixels");
+
+fail_tile_writes:
+	free(ctx.tile_writes);
+fail_fbs:
+	fb_free_all(&ctx.fbs);
+	fb_free(ctx.fb);
+fail:
+	return err;
+}
+
+static int bench_coalesce(struct compositor_bench* bench) {
+	int err;
+	unsigned int i, j, k;
+
+	if(bench_selected(bench, "fb_coalesce")) {
+		for(i = 0; i < ARRAY_LEN(canvas_sizes); i++) {
+			for(j = 0; j < ARRAY_LEN(coalesce_nodes); j++) {
+				for(k = 0; k < ARRAY_LEN(coalesce_densities); k++) {
+					if((err = bench_coalesce_one(bench, "fb_coalesce", &canvas_sizes[i], coalesce_nodes[j],
+						coalesce_densities[k], false))) {
+						return err;
+					}
+				}
+			}
+		}
+	}
+#ifdef FEATURE_ALPHA_BLENDING
+	// Translucent pixels take the blending path in fb_coalesce
+	if(bench_selected(bench, "fb_coalesce_alpha")) {
+		for(k = 0; k < ARRAY_LEN(coalesce_densities); k++) {
+			if((err = bench_coalesce_one(bench, "fb_coalesce_alpha", &canvas_sizes[1], 1, coalesce_densities[k], true))) {
+				return err;
+			}
+		}
+	}
+#endif
+	return 0;
+}
+
+struct blend_ctx {
+	union fb_pixel* src;
+	union fb_pixel* dst;
+	size_t num_pixels;
+};
+
+static int blend_op(void* priv) {
+	struct blend_ctx* ctx = priv;
+	size_t i;
+
+	for(i = 0; i < ctx->num_pixels; i++) {
+		FB_ALPHA_BLEND_PIXEL(ctx->dst[i], ctx->src[i], ctx->dst[i]);
+	}
+	return 0;
+}
+
+static int bench_alpha_blend(struct compositor_bench* bench) {
+	int err;
+	size_t i;
+	char params[64];
+	struct blend_ctx ctx = { .num_pixels = COMPOSITOR_BENCH_BLEND_PIXELS };
+
+	if(!bench_selected(bench, "alpha_blend")) {
+		return 0;
+	}
+
+	ctx.src = malloc(ctx.num_pixels * sizeof(*ctx.src));
+	ctx.dst = malloc(ctx.num_pixels * sizeof(*ctx.dst));
+	if(!ctx.src || !ctx.dst) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	for(i = 0; i < ctx.num_pixels; i++) {
+		ctx.src[i].abgr = bench_random(bench) >> 32;
+		ctx.dst[i].abgr = bench_random(bench) >> 32;
+		ctx.dst[i].color.alpha = 0xff;
+	}
+
+	snprintf(params, sizeof(params), "\"pixels\": %zu", ctx.num_pixels);
+	err = bench_measure(bench, "alpha_blend", params, NULL, blend_op, &ctx, ctx.num_pixels, "pixels");
+
+fail:
+	free(ctx.dst);
+	free(ctx.src);
+	return err;
+}
+
+#if defined(FEATURE_FBDEV) || defined(FEATURE_VNC)
+static void fill_random(struct compositor_bench* bench, struct fb* fb) {
+	size_t i;
+
+	for(i = 0; i < (size_t)fb->size.width * fb->size.height; i++) {
+		fb->pixels[i].abgr = bench_random(bench) >> 32;
+	}
+}
+#endif
+
+#ifdef FEATURE_FBDEV
+static int linuxfb_op(void* priv) {
+	return linuxfb_update(priv);
+}
+
+/*
+ * A linuxfb frontend that writes to /dev/null. Conversion is the same as for
+ * a real device without page flipping, only the final write is free.
+ */
+static int bench_linuxfb(struct compositor_bench* bench) {
+	int err;
+	unsigned int i, j;
+	struct fb* fb;
+	struct frontend* front;
+	struct linuxfb* linuxfb;
+	char params[128];
+
+	if(!bench_selected(bench, "linuxfb_update")) {
+		return 0;
+	}
+
+	for(i = 0; i < ARRAY_LEN(canvas_sizes); i++) {
+		if((err = fb_alloc(&fb, canvas_sizes[i].width, canvas_sizes[i].height))) {
+			return err;
+		}
+		fill_random(bench, fb);
+		for(j = 0; j < ARRAY_LEN(linuxfb_bpps); j++) {
+			if((err = linuxfb_alloc(&front, fb, NULL))) {
+				goto fail_fb;
+			}
+			linuxfb = container_of(front, struct linuxfb, front);
+			linuxfb->vscreen.xres = linuxfb->vscreen.xres_virtual = fb->size.width;
+			linuxfb->vscreen.yres = linuxfb->vscreen.yres_virtual = fb->size.height;
+			linuxfb->vscreen.bits_per_pixel = linuxfb_bpps[j];
+			linuxfb->fd = open("/dev/null", O_WRONLY);
+			if(linuxfb->fd < 0) {
+				err = -errno;
+				goto fail_front;
+			}
+			linuxfb->fbmem = calloc(linuxfb_bpps[j] / 8, (size_t)fb->size.width * fb->size.height);
+			if(!linuxfb->fbmem) {
+				err = -ENOMEM;
+				goto fail_front;
+			}
+
+			snprintf(params, sizeof(params), "\"width\": %u, \"height\": %u, \"bpp\": %u",
+				fb->size.width, fb->size.height, linuxfb_bpps[j]);
+			if((err = bench_measure(bench, "linuxfb_update", params, NULL, linuxfb_op, front,
+				(double)fb->size.width * fb->size.height, "pixels"))) {
+				goto fail_front;
+			}
+			linuxfb_free(front);
+		}
+		fb_free(fb);
+	}
+	return 0;
+
+fail_front:
+	linuxfb_free(front);
+fail_fb:
+	fb_free(fb);
+	return err;
+}
+#endif
+
+#ifdef FEATURE_TTF
+struct text_ctx {
+	struct textrender* txtrndr;
+	struct textrender_string str;
+	struct fb* fb;
+	unsigned int size;
+};
+
+static int textrender_op(void* priv) {
+	struct text_ctx* ctx = priv;
+
+	return textrender_draw_string(ctx->txtrndr, ctx->fb, 0, ctx->size, text, ctx->size);
+}
+
+static int textrender_string_op(void* priv) {
+	struct text_ctx* ctx = priv;
+
+	textrender_string_draw(&ctx->str, ctx->fb, 0, ctx->size);
+	return 0;
+}
+
+static int bench_textrender(struct compositor_bench* bench, char* fontfile) {
+	int err;
+	unsigned int i;
+	char params[64];
+	struct text_ctx ctx = { .str = TEXTRENDER_STRING_INIT };
+
+	if(!bench_selected(bench, "textrender")) {
+		return 0;
+	}
+	if(!fontfile) {
+		fprintf(stderr, "No font given, skipping text rendering\n");
+		return 0;
+	}
+
+	if((err = textrender_alloc(&ctx.txtrndr, fontfile))) {
+		fprintf(stderr, "Failed to load font %s: %s (%d)\n", fontfile, strerror(-err), err);
+		goto fail;
+	}
+	if((err = fb_alloc(&ctx.fb, canvas_sizes[1].width, canvas_sizes[1].height))) {
+		goto fail_txtrndr;
+	}
+
+	for(i = 0; i < ARRAY_LEN(text_sizes); i++) {
+		ctx.size = text_sizes[i];
+		snprintf(params, sizeof(params), "\"size\": %u, \"chars\": %zu", ctx.size, strlen(text));
+		if(bench_selected(bench, "textrender_draw_string")) {
+			if((err = bench_measure(bench, "textrender_draw_string", params, NULL, textrender_op, &ctx,
+				strlen(text), "chars"))) {
+				goto fail_str;
+			}
+		}
+		if(bench_selected(bench, "textrender_string_draw")) {
+			if((err = textrender_string_update(ctx.txtrndr, &ctx.str, text, ctx.size)) < 0) {
+				goto fail_str;
+			}
+			if((err = bench_measure(bench, "textrender_string_draw", params, NULL, textrender_string_op, &ctx,
+				strlen(text), "chars"))) {
+				goto fail_str;
+			}
+		}
+	}
+
+fail_str:
+	textrender_string_free(&ctx.str);
+	fb_free(ctx.fb);
+fail_txtrndr:
+	textrender_free(ctx.txtrndr);
+fail:
+	return err;
+}
+#endif
+
+#ifdef FEATURE_VNC
+static int vnc_op(void* priv) {
+	// Without clients the server is never active, that is not an error here
+	vnc_update(priv);
+	return 0;
+}
+
+// Frame preparation only, the server is never started
+static int bench_vnc(struct compositor_bench* bench) {
+	int err;
+	unsigned int i;
+	struct fb* fb;
+	struct frontend* front;
+	char params[64];
+
+	if(!bench_selected(bench, "vnc_update")) {
+		return 0;
+	}
+
+	for(i = 0; i < ARRAY_LEN(canvas_sizes); i++) {
+		if((err = fb_alloc(&fb, canvas_sizes[i].width, canvas_sizes[i].height))) {
+			return err;
+		}
+		fill_random(bench, fb);
+		if((err = vnc_alloc(&front, fb, NULL))) {
+			fb_free(fb);
+			return err;
+		}
+		snprintf(params, sizeof(params), "\"width\": %u, \"height\": %u", fb->size.width, fb->size.height);
+		err = bench_measure(bench, "vnc_update", params, NULL, vnc_op, front,
+			(double)fb->size.width * fb->size.height, "pixels");
+		vnc_free(front);
+		fb_free(fb);
+		if(err) {
+			return err;
+		}
+	}
+	return 0;
+}
+#endif
+
+static void print_features() {
+	unsigned int i;
+	static const char* features[] = {
+#ifdef FEATURE_STATISTICS
+		"STATISTICS",
+#endif
+#ifdef FEATURE_ALPHA_BLENDING
+		"ALPHA_BLENDING",
+#endif
+#ifdef FEATURE_NUMA
+		"NUMA",
+#endif
+#ifdef FEATURE_FBDEV
+		"FBDEV",
+#endif
+#ifdef FEATURE_TTF
+		"TTF",
+#endif
+#ifdef FEATURE_VNC
+		"VNC",
+#endif
+		NULL
+	};
+
+	printf("  \"features\": [");
+	for(i = 0; features[i]; i++) {
+		printf("%s\"%s\"", i ? ", " : " ", features[i]);
+	}
+	printf("%s],\n", i ? " " : "");
+}
+
+static void show_usage(char* binary) {
+	fprintf(stderr, "Usage: %s [-T <milliseconds>] [-f <filter>] [-t <fontfile>] [-?]\n", binary);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -T <milliseconds>  Minimum time spent on each case (default %u)\n", COMPOSITOR_BENCH_MIN_TIME_MS_DEFAULT);
+	fprintf(stderr, "  -f <filter>        Only run benchmarks whose name contains <filter>\n");
+	fprintf(stderr, "  -t <fontfile>      Font for the text rendering benchmarks, skipped without\n");
+	fprintf(stderr, "  -?                 Show this help\n");
+}
+
+int main(int argc, char** argv) {
+	int opt, err = 0;
+#ifdef FEATURE_TTF
+	char* fontfile = NULL;
+#endif
+	struct compositor_bench bench = {
+		.min_time_ns = COMPOSITOR_BENCH_MIN_TIME_MS_DEFAULT * 1000000LL,
+		.random_state = 0x9e3779b97f4a7c15ULL,
+	};
+
+	while((opt = getopt(argc, argv, "T:f:t:?")) != -1) {
+		switch(opt) {
+			case('T'):
+				if(atoi(optarg) < 0) {
+					fprintf(stderr, "Minimum time must be >= 0\n");
+					return 1;
+				}
+				bench.min_time_ns = atoi(optarg) * 1000000LL;
+				break;
+			case('f'):
+				bench.filter = optarg;
+				break;
+			case('t'):
+#ifdef FEATURE_TTF
+				fontfile = optarg;
+#else
+				fprintf(stderr, "Benchmark was compiled without TTF support!\n");
+				return 1;
+#endif
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	// Frontends fan out conversion the same way they do in shoreline
+	if((err = workqueue_init(NULL))) {
+		fprintf(stderr, "Failed to initialize workqueues: %s\n", strerror(-err));
+		return 1;
+	}
+
+	printf("{\n  \"version\": %u,\n  \"timestamp\": %lld,\n  \"cpus\": %ld,\n  \"workers\": %u,\n",
+		COMPOSITOR_BENCH_VERSION, (long long)time(NULL), sysconf(_SC_NPROCESSORS_ONLN), workqueue_num_workers(0));
+	print_features();
+	printf("  \"results\": [");
+
+	if((err = bench_coalesce(&bench))) {
+		goto done;
+	}
+	if((err = bench_alpha_blend(&bench))) {
+		goto done;
+	}
+#ifdef FEATURE_FBDEV
+	if((err = bench_linuxfb(&bench))) {
+		goto done;
+	}
+#endif
+#ifdef FEATURE_TTF
+	if((err = bench_textrender(&bench, fontfile))) {
+		goto done;
+	}
+#endif
+#ifdef FEATURE_VNC
+	if((err = bench_vnc(&bench))) {
+		goto done;
+	}
+#endif
+
+done:
+	printf("\n  ]\n}\n");
+	workqueue_deinit();
+	return err ? 1 : 0;
+}
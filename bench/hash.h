@@ -0,0 +1,27 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../framebuffer.h"
+
+// FNV-1a, used to compare canvases and responses between runs
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static inline uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+	const unsigned char* bytes = data;
+
+	while(len--) {
+		hash ^= *bytes++;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static inline uint64_t canvas_hash(struct fb* fb) {
+	return fnv1a(FNV_OFFSET, fb->pixels, (size_t)fb->size.width * fb->size.height * sizeof(union fb_pixel));
+}
+
+#endif
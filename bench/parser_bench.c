@@ -0,0 +1,658 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "../framebuffer.h"
+#include "../network.h"
+#include "../parser.h"
+#include "../ring.h"
+#include "../util.h"
+#include "hash.h"
+#include "workload.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * shoreline-parser-bench drives pixelflut command streams through
+ * parser_parse in-process, no sockets involved. It is built with the same
+ * FEATURES as shoreline and thus measures exactly the parser shoreline runs.
+ *
+ * Each corpus, synthetic or recorded, is copied into a ring in chunks just
+ * like read() would deliver it, calling the parser after every chunk:
+ *
+ *   whole   as much as fits into the ring, like a client that is way ahead
+ *   primes  cycling through small primes, splitting commands everywhere
+ *   random  random sizes between 1 and 4096 bytes
+ *   byte    one byte at a time, every command hits the incomplete path
+ *
+ * Small rings (-r) force frequent wraparounds on top of that.
+ *
+ * Every run is checked against a straightforward reference parser working
+ * on the whole corpus at once: the final canvas, all responses and the
+ * number of commands must match. The reference reads one command per line,
+ * recorded corpora that split commands across lines may legitimately differ.
+ *
+ * Timing is the best of several iterations on a fresh canvas. ns/command is
+ * wall clock time per parsed command, bytes/cycle uses the CPU cycle counter
+ * from perf_event_open if the kernel lets us.
+ */
+
+#define PARSER_BENCH_CORPUS_SIZE_DEFAULT (4 * 1024 * 1024)
+#define PARSER_BENCH_ITERATIONS_DEFAULT 3
+#define PARSER_BENCH_WIDTH_DEFAULT 1024
+#define PARSER_BENCH_HEIGHT_DEFAULT 768
+#define PARSER_BENCH_SEED_DEFAULT 1
+#define PARSER_BENCH_MAX_ITEMS 16
+#define PARSER_BENCH_RANDOM_CHUNK_MAX 4096
+#define PARSER_BENCH_GARBAGE_THRESHOLD 32
+
+enum chunking {
+	CHUNKING_WHOLE,
+	CHUNKING_PRIMES,
+	CHUNKING_RANDOM,
+	CHUNKING_BYTE,
+	CHUNKING_NUM_TYPES,
+};
+
+static const char* chunking_names[CHUNKING_NUM_TYPES] = {
+	[CHUNKING_WHOLE] = "whole",
+	[CHUNKING_PRIMES] = "primes",
+	[CHUNKING_RANDOM] = "random",
+	[CHUNKING_BYTE] = "byte",
+};
+
+static const size_t chunk_primes[] = { 1, 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 1021 };
+
+struct chunker {
+	enum chunking type;
+	unsigned int index;
+	uint64_t state;
+};
+
+struct corpus {
+	const char* name;
+	char* data;
+	size_t len;
+};
+
+struct result {
+	uint64_t canvas_hash;
+	uint64_t response_hash;
+	unsigned long long response_bytes;
+	unsigned long long commands;
+	int err;
+};
+
+static size_t chunker_next(struct chunker* chunker) {
+	switch(chunker->type) {
+		case CHUNKING_PRIMES:
+			return chunk_primes[chunker->index++ % ARRAY_LEN(chunk_primes)];
+		case CHUNKING_RANDOM:
+			chunker->state ^= chunker->state >> 12;
+			chunker->state ^= chunker->state << 25;
+			chunker->state ^= chunker->state >> 27;
+			return (chunker->state * 2685821657736338717ULL) % PARSER_BENCH_RANDOM_CHUNK_MAX + 1;
+		case CHUNKING_BYTE:
+			return 1;
+		default:
+			return SIZE_MAX;
+	}
+}
+
+static int respond_hash(struct parser* parser, const char* buf, size_t len) {
+	struct result* result = parser->priv;
+
+	result->response_hash = fnv1a(result->response_hash, buf, len);
+	result->response_bytes += len;
+	return len;
+}
+
+static int respond_printf(struct result* result, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int respond_printf(struct result* result, const char* fmt, ...) {
+	char buf[64];
+	int len;
+	va_list vargs;
+
+	va_start(vargs, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, vargs);
+	va_end(vargs);
+	result->response_hash = fnv1a(result->response_hash, buf, len);
+	result->response_bytes += len;
+	return len;
+}
+
+/*
+ * Reference implementation, one token at a time over the whole corpus. A PX
+ * without color is a read if its y coordinate is followed by a line break.
+ */
+struct lexer {
+	const char* data;
+	size_t len;
+	size_t pos;
+};
+
+static bool lexer_is_whitespace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Returns the length of the next token, 0 if there is no complete token left
+static size_t lexer_next(struct lexer* lex, const char** token, bool* newline) {
+	size_t start, len;
+
+	while(lex->pos < lex->len && lexer_is_whitespace(lex->data[lex->pos])) {
+		lex->pos++;
+	}
+	start = lex->pos;
+	while(lex->pos < lex->len && !lexer_is_whitespace(lex->data[lex->pos])) {
+		lex->pos++;
+	}
+	// Tokens are only complete once followed by whitespace
+	if(lex->pos >= lex->len) {
+		return 0;
+	}
+	len = lex->pos - start;
+	*token = lex->data + start;
+	*newline = false;
+	while(lex->pos < lex->len && lexer_is_whitespace(lex->data[lex->pos])) {
+		if(lex->data[lex->pos] == '\n' || lex->data[lex->pos] == '\r') {
+			*newline = true;
+		}
+		lex->pos++;
+	}
+	return len;
+}
+
+static bool token_is(const char* token, size_t len, const char* ref) {
+	return len == strlen(ref) && !memcmp(token, ref, len);
+}
+
+static uint32_t token_to_uint32_10(const char* token, size_t len) {
+	uint32_t val = 0;
+
+	while(len--) {
+		val = val * 10 + (*token++ - '0');
+	}
+	return val;
+}
+
+static uint32_t token_to_uint32_16(const char* token, size_t len) {
+	uint32_t val = 0;
+	int lower;
+
+	while(len--) {
+		lower = *token++ | 0x20;
+		val = val * 16 + (lower >= 'a' ? lower - 'a' + 10 : lower - '0');
+	}
+	return val;
+}
+
+static void reference_parse(struct fb* fb, struct corpus* corpus, struct result* result) {
+	struct lexer lex = { .data = corpus->data, .len = corpus->len };
+	struct fb_size* size = fb_get_size(fb);
+	unsigned int offset_x = 0, offset_y = 0;
+	const char* token;
+	size_t len;
+	bool newline;
+
+	while((len = lexer_next(&lex, &token, &newline))) {
+		if(token_is(token, len, "PX")) {
+			unsigned int x, y;
+			union fb_pixel pixel;
+
+			if(!(len = lexer_next(&lex, &token, &newline))) {
+				break;
+			}
+			x = token_to_uint32_10(token, len) + offset_x;
+			if(!(len = lexer_next(&lex, &token, &newline))) {
+				break;
+			}
+			y = token_to_uint32_10(token, len) + offset_y;
+			if(newline) {
+				result->commands++;
+				if(x < size->width && y < size->height) {
+					respond_printf(result, "PX %u %u %06x\n", x, y, fb_get_pixel(fb, x, y).abgr >> 8);
+				}
+				continue;
+			}
+			if(!(len = lexer_next(&lex, &token, &newline))) {
+				break;
+			}
+			result->commands++;
+			if(len > 6) {
+				pixel.abgr = token_to_uint32_16(token, len);
+			} else {
+				pixel.abgr = token_to_uint32_16(token, len) << 8;
+				pixel.color.alpha = 0xFF;
+			}
+			if(x < size->width && y < size->height) {
+#ifdef FEATURE_ALPHA_BLENDING
+				if (pixel.color.alpha != 0xFF) {
+					union fb_pixel old_pixel = fb_get_pixel(fb, x, y);
+					FB_ALPHA_BLEND_PIXEL(pixel, pixel, old_pixel);
+				}
+#endif
+				fb_set_pixel(fb, x, y, &pixel);
+			}
+		}
+#ifdef FEATURE_SIZE
+		else if(token_is(token, len, "SIZE")) {
+			result->commands++;
+			respond_printf(result, "SIZE %u %u\n", size->width, size->height);
+		}
+#endif
+#ifdef FEATURE_OFFSET
+		else if(token_is(token, len, "OFFSET")) {
+			unsigned int x;
+
+			if(!(len = lexer_next(&lex, &token, &newline))) {
+				break;
+			}
+			x = token_to_uint32_10(token, len);
+			if(!(len = lexer_next(&lex, &token, &newline))) {
+				break;
+			}
+			result->commands++;
+			offset_x = x;
+			offset_y = token_to_uint32_10(token, len);
+		}
+#endif
+		else if(len > PARSER_BENCH_GARBAGE_THRESHOLD) {
+			result->err = -EINVAL;
+			break;
+		}
+	}
+}
+
+struct cycle_counter {
+	int fd;
+};
+
+static void cycle_counter_open(struct cycle_counter* counter) {
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CPU_CYCLES,
+		.disabled = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+
+	counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void cycle_counter_start(struct cycle_counter* counter) {
+	if(counter->fd >= 0) {
+		ioctl(counter->fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static uint64_t cycle_counter_stop(struct cycle_counter* counter) {
+	uint64_t cycles = 0;
+
+	if(counter->fd >= 0) {
+		ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+		if(read(counter->fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+			cycles = 0;
+		}
+	}
+	return cycles;
+}
+
+// Feed the corpus to the parser the way a connection thread would
+static int ring_parse(struct parser* parser, struct ring* ring, struct corpus* corpus, struct chunker* chunker) {
+	int err;
+	size_t pos = 0, len;
+
+	while(pos < corpus->len) {
+		len = chunker_next(chunker);
+		if(len > ring_free_space_contig(ring)) {
+			len = ring_free_space_contig(ring);
+		}
+		if(len > corpus->len - pos) {
+			len = corpus->len - pos;
+		}
+		if(!len) {
+			// Ring full of an incomplete command, shoreline would hang up
+			return -ENOBUFS;
+		}
+		memcpy(ring->ptr_write, corpus->data + pos, len);
+		ring_advance_write(ring, len);
+		pos += len;
+		if((err = parser_parse(parser, ring)) < 0) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+struct parser_bench {
+	unsigned int width;
+	unsigned int height;
+	unsigned int iterations;
+	struct cycle_counter cycles;
+	bool failed;
+};
+
+static double timespec_diff_ns(struct timespec* a, struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) * 1000000000.0 + (a->tv_nsec - b->tv_nsec);
+}
+
+static int run(struct parser_bench* bench, struct corpus* corpus, struct result* reference, enum chunking chunking, size_t ring_size) {
+	int err;
+	unsigned int i;
+	double best_ns = 0;
+	uint64_t best_cycles = 0;
+	struct result result;
+	const char* verdict;
+
+	for(i = 0; i < bench->iterations; i++) {
+		struct fb* fb;
+		struct ring* ring;
+		struct timespec before, after;
+		uint64_t cycles;
+		double ns;
+		struct chunker chunker = { .type = chunking, .state = 0x9e3779b97f4a7c15ULL };
+#ifdef FEATURE_STATISTICS
+		struct net_counters counters = { 0 };
+#endif
+		struct parser parser = {
+			.respond = respond_hash,
+			.priv = &result,
+			.socket = -1,
+		};
+
+		if((err = fb_alloc(&fb, bench->width, bench->height))) {
+			return err;
+		}
+		if((err = ring_alloc(&ring, ring_size))) {
+			fb_free(fb);
+			return err;
+		}
+		parser.fb = fb;
+		parser.fb_read = fb;
+#ifdef FEATURE_STATISTICS
+		parser.counters = &counters;
+#endif
+		memset(&result, 0, sizeof(result));
+		result.response_hash = FNV_OFFSET;
+
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		cycle_counter_start(&bench->cycles);
+		result.err = ring_parse(&parser, ring, corpus, &chunker);
+		cycles = cycle_counter_stop(&bench->cycles);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+
+		ns = timespec_diff_ns(&after, &before);
+		if(!i || ns < best_ns) {
+			best_ns = ns;
+		}
+		if(!i || cycles < best_cycles) {
+			best_cycles = cycles;
+		}
+		result.canvas_hash = canvas_hash(fb);
+#ifdef FEATURE_STATISTICS
+		result.commands = counters.commands;
+#else
+		result.commands = reference->commands;
+#endif
+		ring_free(ring);
+		fb_free(fb);
+	}
+
+	if(result.err != reference->err && (result.err >= 0 || reference->err >= 0)) {
+		verdict = "MISMATCH (disconnect)";
+	} else if(result.canvas_hash != reference->canvas_hash) {
+		verdict = "MISMATCH (canvas)";
+	} else if(result.response_hash != reference->response_hash || result.response_bytes != reference->response_bytes) {
+		verdict = "MISMATCH (responses)";
+	} else if(result.commands != reference->commands) {
+		verdict = "MISMATCH (commands)";
+	} else {
+		verdict = "ok";
+	}
+	if(strcmp(verdict, "ok")) {
+		bench->failed = true;
+	}
+
+	printf("%-12s %-7s %8zu %11zu %10llu %9.2f ", corpus->name, chunking_names[chunking], ring_size, corpus->len,
+		reference->commands, reference->commands ? best_ns / reference->commands : 0.0);
+	if(best_cycles) {
+		printf("%11.3f ", (double)corpus->len / best_cycles);
+	} else {
+		printf("%11s ", "n/a");
+	}
+	printf("%s\n", verdict);
+	return 0;
+}
+
+static int corpus_load(struct corpus* corpus, const char* path) {
+	int err, fd;
+	struct stat st;
+	size_t pos = 0;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return -errno;
+	}
+	if(fstat(fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+	corpus->data = malloc(st.st_size + 1);
+	if(!corpus->data) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	while(pos < st.st_size) {
+		len = read(fd, corpus->data + pos, st.st_size - pos);
+		if(len <= 0) {
+			err = len < 0 ? -errno : -EIO;
+			goto fail_data;
+		}
+		pos += len;
+	}
+	corpus->len = pos;
+	corpus->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	close(fd);
+	return 0;
+
+fail_data:
+	free(corpus->data);
+fail:
+	close(fd);
+	return err;
+}
+
+static void show_usage(char* binary) {
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-w <workload>] [-f <file>] [-c <chunking>] [-r <ring size>] [-n <iterations>] "\
+		"[-b <corpus size>] [-W <width>] [-H <height>] [-S <seed>] [-?]\n", binary);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -w <workload>     Synthetic corpus to run, may be given multiple times (default all)\n");
+	fprintf(stderr, "  -f <file>         Recorded raw command stream to run, may be given multiple times\n");
+	fprintf(stderr, "  -c <chunking>     Chunking to use, may be given multiple times (default all)\n");
+	fprintf(stderr, "  -r <ring size>    Ring size in bytes, may be given multiple times (default 65536 and 64)\n");
+	fprintf(stderr, "  -n <iterations>   Iterations per run, the fastest one is reported (default %u)\n", PARSER_BENCH_ITERATIONS_DEFAULT);
+	fprintf(stderr, "  -b <corpus size>  Size of synthetic corpora in bytes (default %u)\n", PARSER_BENCH_CORPUS_SIZE_DEFAULT);
+	fprintf(stderr, "  -W <width>        Canvas width (default %u)\n", PARSER_BENCH_WIDTH_DEFAULT);
+	fprintf(stderr, "  -H <height>       Canvas height (default %u)\n", PARSER_BENCH_HEIGHT_DEFAULT);
+	fprintf(stderr, "  -S <seed>         Seed for synthetic corpora (default %u)\n", PARSER_BENCH_SEED_DEFAULT);
+	fprintf(stderr, "  -?                Show this help\n");
+	fprintf(stderr, "Workloads:\n");
+	for(i = 0; i < WORKLOAD_NUM_TYPES; i++) {
+		fprintf(stderr, "  %-8s %s\n", workloads[i].name, workloads[i].description);
+	}
+	fprintf(stderr, "Chunkings: whole, primes, random, byte\n");
+}
+
+int main(int argc, char** argv) {
+	int opt, err = 0;
+	unsigned int i, j, k;
+	struct parser_bench bench = {
+		.width = PARSER_BENCH_WIDTH_DEFAULT,
+		.height = PARSER_BENCH_HEIGHT_DEFAULT,
+		.iterations = PARSER_BENCH_ITERATIONS_DEFAULT,
+	};
+	size_t corpus_size = PARSER_BENCH_CORPUS_SIZE_DEFAULT;
+	uint64_t seed = PARSER_BENCH_SEED_DEFAULT;
+	int workload_types[WORKLOAD_NUM_TYPES];
+	unsigned int num_workload_types = 0;
+	const char* files[PARSER_BENCH_MAX_ITEMS];
+	unsigned int num_files = 0;
+	enum chunking chunkings[CHUNKING_NUM_TYPES];
+	unsigned int num_chunkings = 0;
+	size_t ring_sizes[PARSER_BENCH_MAX_ITEMS];
+	unsigned int num_ring_sizes = 0;
+	struct corpus corpora[WORKLOAD_NUM_TYPES + PARSER_BENCH_MAX_ITEMS];
+	unsigned int num_corpora = 0;
+
+	while((opt = getopt(argc, argv, "w:f:c:r:n:b:W:H:S:?")) != -1) {
+		switch(opt) {
+			case('w'):
+				if((err = workload_find(optarg)) < 0 || num_workload_types >= ARRAY_LEN(workload_types)) {
+					fprintf(stderr, "Unknown workload '%s'\n", optarg);
+					return 1;
+				}
+				workload_types[num_workload_types++] = err;
+				err = 0;
+				break;
+			case('f'):
+				if(num_files >= ARRAY_LEN(files)) {
+					fprintf(stderr, "Too many files\n");
+					return 1;
+				}
+				files[num_files++] = optarg;
+				break;
+			case('c'):
+				for(i = 0; i < CHUNKING_NUM_TYPES; i++) {
+					if(!strcmp(optarg, chunking_names[i])) {
+						break;
+					}
+				}
+				if(i >= CHUNKING_NUM_TYPES || num_chunkings >= ARRAY_LEN(chunkings)) {
+					fprintf(stderr, "Unknown chunking '%s'\n", optarg);
+					return 1;
+				}
+				chunkings[num_chunkings++] = i;
+				break;
+			case('r'):
+				if(num_ring_sizes >= ARRAY_LEN(ring_sizes)) {
+					fprintf(stderr, "Too many ring sizes\n");
+					return 1;
+				}
+				ring_sizes[num_ring_sizes] = strtoul(optarg, NULL, 10);
+				if(ring_sizes[num_ring_sizes] < 2) {
+					fprintf(stderr, "Ring size must be >= 2\n");
+					return 1;
+				}
+				num_ring_sizes++;
+				break;
+			case('n'):
+				bench.iterations = atoi(optarg);
+				break;
+			case('b'):
+				corpus_size = strtoul(optarg, NULL, 10);
+				break;
+			case('W'):
+				bench.width = atoi(optarg);
+				break;
+			case('H'):
+				bench.height = atoi(optarg);
+				break;
+			case('S'):
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(!bench.iterations || !bench.width || !bench.height || corpus_size < 1024) {
+		fprintf(stderr, "Iterations, width and height must be > 0, corpus size must be >= 1024\n");
+		return 1;
+	}
+	if(!num_workload_types && !num_files) {
+		for(i = 0; i < WORKLOAD_NUM_TYPES; i++) {
+			workload_types[num_workload_types++] = i;
+		}
+	}
+	if(!num_chunkings) {
+		for(i = 0; i < CHUNKING_NUM_TYPES; i++) {
+			chunkings[num_chunkings++] = i;
+		}
+	}
+	if(!num_ring_sizes) {
+		ring_sizes[num_ring_sizes++] = 65536;
+		ring_sizes[num_ring_sizes++] = 64;
+	}
+
+	for(i = 0; i < num_workload_types; i++) {
+		struct workload_buffer buf;
+
+		if((err = workload_generate(&buf, workload_types[i], bench.width, bench.height, corpus_size, seed))) {
+			fprintf(stderr, "Failed to generate corpus: %s (%d)\n", strerror(-err), err);
+			goto fail_corpora;
+		}
+		corpora[num_corpora].name = workloads[workload_types[i]].name;
+		corpora[num_corpora].data = buf.data;
+		corpora[num_corpora].len = buf.len;
+		num_corpora++;
+	}
+	for(i = 0; i < num_files; i++) {
+		if((err = corpus_load(&corpora[num_corpora], files[i]))) {
+			fprintf(stderr, "Failed to load %s: %s (%d)\n", files[i], strerror(-err), err);
+			goto fail_corpora;
+		}
+		num_corpora++;
+	}
+
+	cycle_counter_open(&bench.cycles);
+	printf("%-12s %-7s %8s %11s %10s %9s %11s %s\n", "corpus", "chunks", "ring", "bytes", "commands", "ns/cmd", "bytes/cycle", "result");
+	for(i = 0; i < num_corpora; i++) {
+		struct result reference = { .response_hash = FNV_OFFSET };
+		struct fb* fb;
+
+		if((err = fb_alloc(&fb, bench.width, bench.height))) {
+			goto fail_cycles;
+		}
+		reference_parse(fb, &corpora[i], &reference);
+		reference.canvas_hash = canvas_hash(fb);
+		fb_free(fb);
+
+		for(j = 0; j < num_ring_sizes; j++) {
+			for(k = 0; k < num_chunkings; k++) {
+				if((err = run(&bench, &corpora[i], &reference, chunkings[k], ring_sizes[j]))) {
+					fprintf(stderr, "Run failed: %s (%d)\n", strerror(-err), err);
+					goto fail_cycles;
+				}
+			}
+		}
+	}
+
+fail_cycles:
+	if(bench.cycles.fd >= 0) {
+		close(bench.cycles.fd);
+	}
+fail_corpora:
+	for(i = 0; i < num_corpora; i++) {
+		free(corpora[i].data);
+	}
+	return err || bench.failed ? 1 : 0;
+}
@@ -0,0 +1,419 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../capture.h"
+#include "../framebuffer.h"
+#include "../network.h"
+#include "../parser.h"
+#include "../ring.h"
+#include "../util.h"
+#include "hash.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * shoreline-replay loads the capture files of one shoreline run (shoreline -c)
+ * and drives them back through parser_parse into a single framebuffer. Every
+ * captured connection gets its own parser and a ring of the captured size, so
+ * each record lands in the ring exactly like the original read() did.
+ *
+ * Records of all connections are merged by timestamp, ties go to the file
+ * given first. The order of records and thus the final canvas depend on the
+ * captures only, not on replay speed. Live shoreline draws to per NUMA node
+ * framebuffers that are merged asynchronously and answers PX reads from the
+ * merged canvas. Where connections raced for the same pixels the replayed
+ * canvas may thus differ from what was shown live, but every replay of the
+ * same captures yields the same canvas.
+ *
+ * Records are replayed as fast as possible by default, making a capture a
+ * regression benchmark. With -t they are replayed at their original timing.
+ */
+
+#define REPLAY_MAX_FILES 4096
+
+struct replay_conn {
+	const char* path;
+	char* data;
+	size_t len;
+	// Offset of the next record
+	size_t pos;
+	struct capture_header header;
+	struct ring* ring;
+	struct parser parser;
+#ifdef FEATURE_STATISTICS
+	struct net_counters counters;
+#endif
+	// Parser asked to close the connection, the rest of the capture is skipped
+	bool closed;
+};
+
+struct replay_result {
+	uint64_t canvas_hash;
+	uint64_t response_hash;
+	unsigned long long records;
+	unsigned long long bytes;
+	unsigned long long commands;
+	unsigned int closed;
+	long long duration_ns;
+};
+
+struct replay {
+	struct replay_conn* conns;
+	unsigned int num_conns;
+	unsigned int width;
+	unsigned int height;
+	size_t ring_size;
+	struct replay_result* result;
+};
+
+static int replay_respond(struct parser* parser, const char* buf, size_t len) {
+	struct replay* replay = parser->priv;
+
+	replay->result->response_hash = fnv1a(replay->result->response_hash, buf, len);
+	return len;
+}
+
+static int replay_load(struct replay_conn* conn, const char* path) {
+	int err, fd;
+	struct stat st;
+	size_t pos = 0;
+	ssize_t len;
+
+	conn->path = path;
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to open %s: %s (%d)\n", path, strerror(errno), err);
+		goto fail;
+	}
+	if(fstat(fd, &st)) {
+		err = -errno;
+		goto fail_fd;
+	}
+	if(st.st_size < sizeof(conn->header)) {
+		err = -EINVAL;
+		fprintf(stderr, "%s is too short for a capture file\n", path);
+		goto fail_fd;
+	}
+	conn->data = malloc(st.st_size);
+	if(!conn->data) {
+		err = -ENOMEM;
+		goto fail_fd;
+	}
+	while(pos < st.st_size) {
+		len = read(fd, conn->data + pos, st.st_size - pos);
+		if(len <= 0) {
+			err = len < 0 ? -errno : -EIO;
+			fprintf(stderr, "Failed to read %s: %s (%d)\n", path, strerror(-err), err);
+			goto fail_data;
+		}
+		pos += len;
+	}
+	conn->len = pos;
+
+	memcpy(&conn->header, conn->data, sizeof(conn->header));
+	if(conn->header.magic != CAPTURE_MAGIC || conn->header.version != CAPTURE_VERSION) {
+		err = -EINVAL;
+		fprintf(stderr, "%s is not a version %u capture file\n", path, CAPTURE_VERSION);
+		goto fail_data;
+	}
+	close(fd);
+	return 0;
+
+fail_data:
+	free(conn->data);
+	conn->data = NULL;
+fail_fd:
+	close(fd);
+fail:
+	return err;
+}
+
+// Find the connection with the earliest pending record
+static struct replay_conn* replay_next(struct replay* replay, struct capture_record* record) {
+	unsigned int i;
+	struct capture_record candidate;
+	struct replay_conn* conn, *next = NULL;
+
+	for(i = 0; i < replay->num_conns; i++) {
+		conn = &replay->conns[i];
+		if(conn->pos + sizeof(candidate) > conn->len) {
+			continue;
+		}
+		memcpy(&candidate, conn->data + conn->pos, sizeof(candidate));
+		// A truncated last record ends the capture
+		if(conn->pos + sizeof(candidate) + candidate.len > conn->len) {
+			conn->pos = conn->len;
+			continue;
+		}
+		if(!next || candidate.timestamp_ns < record->timestamp_ns) {
+			next = conn;
+			*record = candidate;
+		}
+	}
+	return next;
+}
+
+static uint64_t replay_first_timestamp(struct replay* replay) {
+	unsigned int i;
+	uint64_t first = UINT64_MAX;
+	struct capture_record record;
+
+	for(i = 0; i < replay->num_conns; i++) {
+		struct replay_conn* conn = &replay->conns[i];
+		if(conn->len >= sizeof(conn->header) + sizeof(record)) {
+			memcpy(&record, conn->data + sizeof(conn->header), sizeof(record));
+			first = min(first, record.timestamp_ns);
+		}
+	}
+	return first;
+}
+
+static void replay_wait(struct timespec* start, uint64_t offset_ns) {
+	struct timespec deadline = *start;
+	uint64_t nsec = deadline.tv_nsec + offset_ns;
+
+	deadline.tv_sec += nsec / 1000000000ULL;
+	deadline.tv_nsec = nsec % 1000000000ULL;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+static int replay_run(struct replay* replay, bool timed, struct replay_result* result, struct fb** ret) {
+	int err;
+	unsigned int i;
+	struct fb* fb;
+	struct replay_conn* conn;
+	struct capture_record record;
+	struct timespec start, end;
+	uint64_t first_ns = replay_first_timestamp(replay);
+
+	memset(result, 0, sizeof(*result));
+	result->response_hash = FNV_OFFSET;
+	replay->result = result;
+
+	if((err = fb_alloc(&fb, replay->width, replay->height))) {
+		fprintf(stderr, "Failed to allocate framebuffer: %s (%d)\n", strerror(-err), err);
+		goto fail;
+	}
+
+	for(i = 0; i < replay->num_conns; i++) {
+		conn = &replay->conns[i];
+		if((err = ring_alloc(&conn->ring, replay->ring_size))) {
+			fprintf(stderr, "Failed to allocate ring: %s (%d)\n", strerror(-err), err);
+			goto fail_rings;
+		}
+		memset(&conn->parser, 0, sizeof(conn->parser));
+		conn->parser.fb = fb;
+		conn->parser.fb_read = fb;
+		conn->parser.respond = replay_respond;
+		conn->parser.priv = replay;
+		conn->parser.socket = conn->header.id;
+#ifdef FEATURE_STATISTICS
+		memset(&conn->counters, 0, sizeof(conn->counters));
+		conn->parser.counters = &conn->counters;
+#endif
+		conn->pos = sizeof(conn->header);
+		conn->closed = false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while((conn = replay_next(replay, &record))) {
+		const char* data = conn->data + conn->pos + sizeof(record);
+
+		conn->pos += sizeof(record) + record.len;
+		if(conn->closed) {
+			continue;
+		}
+		if(timed) {
+			replay_wait(&start, record.timestamp_ns - first_ns);
+		}
+		if(record.len > ring_free_space_contig(conn->ring)) {
+			err = -EINVAL;
+			fprintf(stderr, "Record of %s does not fit the ring, corrupt capture?\n", conn->path);
+			goto fail_rings;
+		}
+		memcpy(conn->ring->ptr_write, data, record.len);
+		ring_advance_write(conn->ring, record.len);
+		result->records++;
+		result->bytes += record.len;
+		if(parser_parse(&conn->parser, conn->ring) < 0) {
+			conn->closed = true;
+			result->closed++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	result->duration_ns = get_timespec_diff(&end, &start);
+	result->canvas_hash = canvas_hash(fb);
+
+	for(i = 0; i < replay->num_conns; i++) {
+#ifdef FEATURE_STATISTICS
+		result->commands += replay->conns[i].counters.commands;
+#endif
+		ring_free(replay->conns[i].ring);
+	}
+	*ret = fb;
+	return 0;
+
+fail_rings:
+	while(i-- > 0) {
+		ring_free(replay->conns[i].ring);
+	}
+	fb_free(fb);
+fail:
+	return err;
+}
+
+// Binary PPM, easy to view and to diff
+static int replay_write_ppm(struct fb* fb, const char* path) {
+	int err = 0;
+	FILE* file;
+	unsigned int x, y;
+	union fb_pixel pixel;
+
+	file = fopen(path, "wb");
+	if(!file) {
+		err = -errno;
+		fprintf(stderr, "Failed to create %s: %s (%d)\n", path, strerror(errno), err);
+		return err;
+	}
+	fprintf(file, "P6\n%u %u\n255\n", fb->size.width, fb->size.height);
+	for(y = 0; y < fb->size.height; y++) {
+		for(x = 0; x < fb->size.width; x++) {
+			pixel = fb_get_pixel(fb, x, y);
+			fputc(pixel.abgr >> 24, file);
+			fputc(pixel.abgr >> 16, file);
+			fputc(pixel.abgr >> 8, file);
+		}
+	}
+	if(fclose(file)) {
+		err = -errno;
+		fprintf(stderr, "Failed to write %s: %s (%d)\n", path, strerror(errno), err);
+	}
+	return err;
+}
+
+static void show_usage(char* binary) {
+	fprintf(stderr, "Usage: %s [-t] [-n <iterations>] [-e <canvas hash>] [-o <ppm file>] [-?] <capture file>...\n", binary);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -t                Replay at original timing instead of as fast as possible\n");
+	fprintf(stderr, "  -n <iterations>   Number of replays, the fastest one is reported (default 1)\n");
+	fprintf(stderr, "  -e <canvas hash>  Fail unless the final canvas has this hash\n");
+	fprintf(stderr, "  -o <ppm file>     Write the final canvas to <ppm file>\n");
+	fprintf(stderr, "  -?                Show this help\n");
+}
+
+int main(int argc, char** argv) {
+	int opt, err = 0;
+	unsigned int i, iterations = 1;
+	bool timed = false, check_hash = false;
+	uint64_t expected_hash = 0;
+	const char* ppm_path = NULL;
+	struct replay replay = { 0 };
+	struct replay_result result, best = { 0 };
+	struct fb* fb;
+
+	while((opt = getopt(argc, argv, "tn:e:o:?")) != -1) {
+		switch(opt) {
+			case('t'):
+				timed = true;
+				break;
+			case('n'):
+				if(atoi(optarg) <= 0) {
+					fprintf(stderr, "Number of iterations must be > 0\n");
+					return 1;
+				}
+				iterations = atoi(optarg);
+				break;
+			case('e'):
+				expected_hash = strtoull(optarg, NULL, 16);
+				check_hash = true;
+				break;
+			case('o'):
+				ppm_path = optarg;
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind >= argc || argc - optind > REPLAY_MAX_FILES) {
+		show_usage(argv[0]);
+		return 1;
+	}
+
+	replay.conns = calloc(argc - optind, sizeof(*replay.conns));
+	if(!replay.conns) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	for(i = optind; i < argc; i++) {
+		struct replay_conn* conn = &replay.conns[replay.num_conns];
+
+		if((err = replay_load(conn, argv[i]))) {
+			goto fail_conns;
+		}
+		replay.num_conns++;
+		if(replay.num_conns == 1) {
+			replay.width = conn->header.width;
+			replay.height = conn->header.height;
+			replay.ring_size = conn->header.ring_size;
+		} else if(conn->header.width != replay.width || conn->header.height != replay.height ||
+			conn->header.ring_size != replay.ring_size) {
+			err = -EINVAL;
+			fprintf(stderr, "%s was captured with a different canvas or ring size, not from the same run?\n", argv[i]);
+			goto fail_conns;
+		}
+	}
+
+	for(i = 0; i < iterations; i++) {
+		if((err = replay_run(&replay, timed, &result, &fb))) {
+			goto fail_conns;
+		}
+		if(i && (result.canvas_hash != best.canvas_hash || result.response_hash != best.response_hash)) {
+			fprintf(stderr, "Replay %u is not deterministic!\n", i + 1);
+			err = -EINVAL;
+		}
+		if(!i || result.duration_ns < best.duration_ns) {
+			best = result;
+		}
+		if(ppm_path && i + 1 == iterations) {
+			if(replay_write_ppm(fb, ppm_path)) {
+				err = -EIO;
+			}
+		}
+		fb_free(fb);
+		if(err) {
+			goto fail_conns;
+		}
+	}
+
+	printf("summary: connections=%u records=%llu bytes=%llu commands=%llu closed=%u duration=%.3f "\
+		"bytes_per_second=%.0f ns_per_command=%.2f canvas=%016"PRIx64" responses=%016"PRIx64"\n",
+		replay.num_conns, best.records, best.bytes, best.commands, best.closed, best.duration_ns / 1e9,
+		best.duration_ns ? best.bytes * 1e9 / best.duration_ns : 0.0,
+		best.commands ? (double)best.duration_ns / best.commands : 0.0,
+		best.canvas_hash, best.response_hash);
+	if(check_hash && best.canvas_hash != expected_hash) {
+		fprintf(stderr, "Canvas hash %016"PRIx64" does not match expected %016"PRIx64"\n", best.canvas_hash, expected_hash);
+		err = -EINVAL;
+	}
+
+fail_conns:
+	for(i = 0; i < replay.num_conns; i++) {
+		free(replay.conns[i].data);
+	}
+	free(replay.conns);
+fail:
+	return err ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+#!/usr/bin/env bash
+#
+# Scaling matrix for shoreline
+#
+# Starts shoreline for every combination of listen threads (-l), ring size
+# (-s) and NUMA restriction, then loads it with shoreline-bench at each
+# connection count. Writes one CSV row per run to stdout, a readable table
+# to stderr.
+#
+# Columns:
+#   listen_threads, ring_size, numa    shoreline configuration of the run
+#   connections, bench_threads         load generator configuration
+#   bytes_per_second, pixels_per_second
+#                                      throughput seen by the load generator
+#   fps                                frames output by shoreline
+#   speedup                            pixels_per_second relative to the
+#                                      fewest connections of the same
+#                                      shoreline configuration
+#   marginal                           pixels_per_second relative to the
+#                                      previous connection count, scaling
+#                                      has flattened where this nears 1
+#   node_coalesce_mbps                 per NUMA node framebuffer traffic
+#                                      picked up by coalescing, as
+#                                      node:MB/s separated by spaces
+#
+# Needs shoreline built with STATISTICS, shoreline-bench (make
+# shoreline-bench), curl and for NUMA restrictions numactl.
+
+set -e -o pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+BIN_DIR="$SCRIPT_DIR/.."
+
+LISTEN_THREADS="1 4 10"
+RING_SIZES="65536"
+NUMA="all"
+CONNECTIONS="1 2 4 8 16 32"
+BENCH_THREADS=""
+WORKLOAD="tiles"
+DURATION=10
+WIDTH=1024
+HEIGHT=768
+PORT=14000
+
+usage() {
+	cat >&2 <<EOF
+Usage: $0 [-l <listen threads>] [-s <ring sizes>] [-n <numa restrictions>] [-c <connections>]
+          [-t <bench threads>] [-w <workload>] [-d <seconds>] [-W <width>] [-H <height>] [-p <port>]
+          [-b <binary dir>]
+Lists are space separated and must be quoted, e.g. -c "1 2 4 8".
+  -l <list>     Listen thread counts (default "$LISTEN_THREADS")
+  -s <list>     Ring sizes in bytes (default "$RING_SIZES")
+  -n <list>     NUMA nodes to restrict shoreline to, "all" for no restriction, e.g. "0 0,1" (default "$NUMA")
+  -c <list>     Load generator connection counts (default "$CONNECTIONS")
+  -t <threads>  Load generator threads (default connections, at most the number of cpus)
+  -w <workload> Load generator workload (default $WORKLOAD)
+  -d <seconds>  Duration of each run (default $DURATION)
+  -W <width>    Canvas width (default $WIDTH)
+  -H <height>   Canvas height (default $HEIGHT)
+  -p <port>     Pixelflut port, the next two ports are used for statistics (default $PORT)
+  -b <dir>      Directory containing shoreline and shoreline-bench (default $BIN_DIR)
+EOF
+	exit 1
+}
+
+while getopts "l:s:n:c:t:w:d:W:H:p:b:h" opt; do
+	case "$opt" in
+		l) LISTEN_THREADS="$OPTARG" ;;
+		s) RING_SIZES="$OPTARG" ;;
+		n) NUMA="$OPTARG" ;;
+		c) CONNECTIONS="$OPTARG" ;;
+		t) BENCH_THREADS="$OPTARG" ;;
+		w) WORKLOAD="$OPTARG" ;;
+		d) DURATION="$OPTARG" ;;
+		W) WIDTH="$OPTARG" ;;
+		H) HEIGHT="$OPTARG" ;;
+		p) PORT="$OPTARG" ;;
+		b) BIN_DIR="$OPTARG" ;;
+		*) usage ;;
+	esac
+done
+
+SHORELINE="$BIN_DIR/shoreline"
+BENCH="$BIN_DIR/shoreline-bench"
+STATS_PORT=$((PORT + 1))
+HTTP_PORT=$((PORT + 2))
+CPUS="$(nproc)"
+
+for bin in "$SHORELINE" "$BENCH"; do
+	if [ ! -x "$bin" ]; then
+		echo "$bin not found, run make shoreline shoreline-bench first" >&2
+		exit 1
+	fi
+done
+if ! command -v curl > /dev/null; then
+	echo "curl is required to collect statistics" >&2
+	exit 1
+fi
+for numa in $NUMA; do
+	if [ "$numa" != all ] && ! command -v numactl > /dev/null; then
+		echo "numactl is required for NUMA restrictions" >&2
+		exit 1
+	fi
+done
+
+SHORELINE_PID=""
+
+stop_shoreline() {
+	if [ -n "$SHORELINE_PID" ]; then
+		# Background jobs of scripts ignore SIGINT
+		kill -TERM "$SHORELINE_PID" 2> /dev/null || true
+		wait "$SHORELINE_PID" 2> /dev/null || true
+		SHORELINE_PID=""
+	fi
+}
+trap stop_shoreline EXIT
+
+metrics() {
+	curl -sf "http://127.0.0.1:$HTTP_PORT/metrics"
+}
+
+# Prints "<frames> <node>:<pixels coalesced> ..."
+sample() {
+	metrics | awk '
+		/^shoreline_frames_total / { frames = $2 }
+		/^shoreline_node_pixels_coalesced_total\{/ {
+			match($1, /node="[0-9]+"/)
+			nodes = nodes " " substr($1, RSTART + 6, RLENGTH - 7) ":" $2
+		}
+		END { print frames nodes }'
+}
+
+now_ns() {
+	date +%s%N
+}
+
+echo "listen_threads,ring_size,numa,connections,bench_threads,bytes_per_second,pixels_per_second,fps,speedup,marginal,node_coalesce_mbps"
+TABLE="listen ring numa conns threads MB/s Mpixels/s fps speedup marginal"
+
+for listen in $LISTEN_THREADS; do
+	for ring in $RING_SIZES; do
+		for numa in $NUMA; do
+			prefix=()
+			if [ "$numa" != all ]; then
+				prefix=(numactl --cpunodebind="$numa" --membind="$numa")
+			fi
+			first_pps=""
+			prev_pps=""
+			for conns in $CONNECTIONS; do
+				threads="$BENCH_THREADS"
+				if [ -z "$threads" ]; then
+					threads=$((conns < CPUS ? conns : CPUS))
+				fi
+
+				"${prefix[@]}" "$SHORELINE" -p "$PORT" -l "$listen" -s "$ring" -w "$WIDTH" -h "$HEIGHT" \
+					-f "statistics,port=$STATS_PORT,http_port=$HTTP_PORT" > /dev/null 2>&1 &
+				SHORELINE_PID=$!
+				for _ in $(seq 50); do
+					metrics > /dev/null 2>&1 && break
+					sleep 0.1
+				done
+				if ! metrics > /dev/null 2>&1; then
+					echo "shoreline did not come up, is it built with STATISTICS?" >&2
+					exit 1
+				fi
+
+				before="$(sample)"
+				before_ns="$(now_ns)"
+				summary="$("$BENCH" -p "$PORT" -c "$conns" -t "$threads" -w "$WORKLOAD" -d "$DURATION" 2> /dev/null | grep '^summary:')"
+				after="$(sample)"
+				after_ns="$(now_ns)"
+				stop_shoreline
+
+				bps="$(sed -n 's/.* bytes_per_second=\([0-9.]*\).*/\1/p' <<< "$summary")"
+				pps="$(sed -n 's/.* pixels_per_second=\([0-9.]*\).*/\1/p' <<< "$summary")"
+				if [ -z "$pps" ]; then
+					echo "Load generator failed for $conns connections" >&2
+					exit 1
+				fi
+				first_pps="${first_pps:-$pps}"
+				prev_pps="${prev_pps:-$pps}"
+
+				# Frames and per node rates between the two samples
+				read -r fps nodes <<< "$(awk -v before="$before" -v after="$after" -v ns=$((after_ns - before_ns)) 'BEGIN {
+					secs = ns / 1e9
+					nb = split(before, b, " ")
+					na = split(after, a, " ")
+					for(i = 2; i <= nb; i++) {
+						split(b[i], kv, ":")
+						start[kv[1]] = kv[2]
+					}
+					out = ""
+					for(i = 2; i <= na; i++) {
+						split(a[i], kv, ":")
+						out = out sprintf("%s%s:%.1f", out == "" ? "" : " ", kv[1], (kv[2] - start[kv[1]]) * 4 / 1e6 / secs)
+					}
+					printf "%.1f %s\n", (a[1] - b[1]) / secs, out
+				}')"
+				read -r speedup marginal <<< "$(awk -v pps="$pps" -v first="$first_pps" -v prev="$prev_pps" \
+					'BEGIN { printf "%.2f %.2f\n", (first > 0 ? pps / first : 0), (prev > 0 ? pps / prev : 0) }')"
+				prev_pps="$pps"
+
+				echo "$listen,$ring,\"$numa\",$conns,$threads,$bps,$pps,$fps,$speedup,$marginal,$nodes"
+				TABLE="$TABLE
+$listen $ring $numa $conns $threads $(awk -v b="$bps" -v p="$pps" 'BEGIN { printf "%.1f %.2f", b / 1e6, p / 1e6 }') $fps $speedup $marginal"
+			done
+		done
+	done
+done
+
+if command -v column > /dev/null; then
+	column -t <<< "$TABLE" >&2
+else
+	echo "$TABLE" >&2
+fi
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workload.h"
+
+#define WORKLOAD_TILE_SIZE 64
+#define WORKLOAD_OFFSET_BLOCK_SIZE 16
+#define WORKLOAD_MAX_COMMAND_LEN 64
+
+const struct workload_def workloads[WORKLOAD_NUM_TYPES] = {
+	[WORKLOAD_RANDOM] = { "random", "PX with 6 digit colors at random positions" },
+	[WORKLOAD_TILES] = { "tiles", "Image tiles of 64x64 pixels at random positions" },
+	[WORKLOAD_OFFSET] = { "offset", "OFFSET followed by a 16x16 block of relative PX" },
+	[WORKLOAD_READ] = { "read", "PX reads at random positions" },
+	[WORKLOAD_MIXED] = { "mixed", "PX with 6 and 8 digit colors at random positions" },
+	[WORKLOAD_MESSY] = { "messy", "Everything mixed with odd whitespace, CRLF, garbage and out of bounds pixels" },
+};
+
+struct workload_ctx {
+	struct workload_buffer* buf;
+	unsigned int width;
+	unsigned int height;
+	uint64_t state;
+};
+
+// xorshift64*, good enough to scatter pixels
+static uint64_t workload_random(struct workload_ctx* ctx) {
+	ctx->state ^= ctx->state >> 12;
+	ctx->state ^= ctx->state << 25;
+	ctx->state ^= ctx->state >> 27;
+	return ctx->state * 2685821657736338717ULL;
+}
+
+static bool workload_full(struct workload_ctx* ctx) {
+	return ctx->buf->len + WORKLOAD_MAX_COMMAND_LEN > ctx->buf->size;
+}
+
+static void workload_printf(struct workload_ctx* ctx, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void workload_printf(struct workload_ctx* ctx, const char* fmt, ...) {
+	struct workload_buffer* buf = ctx->buf;
+	va_list vargs;
+
+	va_start(vargs, fmt);
+	buf->len += vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, vargs);
+	va_end(vargs);
+}
+
+static void workload_append_px(struct workload_ctx* ctx, unsigned int x, unsigned int y, uint32_t color, bool alpha) {
+	if(alpha) {
+		workload_printf(ctx, "PX %u %u %08x\n", x, y, color);
+	} else {
+		workload_printf(ctx, "PX %u %u %06x\n", x, y, color & 0xffffff);
+	}
+	ctx->buf->pixels++;
+}
+
+static void workload_generate_random(struct workload_ctx* ctx, bool mixed) {
+	while(!workload_full(ctx)) {
+		uint64_t rnd = workload_random(ctx);
+		unsigned int x = (rnd & 0xffff) % ctx->width;
+		unsigned int y = ((rnd >> 16) & 0xffff) % ctx->height;
+		uint32_t color = workload_random(ctx);
+
+		workload_append_px(ctx, x, y, color, mixed && (rnd >> 32) & 1);
+	}
+}
+
+static void workload_generate_tiles(struct workload_ctx* ctx) {
+	while(!workload_full(ctx)) {
+		uint64_t rnd = workload_random(ctx);
+		unsigned int origin_x = (rnd & 0xffff) % ctx->width;
+		unsigned int origin_y = ((rnd >> 16) & 0xffff) % ctx->height;
+		uint32_t base = rnd >> 32;
+		unsigned int x, y;
+
+		// A smooth gradient, like a scaled down photo
+		for(y = origin_y; y < origin_y + WORKLOAD_TILE_SIZE && y < ctx->height; y++) {
+			for(x = origin_x; x < origin_x + WORKLOAD_TILE_SIZE && x < ctx->width; x++) {
+				uint32_t color = base + ((x - origin_x) << 18) + ((y - origin_y) << 10);
+
+				if(workload_full(ctx)) {
+					return;
+				}
+				workload_append_px(ctx, x, y, color, false);
+			}
+		}
+	}
+}
+
+static void workload_generate_offset(struct workload_ctx* ctx) {
+	unsigned int block_width = ctx->width < WORKLOAD_OFFSET_BLOCK_SIZE ? ctx->width : WORKLOAD_OFFSET_BLOCK_SIZE;
+	unsigned int block_height = ctx->height < WORKLOAD_OFFSET_BLOCK_SIZE ? ctx->height : WORKLOAD_OFFSET_BLOCK_SIZE;
+
+	while(!workload_full(ctx)) {
+		uint64_t rnd = workload_random(ctx);
+		unsigned int x, y;
+
+		workload_printf(ctx, "OFFSET %u %u\n",
+			(unsigned int)((rnd & 0xffff) % (ctx->width - block_width + 1)),
+			(unsigned int)(((rnd >> 16) & 0xffff) % (ctx->height - block_height + 1)));
+		for(y = 0; y < block_height; y++) {
+			for(x = 0; x < block_width; x++) {
+				if(workload_full(ctx)) {
+					return;
+				}
+				workload_append_px(ctx, x, y, workload_random(ctx), false);
+			}
+		}
+	}
+}
+
+static void workload_generate_read(struct workload_ctx* ctx) {
+	while(!workload_full(ctx)) {
+		uint64_t rnd = workload_random(ctx);
+
+		workload_printf(ctx, "PX %u %u\n",
+			(unsigned int)((rnd & 0xffff) % ctx->width), (unsigned int)(((rnd >> 16) & 0xffff) % ctx->height));
+		ctx->buf->reads++;
+	}
+}
+
+// One command per line, but otherwise everything a sloppy client might send
+static void workload_generate_messy(struct workload_ctx* ctx) {
+	static const char* separators[] = { " ", "  ", "\t", " \t" };
+	static const char* newlines[] = { "\n", "\r\n", "\n\n", " \n" };
+
+	while(!workload_full(ctx)) {
+		uint64_t rnd = workload_random(ctx);
+		const char* sep = separators[rnd & 3];
+		const char* newline = newlines[(rnd >> 2) & 3];
+		// Some pixels just off the canvas
+		unsigned int x = ((rnd >> 8) & 0xffff) % (ctx->width + 8);
+		unsigned int y = ((rnd >> 24) & 0xffff) % (ctx->height + 8);
+		uint32_t color = workload_random(ctx);
+
+		switch((rnd >> 40) & 0xf) {
+			case 0:
+				workload_printf(ctx, "PX%s%u%s%u%s", sep, x, sep, y, newline);
+				ctx->buf->reads++;
+				break;
+			case 1:
+				workload_printf(ctx, "SIZE%s", newline);
+				break;
+			case 2:
+				workload_printf(ctx, "OFFSET%s%u%s%u%s", sep, x / 4, sep, y / 4, newline);
+				break;
+			case 3:
+				workload_printf(ctx, "OFFSET 0 0%s", newline);
+				break;
+			case 4:
+				workload_printf(ctx, "HELLO%s", newline);
+				break;
+			case 5:
+				workload_printf(ctx, "PX%s%u%s%u%s%08X%s", sep, x, sep, y, sep, color, newline);
+				ctx->buf->pixels++;
+				break;
+			default:
+				workload_printf(ctx, "PX%s%u%s%u%s%06x%s", sep, x, sep, y, sep, color & 0xffffff, newline);
+				ctx->buf->pixels++;
+				break;
+		}
+	}
+}
+
+int workload_find(const char* name) {
+	int i;
+
+	for(i = 0; i < WORKLOAD_NUM_TYPES; i++) {
+		if(!strcmp(name, workloads[i].name)) {
+			return i;
+		}
+	}
+	return -ENOENT;
+}
+
+int workload_generate(struct workload_buffer* buf, enum workload_type type, unsigned int width, unsigned int height,
+	size_t size, uint64_t seed) {
+	struct workload_ctx ctx = {
+		.buf = buf,
+		.width = width,
+		.height = height,
+		.state = seed * 0x9e3779b97f4a7c15ULL | 1,
+	};
+
+	memset(buf, 0, sizeof(*buf));
+	buf->data = malloc(size);
+	if(!buf->data) {
+		return -ENOMEM;
+	}
+	buf->size = size;
+
+	switch(type) {
+		case WORKLOAD_RANDOM:
+			workload_generate_random(&ctx, false);
+			break;
+		case WORKLOAD_TILES:
+			workload_generate_tiles(&ctx);
+			break;
+		case WORKLOAD_OFFSET:
+			workload_generate_offset(&ctx);
+			break;
+		case WORKLOAD_READ:
+			workload_generate_read(&ctx);
+			break;
+		case WORKLOAD_MIXED:
+			workload_generate_random(&ctx, true);
+			break;
+		case WORKLOAD_MESSY:
+			workload_generate_messy(&ctx);
+			break;
+		default:
+			workload_buffer_free(buf);
+			return -EINVAL;
+	}
+	return 0;
+}
+
+void workload_buffer_free(struct workload_buffer* buf) {
+	free(buf->data);
+	buf->data = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Synthetic pixelflut command streams shared by the benchmarks. The same
+ * type, canvas size, buffer size and seed always yield the same stream.
+ */
+
+enum workload_type {
+	WORKLOAD_RANDOM,
+	WORKLOAD_TILES,
+	WORKLOAD_OFFSET,
+	WORKLOAD_READ,
+	WORKLOAD_MIXED,
+	WORKLOAD_MESSY,
+	WORKLOAD_NUM_TYPES,
+};
+
+struct workload_def {
+	const char* name;
+	const char* description;
+};
+
+extern const struct workload_def workloads[WORKLOAD_NUM_TYPES];
+
+struct workload_buffer {
+	char* data;
+	size_t len;
+	size_t size;
+	// Pixels set and pixels read by one pass over the buffer
+	unsigned long long pixels;
+	unsigned long long reads;
+};
+
+int workload_find(const char* name);
+int workload_generate(struct workload_buffer* buf, enum workload_type type, unsigned int width, unsigned int height,
+	size_t size, uint64_t seed);
+void workload_buffer_free(struct workload_buffer* buf);
+
+#endif
@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "util.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * Capturing runs on the connection threads, right after read(). To keep the
+ * overhead bounded each connection collects records in a private buffer and
+ * only hands full buffers to the kernel, so there is no locking and about one
+ * write() per CAPTURE_BUFFER_SIZE bytes received. Once a capture file reaches
+ * its size limit or a write fails the connection stops capturing, the
+ * connection itself is never affected.
+ */
+
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+
+struct capture_conn {
+	struct capture* capture;
+	int fd;
+	uint64_t id;
+	size_t captured;
+	size_t len;
+	char buf[CAPTURE_BUFFER_SIZE];
+};
+
+int capture_alloc(struct capture** ret, const char* directory, size_t limit, size_t ring_size,
+	unsigned int width, unsigned int height) {
+	int err;
+	struct capture* capture;
+	struct stat st;
+
+	if(stat(directory, &st)) {
+		err = -errno;
+		fprintf(stderr, "Failed to access capture directory %s: %s (%d)\n", directory, strerror(errno), err);
+		goto fail;
+	}
+	if(!S_ISDIR(st.st_mode)) {
+		err = -ENOTDIR;
+		fprintf(stderr, "Capture path %s is not a directory\n", directory);
+		goto fail;
+	}
+
+	capture = calloc(1, sizeof(*capture));
+	if(!capture) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	capture->directory = directory;
+	capture->limit = limit;
+	capture->ring_size = ring_size;
+	capture->width = width;
+	capture->height = height;
+	capture->epoch_ns = get_monotonic_ns();
+
+	*ret = capture;
+	return 0;
+
+fail:
+	return err;
+}
+
+void capture_free(struct capture* capture) {
+	free(capture);
+}
+
+static void capture_conn_stop(struct capture_conn* conn) {
+	if(conn->fd >= 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+}
+
+static void capture_conn_flush(struct capture_conn* conn) {
+	size_t write_cnt = 0;
+	ssize_t write_len;
+
+	while(conn->fd >= 0 && write_cnt < conn->len) {
+		write_len = write(conn->fd, conn->buf + write_cnt, conn->len - write_cnt);
+		if(write_len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Failed to write capture %"PRIu64", stopping capture: %s (%d)\n", conn->id, strerror(errno), errno);
+			capture_conn_stop(conn);
+			break;
+		}
+		write_cnt += write_len;
+	}
+	conn->len = 0;
+}
+
+static void capture_conn_append(struct capture_conn* conn, const void* ptr, size_t len) {
+	const char* data = ptr;
+	size_t copy_len;
+
+	while(len) {
+		if(conn->len == sizeof(conn->buf)) {
+			capture_conn_flush(conn);
+		}
+		copy_len = min(len, sizeof(conn->buf) - conn->len);
+		memcpy(conn->buf + conn->len, data, copy_len);
+		conn->len += copy_len;
+		data += copy_len;
+		len -= copy_len;
+	}
+}
+
+int capture_conn_open(struct capture* capture, struct capture_conn** ret) {
+	int err;
+	struct capture_conn* conn;
+	char path[PATH_MAX];
+	struct capture_header header = {
+		.magic = CAPTURE_MAGIC,
+		.version = CAPTURE_VERSION,
+		.width = capture->width,
+		.height = capture->height,
+		.ring_size = capture->ring_size,
+		.timestamp_ns = get_monotonic_ns() - capture->epoch_ns,
+	};
+
+	conn = malloc(sizeof(*conn));
+	if(!conn) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	conn->capture = capture;
+	conn->id = __atomic_fetch_add(&capture->next_id, 1, __ATOMIC_RELAXED);
+	conn->captured = 0;
+	conn->len = 0;
+
+	snprintf(path, sizeof(path), "%s/%"PRIu64".cap", capture->directory, conn->id);
+	conn->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(conn->fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to create capture file %s: %s (%d)\n", path, strerror(errno), err);
+		goto fail_conn;
+	}
+
+	header.id = conn->id;
+	capture_conn_append(conn, &header, sizeof(header));
+	conn->captured = sizeof(header);
+
+	*ret = conn;
+	return 0;
+
+fail_conn:
+	free(conn);
+fail:
+	return err;
+}
+
+void capture_conn_record(struct capture_conn* conn, const char* data, size_t len) {
+	struct capture_record record;
+
+	if(conn->fd < 0) {
+		return;
+	}
+	if(conn->captured + sizeof(record) + len > conn->capture->limit) {
+		fprintf(stderr, "Capture %"PRIu64" reached its size limit, stopping capture\n", conn->id);
+		capture_conn_flush(conn);
+		capture_conn_stop(conn);
+		return;
+	}
+
+	record.timestamp_ns = get_monotonic_ns() - conn->capture->epoch_ns;
+	record.len = len;
+	capture_conn_append(conn, &record, sizeof(record));
+	capture_conn_append(conn, data, len);
+	conn->captured += sizeof(record) + len;
+}
+
+void capture_conn_close(struct capture_conn* conn) {
+	capture_conn_flush(conn);
+	capture_conn_stop(conn);
+	free(conn);
+}
@@ -0,0 +1,64 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Raw traffic capture
+ *
+ * Every connection gets its own capture file <directory>/<id>.cap. The file
+ * starts with a struct capture_header followed by one struct capture_record
+ * per read(), each followed by len bytes of data exactly as received.
+ *
+ * Timestamps are relative to a common epoch for all connections of one
+ * shoreline run, so captures of concurrent connections can be merged back
+ * into a single stream. All fields are in host byte order.
+ *
+ * Since every record is what one read() placed in the ring, a replay using
+ * the same ring size sees exactly the same partial commands and wraparounds.
+ */
+
+#define CAPTURE_MAGIC 0x70637273 // "srcp"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_LIMIT_DEFAULT (64 * 1024 * 1024)
+
+struct capture_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint64_t ring_size;
+	uint64_t id;
+	// Connect time relative to the capture epoch
+	uint64_t timestamp_ns;
+} __attribute__((packed));
+
+struct capture_record {
+	uint64_t timestamp_ns;
+	uint32_t len;
+} __attribute__((packed));
+
+struct capture {
+	const char* directory;
+	// Maximum size of a single capture file
+	size_t limit;
+	size_t ring_size;
+	unsigned int width;
+	unsigned int height;
+	uint64_t epoch_ns;
+	uint64_t next_id;
+};
+
+struct capture_conn;
+
+int capture_alloc(struct capture** ret, const char* directory, size_t limit, size_t ring_size,
+	unsigned int width, unsigned int height);
+void capture_free(struct capture* capture);
+
+int capture_conn_open(struct capture* capture, struct capture_conn** ret);
+void capture_conn_record(struct capture_conn* conn, const char* data, size_t len);
+void capture_conn_close(struct capture_conn* conn);
+
+#endif
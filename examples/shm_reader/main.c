@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../seqlock.h"
+#include "../../shm.h"
+
+/*
+ * Minimal consumer of the shm frontend. Checksums every frame in place and
+ * prints a summary once per second. With -r frames are additionally written
+ * to stdout as raw video, e.g.
+ *
+ *   shm_reader -r /shoreline | ffmpeg -f rawvideo -pix_fmt abgr -s 1024x768 -i - out.mkv
+ *
+ * Raw output is written before the frame is validated and may contain a torn
+ * frame if the reader falls more than SHM_NUM_SLOTS - 1 frames behind.
+ */
+
+static void* map_segment(int fd, size_t* size) {
+	struct shm_header* header;
+	size_t len = sizeof(struct shm_header);
+	void* map;
+
+	while(1) {
+		map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		if(map == MAP_FAILED) {
+			return NULL;
+		}
+		header = map;
+		if(__atomic_load_n(&header->size, __ATOMIC_ACQUIRE) <= len) {
+			*size = len;
+			return map;
+		}
+		len = header->size;
+		munmap(map, sizeof(struct shm_header));
+	}
+}
+
+static double timespec_diff(struct timespec* a, struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1000000000.0;
+}
+
+int main(int argc, char** argv) {
+	int fd;
+	bool raw = false;
+	const char* name = "/shoreline";
+	struct shm_header* header;
+	size_t size;
+	uint64_t last_frame = 0;
+	unsigned long frames = 0, torn = 0;
+	uint32_t checksum = 0, width = 0, height = 0;
+	struct timespec last_print, now;
+	struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+	if(argc > 1 && !strcmp(argv[1], "-r")) {
+		raw = true;
+		argc--;
+		argv++;
+	}
+	if(argc > 1) {
+		name = argv[1];
+	}
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s(%d)\n", name, strerror(errno), errno);
+		return 1;
+	}
+
+	header = map_segment(fd, &size);
+	if(!header) {
+		fprintf(stderr, "Failed to map %s: %s(%d)\n", name, strerror(errno), errno);
+		return 1;
+	}
+	while(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+		nanosleep(&poll_interval, NULL);
+	}
+	if(header->version != SHM_VERSION || header->format != SHM_FORMAT_RGBA8888) {
+		fprintf(stderr, "Unsupported segment version %u, format %u\n", header->version, header->format);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &last_print);
+	while(1) {
+		uint64_t frame = __atomic_load_n(&header->frame, __ATOMIC_ACQUIRE);
+		struct shm_slot* slot = &header->slots[frame % header->num_slots];
+		uint32_t seq, sum = 0, *pixels;
+		size_t i, len;
+
+		if(frame == last_frame) {
+			nanosleep(&poll_interval, NULL);
+			goto print;
+		}
+
+		if(!seqlock_read_begin(&slot->seq, &seq)) {
+			torn++;
+			continue;
+		}
+		if(slot->frame != frame) {
+			// Slot invalidated by a resize or already reused, wait for the next frame
+			nanosleep(&poll_interval, NULL);
+			goto print;
+		}
+		width = slot->width;
+		height = slot->height;
+		len = (size_t)slot->stride * height;
+		if(slot->offset + len > size) {
+			// Segment grew, remap before touching the frame
+			munmap(header, size);
+			header = map_segment(fd, &size);
+			if(!header) {
+				fprintf(stderr, "Failed to remap %s: %s(%d)\n", name, strerror(errno), errno);
+				return 1;
+			}
+			continue;
+		}
+
+		pixels = (uint32_t*)((char*)header + slot->offset);
+		for(i = 0; i < len / sizeof(uint32_t); i++) {
+			sum = sum * 31 + pixels[i];
+		}
+		if(raw && fwrite(pixels, len, 1, stdout) != 1) {
+			return 1;
+		}
+		if(seqlock_read_retry(&slot->seq, seq)) {
+			torn++;
+			continue;
+		}
+		checksum = sum;
+		last_frame = frame;
+		frames++;
+
+print:
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(timespec_diff(&now, &last_print) >= 1.0) {
+			fprintf(stderr, "frame %llu, %ux%u, checksum %08x, %lu frames, %lu torn\n",
+				(unsigned long long)last_frame, width, height, checksum, frames, torn);
+			frames = 0;
+			torn = 0;
+			last_print = now;
+		}
+	}
+
+	return 0;
+}
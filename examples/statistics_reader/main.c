@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../seqlock.h"
+#include "../../statistics_shm.h"
+
+/*
+ * Minimal consumer of the shared memory statistics page, e.g.
+ *
+ *   shoreline -f statistics,shm=/shoreline-statistics
+ *   statistics_reader /shoreline-statistics
+ *
+ * Prints totals and per NUMA node counters once per second.
+ */
+
+// Take a consistent copy of the page, returns the number of retries needed
+static unsigned int read_snapshot(const struct statistics_shm* shm, struct statistics_shm* snapshot) {
+	unsigned int retries = 0;
+	uint32_t seq;
+
+	while(1) {
+		if(seqlock_read_begin(&shm->seq, &seq)) {
+			memcpy(snapshot, shm, sizeof(*snapshot));
+			if(!seqlock_read_retry(&shm->seq, seq)) {
+				return retries;
+			}
+		}
+		retries++;
+	}
+}
+
+int main(int argc, char** argv) {
+	int fd;
+	const char* name = "/shoreline-statistics";
+	struct statistics_shm* shm;
+	struct statistics_shm snapshot;
+	struct timespec interval = { .tv_sec = 1, .tv_nsec = 0 };
+	unsigned int i, retries;
+
+	if(argc > 1) {
+		name = argv[1];
+	}
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s(%d)\n", name, strerror(errno), errno);
+		return 1;
+	}
+
+	shm = mmap(NULL, sizeof(struct statistics_shm), PROT_READ, MAP_SHARED, fd, 0);
+	if(shm == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s(%d)\n", name, strerror(errno), errno);
+		return 1;
+	}
+	while(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATISTICS_SHM_MAGIC) {
+		nanosleep(&interval, NULL);
+	}
+	if(shm->version != STATISTICS_SHM_VERSION) {
+		fprintf(stderr, "Unsupported statistics page version %u\n", shm->version);
+		return 1;
+	}
+
+	while(1) {
+		retries = read_snapshot(shm, &snapshot);
+		printf("update %llu: %llu bytes, %llu pixels, %llu pixels/s, %llu fps, %llu connections, %u retries\n",
+			(unsigned long long)snapshot.update, (unsigned long long)snapshot.bytes_total,
+			(unsigned long long)snapshot.pixels_total, (unsigned long long)snapshot.pixels_per_second,
+			(unsigned long long)snapshot.frames_per_second, (unsigned long long)snapshot.connections, retries);
+		for(i = 0; i < snapshot.num_nodes && i < STATISTICS_SHM_MAX_NODES; i++) {
+			printf("  node %u: %llu connections, %llu pixels coalesced\n", snapshot.nodes[i].numa_node,
+				(unsigned long long)snapshot.nodes[i].connections,
+				(unsigned long long)snapshot.nodes[i].pixels_coalesced_total);
+		}
+		fflush(stdout);
+		nanosleep(&interval, NULL);
+	}
+
+	return 0;
+}
@@ -6,6 +6,11 @@
 
 #include "framebuffer.h"
 
+static void fb_set_tiles(struct fb_size* tiles, unsigned int width, unsigned int height) {
+	tiles->width = (width + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+	tiles->height = (height + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+}
+
 int fb_alloc(struct fb** framebuffer, unsigned int width, unsigned int height) {
 	int err = 0;
 	size_t fb_size;
@@ -26,6 +31,15 @@ int fb_alloc(struct fb** framebuffer, unsigned int width, unsigned int height) {
 		goto fail_fb;
 	}
 
+	// Everything is new in a fresh framebuffer
+	fb_set_tiles(&fb->tiles, width, height);
+	fb->dirty = malloc(fb->tiles.width * fb->tiles.height);
+	if(!fb->dirty) {
+		err = -ENOMEM;
+		goto fail_pixels;
+	}
+	fb_mark_all_dirty(fb);
+
 	while (fb_size--) {
 		if (is_big_endian()) {
 			fb->pixels[fb_size].color_be.alpha = 0xff;
@@ -36,10 +50,16 @@ int fb_alloc(struct fb** framebuffer, unsigned int width, unsigned int height) {
 
 	fb->numa_node = get_numa_node();
 	fb->list = LLIST_ENTRY_INIT;
+#ifdef FEATURE_STATISTICS
+	fb->latency_sample = 0;
+	fb->pixels_coalesced = 0;
+#endif
 
 	*framebuffer = fb;
 	return 0;
 
+fail_pixels:
+	free(fb->pixels);
 fail_fb:
 	free(fb);
 fail:
@@ -59,6 +79,7 @@ struct fb* fb_get_fb_on_node(struct llist* fbs, unsigned numa_node) {
 }
 
 void fb_free(struct fb* fb) {
+	free(fb->dirty);
 	free(fb->pixels);
 	free(fb);
 }
@@ -82,6 +103,7 @@ void fb_set_pixel_rgb(struct fb* fb, unsigned int x, unsigned int y, uint8_t red
 }
 
 void fb_clear_rect(struct fb* fb, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	fb_mark_dirty(fb, x, y, width, height);
 	while(height--) {
 		if(y + height >= fb->size.height) {
 			continue;
@@ -100,6 +122,8 @@ static void fb_set_size(struct fb* fb, unsigned int width, unsigned int height)
 int fb_resize(struct fb* fb, unsigned int width, unsigned int height) {
 	int err = 0;
 	union fb_pixel* fbmem, *oldmem;
+	uint8_t* dirty, *olddirty;
+	struct fb_size tiles;
 	struct fb_size oldsize = *fb_get_size(fb);
 	size_t memsize = width * height * sizeof(union fb_pixel);
 	size_t oldmemsize = oldsize.width * oldsize.height * sizeof(union fb_pixel);
@@ -110,16 +134,34 @@ int fb_resize(struct fb* fb, unsigned int width, unsigned int height) {
 	}
 	memset(fbmem, 0, memsize);
 
+	fb_set_tiles(&tiles, width, height);
+	dirty = malloc(tiles.width * tiles.height);
+	if(!dirty) {
+		err = -ENOMEM;
+		goto fail_fbmem;
+	}
+	memset(dirty, 1, tiles.width * tiles.height);
+
 	oldmem = fb->pixels;
+	olddirty = fb->dirty;
 	// Try to prevent oob writes
 	if(oldmemsize > memsize) {
 		fb_set_size(fb, width, height);
+		fb->tiles = tiles;
 		fb->pixels = fbmem;
+		fb->dirty = dirty;
 	} else {
 		fb->pixels = fbmem;
+		fb->dirty = dirty;
+		fb->tiles = tiles;
 		fb_set_size(fb, width, height);
 	}
 	free(oldmem);
+	free(olddirty);
+	return 0;
+
+fail_fbmem:
+	free(fbmem);
 fail:
 	return err;
 }
@@ -130,11 +172,89 @@ void fb_copy(struct fb* dst, struct fb* src) {
 	memcpy(dst->pixels, src->pixels, dst->size.width * dst->size.height * sizeof(union fb_pixel));
 }
 
-int fb_coalesce(struct fb* fb, struct llist* fbs) {
+/*
+ * Copy all tiles marked in the tile map to dst and mark them dirty in dst.
+ * The map must match the tile layout of src. If the sizes differ dst is
+ * resized to match and copied completely.
+ */
+int fb_copy_tiles(struct fb* dst, struct fb* src, uint8_t* tiles) {
+	int err;
+	unsigned int tile_x, tile_y, y;
+
+	if(dst->size.width != src->size.width || dst->size.height != src->size.height) {
+		if((err = fb_resize(dst, src->size.width, src->size.height))) {
+			return err;
+		}
+		fb_copy(dst, src);
+		return 0;
+	}
+
+	for(tile_y = 0; tile_y < src->tiles.height; tile_y++) {
+		unsigned int y_start = tile_y * FB_TILE_SIZE;
+		unsigned int y_end = min(y_start + FB_TILE_SIZE, src->size.height);
+		uint8_t* tile_row = &tiles[tile_y * src->tiles.width];
+		for(tile_x = 0; tile_x < src->tiles.width; tile_x++) {
+			unsigned int x_start, width;
+			if(!tile_row[tile_x]) {
+				continue;
+			}
+			// Merge runs of dirty tiles into one copy per line
+			x_start = tile_x * FB_TILE_SIZE;
+			while(tile_x < src->tiles.width && tile_row[tile_x]) {
+				dst->dirty[tile_y * dst->tiles.width + tile_x] = 1;
+				tile_x++;
+			}
+			width = min(tile_x * FB_TILE_SIZE, src->size.width) - x_start;
+			for(y = y_start; y < y_end; y++) {
+				memcpy(fb_get_line_base(dst, y) + x_start, fb_get_line_base(src, y) + x_start, width * sizeof(union fb_pixel));
+			}
+		}
+	}
+	return 0;
+}
+
+// Copy all tiles marked dirty in src to dst
+int fb_copy_dirty(struct fb* dst, struct fb* src) {
+	return fb_copy_tiles(dst, src, src->dirty);
+}
+
+void fb_mark_dirty(struct fb* fb, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	unsigned int tile_x, tile_y, tile_x_end, tile_y_end;
+
+	if(!width || !height || x >= fb->size.width || y >= fb->size.height) {
+		return;
+	}
+
+	tile_x_end = min(x + width - 1, fb->size.width - 1) / FB_TILE_SIZE;
+	tile_y_end = min(y + height - 1, fb->size.height - 1) / FB_TILE_SIZE;
+	for(tile_y = y / FB_TILE_SIZE; tile_y <= tile_y_end; tile_y++) {
+		for(tile_x = x / FB_TILE_SIZE; tile_x <= tile_x_end; tile_x++) {
+			fb->dirty[tile_y * fb->tiles.width + tile_x] = 1;
+		}
+	}
+}
+
+void fb_mark_all_dirty(struct fb* fb) {
+	memset(fb->dirty, 1, fb->tiles.width * fb->tiles.height);
+}
+
+void fb_clear_dirty(struct fb* fb) {
+	memset(fb->dirty, 0, fb->tiles.width * fb->tiles.height);
+}
+
+// Merge pixels written to fbs into fb, limited to the tile rows [tile_row_start, tile_row_end)
+// Disjoint tile row ranges of the same fb may be coalesced concurrently
+int fb_coalesce_rows(struct fb* fb, struct llist* fbs, uint32_t* tile_writes, unsigned int tile_row_start, unsigned int tile_row_end) {
 	struct llist_entry* cursor;
 	struct fb* other;
-	size_t i, j, fb_size = fb->size.width * fb->size.height, num_fbs = llist_length(fbs);
+	size_t i, num_fbs = llist_length(fbs);
+	unsigned int x, y, tile_x;
+	unsigned int y_start = tile_row_start * FB_TILE_SIZE;
+	unsigned int y_end = min(tile_row_end * FB_TILE_SIZE, fb->size.height);
 	unsigned int indices[num_fbs];
+#ifdef FEATURE_STATISTICS
+	uint64_t coalesced;
+#endif
 	for(i = 0; i < num_fbs; i++) {
 		indices[i] = i;
 	}
@@ -145,22 +265,51 @@ int fb_coalesce(struct fb* fb, struct llist* fbs) {
 		if(fb->size.width != other->size.width || fb->size.height != other->size.height) {
 			return -EINVAL;
 		}
-		for(j = 0; j < fb_size; j++) {
-			if(other->pixels[j].color.alpha == 0) {
-				continue;
-			}
+#ifdef FEATURE_STATISTICS
+		coalesced = 0;
+#endif
+		for(y = y_start; y < y_end; y++) {
+			union fb_pixel* dst = fb_get_line_base(fb, y);
+			union fb_pixel* src = fb_get_line_base(other, y);
+			size_t tile_row = (y / FB_TILE_SIZE) * fb->tiles.width;
+			uint8_t* dirty = &fb->dirty[tile_row];
+			for(tile_x = 0; tile_x < fb->tiles.width; tile_x++) {
+				unsigned int x_end = min((tile_x + 1) * FB_TILE_SIZE, fb->size.width);
+				uint32_t writes = 0;
+				for(x = tile_x * FB_TILE_SIZE; x < x_end; x++) {
+					if(src[x].color.alpha == 0) {
+						continue;
+					}
 #ifdef FEATURE_ALPHA_BLENDING
-			if(other->pixels[j].color.alpha == 0xff) {
-				fb->pixels[j] = other->pixels[j];
-			} else {
-				FB_ALPHA_BLEND_PIXEL(fb->pixels[j], other->pixels[j], fb->pixels[j]);
-			}
+					if(src[x].color.alpha == 0xff) {
+						dst[x] = src[x];
+					} else {
+						FB_ALPHA_BLEND_PIXEL(dst[x], src[x], dst[x]);
+					}
 #else
-			fb->pixels[j] = other->pixels[j];
+					dst[x] = src[x];
+#endif
+					// Reset to fully transparent
+					src[x].color.alpha = 0;
+					writes++;
+				}
+				dirty[tile_x] |= !!writes;
+				if(tile_writes) {
+					tile_writes[tile_row + tile_x] += writes;
+				}
+#ifdef FEATURE_STATISTICS
+				coalesced += writes;
 #endif
-			// Reset to fully transparent
-			other->pixels[j].color.alpha = 0;
+			}
 		}
+#ifdef FEATURE_STATISTICS
+		__atomic_fetch_add(&other->pixels_coalesced, coalesced, __ATOMIC_RELAXED);
+#endif
 	}
 	return 0;
 }
+
+// Merge all pixels written to fbs into fb. tile_writes, if not NULL, accumulates the number of pixels changed per tile
+int fb_coalesce(struct fb* fb, struct llist* fbs, uint32_t* tile_writes) {
+	return fb_coalesce_rows(fb, fbs, tile_writes, 0, fb->tiles.height);
+}
@@ -9,6 +9,9 @@
 
 #define COLORDEPTH 24
 
+// Edge length of the square tiles used for dirty tracking
+#define FB_TILE_SIZE 32
+
 struct fb_size {
 	unsigned int width;
 	unsigned int height;
@@ -44,12 +47,16 @@ union fb_pixel {
 struct fb {
 	struct fb_size size;
 	union fb_pixel* pixels;
+	// One byte per tile, non-zero if the tile changed since the last fb_clear_dirty
+	struct fb_size tiles;
+	uint8_t* dirty;
 	unsigned numa_node;
 	struct llist_entry list;
 #ifdef FEATURE_STATISTICS
-#ifdef FEATURE_PIXEL_COUNT
-	uint32_t pixel_count;
-#endif
+	// Read timestamp of a latency sample written to this fb, 0 if none
+	uint64_t latency_sample;
+	// Pixels taken from this fb by fb_coalesce, updated atomically once per coalesced band
+	uint64_t pixels_coalesced;
 #endif
 };
 
@@ -73,8 +80,20 @@ static inline void fb_set_pixel(struct fb* fb, unsigned int x, unsigned int y, u
 void fb_set_pixel_rgb(struct fb* fb, unsigned int x, unsigned int y, uint8_t red, uint8_t green, uint8_t blue);
 void fb_clear_rect(struct fb* fb, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
 int fb_resize(struct fb* fb, unsigned int width, unsigned int height);
-int fb_coalesce(struct fb* fb, struct llist* fbs);
+int fb_coalesce(struct fb* fb, struct llist* fbs, uint32_t* tile_writes);
+int fb_coalesce_rows(struct fb* fb, struct llist* fbs, uint32_t* tile_writes, unsigned int tile_row_start, unsigned int tile_row_end);
 void fb_copy(struct fb* dst, struct fb* src);
+int fb_copy_dirty(struct fb* dst, struct fb* src);
+int fb_copy_tiles(struct fb* dst, struct fb* src, uint8_t* tiles);
+
+// Dirty tracking
+void fb_mark_dirty(struct fb* fb, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+void fb_mark_all_dirty(struct fb* fb);
+void fb_clear_dirty(struct fb* fb);
+
+static inline bool fb_tile_is_dirty(struct fb* fb, unsigned int tile_x, unsigned int tile_y) {
+	return fb->dirty[tile_y * fb->tiles.width + tile_x];
+}
 
 static inline union fb_pixel fb_get_pixel(struct fb* fb, unsigned int x, unsigned int y) {
 	assert(x < fb->size.width);
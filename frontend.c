@@ -2,8 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include "frontend.h"
+#include "trace.h"
+#include "util.h"
 
 #ifdef FEATURE_SDL
 extern struct frontend_def front_sdl;
@@ -17,6 +20,15 @@ extern struct frontend_def front_statistics;
 #ifdef FEATURE_FBDEV
 extern struct frontend_def front_linuxfb;
 #endif
+#ifdef FEATURE_KMS
+extern struct frontend_def front_kms;
+#endif
+#ifdef FEATURE_SHM
+extern struct frontend_def front_shm;
+#endif
+#ifdef FEATURE_HTTP
+extern struct frontend_def front_http;
+#endif
 
 struct frontend_id frontends[] = {
 #ifdef FEATURE_SDL
@@ -30,6 +42,15 @@ struct frontend_id frontends[] = {
 #endif
 #ifdef FEATURE_FBDEV
 	{ "fbdev", &front_linuxfb },
+#endif
+#ifdef FEATURE_KMS
+	{ "kms", &front_kms },
+#endif
+#ifdef FEATURE_SHM
+	{ "shm", &front_shm },
+#endif
+#ifdef FEATURE_HTTP
+	{ "http", &front_http },
 #endif
 	{ NULL, NULL }
 };
@@ -44,6 +65,16 @@ struct frontend_def* frontend_get_def(char* id) {
 	return NULL;
 }
 
+char* frontend_get_id(struct frontend_def* def) {
+	struct frontend_id* front = frontends;
+	for(; front->def != NULL; front++) {
+		if(front->def == def) {
+			return front->id;
+		}
+	}
+	return NULL;
+}
+
 char* frontend_spec_extract_name(char* spec) {
 	char* sep = strchr(spec, ',');
 	char* limit = spec + strlen(spec);
@@ -54,6 +85,51 @@ char* frontend_spec_extract_name(char* spec) {
 	return NULL;
 }
 
+/*
+ * Remove the generic threading options from a frontend option string
+ *   thread     update the frontend from its own thread on every published frame
+ *   rate=<hz>  update the frontend from its own thread at most <hz> times per second
+ */
+int frontend_spec_extract_thread(char* options, bool* threaded, unsigned int* rate) {
+	char* read = options, *write = options;
+	size_t len;
+	int val;
+
+	*threaded = false;
+	*rate = 0;
+	if(!options) {
+		return 0;
+	}
+
+	while(*read) {
+		char* sep = strchr(read, ',');
+		len = sep ? sep - read : strlen(read);
+		if(len == strlen("thread") && !strncmp(read, "thread", len)) {
+			*threaded = true;
+		} else if(!strncmp(read, "rate=", strlen("rate="))) {
+			val = atoi(read + strlen("rate="));
+			if(val <= 0) {
+				fprintf(stderr, "Frontend update rate must be > 0\n");
+				return -EINVAL;
+			}
+			*rate = val;
+			*threaded = true;
+		} else {
+			if(write != options) {
+				*write++ = ',';
+			}
+			memmove(write, read, len);
+			write += len;
+		}
+		read += len;
+		if(*read == ',') {
+			read++;
+		}
+	}
+	*write = '\0';
+	return 0;
+}
+
 static int frontend_configure_option(struct frontend* front, char* option) {
 	char* sep = strchr(option, '=');
 	char* sep_limit = strchr(option, ',');
@@ -91,3 +167,179 @@ int frontend_configure(struct frontend* front, char* options) {
 	}
 	return 0;
 }
+
+/* Theory Of Operation
+ * ===================
+ *
+ * A frontend that runs on an output thread renders from a private frame
+ * instead of the canvas. After each compositor iteration the main loop
+ * publishes the canvas to the thread: the tiles that changed since the last
+ * copy are copied into the frame and the thread is woken up.
+ *
+ * While the thread is still busy updating the frontend, nothing is copied.
+ * The changed tiles are remembered instead and copied with the next frame
+ * the thread is ready for. A slow frontend therefore skips frames but never
+ * holds up the compositor.
+ */
+
+int frontend_thread_alloc(struct frontend_thread** ret, struct fb* fb, unsigned int rate) {
+	int err;
+	struct fb_size* size = fb_get_size(fb);
+	struct frontend_thread* thread = calloc(1, sizeof(struct frontend_thread));
+	if(!thread) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if((err = fb_alloc(&thread->frame, size->width, size->height))) {
+		goto fail_thread;
+	}
+
+	thread->pending_len = fb->tiles.width * fb->tiles.height;
+	thread->pending = malloc(thread->pending_len);
+	if(!thread->pending) {
+		err = -ENOMEM;
+		goto fail_frame;
+	}
+	memset(thread->pending, 1, thread->pending_len);
+
+	thread->rate = rate;
+	pthread_mutex_init(&thread->lock, NULL);
+	pthread_cond_init(&thread->cond, NULL);
+
+	*ret = thread;
+	return 0;
+
+fail_frame:
+	fb_free(thread->frame);
+fail_thread:
+	free(thread);
+fail:
+	return err;
+}
+
+static void* frontend_thread_run(void* priv) {
+	struct frontend* front = priv;
+	struct frontend_thread* thread = front->thread;
+	unsigned long long frame_seq = 0;
+	struct timespec before, after;
+	long long time_delta;
+	int err;
+
+	pthread_mutex_lock(&thread->lock);
+	while(!thread->exit) {
+		if(thread->frame_seq == frame_seq) {
+			pthread_cond_wait(&thread->cond, &thread->lock);
+			continue;
+		}
+		frame_seq = thread->frame_seq;
+		thread->busy = true;
+		pthread_mutex_unlock(&thread->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		TRACE1(frontend_update_start, front->def->name);
+		err = frontend_update(front);
+		TRACE2(frontend_update_end, front->def->name, err);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+#ifdef FEATURE_STATISTICS
+		histogram_record(&front->update_duration, get_timespec_diff(&after, &before));
+#endif
+
+		pthread_mutex_lock(&thread->lock);
+		thread->busy = false;
+		if(err) {
+			thread->err = err;
+			break;
+		}
+
+		if(thread->rate) {
+			pthread_mutex_unlock(&thread->lock);
+			time_delta = get_timespec_diff(&after, &before);
+			time_delta = 1000000000UL / thread->rate - time_delta;
+			if(time_delta > 0) {
+				usleep(time_delta / 1000UL);
+			}
+			pthread_mutex_lock(&thread->lock);
+		}
+	}
+	pthread_mutex_unlock(&thread->lock);
+
+	return NULL;
+}
+
+int frontend_thread_start(struct frontend* front, struct frontend_thread* thread) {
+	int err;
+
+	front->thread = thread;
+	if((err = -pthread_create(&thread->thread, NULL, frontend_thread_run, front))) {
+		return err;
+	}
+	thread->running = true;
+	return 0;
+}
+
+void frontend_thread_stop(struct frontend_thread* thread) {
+	if(!thread->running) {
+		return;
+	}
+	pthread_mutex_lock(&thread->lock);
+	thread->exit = true;
+	pthread_cond_signal(&thread->cond);
+	pthread_mutex_unlock(&thread->lock);
+	pthread_join(thread->thread, NULL);
+	if(thread->frames_dropped) {
+		printf("Output thread dropped %llu frames\n", thread->frames_dropped);
+	}
+}
+
+void frontend_thread_free(struct frontend_thread* thread) {
+	fb_free(thread->frame);
+	free(thread->pending);
+	free(thread);
+}
+
+/*
+ * Hand the current canvas to an output thread. Returns the error the
+ * frontend update failed with, if any.
+ */
+int frontend_thread_publish(struct frontend_thread* thread, struct fb* fb) {
+	int err;
+	size_t i, tiles_len = fb->tiles.width * fb->tiles.height;
+
+	pthread_mutex_lock(&thread->lock);
+	if((err = thread->err)) {
+		goto out;
+	}
+
+	if(tiles_len != thread->pending_len) {
+		// Canvas has been resized, everything is dirty anyway
+		uint8_t* pending = realloc(thread->pending, tiles_len);
+		if(!pending) {
+			err = -ENOMEM;
+			goto out;
+		}
+		thread->pending = pending;
+		thread->pending_len = tiles_len;
+		memset(thread->pending, 1, tiles_len);
+	} else {
+		for(i = 0; i < tiles_len; i++) {
+			thread->pending[i] |= fb->dirty[i];
+		}
+	}
+
+	if(thread->busy) {
+		thread->frames_dropped++;
+		goto out;
+	}
+
+	if((err = fb_copy_tiles(thread->frame, fb, thread->pending))) {
+		goto out;
+	}
+	memset(thread->pending, 0, tiles_len);
+	thread->frame_seq++;
+	pthread_cond_signal(&thread->cond);
+
+out:
+	pthread_mutex_unlock(&thread->lock);
+	return err;
+}
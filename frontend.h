@@ -1,11 +1,14 @@
 #ifndef _FRONTEND_H_
 #define _FRONTEND_H_
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct frontend;
 
 #include "framebuffer.h"
+#include "histogram.h"
 #include "llist.h"
 
 #define FRONTEND_ALLOC(name) int (*name)(struct frontend** res, struct fb* fb, void* priv)
@@ -38,6 +41,8 @@ struct frontend_def {
 	const struct frontend_ops* ops;
 	bool handles_signals;
 	const struct frontend_arg* args;
+	// Frontend may be updated from its own output thread
+	bool threadable;
 };
 
 #define DECLARE_FRONTEND(name, frontname, frontops, sig) \
@@ -58,6 +63,15 @@ struct frontend_def {
 #define DECLARE_FRONTEND_NOSIG_ARGS(name, frontname, frontops, arg_names) \
 	DECLARE_FRONTEND_ARGS(name, frontname, frontops, false, arg_names)
 
+#define DECLARE_FRONTEND_THREADABLE_ARGS(name, frontname, frontops, sig, arg_names) \
+	struct frontend_def name = {frontname, frontops, sig, arg_names, true}
+
+#define DECLARE_FRONTEND_THREADABLE_SIG_ARGS(name, frontname, frontops, arg_names) \
+	DECLARE_FRONTEND_THREADABLE_ARGS(name, frontname, frontops, true, arg_names)
+
+#define DECLARE_FRONTEND_THREADABLE_NOSIG_ARGS(name, frontname, frontops, arg_names) \
+	DECLARE_FRONTEND_THREADABLE_ARGS(name, frontname, frontops, false, arg_names)
+
 #define frontend_alloc(def, front, fb, priv) ((def)->ops->alloc((front), (fb), (priv)))
 #define frontend_start(front) ((front)->def->ops->start((front)))
 #define frontend_free(front) ((front)->def->ops->free((front)))
@@ -68,10 +82,33 @@ struct frontend_def {
 #define frontend_can_start(front) (!!(front)->def->ops->start)
 #define frontend_can_draw_string(front) (!!(front)->def->ops->draw_string)
 
+struct frontend_thread {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// Private copy of the canvas the frontend renders from
+	struct fb* frame;
+	// Tiles changed since the last copy to frame
+	uint8_t* pending;
+	size_t pending_len;
+	// Target update rate in Hz, 0 to update on every published frame
+	unsigned int rate;
+	unsigned long long frame_seq;
+	unsigned long long frames_dropped;
+	bool busy;
+	bool exit;
+	// Set once the thread has been created, stopping is a no-op before
+	bool running;
+	int err;
+};
+
 struct frontend {
 	struct frontend_def* def;
 	struct llist_entry list;
 	bool sync_overlay_draw;
+	struct frontend_thread* thread;
+	// Nanoseconds spent in frontend_update
+	struct histogram update_duration;
 };
 
 struct frontend_id {
@@ -80,7 +117,16 @@ struct frontend_id {
 };
 
 struct frontend_def* frontend_get_def(char* id);
+char* frontend_get_id(struct frontend_def* def);
 char* frontend_spec_extract_name(char* spec);
+int frontend_spec_extract_thread(char* options, bool* threaded, unsigned int* rate);
 int frontend_configure(struct frontend* front, char* options);
 
+// Output threads
+int frontend_thread_alloc(struct frontend_thread** ret, struct fb* fb, unsigned int rate);
+int frontend_thread_start(struct frontend* front, struct frontend_thread* thread);
+void frontend_thread_stop(struct frontend_thread* thread);
+void frontend_thread_free(struct frontend_thread* thread);
+int frontend_thread_publish(struct frontend_thread* thread, struct fb* fb);
+
 #endif
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heatmap.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * The heatmap tracks where on the canvas pixels are changing, one value per
+ * dirty tracking tile. It does not add any work to the network threads:
+ * fb_coalesce already visits every pixel written since the last frame and
+ * counts them per tile into heatmap->writes.
+ *
+ * Once per frame heatmap_update folds these counts into an exponentially
+ * decaying sum with a configurable half-life. In steady state a tile changing
+ * r pixels per second settles at r * half_life / ln(2), which
+ * heatmap_snapshot converts back to pixels per second.
+ *
+ * Note that a pixel written several times within one frame counts once.
+ *
+ * The optional overlay paints each tile in one of HEATMAP_NUM_LEVELS
+ * translucent colors on a log2 scale. Only tiles whose level changed are
+ * redrawn and marked dirty in the overlay.
+ */
+
+int heatmap_alloc(struct heatmap** ret, unsigned int half_life_ms) {
+	struct heatmap* heatmap = calloc(1, sizeof(struct heatmap));
+	if(!heatmap) {
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&heatmap->lock, NULL);
+	heatmap->half_life_ms = half_life_ms;
+	heatmap->item = OVERLAY_ITEM_INIT;
+	*ret = heatmap;
+	return 0;
+}
+
+void heatmap_free(struct heatmap* heatmap) {
+	free(heatmap->writes);
+	free(heatmap->heat);
+	free(heatmap->levels);
+	free(heatmap->pixels);
+	free(heatmap);
+}
+
+// Match the heatmap to the canvas size, resets all state on change
+int heatmap_resize(struct heatmap* heatmap, struct fb_size* size) {
+	int err = 0;
+	uint32_t* writes;
+	float* heat;
+	struct fb_size tiles = {
+		.width = (size->width + FB_TILE_SIZE - 1) / FB_TILE_SIZE,
+		.height = (size->height + FB_TILE_SIZE - 1) / FB_TILE_SIZE,
+	};
+	size_t num_tiles = tiles.width * tiles.height;
+
+	if(heatmap->writes && heatmap->size.width == size->width && heatmap->size.height == size->height) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&heatmap->lock);
+	writes = realloc(heatmap->writes, num_tiles * sizeof(uint32_t));
+	if(!writes) {
+		err = -ENOMEM;
+		goto out;
+	}
+	heatmap->writes = writes;
+
+	heat = realloc(heatmap->heat, num_tiles * sizeof(float));
+	if(!heat) {
+		err = -ENOMEM;
+		goto out;
+	}
+	heatmap->heat = heat;
+
+	memset(heatmap->writes, 0, num_tiles * sizeof(uint32_t));
+	memset(heatmap->heat, 0, num_tiles * sizeof(float));
+	heatmap->size = *size;
+	heatmap->tiles = tiles;
+	pthread_mutex_unlock(&heatmap->lock);
+	return 0;
+
+out:
+	// Leave an empty heatmap behind, the next call retries
+	heatmap->size = (struct fb_size){ 0, 0 };
+	heatmap->tiles = (struct fb_size){ 0, 0 };
+	pthread_mutex_unlock(&heatmap->lock);
+	return err;
+}
+
+void heatmap_update(struct heatmap* heatmap, long long delta_ns) {
+	size_t i, num_tiles = heatmap->tiles.width * heatmap->tiles.height;
+	float decay = exp2f(-(float)delta_ns / (heatmap->half_life_ms * 1000000.0f));
+
+	pthread_mutex_lock(&heatmap->lock);
+	for(i = 0; i < num_tiles; i++) {
+		heatmap->heat[i] = heatmap->heat[i] * decay + heatmap->writes[i];
+		heatmap->writes[i] = 0;
+	}
+	pthread_mutex_unlock(&heatmap->lock);
+}
+
+static float heatmap_rate(struct heatmap* heatmap, size_t tile) {
+	return heatmap->heat[tile] * (float)M_LN2 * 1000.0f / heatmap->half_life_ms;
+}
+
+// Copy current pixel change rates per tile, *rates must be freed by the caller
+int heatmap_snapshot(struct heatmap* heatmap, struct fb_size* tiles, float** rates) {
+	size_t i, num_tiles;
+	float* copy;
+
+	pthread_mutex_lock(&heatmap->lock);
+	num_tiles = heatmap->tiles.width * heatmap->tiles.height;
+	copy = malloc(num_tiles * sizeof(float) + 1);
+	if(!copy) {
+		pthread_mutex_unlock(&heatmap->lock);
+		return -ENOMEM;
+	}
+	for(i = 0; i < num_tiles; i++) {
+		copy[i] = heatmap_rate(heatmap, i);
+	}
+	*tiles = heatmap->tiles;
+	pthread_mutex_unlock(&heatmap->lock);
+
+	*rates = copy;
+	return 0;
+}
+
+static uint8_t heatmap_level(float rate) {
+	if(rate < 1.0f) {
+		return 0;
+	}
+	return min(HEATMAP_NUM_LEVELS - 1, 1 + (int)log2f(rate));
+}
+
+// Blue for little activity to red for a lot, level 0 is transparent
+static union fb_pixel heatmap_level_color(uint8_t level) {
+	union fb_pixel pixel = { .abgr = 0 };
+	unsigned int t;
+
+	if(level) {
+		t = (level - 1) * 255 / (HEATMAP_NUM_LEVELS - 2);
+		pixel.abgr = t << 24 | (255 - t) << 8 | (0x60 + t * 0x60 / 255);
+	}
+	return pixel;
+}
+
+static void heatmap_fill_tile(struct heatmap* heatmap, unsigned int tile_x, unsigned int tile_y, union fb_pixel color) {
+	unsigned int x, y;
+	unsigned int x_end = min((tile_x + 1) * FB_TILE_SIZE, heatmap->size.width);
+	unsigned int y_end = min((tile_y + 1) * FB_TILE_SIZE, heatmap->size.height);
+
+	for(y = tile_y * FB_TILE_SIZE; y < y_end; y++) {
+		union fb_pixel* line = &heatmap->pixels[y * heatmap->size.width];
+		for(x = tile_x * FB_TILE_SIZE; x < x_end; x++) {
+			line[x] = color;
+		}
+	}
+}
+
+int heatmap_draw_overlay(struct heatmap* heatmap, struct overlay* overlay) {
+	unsigned int tile_x, tile_y;
+	size_t num_tiles = heatmap->tiles.width * heatmap->tiles.height;
+	bool resized = false;
+
+	if(!heatmap->item.list.list || heatmap->item.width != heatmap->size.width || heatmap->item.height != heatmap->size.height) {
+		uint8_t* levels;
+		union fb_pixel* pixels;
+
+		levels = realloc(heatmap->levels, num_tiles);
+		if(!levels) {
+			return -ENOMEM;
+		}
+		heatmap->levels = levels;
+		pixels = realloc(heatmap->pixels, heatmap->size.width * heatmap->size.height * sizeof(union fb_pixel));
+		if(!pixels) {
+			return -ENOMEM;
+		}
+		heatmap->pixels = pixels;
+		memset(heatmap->levels, 0, num_tiles);
+		memset(heatmap->pixels, 0, heatmap->size.width * heatmap->size.height * sizeof(union fb_pixel));
+		resized = true;
+	}
+
+	for(tile_y = 0; tile_y < heatmap->tiles.height; tile_y++) {
+		for(tile_x = 0; tile_x < heatmap->tiles.width; tile_x++) {
+			size_t tile = tile_y * heatmap->tiles.width + tile_x;
+			uint8_t level = heatmap_level(heatmap_rate(heatmap, tile));
+
+			if(level == heatmap->levels[tile]) {
+				continue;
+			}
+			heatmap->levels[tile] = level;
+			heatmap_fill_tile(heatmap, tile_x, tile_y, heatmap_level_color(level));
+			if(!resized) {
+				overlay_item_mark_dirty(overlay, &heatmap->item, tile_x * FB_TILE_SIZE, tile_y * FB_TILE_SIZE,
+					FB_TILE_SIZE, FB_TILE_SIZE);
+			}
+		}
+	}
+
+	if(resized) {
+		if(!heatmap->item.list.list) {
+			overlay_add(overlay, &heatmap->item);
+		}
+		overlay_item_update(overlay, &heatmap->item, 0, 0, heatmap->size.width, heatmap->size.height,
+			heatmap->pixels, true);
+	}
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef _HEATMAP_H_
+#define _HEATMAP_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "framebuffer.h"
+#include "overlay.h"
+
+#define HEATMAP_HALF_LIFE_MS_DEFAULT 2000
+#define HEATMAP_NUM_LEVELS 16
+
+struct heatmap {
+	// Protects tiles and heat against concurrent snapshots
+	pthread_mutex_t lock;
+	struct fb_size size;
+	struct fb_size tiles;
+	unsigned int half_life_ms;
+	// Pixels changed per tile since the last heatmap_update, filled by fb_coalesce
+	uint32_t* writes;
+	// Exponentially decayed pixel changes per tile
+	float* heat;
+
+	// Overlay state, only allocated once the overlay is drawn
+	uint8_t* levels;
+	union fb_pixel* pixels;
+	struct overlay_item item;
+};
+
+int heatmap_alloc(struct heatmap** ret, unsigned int half_life_ms);
+void heatmap_free(struct heatmap* heatmap);
+
+int heatmap_resize(struct heatmap* heatmap, struct fb_size* size);
+void heatmap_update(struct heatmap* heatmap, long long delta_ns);
+int heatmap_snapshot(struct heatmap* heatmap, struct fb_size* tiles, float** rates);
+
+int heatmap_draw_overlay(struct heatmap* heatmap, struct overlay* overlay);
+
+#endif
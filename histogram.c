@@ -0,0 +1,33 @@
+#include "histogram.h"
+
+// Exclusive upper bound of the values counted in a bucket
+uint64_t histogram_bucket_upper(unsigned int index) {
+	unsigned int group = index / HISTOGRAM_SUB_BUCKETS;
+	unsigned int sub = index % HISTOGRAM_SUB_BUCKETS;
+
+	if(!group) {
+		return sub + 1;
+	}
+	return (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (group - 1);
+}
+
+void histogram_snapshot(struct histogram* dst, struct histogram* src) {
+	unsigned int i;
+
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	for(i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+		dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	}
+}
+
+// Number of recorded values below bound, exact if bound is a bucket boundary
+uint64_t histogram_count_below(struct histogram* hist, uint64_t bound) {
+	unsigned int i;
+	uint64_t count = 0;
+
+	for(i = 0; i < HISTOGRAM_NUM_BUCKETS && histogram_bucket_upper(i) <= bound; i++) {
+		count += hist->buckets[i];
+	}
+	return count;
+}
@@ -0,0 +1,51 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram in the style of HdrHistogram. Values below
+ * HISTOGRAM_SUB_BUCKETS get a bucket each, above that every power of two is
+ * split into HISTOGRAM_SUB_BUCKETS buckets, giving a relative error of at
+ * most 1 / HISTOGRAM_SUB_BUCKETS. Values of 2^HISTOGRAM_MAX_BITS and above
+ * land in the last bucket.
+ *
+ * Recording uses relaxed atomics so snapshots may be taken concurrently.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_NUM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[HISTOGRAM_NUM_BUCKETS];
+};
+
+static inline unsigned int histogram_bucket_index(uint64_t value) {
+	unsigned int msb, shift;
+
+	if(value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	if(value >= (1ULL << HISTOGRAM_MAX_BITS)) {
+		return HISTOGRAM_NUM_BUCKETS - 1;
+	}
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static inline void histogram_record(struct histogram* hist, uint64_t value) {
+	__atomic_fetch_add(&hist->buckets[histogram_bucket_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_bucket_upper(unsigned int index);
+void histogram_snapshot(struct histogram* dst, struct histogram* src);
+uint64_t histogram_count_below(struct histogram* hist, uint64_t bound);
+
+#endif
@@ -0,0 +1,568 @@
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <png.h>
+
+#include "http.h"
+#include "util.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * The HTTP frontend serves the canvas to browsers:
+ *
+ *   /              small HTML viewer
+ *   /snapshot.png  latest frame as PNG
+ *   /stream        server-sent events with changed tiles
+ *
+ * frontend_update only copies dirty tiles into a private frame buffer and
+ * bumps the frame sequence number. All encoding happens elsewhere.
+ *
+ * Snapshots are encoded lazily by the first request that finds the cached
+ * PNG outdated. Concurrent requests wait for that encode and share the
+ * result, so a frame is encoded at most once no matter how many requests
+ * arrive. The snapshot keeps its own map of tiles changed since the last
+ * encode and only copies those out of the frame.
+ *
+ * The encoder thread drives /stream at stream_rate Hz. It consumes the dirty
+ * tiles of the frame, encodes each horizontal run of changed tiles as a PNG
+ * and broadcasts all of them as one message. New clients first receive a
+ * full frame and then join the stream. Clients that can not keep up are
+ * dropped by httpd_stream_broadcast.
+ */
+
+#define HTTP_LISTEN_PORT_DEFAULT "8080"
+#define HTTP_LISTEN_ADDRESS_DEFAULT "::"
+#define HTTP_STREAM_RATE_DEFAULT 10
+
+static const char* http_index =
+"<!DOCTYPE html>\n"
+"<html><head><meta charset=\"utf-8\"><title>shoreline</title>\n"
+"<style>body{margin:0;background:#000}canvas{display:block;margin:auto;max-width:100vw;max-height:100vh;image-rendering:pixelated}</style>\n"
+"</head><body><canvas id=\"canvas\"></canvas><script>\n"
+"const canvas = document.getElementById('canvas');\n"
+"const ctx = canvas.getContext('2d');\n"
+"let queue = Promise.resolve();\n"
+"function draw(data, full) {\n"
+"  const [a, b, png] = data.split(' ');\n"
+"  const bytes = Uint8Array.from(atob(png), c => c.charCodeAt(0));\n"
+"  const bitmap = createImageBitmap(new Blob([bytes], {type: 'image/png'}));\n"
+"  queue = queue.then(() => bitmap).then(img => {\n"
+"    if(full) { canvas.width = +a; canvas.height = +b; ctx.drawImage(img, 0, 0); }\n"
+"    else { ctx.drawImage(img, +a, +b); }\n"
+"  });\n"
+"}\n"
+"const source = new EventSource('stream');\n"
+"source.addEventListener('frame', ev => draw(ev.data, true));\n"
+"source.addEventListener('tile', ev => draw(ev.data, false));\n"
+"</script></body></html>\n";
+
+static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int http_buf_append_base64(struct httpd_buf* buf, const uint8_t* data, size_t len) {
+	int err;
+	char* out;
+	size_t i;
+
+	if((err = httpd_buf_reserve(buf, (len + 2) / 3 * 4))) {
+		return err;
+	}
+	out = buf->data + buf->len;
+	for(i = 0; i + 2 < len; i += 3) {
+		uint32_t triple = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		*out++ = base64_table[(triple >> 18) & 0x3f];
+		*out++ = base64_table[(triple >> 12) & 0x3f];
+		*out++ = base64_table[(triple >> 6) & 0x3f];
+		*out++ = base64_table[triple & 0x3f];
+	}
+	if(i < len) {
+		uint32_t triple = data[i] << 16;
+		if(i + 1 < len) {
+			triple |= data[i + 1] << 8;
+		}
+		*out++ = base64_table[(triple >> 18) & 0x3f];
+		*out++ = base64_table[(triple >> 12) & 0x3f];
+		*out++ = i + 1 < len ? base64_table[(triple >> 6) & 0x3f] : '=';
+		*out++ = '=';
+	}
+	buf->len = out - buf->data;
+	return 0;
+}
+
+static void http_png_write(png_structp png, png_bytep data, png_size_t len) {
+	struct httpd_buf* buf = png_get_io_ptr(png);
+	if(httpd_buf_append(buf, data, len)) {
+		png_error(png, "Out of memory");
+	}
+}
+
+static void http_png_flush(png_structp png) {
+}
+
+// Encode a rectangle of fb as RGB PNG, appending to buf
+static int http_encode_png(struct httpd_buf* buf, struct fb* fb, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	int err;
+	png_structp png;
+	png_infop info;
+	unsigned int i, line;
+	bool is_be = is_big_endian();
+	uint8_t* row = malloc(width * 3);
+	if(!row) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if(!png) {
+		err = -ENOMEM;
+		goto fail_row;
+	}
+	info = png_create_info_struct(png);
+	if(!info) {
+		err = -ENOMEM;
+		goto fail_png;
+	}
+	if(setjmp(png_jmpbuf(png))) {
+		err = -ENOMEM;
+		goto fail_png;
+	}
+
+	png_set_write_fn(png, buf, http_png_write, http_png_flush);
+	png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	// Encoding speed matters more than size here
+	png_set_compression_level(png, 1);
+	png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+	png_write_info(png, info);
+
+	for(line = y; line < y + height; line++) {
+		union fb_pixel* pixels = fb_get_line_base(fb, line) + x;
+		uint8_t* out = row;
+		for(i = 0; i < width; i++) {
+			if(is_be) {
+				*out++ = pixels[i].color_be.color_bgr.red;
+				*out++ = pixels[i].color_be.color_bgr.green;
+				*out++ = pixels[i].color_be.color_bgr.blue;
+			} else {
+				*out++ = pixels[i].color.color_bgr.red;
+				*out++ = pixels[i].color.color_bgr.green;
+				*out++ = pixels[i].color.color_bgr.blue;
+			}
+		}
+		png_write_row(png, row);
+	}
+	png_write_end(png, NULL);
+	err = 0;
+
+fail_png:
+	png_destroy_write_struct(&png, info ? &info : NULL);
+fail_row:
+	free(row);
+fail:
+	return err;
+}
+
+// Append one server-sent event carrying a PNG of the given rectangle
+static int http_append_event(struct httpd_buf* msg, struct httpd_buf* png, const char* event, struct fb* fb,
+	unsigned int x, unsigned int y, unsigned int width, unsigned int height, bool full) {
+
+	int err;
+	char head[128];
+	int len;
+
+	png->len = 0;
+	if((err = http_encode_png(png, fb, x, y, width, height))) {
+		return err;
+	}
+	len = snprintf(head, sizeof(head), "event: %s\ndata: %u %u ", event, full ? width : x, full ? height : y);
+	if((err = httpd_buf_append(msg, head, len))) {
+		return err;
+	}
+	if((err = http_buf_append_base64(msg, (uint8_t*)png->data, png->len))) {
+		return err;
+	}
+	return httpd_buf_append(msg, "\n\n", 2);
+}
+
+static void http_png_put(struct http_png* png) {
+	if(!png) {
+		return;
+	}
+	if(!__atomic_sub_fetch(&png->refcount, 1, __ATOMIC_ACQ_REL)) {
+		httpd_buf_free(&png->buf);
+		free(png);
+	}
+}
+
+// Get a reference to a PNG of the latest frame, encoding it if necessary
+static int http_png_get(struct http_frontend* http, struct http_png** ret) {
+	int err;
+	uint64_t frame_seq;
+	struct http_png* png;
+
+	pthread_mutex_lock(&http->png_lock);
+	pthread_mutex_lock(&http->frame_lock);
+	frame_seq = http->frame_seq;
+	if(http->png && http->png->frame == frame_seq) {
+		pthread_mutex_unlock(&http->frame_lock);
+		goto done;
+	}
+	err = fb_copy_tiles(http->png_fb, http->frame, http->png_dirty);
+	memset(http->png_dirty, 0, http->frame->tiles.width * http->frame->tiles.height);
+	pthread_mutex_unlock(&http->frame_lock);
+	if(err) {
+		goto fail;
+	}
+
+	png = calloc(1, sizeof(struct http_png));
+	if(!png) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	png->refcount = 1;
+	png->frame = frame_seq;
+	if((err = http_encode_png(&png->buf, http->png_fb, 0, 0, http->png_fb->size.width, http->png_fb->size.height))) {
+		http_png_put(png);
+		goto fail;
+	}
+	http_png_put(http->png);
+	http->png = png;
+
+done:
+	__atomic_add_fetch(&http->png->refcount, 1, __ATOMIC_RELAXED);
+	*ret = http->png;
+	pthread_mutex_unlock(&http->png_lock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&http->png_lock);
+	return err;
+}
+
+static int http_handle_request(struct httpd* httpd, struct httpd_request* req, void* priv) {
+	struct http_frontend* http = priv;
+	struct http_png* png;
+	int err;
+
+	if(strcmp(req->method, "GET")) {
+		return httpd_respond_error(req->socket, 405);
+	}
+
+	if(!strcmp(req->path, "/")) {
+		return httpd_respond(req->socket, 200, "text/html; charset=utf-8", http_index, strlen(http_index));
+	}
+
+	if(!strcmp(req->path, "/snapshot.png")) {
+		if((err = http_png_get(http, &png))) {
+			return err;
+		}
+		httpd_respond(req->socket, 200, "image/png", png->buf.data, png->buf.len);
+		http_png_put(png);
+		return 0;
+	}
+
+	if(!strcmp(req->path, "/stream")) {
+		if(httpd_respond_header(req->socket, 200, "text/event-stream", -1)) {
+			return 0;
+		}
+		if((err = httpd_stream_add(&http->pending, req->socket))) {
+			return err;
+		}
+		return 1;
+	}
+
+	return httpd_respond_error(req->socket, 404);
+}
+
+static int http_stream_frame(struct http_frontend* http, struct httpd_buf* msg, struct httpd_buf* png) {
+	int err;
+	struct fb* fb = http->stream_fb;
+	unsigned int tile_x, tile_y, num_dirty = 0;
+	unsigned int num_tiles = fb->tiles.width * fb->tiles.height;
+
+	for(tile_x = 0; tile_x < num_tiles; tile_x++) {
+		num_dirty += !!fb->dirty[tile_x];
+	}
+
+	msg->len = 0;
+	if(num_dirty && http->stream.num_clients) {
+		if(num_dirty > num_tiles / 2) {
+			// Cheaper to send one large image than lots of small ones
+			err = http_append_event(msg, png, "frame", fb, 0, 0, fb->size.width, fb->size.height, true);
+			if(err) {
+				return err;
+			}
+		} else {
+			for(tile_y = 0; tile_y < fb->tiles.height; tile_y++) {
+				unsigned int y = tile_y * FB_TILE_SIZE;
+				unsigned int height = min(y + FB_TILE_SIZE, fb->size.height) - y;
+				for(tile_x = 0; tile_x < fb->tiles.width; tile_x++) {
+					unsigned int x, width;
+					if(!fb_tile_is_dirty(fb, tile_x, tile_y)) {
+						continue;
+					}
+					x = tile_x * FB_TILE_SIZE;
+					while(tile_x < fb->tiles.width && fb_tile_is_dirty(fb, tile_x, tile_y)) {
+						tile_x++;
+					}
+					width = min(tile_x * FB_TILE_SIZE, fb->size.width) - x;
+					if((err = http_append_event(msg, png, "tile", fb, x, y, width, height, false))) {
+						return err;
+					}
+				}
+			}
+		}
+		httpd_stream_broadcast(&http->stream, msg->data, msg->len);
+	}
+	fb_clear_dirty(fb);
+
+	if(http->pending.num_clients) {
+		msg->len = 0;
+		if((err = http_append_event(msg, png, "frame", fb, 0, 0, fb->size.width, fb->size.height, true))) {
+			return err;
+		}
+		httpd_stream_broadcast(&http->pending, msg->data, msg->len);
+		httpd_stream_splice(&http->stream, &http->pending);
+	}
+
+	return 0;
+}
+
+static void* http_encoder_thread(void* args) {
+	struct http_frontend* http = args;
+	struct httpd_buf msg = { 0 };
+	struct httpd_buf png = { 0 };
+	struct timespec timeout;
+	long interval_ns = 1000000000L / http->stream_rate;
+	int err;
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	pthread_mutex_lock(&http->frame_lock);
+	while(!http->exit) {
+		timeout.tv_nsec += interval_ns;
+		while(timeout.tv_nsec >= 1000000000L) {
+			timeout.tv_sec++;
+			timeout.tv_nsec -= 1000000000L;
+		}
+		while(!http->exit && pthread_cond_timedwait(&http->frame_cond, &http->frame_lock, &timeout) != ETIMEDOUT);
+		if(http->exit) {
+			break;
+		}
+
+		if(!http->stream.num_clients && !http->pending.num_clients) {
+			continue;
+		}
+		if(http->stream_seq != http->frame_seq) {
+			err = fb_copy_dirty(http->stream_fb, http->frame);
+			fb_clear_dirty(http->frame);
+			http->stream_seq = http->frame_seq;
+			if(err) {
+				fprintf(stderr, "Failed to copy frame for HTTP stream: %s(%d)\n", strerror(-err), -err);
+				continue;
+			}
+		}
+		pthread_mutex_unlock(&http->frame_lock);
+
+		if((err = http_stream_frame(http, &msg, &png))) {
+			fprintf(stderr, "Failed to encode HTTP stream update: %s(%d)\n", strerror(-err), -err);
+		}
+
+		pthread_mutex_lock(&http->frame_lock);
+	}
+	pthread_mutex_unlock(&http->frame_lock);
+
+	httpd_buf_free(&msg);
+	httpd_buf_free(&png);
+	return NULL;
+}
+
+static int http_alloc(struct frontend** ret, struct fb* fb, void* priv) {
+	int err;
+	struct http_frontend* http = calloc(1, sizeof(struct http_frontend));
+	if(!http) {
+		fprintf(stderr, "Failed to allocate HTTP frontend, out of memory\n");
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	http->fb = fb;
+	http->listen_port = HTTP_LISTEN_PORT_DEFAULT;
+	http->listen_address = HTTP_LISTEN_ADDRESS_DEFAULT;
+	http->stream_rate = HTTP_STREAM_RATE_DEFAULT;
+	pthread_mutex_init(&http->frame_lock, NULL);
+	pthread_cond_init(&http->frame_cond, NULL);
+	pthread_mutex_init(&http->png_lock, NULL);
+	httpd_stream_init(&http->pending);
+	httpd_stream_init(&http->stream);
+
+	if((err = fb_alloc(&http->frame, fb->size.width, fb->size.height))) {
+		goto fail_http;
+	}
+	if((err = fb_alloc(&http->png_fb, fb->size.width, fb->size.height))) {
+		goto fail_frame;
+	}
+	if((err = fb_alloc(&http->stream_fb, fb->size.width, fb->size.height))) {
+		goto fail_png_fb;
+	}
+	http->png_dirty = malloc(http->frame->tiles.width * http->frame->tiles.height);
+	if(!http->png_dirty) {
+		err = -ENOMEM;
+		goto fail_stream_fb;
+	}
+	memset(http->png_dirty, 1, http->frame->tiles.width * http->frame->tiles.height);
+
+	*ret = &http->front;
+	return 0;
+
+fail_stream_fb:
+	fb_free(http->stream_fb);
+fail_png_fb:
+	fb_free(http->png_fb);
+fail_frame:
+	fb_free(http->frame);
+fail_http:
+	free(http);
+fail:
+	return err;
+}
+
+static int http_start(struct frontend* front) {
+	int err;
+	struct http_frontend* http = container_of(front, struct http_frontend, front);
+
+	if((err = -pthread_create(&http->encoder_thread, NULL, http_encoder_thread, http))) {
+		fprintf(stderr, "Failed to create HTTP encoder thread: %s(%d)\n", strerror(-err), -err);
+		goto fail;
+	}
+	http->encoder_created = true;
+
+	if((err = httpd_start(&http->httpd, http->listen_address, http->listen_port, http_handle_request, http))) {
+		goto fail;
+	}
+	http->httpd_started = true;
+
+	return 0;
+
+fail:
+	return err;
+}
+
+static int http_update(struct frontend* front) {
+	int err = 0;
+	struct http_frontend* http = container_of(front, struct http_frontend, front);
+	struct fb* fb = http->fb;
+	size_t i, num_tiles = fb->tiles.width * fb->tiles.height;
+	bool changed = false;
+
+	pthread_mutex_lock(&http->frame_lock);
+	if(fb->size.width != http->frame->size.width || fb->size.height != http->frame->size.height) {
+		uint8_t* png_dirty = realloc(http->png_dirty, num_tiles);
+		if(!png_dirty) {
+			err = -ENOMEM;
+			goto out;
+		}
+		http->png_dirty = png_dirty;
+		memset(http->png_dirty, 1, num_tiles);
+		changed = true;
+	}
+
+	for(i = 0; i < num_tiles; i++) {
+		http->png_dirty[i] |= fb->dirty[i];
+		changed |= !!fb->dirty[i];
+	}
+	if(changed) {
+		if((err = fb_copy_dirty(http->frame, fb))) {
+			goto out;
+		}
+		http->frame_seq++;
+	}
+
+out:
+	pthread_mutex_unlock(&http->frame_lock);
+	return err;
+}
+
+static void http_free(struct frontend* front) {
+	struct http_frontend* http = container_of(front, struct http_frontend, front);
+
+	if(http->httpd_started) {
+		httpd_stop(&http->httpd);
+	}
+	if(http->encoder_created) {
+		pthread_mutex_lock(&http->frame_lock);
+		http->exit = true;
+		pthread_cond_signal(&http->frame_cond);
+		pthread_mutex_unlock(&http->frame_lock);
+		pthread_join(http->encoder_thread, NULL);
+	}
+	httpd_stream_close(&http->pending);
+	httpd_stream_close(&http->stream);
+	http_png_put(http->png);
+	free(http->png_dirty);
+	fb_free(http->stream_fb);
+	fb_free(http->png_fb);
+	fb_free(http->frame);
+	free(http);
+}
+
+static int http_configure_port(struct frontend* front, char* value) {
+	struct http_frontend* http = container_of(front, struct http_frontend, front);
+	if(!value) {
+		return -EINVAL;
+	}
+
+	int port = atoi(value);
+	if(port < 0 || port > 65535) {
+		return -EINVAL;
+	}
+
+	http->listen_port = value;
+	return 0;
+}
+
+static int http_configure_listen_address(struct frontend* front, char* value) {
+	struct http_frontend* http = container_of(front, struct http_frontend, front);
+	if(!value) {
+		return -EINVAL;
+	}
+
+	http->listen_address = value;
+	return 0;
+}
+
+static int http_configure_stream_rate(struct frontend* front, char* value) {
+	struct http_frontend* http = container_of(front, struct http_frontend, front);
+	if(!value) {
+		return -EINVAL;
+	}
+
+	int rate = atoi(value);
+	if(rate <= 0 || rate > 1000) {
+		fprintf(stderr, "Stream rate must be between 1 and 1000 Hz\n");
+		return -EINVAL;
+	}
+
+	http->stream_rate = rate;
+	return 0;
+}
+
+static const struct frontend_ops fops = {
+	.alloc = http_alloc,
+	.start = http_start,
+	.free = http_free,
+	.update = http_update,
+};
+
+static const struct frontend_arg fargs[] = {
+	{ .name = "port", .configure = http_configure_port },
+	{ .name = "listen", .configure = http_configure_listen_address },
+	{ .name = "stream_rate", .configure = http_configure_stream_rate },
+	{ .name = "", .configure = NULL },
+};
+
+DECLARE_FRONTEND_THREADABLE_NOSIG_ARGS(front_http, "HTTP snapshot and stream frontend", &fops, fargs);
@@ -0,0 +1,51 @@
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "framebuffer.h"
+#include "frontend.h"
+#include "httpd.h"
+
+// Encoded snapshot, shared by all requests for the same frame
+struct http_png {
+	unsigned int refcount;
+	uint64_t frame;
+	struct httpd_buf buf;
+};
+
+struct http_frontend {
+	struct frontend front;
+	struct fb* fb;
+	char* listen_port;
+	char* listen_address;
+	unsigned int stream_rate;
+	bool exit;
+
+	struct httpd httpd;
+	bool httpd_started;
+	// Clients waiting for their initial full frame
+	struct httpd_stream pending;
+	struct httpd_stream stream;
+
+	// Latest published frame, dirty tiles are consumed by the stream encoder
+	pthread_mutex_t frame_lock;
+	pthread_cond_t frame_cond;
+	struct fb* frame;
+	uint64_t frame_seq;
+	// Tiles changed since the last snapshot was encoded
+	uint8_t* png_dirty;
+
+	pthread_mutex_t png_lock;
+	struct fb* png_fb;
+	struct http_png* png;
+
+	pthread_t encoder_thread;
+	bool encoder_created;
+	struct fb* stream_fb;
+	uint64_t stream_seq;
+};
+
+#endif
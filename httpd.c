@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "httpd.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * A minimal HTTP/1.0 style server for the auxiliary APIs. It is not on the
+ * pixel path and favours simplicity over throughput.
+ *
+ * A listener thread accepts connections and hands each one to a detached
+ * request thread. The request thread reads the request head, parses the
+ * request line and calls the handler. Each request is answered with a
+ * single response and the connection is closed afterwards, there is no
+ * keep-alive. Client sockets have send and receive timeouts so a stalled
+ * client can never pin a request thread forever. httpd_stop waits for all
+ * request threads to finish.
+ *
+ * Handlers may take over the socket instead, for example to add it to a
+ * httpd_stream. Streams push the same data to all of their clients using
+ * non-blocking writes. A client that can not take a complete message is
+ * dropped, a partial message would corrupt the stream and stalling the
+ * producer for a single slow client is not an option.
+ */
+
+#define HTTPD_REQUEST_MAX 2048
+#define HTTPD_TIMEOUT_SEC 5
+#define HTTPD_BACKLOG 16
+
+struct httpd_connection {
+	struct httpd* httpd;
+	int socket;
+};
+
+static const char* httpd_status_text(int status) {
+	switch(status) {
+		case 200:
+			return "OK";
+		case 400:
+			return "Bad Request";
+		case 404:
+			return "Not Found";
+		case 405:
+			return "Method Not Allowed";
+		case 503:
+			return "Service Unavailable";
+		default:
+			return "Internal Server Error";
+	}
+}
+
+int httpd_write(int socket, const void* buf, size_t len) {
+	const char* ptr = buf;
+	while(len > 0) {
+		ssize_t write_len = send(socket, ptr, len, MSG_NOSIGNAL);
+		if(write_len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		len -= write_len;
+		ptr += write_len;
+	}
+	return 0;
+}
+
+int httpd_respond_header(int socket, int status, const char* content_type, ssize_t content_length) {
+	char header[256];
+	int len;
+
+	if(content_length >= 0) {
+		len = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zd\r\n"
+			"Cache-Control: no-cache\r\nConnection: close\r\n\r\n",
+			status, httpd_status_text(status), content_type, content_length);
+	} else {
+		len = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+			"Cache-Control: no-cache\r\nConnection: close\r\n\r\n",
+			status, httpd_status_text(status), content_type);
+	}
+	return httpd_write(socket, header, len);
+}
+
+int httpd_respond(int socket, int status, const char* content_type, const void* body, size_t len) {
+	int err;
+	if((err = httpd_respond_header(socket, status, content_type, len))) {
+		return err;
+	}
+	return httpd_write(socket, body, len);
+}
+
+int httpd_respond_error(int socket, int status) {
+	char body[64];
+	int len = snprintf(body, sizeof(body), "%d %s\n", status, httpd_status_text(status));
+	return httpd_respond(socket, status, "text/plain", body, len);
+}
+
+// Value of query parameter name, terminated by '&' or end of string, NULL if not present
+const char* httpd_query_param(struct httpd_request* req, const char* name) {
+	const char* param = req->query;
+	size_t len = strlen(name);
+
+	while(*param) {
+		if(!strncmp(param, name, len) && param[len] == '=') {
+			return param + len + 1;
+		}
+		param = strchrnul(param, '&');
+		if(*param) {
+			param++;
+		}
+	}
+	return NULL;
+}
+
+static int httpd_parse_request(struct httpd_request* req, char* buf) {
+	char* saveptr;
+	char* method = strtok_r(buf, " ", &saveptr);
+	char* path = strtok_r(NULL, " \r\n", &saveptr);
+	char* query;
+
+	if(!method || !path || strlen(method) >= sizeof(req->method) || strlen(path) >= sizeof(req->path)) {
+		return -EINVAL;
+	}
+
+	strcpy(req->method, method);
+	strcpy(req->path, path);
+	query = strchr(req->path, '?');
+	if(query) {
+		*query++ = '\0';
+	} else {
+		query = req->path + strlen(req->path);
+	}
+	req->query = query;
+	return 0;
+}
+
+static void* httpd_request_thread(void* args) {
+	struct httpd_connection* conn = args;
+	struct httpd* httpd = conn->httpd;
+	struct httpd_request req = { .socket = conn->socket };
+	char buf[HTTPD_REQUEST_MAX + 1];
+	size_t len = 0;
+	int ret = 0;
+
+	free(conn);
+
+	// Read until the end of the request head, a body is never expected
+	while(len < HTTPD_REQUEST_MAX) {
+		ssize_t read_len = recv(req.socket, buf + len, HTTPD_REQUEST_MAX - len, 0);
+		if(read_len <= 0) {
+			goto done;
+		}
+		len += read_len;
+		buf[len] = '\0';
+		if(strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+			break;
+		}
+	}
+
+	if(httpd_parse_request(&req, buf)) {
+		httpd_respond_error(req.socket, 400);
+		goto done;
+	}
+
+	ret = httpd->handler(httpd, &req, httpd->priv);
+	if(ret < 0) {
+		httpd_respond_error(req.socket, 500);
+	}
+
+done:
+	if(ret <= 0) {
+		shutdown(req.socket, SHUT_RDWR);
+		close(req.socket);
+	}
+	pthread_mutex_lock(&httpd->lock);
+	httpd->num_requests--;
+	pthread_cond_broadcast(&httpd->idle);
+	pthread_mutex_unlock(&httpd->lock);
+	return NULL;
+}
+
+static void* httpd_listen_thread(void* args) {
+	struct httpd* httpd = args;
+	struct timeval timeout = { .tv_sec = HTTPD_TIMEOUT_SEC, .tv_usec = 0 };
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while(!httpd->exit) {
+		pthread_t thread;
+		struct httpd_connection* conn;
+		int sock = accept(httpd->socket, NULL, NULL);
+		if(sock < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "HTTP listener failed, bailing out: %s(%d)\n", strerror(errno), errno);
+			break;
+		}
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		conn = malloc(sizeof(struct httpd_connection));
+		if(!conn) {
+			close(sock);
+			continue;
+		}
+		conn->httpd = httpd;
+		conn->socket = sock;
+
+		pthread_mutex_lock(&httpd->lock);
+		httpd->num_requests++;
+		pthread_mutex_unlock(&httpd->lock);
+		if(pthread_create(&thread, &attr, httpd_request_thread, conn)) {
+			fprintf(stderr, "Failed to create HTTP request thread\n");
+			pthread_mutex_lock(&httpd->lock);
+			httpd->num_requests--;
+			pthread_mutex_unlock(&httpd->lock);
+			close(sock);
+			free(conn);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+int httpd_start(struct httpd* httpd, const char* address, const char* port, httpd_handler handler, void* priv) {
+	int err;
+	int sock;
+	int one = 1;
+	struct addrinfo* addr_list;
+
+	memset(httpd, 0, sizeof(*httpd));
+	httpd->socket = -1;
+	httpd->handler = handler;
+	httpd->priv = priv;
+	pthread_mutex_init(&httpd->lock, NULL);
+	pthread_cond_init(&httpd->idle, NULL);
+
+	if((err = -getaddrinfo(address, port, NULL, &addr_list))) {
+		fprintf(stderr, "Failed to resolve HTTP listen address '%s', %d => %s\n", address, err, gai_strerror(-err));
+		goto fail;
+	}
+	httpd->addr_list = addr_list;
+
+	if((sock = socket(addr_list->ai_family, SOCK_STREAM, 0)) < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to create HTTP socket: %s(%d)\n", strerror(errno), errno);
+		goto fail_addrlist;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+
+	if(bind(sock, addr_list->ai_addr, addr_list->ai_addrlen) < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to bind to %s:%s %d => %s\n", address, port, errno, strerror(errno));
+		goto fail_socket;
+	}
+
+	if(listen(sock, HTTPD_BACKLOG)) {
+		err = -errno;
+		fprintf(stderr, "Failed to start listening: %d => %s\n", errno, strerror(errno));
+		goto fail_socket;
+	}
+	httpd->socket = sock;
+
+	if((err = -pthread_create(&httpd->listen_thread, NULL, httpd_listen_thread, httpd))) {
+		goto fail_socket;
+	}
+	httpd->thread_created = true;
+
+	return 0;
+
+fail_socket:
+	close(sock);
+	httpd->socket = -1;
+fail_addrlist:
+	freeaddrinfo(addr_list);
+	httpd->addr_list = NULL;
+fail:
+	return err;
+}
+
+void httpd_stop(struct httpd* httpd) {
+	httpd->exit = true;
+	if(httpd->thread_created) {
+		pthread_cancel(httpd->listen_thread);
+		pthread_join(httpd->listen_thread, NULL);
+		httpd->thread_created = false;
+	}
+	pthread_mutex_lock(&httpd->lock);
+	while(httpd->num_requests) {
+		pthread_cond_wait(&httpd->idle, &httpd->lock);
+	}
+	pthread_mutex_unlock(&httpd->lock);
+	if(httpd->socket >= 0) {
+		close(httpd->socket);
+		httpd->socket = -1;
+	}
+	if(httpd->addr_list) {
+		freeaddrinfo(httpd->addr_list);
+		httpd->addr_list = NULL;
+	}
+}
+
+// Make room for len more bytes
+int httpd_buf_reserve(struct httpd_buf* buf, size_t len) {
+	size_t size = buf->size ? buf->size : 4096;
+	char* data;
+
+	if(buf->len + len <= buf->size) {
+		return 0;
+	}
+	while(size < buf->len + len) {
+		size *= 2;
+	}
+	data = realloc(buf->data, size);
+	if(!data) {
+		buf->err = -ENOMEM;
+		return -ENOMEM;
+	}
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+int httpd_buf_append(struct httpd_buf* buf, const void* data, size_t len) {
+	int err;
+	if((err = httpd_buf_reserve(buf, len))) {
+		return err;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+int httpd_buf_printf(struct httpd_buf* buf, const char* fmt, ...) {
+	int err, len;
+	va_list vargs;
+
+	va_start(vargs, fmt);
+	len = vsnprintf(NULL, 0, fmt, vargs);
+	va_end(vargs);
+	if(len < 0) {
+		buf->err = -EINVAL;
+		return -EINVAL;
+	}
+
+	// vsnprintf needs room for the terminating null byte
+	if((err = httpd_buf_reserve(buf, len + 1))) {
+		return err;
+	}
+	va_start(vargs, fmt);
+	vsnprintf(buf->data + buf->len, len + 1, fmt, vargs);
+	va_end(vargs);
+	buf->len += len;
+	return 0;
+}
+
+void httpd_buf_free(struct httpd_buf* buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
+	buf->err = 0;
+}
+
+void httpd_stream_init(struct httpd_stream* stream) {
+	pthread_mutex_init(&stream->lock, NULL);
+	stream->clients = NULL;
+	stream->num_clients = 0;
+}
+
+int httpd_stream_add(struct httpd_stream* stream, int socket) {
+	struct httpd_stream_client* client = malloc(sizeof(struct httpd_stream_client));
+	if(!client) {
+		return -ENOMEM;
+	}
+	client->socket = socket;
+
+	pthread_mutex_lock(&stream->lock);
+	client->next = stream->clients;
+	stream->clients = client;
+	stream->num_clients++;
+	pthread_mutex_unlock(&stream->lock);
+	return 0;
+}
+
+// Returns the number of clients the data was delivered to
+unsigned int httpd_stream_broadcast(struct httpd_stream* stream, const void* buf, size_t len) {
+	struct httpd_stream_client** cursor;
+	unsigned int num_delivered = 0;
+
+	pthread_mutex_lock(&stream->lock);
+	cursor = &stream->clients;
+	while(*cursor) {
+		struct httpd_stream_client* client = *cursor;
+		ssize_t write_len = send(client->socket, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(write_len == len) {
+			num_delivered++;
+			cursor = &client->next;
+			continue;
+		}
+		*cursor = client->next;
+		stream->num_clients--;
+		shutdown(client->socket, SHUT_RDWR);
+		close(client->socket);
+		free(client);
+	}
+	pthread_mutex_unlock(&stream->lock);
+	return num_delivered;
+}
+
+// Move all clients from src to dst
+void httpd_stream_splice(struct httpd_stream* dst, struct httpd_stream* src) {
+	struct httpd_stream_client* client;
+
+	pthread_mutex_lock(&src->lock);
+	pthread_mutex_lock(&dst->lock);
+	while((client = src->clients)) {
+		src->clients = client->next;
+		client->next = dst->clients;
+		dst->clients = client;
+		dst->num_clients++;
+	}
+	src->num_clients = 0;
+	pthread_mutex_unlock(&dst->lock);
+	pthread_mutex_unlock(&src->lock);
+}
+
+void httpd_stream_close(struct httpd_stream* stream) {
+	struct httpd_stream_client* client;
+
+	pthread_mutex_lock(&stream->lock);
+	while((client = stream->clients)) {
+		stream->clients = client->next;
+		shutdown(client->socket, SHUT_RDWR);
+		close(client->socket);
+		free(client);
+	}
+	stream->num_clients = 0;
+	pthread_mutex_unlock(&stream->lock);
+}
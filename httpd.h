@@ -0,0 +1,82 @@
+#ifndef _HTTPD_H_
+#define _HTTPD_H_
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define HTTPD_PATH_LEN 256
+
+struct httpd;
+
+struct httpd_request {
+	int socket;
+	char method[8];
+	char path[HTTPD_PATH_LEN];
+	// Query string without leading '?', empty if none
+	char* query;
+};
+
+/*
+ * Called from a per-request thread. Returns 0 when the request has been
+ * handled and the connection may be closed, a positive value if the handler
+ * took over the socket (e.g. added it to a stream) or a negative error code.
+ */
+typedef int (*httpd_handler)(struct httpd* httpd, struct httpd_request* req, void* priv);
+
+struct httpd {
+	int socket;
+	struct addrinfo* addr_list;
+	pthread_t listen_thread;
+	bool thread_created;
+	httpd_handler handler;
+	void* priv;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	unsigned int num_requests;
+	bool exit;
+};
+
+// Growable buffer for assembling responses
+struct httpd_buf {
+	char* data;
+	size_t len;
+	size_t size;
+	// First error of any append, allows checking once after a series of appends
+	int err;
+};
+
+struct httpd_stream_client {
+	struct httpd_stream_client* next;
+	int socket;
+};
+
+// Set of streaming clients that get the same data pushed to them
+struct httpd_stream {
+	pthread_mutex_t lock;
+	struct httpd_stream_client* clients;
+	unsigned int num_clients;
+};
+
+int httpd_start(struct httpd* httpd, const char* address, const char* port, httpd_handler handler, void* priv);
+void httpd_stop(struct httpd* httpd);
+
+int httpd_write(int socket, const void* buf, size_t len);
+int httpd_respond_header(int socket, int status, const char* content_type, ssize_t content_length);
+int httpd_respond(int socket, int status, const char* content_type, const void* body, size_t len);
+int httpd_respond_error(int socket, int status);
+const char* httpd_query_param(struct httpd_request* req, const char* name);
+
+int httpd_buf_reserve(struct httpd_buf* buf, size_t len);
+int httpd_buf_append(struct httpd_buf* buf, const void* data, size_t len);
+int httpd_buf_printf(struct httpd_buf* buf, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void httpd_buf_free(struct httpd_buf* buf);
+
+void httpd_stream_init(struct httpd_stream* stream);
+int httpd_stream_add(struct httpd_stream* stream, int socket);
+unsigned int httpd_stream_broadcast(struct httpd_stream* stream, const void* buf, size_t len);
+void httpd_stream_splice(struct httpd_stream* dst, struct httpd_stream* src);
+void httpd_stream_close(struct httpd_stream* stream);
+
+#endif
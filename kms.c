@@ -0,0 +1,647 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+
+#include "kms.h"
+#include "util.h"
+
+#define KMS_FLIP_TIMEOUT_MS 1000
+
+char* default_card = "/dev/dri/card0";
+
+/* Theory Of Operation
+ * ===================
+ *
+ * The KMS frontend drives a single connector through the atomic modesetting
+ * API. On start it picks the first connected connector (or the one passed
+ * via the connector option), its preferred mode, a CRTC reachable from that
+ * connector and the primary plane of that CRTC. Two dumb buffers are
+ * allocated in the first pixel format the primary plane advertises that we
+ * know how to convert to.
+ *
+ * Each update converts the canvas into the hidden buffer and queues a
+ * non-blocking atomic commit that points the primary plane at it. The
+ * commit completes asynchronously, signalled by a page flip event on the
+ * DRM fd. While a flip is still in flight updates are skipped instead of
+ * waiting for it, so a slow display never stalls the compositor.
+ */
+
+static int kms_alloc(struct frontend** ret, struct fb* fb, void* priv) {
+	int err;
+	struct kms* kms = calloc(1, sizeof(struct kms));
+	if(!kms) {
+		fprintf(stderr, "Failed to allocate KMS frontend, out of memory\n");
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	kms->fb = fb;
+	kms->card = default_card;
+	kms->fd = -1;
+
+	*ret = &kms->front;
+	return 0;
+
+fail:
+	return err;
+}
+
+static uint32_t kms_get_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char* name) {
+	uint32_t i, prop_id = 0;
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if(!props) {
+		return 0;
+	}
+
+	for(i = 0; i < props->count_props && !prop_id; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if(prop) {
+			if(strcmp(prop->name, name) == 0) {
+				prop_id = prop->prop_id;
+			}
+			drmModeFreeProperty(prop);
+		}
+	}
+	drmModeFreeObjectProperties(props);
+	return prop_id;
+}
+
+static bool kms_get_prop_value(int fd, uint32_t obj_id, uint32_t obj_type, const char* name, uint64_t* value) {
+	uint32_t i;
+	bool found = false;
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if(!props) {
+		return false;
+	}
+
+	for(i = 0; i < props->count_props && !found; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if(prop) {
+			if(strcmp(prop->name, name) == 0) {
+				*value = props->prop_values[i];
+				found = true;
+			}
+			drmModeFreeProperty(prop);
+		}
+	}
+	drmModeFreeObjectProperties(props);
+	return found;
+}
+
+static int kms_lookup_props(struct kms* kms) {
+	struct kms_props* props = &kms->props;
+	int fd = kms->fd;
+
+	props->connector.crtc_id = kms_get_prop_id(fd, kms->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	props->crtc.mode_id = kms_get_prop_id(fd, kms->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+	props->crtc.active = kms_get_prop_id(fd, kms->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+	props->plane.fb_id = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID");
+	props->plane.crtc_id = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	props->plane.src_x = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X");
+	props->plane.src_y = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+	props->plane.src_w = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W");
+	props->plane.src_h = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H");
+	props->plane.crtc_x = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+	props->plane.crtc_y = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+	props->plane.crtc_w = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+	props->plane.crtc_h = kms_get_prop_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+
+	if(!props->connector.crtc_id || !props->crtc.mode_id || !props->crtc.active ||
+	   !props->plane.fb_id || !props->plane.crtc_id ||
+	   !props->plane.src_x || !props->plane.src_y || !props->plane.src_w || !props->plane.src_h ||
+	   !props->plane.crtc_x || !props->plane.crtc_y || !props->plane.crtc_w || !props->plane.crtc_h) {
+		fprintf(stderr, "KMS device is missing required atomic properties\n");
+		return -ENOTSUP;
+	}
+	return 0;
+}
+
+static int kms_find_connector(struct kms* kms, drmModeResPtr res) {
+	int i, j;
+	drmModeConnectorPtr conn = NULL;
+	drmModeEncoderPtr enc;
+
+	for(i = 0; i < res->count_connectors; i++) {
+		conn = drmModeGetConnector(kms->fd, res->connectors[i]);
+		if(!conn) {
+			continue;
+		}
+		if(conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0 &&
+		   (!kms->connector_req || conn->connector_id == kms->connector_req)) {
+			break;
+		}
+		drmModeFreeConnector(conn);
+		conn = NULL;
+	}
+
+	if(!conn) {
+		if(kms->connector_req) {
+			fprintf(stderr, "Connector %u not found or not connected\n", kms->connector_req);
+		} else {
+			fprintf(stderr, "No connected connector found\n");
+		}
+		return -ENODEV;
+	}
+
+	kms->connector_id = conn->connector_id;
+	kms->mode = conn->modes[0];
+	for(i = 0; i < conn->count_modes; i++) {
+		if(conn->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+			kms->mode = conn->modes[i];
+			break;
+		}
+	}
+
+	// Prefer the CRTC the connector is currently driven by
+	kms->crtc_id = 0;
+	if(conn->encoder_id) {
+		enc = drmModeGetEncoder(kms->fd, conn->encoder_id);
+		if(enc) {
+			kms->crtc_id = enc->crtc_id;
+			drmModeFreeEncoder(enc);
+		}
+	}
+	for(i = 0; i < conn->count_encoders && !kms->crtc_id; i++) {
+		enc = drmModeGetEncoder(kms->fd, conn->encoders[i]);
+		if(!enc) {
+			continue;
+		}
+		for(j = 0; j < res->count_crtcs; j++) {
+			if(enc->possible_crtcs & (1 << j)) {
+				kms->crtc_id = res->crtcs[j];
+				break;
+			}
+		}
+		drmModeFreeEncoder(enc);
+	}
+	drmModeFreeConnector(conn);
+
+	if(!kms->crtc_id) {
+		fprintf(stderr, "No usable CRTC for connector %u\n", kms->connector_id);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static bool kms_format_supported(uint32_t format) {
+	switch(format) {
+		case DRM_FORMAT_XRGB8888:
+		case DRM_FORMAT_ARGB8888:
+		case DRM_FORMAT_XBGR8888:
+		case DRM_FORMAT_ABGR8888:
+		case DRM_FORMAT_RGB565:
+			return true;
+	}
+	return false;
+}
+
+static int kms_find_plane(struct kms* kms, drmModeResPtr res) {
+	int crtc_index;
+	uint32_t i, j;
+	uint64_t type;
+	drmModePlaneResPtr plane_res;
+	drmModePlanePtr plane;
+
+	for(crtc_index = 0; crtc_index < res->count_crtcs; crtc_index++) {
+		if(res->crtcs[crtc_index] == kms->crtc_id) {
+			break;
+		}
+	}
+
+	plane_res = drmModeGetPlaneResources(kms->fd);
+	if(!plane_res) {
+		fprintf(stderr, "Failed to get KMS plane resources: %s(%d)\n", strerror(errno), errno);
+		return -errno;
+	}
+
+	kms->plane_id = 0;
+	for(i = 0; i < plane_res->count_planes && !kms->plane_id; i++) {
+		plane = drmModeGetPlane(kms->fd, plane_res->planes[i]);
+		if(!plane) {
+			continue;
+		}
+		if((plane->possible_crtcs & (1 << crtc_index)) &&
+		   kms_get_prop_value(kms->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) &&
+		   type == DRM_PLANE_TYPE_PRIMARY) {
+			// Formats are listed in the order preferred by the driver
+			for(j = 0; j < plane->count_formats; j++) {
+				if(kms_format_supported(plane->formats[j])) {
+					kms->plane_id = plane->plane_id;
+					kms->format = plane->formats[j];
+					break;
+				}
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(plane_res);
+
+	if(!kms->plane_id) {
+		fprintf(stderr, "No primary plane with a supported pixel format for CRTC %u\n", kms->crtc_id);
+		return -ENODEV;
+	}
+
+	kms->bpp = kms->format == DRM_FORMAT_RGB565 ? 16 : 32;
+	return 0;
+}
+
+static int kms_buffer_create(struct kms* kms, struct kms_buffer* buf) {
+	int err;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	struct drm_mode_create_dumb create = { 0 };
+	struct drm_mode_map_dumb map = { 0 };
+	struct drm_mode_destroy_dumb destroy = { 0 };
+
+	create.width = kms->mode.hdisplay;
+	create.height = kms->mode.vdisplay;
+	create.bpp = kms->bpp;
+	if(drmIoctl(kms->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		fprintf(stderr, "Failed to create dumb buffer: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail;
+	}
+	buf->handle = create.handle;
+	buf->pitch = create.pitch;
+	buf->size = create.size;
+
+	handles[0] = buf->handle;
+	pitches[0] = buf->pitch;
+	if(drmModeAddFB2(kms->fd, create.width, create.height, kms->format, handles, pitches, offsets, &buf->fb_id, 0)) {
+		fprintf(stderr, "Failed to add KMS framebuffer: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail_dumb;
+	}
+
+	map.handle = buf->handle;
+	if(drmIoctl(kms->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+		fprintf(stderr, "Failed to prepare dumb buffer mapping: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail_fb;
+	}
+
+	buf->map = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, kms->fd, map.offset);
+	if(buf->map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map dumb buffer: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail_fb;
+	}
+	memset(buf->map, 0, buf->size);
+
+	return 0;
+
+fail_fb:
+	drmModeRmFB(kms->fd, buf->fb_id);
+fail_dumb:
+	destroy.handle = buf->handle;
+	drmIoctl(kms->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+fail:
+	return err;
+}
+
+static void kms_buffer_destroy(struct kms* kms, struct kms_buffer* buf) {
+	struct drm_mode_destroy_dumb destroy = { 0 };
+
+	munmap(buf->map, buf->size);
+	drmModeRmFB(kms->fd, buf->fb_id);
+	destroy.handle = buf->handle;
+	drmIoctl(kms->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+}
+
+static int kms_add_plane_props(struct kms* kms, drmModeAtomicReqPtr req, struct kms_buffer* buf) {
+	struct kms_props* props = &kms->props;
+	uint32_t plane = kms->plane_id;
+	int err = 0;
+
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.fb_id, buf->fb_id) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.crtc_id, kms->crtc_id) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.src_x, 0) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.src_y, 0) < 0;
+	// Source coordinates are 16.16 fixed point
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.src_w, (uint64_t)kms->mode.hdisplay << 16) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.src_h, (uint64_t)kms->mode.vdisplay << 16) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.crtc_x, 0) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.crtc_y, 0) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.crtc_w, kms->mode.hdisplay) < 0;
+	err |= drmModeAtomicAddProperty(req, plane, props->plane.crtc_h, kms->mode.vdisplay) < 0;
+
+	return err ? -ENOMEM : 0;
+}
+
+static int kms_modeset(struct kms* kms) {
+	int err;
+	struct kms_props* props = &kms->props;
+	drmModeAtomicReqPtr req;
+
+	if(drmModeCreatePropertyBlob(kms->fd, &kms->mode, sizeof(kms->mode), &kms->mode_blob_id)) {
+		fprintf(stderr, "Failed to create KMS mode blob: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail;
+	}
+
+	req = drmModeAtomicAlloc();
+	if(!req) {
+		err = -ENOMEM;
+		goto fail_blob;
+	}
+
+	if(drmModeAtomicAddProperty(req, kms->connector_id, props->connector.crtc_id, kms->crtc_id) < 0 ||
+	   drmModeAtomicAddProperty(req, kms->crtc_id, props->crtc.mode_id, kms->mode_blob_id) < 0 ||
+	   drmModeAtomicAddProperty(req, kms->crtc_id, props->crtc.active, 1) < 0) {
+		err = -ENOMEM;
+		goto fail_req;
+	}
+	if((err = kms_add_plane_props(kms, req, &kms->buffers[0]))) {
+		goto fail_req;
+	}
+
+	if(drmModeAtomicCommit(kms->fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL)) {
+		fprintf(stderr, "Atomic modeset failed: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail_req;
+	}
+	drmModeAtomicFree(req);
+
+	kms->back = 1;
+	return 0;
+
+fail_req:
+	drmModeAtomicFree(req);
+fail_blob:
+	drmModeDestroyPropertyBlob(kms->fd, kms->mode_blob_id);
+	kms->mode_blob_id = 0;
+fail:
+	return err;
+}
+
+static int kms_start(struct frontend* front) {
+	struct kms* kms = container_of(front, struct kms, front);
+	int err;
+	uint64_t cap = 0;
+	drmModeResPtr res;
+
+	kms->fd = open(kms->card, O_RDWR | O_CLOEXEC);
+	if(kms->fd < 0) {
+		fprintf(stderr, "Failed to open DRM device '%s': %s(%d)\n", kms->card, strerror(errno), errno);
+		err = -errno;
+		goto fail;
+	}
+
+	if(drmGetCap(kms->fd, DRM_CAP_DUMB_BUFFER, &cap) || !cap) {
+		fprintf(stderr, "DRM device '%s' does not support dumb buffers\n", kms->card);
+		err = -ENOTSUP;
+		goto fail_fd;
+	}
+
+	if(drmSetClientCap(kms->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	   drmSetClientCap(kms->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		fprintf(stderr, "DRM device '%s' does not support atomic modesetting\n", kms->card);
+		err = -ENOTSUP;
+		goto fail_fd;
+	}
+
+	res = drmModeGetResources(kms->fd);
+	if(!res) {
+		fprintf(stderr, "Failed to get KMS resources: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto fail_fd;
+	}
+
+	if((err = kms_find_connector(kms, res))) {
+		goto fail_res;
+	}
+
+	if((err = kms_find_plane(kms, res))) {
+		goto fail_res;
+	}
+
+	if((err = kms_lookup_props(kms))) {
+		goto fail_res;
+	}
+
+	for(kms->num_buffers = 0; kms->num_buffers < KMS_NUM_BUFFERS; kms->num_buffers++) {
+		if((err = kms_buffer_create(kms, &kms->buffers[kms->num_buffers]))) {
+			goto fail_buffers;
+		}
+	}
+
+	kms->saved_crtc = drmModeGetCrtc(kms->fd, kms->crtc_id);
+
+	if((err = kms_modeset(kms))) {
+		goto fail_crtc;
+	}
+
+	printf("KMS output on connector %u, CRTC %u, plane %u: %ux%u@%u, format %.4s\n",
+	       kms->connector_id, kms->crtc_id, kms->plane_id, kms->mode.hdisplay, kms->mode.vdisplay,
+	       kms->mode.vrefresh, (char*)&kms->format);
+
+	drmModeFreeResources(res);
+	return 0;
+
+fail_crtc:
+	if(kms->saved_crtc) {
+		drmModeFreeCrtc(kms->saved_crtc);
+		kms->saved_crtc = NULL;
+	}
+fail_buffers:
+	while(kms->num_buffers-- > 0) {
+		kms_buffer_destroy(kms, &kms->buffers[kms->num_buffers]);
+	}
+	kms->num_buffers = 0;
+fail_res:
+	drmModeFreeResources(res);
+fail_fd:
+	close(kms->fd);
+	kms->fd = -1;
+fail:
+	return err;
+}
+
+static void kms_page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void* user_data) {
+	struct kms* kms = user_data;
+	kms->flip_pending = false;
+}
+
+static int kms_handle_events(struct kms* kms, int timeout) {
+	struct pollfd pfd = { .fd = kms->fd, .events = POLLIN };
+	drmEventContext evctx = {
+		.version = DRM_EVENT_CONTEXT_VERSION,
+		.page_flip_handler = kms_page_flip_handler,
+	};
+	int ret;
+
+	while(kms->flip_pending) {
+		ret = poll(&pfd, 1, timeout);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if(ret == 0) {
+			break;
+		}
+		if(drmHandleEvent(kms->fd, &evctx)) {
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static void kms_convert(struct kms* kms, struct kms_buffer* buf) {
+	unsigned int x, y;
+	unsigned int width = min(kms->fb->size.width, kms->mode.hdisplay);
+	unsigned int height = min(kms->fb->size.height, kms->mode.vdisplay);
+
+	for(y = 0; y < height; y++) {
+		union fb_pixel* src = fb_get_line_base(kms->fb, y);
+		char* line = buf->map + y * buf->pitch;
+		uint32_t* line32 = (uint32_t*)line;
+		uint16_t* line16 = (uint16_t*)line;
+
+		// Canvas pixels read as 0xRRGGBBAA, DRM formats are little endian
+		switch(kms->format) {
+			case DRM_FORMAT_XRGB8888:
+			case DRM_FORMAT_ARGB8888:
+				for(x = 0; x < width; x++) {
+					line32[x] = htole32(0xff000000 | (src[x].abgr >> 8));
+				}
+				break;
+			case DRM_FORMAT_XBGR8888:
+			case DRM_FORMAT_ABGR8888:
+				for(x = 0; x < width; x++) {
+					uint32_t rgba = src[x].abgr;
+					line32[x] = htole32(0xff000000 | (rgba >> 24) | (rgba & 0x00ff0000) >> 8 | (rgba & 0x0000ff00) << 8);
+				}
+				break;
+			case DRM_FORMAT_RGB565:
+				for(x = 0; x < width; x++) {
+					uint32_t rgba = src[x].abgr;
+					line16[x] = htole16(((rgba >> 16) & 0xf800) | ((rgba >> 13) & 0x07e0) | ((rgba >> 11) & 0x001f));
+				}
+				break;
+		}
+	}
+}
+
+static int kms_update(struct frontend* front) {
+	struct kms* kms = container_of(front, struct kms, front);
+	struct kms_buffer* buf = &kms->buffers[kms->back];
+	drmModeAtomicReqPtr req;
+	int err;
+
+	if((err = kms_handle_events(kms, 0))) {
+		fprintf(stderr, "Failed to handle KMS events: %d => %s\n", err, strerror(-err));
+		return err;
+	}
+
+	// Previous flip still in flight, drop this frame
+	if(kms->flip_pending) {
+		return 0;
+	}
+
+	kms_convert(kms, buf);
+
+	req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+	if(drmModeAtomicAddProperty(req, kms->plane_id, kms->props.plane.fb_id, buf->fb_id) < 0) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if(drmModeAtomicCommit(kms->fd, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, kms)) {
+		if(errno == EBUSY) {
+			// Commit queue is full, try again next frame
+			goto out;
+		}
+		fprintf(stderr, "Atomic page flip failed: %s(%d)\n", strerror(errno), errno);
+		err = -errno;
+		goto out;
+	}
+	kms->flip_pending = true;
+	kms->back = (kms->back + 1) % KMS_NUM_BUFFERS;
+
+out:
+	drmModeAtomicFree(req);
+	return err;
+}
+
+static void kms_free(struct frontend* front) {
+	struct kms* kms = container_of(front, struct kms, front);
+
+	if(kms->fd >= 0) {
+		kms_handle_events(kms, KMS_FLIP_TIMEOUT_MS);
+		if(kms->saved_crtc) {
+			drmModeSetCrtc(kms->fd, kms->saved_crtc->crtc_id, kms->saved_crtc->buffer_id,
+			               kms->saved_crtc->x, kms->saved_crtc->y, &kms->connector_id, 1, &kms->saved_crtc->mode);
+			drmModeFreeCrtc(kms->saved_crtc);
+		}
+		while(kms->num_buffers-- > 0) {
+			kms_buffer_destroy(kms, &kms->buffers[kms->num_buffers]);
+		}
+		if(kms->mode_blob_id) {
+			drmModeDestroyPropertyBlob(kms->fd, kms->mode_blob_id);
+		}
+		close(kms->fd);
+	}
+	if(kms->card != default_card) {
+		free(kms->card);
+	}
+	free(kms);
+}
+
+static int configure_card(struct frontend* front, char* value) {
+	struct kms* kms = container_of(front, struct kms, front);
+	char* card;
+	if(!value) {
+		return -EINVAL;
+	}
+
+	card = strdup(value);
+	if(!card) {
+		fprintf(stderr, "Failed to allocate space for DRM device path, out of memory\n");
+		return -ENOMEM;
+	}
+
+	kms->card = card;
+	return 0;
+}
+
+static int configure_connector(struct frontend* front, char* value) {
+	struct kms* kms = container_of(front, struct kms, front);
+	if(!value) {
+		return -EINVAL;
+	}
+
+	int connector = atoi(value);
+	if(connector <= 0) {
+		fprintf(stderr, "Connector id must be > 0\n");
+		return -EINVAL;
+	}
+
+	kms->connector_req = connector;
+	return 0;
+}
+
+static const struct frontend_ops fops = {
+	.alloc = kms_alloc,
+	.start = kms_start,
+	.free = kms_free,
+	.update = kms_update,
+};
+
+static const struct frontend_arg fargs[] = {
+	{ .name = "card", .configure = configure_card },
+	{ .name = "connector", .configure = configure_connector },
+	{ .name = "", .configure = NULL },
+};
+
+DECLARE_FRONTEND_THREADABLE_SIG_ARGS(front_kms, "DRM/KMS frontend", &fops, fargs);
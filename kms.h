@@ -0,0 +1,68 @@
+#ifndef _KMS_H_
+#define _KMS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "framebuffer.h"
+#include "frontend.h"
+
+#define KMS_NUM_BUFFERS 2
+
+struct kms_buffer {
+	uint32_t handle;
+	uint32_t pitch;
+	uint64_t size;
+	uint32_t fb_id;
+	char* map;
+};
+
+struct kms_props {
+	struct {
+		uint32_t crtc_id;
+	} connector;
+	struct {
+		uint32_t mode_id;
+		uint32_t active;
+	} crtc;
+	struct {
+		uint32_t fb_id;
+		uint32_t crtc_id;
+		uint32_t src_x;
+		uint32_t src_y;
+		uint32_t src_w;
+		uint32_t src_h;
+		uint32_t crtc_x;
+		uint32_t crtc_y;
+		uint32_t crtc_w;
+		uint32_t crtc_h;
+	} plane;
+};
+
+struct kms {
+	struct frontend front;
+	struct fb* fb;
+	char* card;
+	uint32_t connector_req;
+	int fd;
+
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	uint32_t plane_id;
+	drmModeModeInfo mode;
+	uint32_t mode_blob_id;
+	drmModeCrtcPtr saved_crtc;
+	struct kms_props props;
+
+	uint32_t format;
+	unsigned int bpp;
+	struct kms_buffer buffers[KMS_NUM_BUFFERS];
+	unsigned int num_buffers;
+	unsigned int back;
+	bool flip_pending;
+};
+
+#endif
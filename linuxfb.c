@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -10,6 +11,7 @@
 
 #include "linuxfb.h"
 #include "util.h"
+#include "workqueue.h"
 
 char* default_fbdev = "/dev/fb0";
 
@@ -25,6 +27,8 @@ int linuxfb_alloc(struct frontend** ret, struct fb* fb, void* priv) {
 	linuxfb->fb = fb;
 	linuxfb->fbdev = default_fbdev;
 	linuxfb->fd = -1;
+	linuxfb->fbmap = MAP_FAILED;
+	workqueue_completion_init(&linuxfb->convert_completion);
 
 	*ret = &linuxfb->front;
 	return 0;
@@ -33,6 +37,72 @@ fail:
 	return err;
 }
 
+/*
+ * Try to set up a second page below the visible one. On success conversion
+ * renders into the hidden page and FBIOPAN_DISPLAY flips it into view.
+ * Without enough virtual resolution we fall back to writing a shadow buffer
+ * to the visible page.
+ */
+static void linuxfb_setup_flip(struct linuxfb* linuxfb, int fd) {
+	struct fb_var_screeninfo vscreen = linuxfb->vscreen;
+	__u32 crtc = 0;
+	char* fbmap;
+
+	if(ioctl(fd, FBIOGET_FSCREENINFO, &linuxfb->fscreen) < 0) {
+		fprintf(stderr, "Failed to get fix screeninfo, not using page flipping: %s(%d)\n", strerror(errno), errno);
+		return;
+	}
+
+	if(!linuxfb->fscreen.ypanstep || vscreen.yres % linuxfb->fscreen.ypanstep) {
+		printf("fbdev does not support panning by full pages, not using page flipping\n");
+		return;
+	}
+
+	if(vscreen.yres_virtual < vscreen.yres * 2) {
+		vscreen.yres_virtual = vscreen.yres * 2;
+		if(ioctl(fd, FBIOPUT_VSCREENINFO, &vscreen) < 0 || ioctl(fd, FBIOGET_VSCREENINFO, &vscreen) < 0) {
+			printf("Failed to increase virtual resolution to %ux%u, not using page flipping\n", vscreen.xres_virtual, vscreen.yres * 2);
+			goto fail_vscreen;
+		}
+		linuxfb->vscreen_changed = true;
+		if(vscreen.yres_virtual < vscreen.yres * 2) {
+			printf("Virtual resolution too small for two pages, not using page flipping\n");
+			goto fail_vscreen;
+		}
+		// Line length and memory size may change with the mode
+		if(ioctl(fd, FBIOGET_FSCREENINFO, &linuxfb->fscreen) < 0) {
+			fprintf(stderr, "Failed to get fix screeninfo, not using page flipping: %s(%d)\n", strerror(errno), errno);
+			goto fail_vscreen;
+		}
+	}
+
+	if(linuxfb->fscreen.line_length * vscreen.yres * 2 > linuxfb->fscreen.smem_len) {
+		printf("fbdev memory too small for two pages, not using page flipping\n");
+		goto fail_vscreen;
+	}
+
+	fbmap = mmap(NULL, linuxfb->fscreen.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(fbmap == MAP_FAILED) {
+		fprintf(stderr, "Failed to map fbdev memory, not using page flipping: %s(%d)\n", strerror(errno), errno);
+		goto fail_vscreen;
+	}
+
+	linuxfb->vsync = ioctl(fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+	linuxfb->vscreen = vscreen;
+	linuxfb->page = vscreen.yoffset >= vscreen.yres ? 1 : 0;
+	linuxfb->fbmap = fbmap;
+	linuxfb->fbmap_len = linuxfb->fscreen.smem_len;
+	linuxfb->flip = true;
+	printf("Using page flipping on fbdev %s vsync\n", linuxfb->vsync ? "with" : "without");
+	return;
+
+fail_vscreen:
+	if(linuxfb->vscreen_changed) {
+		ioctl(fd, FBIOPUT_VSCREENINFO, &linuxfb->vscreen_orig);
+		linuxfb->vscreen_changed = false;
+	}
+}
+
 static int linuxfb_start(struct frontend* front) {
 	struct linuxfb* linuxfb = container_of(front, struct linuxfb, front);
 	char* fbmem;
@@ -49,6 +119,7 @@ static int linuxfb_start(struct frontend* front) {
 		err = -errno;
 		goto fail_fd;
 	}
+	linuxfb->vscreen_orig = linuxfb->vscreen;
 
 	switch(linuxfb->vscreen.bits_per_pixel) {
 		case 8:
@@ -75,6 +146,12 @@ fail_depth:
 	printf("  green: %u.%u\n", linuxfb->vscreen.green.offset, linuxfb->vscreen.green.length);
 	printf("  blue:  %u.%u\n", linuxfb->vscreen.blue.offset, linuxfb->vscreen.blue.length);
 
+	linuxfb_setup_flip(linuxfb, fd);
+	if(linuxfb->flip) {
+		linuxfb->fd = fd;
+		return 0;
+	}
+
 	fbmem = calloc(linuxfb->vscreen.bits_per_pixel / 8, linuxfb->vscreen.xres_virtual * linuxfb->vscreen.yres_virtual + linuxfb->pixel_offset);
 	if(!fbmem) {
 		fprintf(stderr, "Failed to allocate buffer for fb color format, out of memory\n");
@@ -93,54 +170,59 @@ fail:
 	return err;
 }
 
-int linuxfb_update(struct frontend* front) {
-	struct linuxfb* linuxfb = container_of(front, struct linuxfb, front);
+struct linuxfb_convert_job {
+	struct linuxfb* linuxfb;
+	char* fbmem;
+	size_t line_length;
+};
+
+static int linuxfb_convert_lines(void* priv, unsigned int y_start, unsigned int y_end) {
+	struct linuxfb_convert_job* job = priv;
+	struct linuxfb* linuxfb = job->linuxfb;
 	union fb_pixel px;
 	unsigned int x, y;
-	ssize_t write_len = 0;
-	size_t len;
-	char* fbmem;
-	unsigned int px_index = linuxfb->pixel_offset;
+	unsigned int px_index;
+	unsigned int bytes_per_pixel = linuxfb->vscreen.bits_per_pixel / 8;
 	bool is_be = is_big_endian();
 
-	px_index += linuxfb->vscreen.yoffset * linuxfb->vscreen.xres_virtual;
-	for(y = 0; y < min(linuxfb->fb->size.height, linuxfb->vscreen.yres); y++) {
-		px_index += linuxfb->vscreen.xoffset * (linuxfb->vscreen.bits_per_pixel / 8);
+	for(y = y_start; y < y_end; y++) {
+		char* line = job->fbmem + y * job->line_length;
+		px_index = linuxfb->vscreen.xoffset * bytes_per_pixel;
 		for(x = 0; x < min(linuxfb->fb->size.width, linuxfb->vscreen.xres); x++) {
 			px = fb_get_pixel(linuxfb->fb, x, y);
 			switch(linuxfb->vscreen.bits_per_pixel) {
 				case 16: // BGR 565
 					if(is_be) {
-						linuxfb->fbmem[px_index++] = (px.color_be.color_bgr.blue >> 3) | (((px.color_be.color_bgr.green >> 2) & 0x07) << 5);
-						linuxfb->fbmem[px_index++] = (((px.color_be.color_bgr.green >> 2) & 0x38) >> 3) | (px.color_be.color_bgr.red & 0xF8);
+						line[px_index++] = (px.color_be.color_bgr.blue >> 3) | (((px.color_be.color_bgr.green >> 2) & 0x07) << 5);
+						line[px_index++] = (((px.color_be.color_bgr.green >> 2) & 0x38) >> 3) | (px.color_be.color_bgr.red & 0xF8);
 					} else {
-						linuxfb->fbmem[px_index++] = (px.color.color_bgr.blue >> 3) | (((px.color.color_bgr.green >> 2) & 0x07) << 5);
-						linuxfb->fbmem[px_index++] = (((px.color.color_bgr.green >> 2) & 0x38) >> 3) | (px.color.color_bgr.red & 0xF8);
+						line[px_index++] = (px.color.color_bgr.blue >> 3) | (((px.color.color_bgr.green >> 2) & 0x07) << 5);
+						line[px_index++] = (((px.color.color_bgr.green >> 2) & 0x38) >> 3) | (px.color.color_bgr.red & 0xF8);
 					}
 					break;
 				case 32: // ABGR 8888
 					if(is_be) {
-						linuxfb->fbmem[px_index++] = px.color_be.alpha;
+						line[px_index++] = px.color_be.alpha;
 					} else {
-						linuxfb->fbmem[px_index++] = px.color.alpha;
+						line[px_index++] = px.color.alpha;
 					}
 				case 24: // BGR 888
 					if(is_be) {
-						linuxfb->fbmem[px_index++] = px.color_be.color_bgr.blue;
-						linuxfb->fbmem[px_index++] = px.color_be.color_bgr.green;
-						linuxfb->fbmem[px_index++] = px.color_be.color_bgr.red;
+						line[px_index++] = px.color_be.color_bgr.blue;
+						line[px_index++] = px.color_be.color_bgr.green;
+						line[px_index++] = px.color_be.color_bgr.red;
 					} else {
-						linuxfb->fbmem[px_index++] = px.color.color_bgr.blue;
-						linuxfb->fbmem[px_index++] = px.color.color_bgr.green;
-						linuxfb->fbmem[px_index++] = px.color.color_bgr.red;
+						line[px_index++] = px.color.color_bgr.blue;
+						line[px_index++] = px.color.color_bgr.green;
+						line[px_index++] = px.color.color_bgr.red;
 					}
 					break;
 				case 8: // 8 bit grayscale
 					// interprete red channel only. While this is not correct it is at least something
 					if(is_be) {
-						linuxfb->fbmem[px_index++] = px.color_be.color_bgr.red;
+						line[px_index++] = px.color_be.color_bgr.red;
 					} else {
-						linuxfb->fbmem[px_index++] = px.color.color_bgr.red;
+						line[px_index++] = px.color.color_bgr.red;
 					}
 					break;
 				default:
@@ -148,7 +230,66 @@ int linuxfb_update(struct frontend* front) {
 					return -EINVAL;
 			}
 		}
-		px_index += (linuxfb->vscreen.xres_virtual - x) * (linuxfb->vscreen.bits_per_pixel / 8);
+	}
+
+	return 0;
+}
+
+// Lines are converted in parallel on the workqueue of the node the fb lives on
+static int linuxfb_convert(struct linuxfb* linuxfb, char* fbmem, size_t line_length) {
+	struct linuxfb_convert_job job = {
+		.linuxfb = linuxfb,
+		.fbmem = fbmem,
+		.line_length = line_length,
+	};
+	unsigned int height = min(linuxfb->fb->size.height, linuxfb->vscreen.yres);
+	int err, wait_err;
+
+	err = workqueue_parallel_for(linuxfb->fb->numa_node, &linuxfb->convert_completion, 0, height, LINUXFB_CONVERT_LINES,
+		&job, linuxfb_convert_lines);
+	wait_err = workqueue_completion_wait(&linuxfb->convert_completion);
+	return err ? err : wait_err;
+}
+
+static int linuxfb_flip(struct linuxfb* linuxfb) {
+	int err;
+	__u32 crtc = 0;
+	unsigned int back = !linuxfb->page;
+	char* page = linuxfb->fbmap + back * linuxfb->vscreen.yres * linuxfb->fscreen.line_length;
+
+	if((err = linuxfb_convert(linuxfb, page + linuxfb->pixel_offset, linuxfb->fscreen.line_length))) {
+		return err;
+	}
+
+	if(linuxfb->vsync && ioctl(linuxfb->fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+		fprintf(stderr, "Wait for vsync failed, continuing without vsync: %s(%d)\n", strerror(errno), errno);
+		linuxfb->vsync = false;
+	}
+
+	linuxfb->vscreen.yoffset = back * linuxfb->vscreen.yres;
+	if(ioctl(linuxfb->fd, FBIOPAN_DISPLAY, &linuxfb->vscreen) < 0) {
+		fprintf(stderr, "Failed to pan fbdev display: %s(%d)\n", strerror(errno), errno);
+		return -errno;
+	}
+	linuxfb->page = back;
+
+	return 0;
+}
+
+int linuxfb_update(struct frontend* front) {
+	struct linuxfb* linuxfb = container_of(front, struct linuxfb, front);
+	ssize_t write_len = 0;
+	size_t len;
+	char* fbmem;
+	int err;
+
+	if(linuxfb->flip) {
+		return linuxfb_flip(linuxfb);
+	}
+
+	fbmem = linuxfb->fbmem + linuxfb->pixel_offset + linuxfb->vscreen.yoffset * linuxfb->vscreen.xres_virtual;
+	if((err = linuxfb_convert(linuxfb, fbmem, linuxfb->vscreen.xres_virtual * (linuxfb->vscreen.bits_per_pixel / 8)))) {
+		return err;
 	}
 
 	fbmem = linuxfb->fbmem;
@@ -203,9 +344,17 @@ void linuxfb_free(struct frontend* front) {
 	if(linuxfb->fbdev != default_fbdev) {
 		free(linuxfb->fbdev);
 	}
+	if(linuxfb->fbmap != MAP_FAILED) {
+		munmap(linuxfb->fbmap, linuxfb->fbmap_len);
+	}
 	if(linuxfb->fd > 0) {
+		if(linuxfb->vscreen_changed) {
+			ioctl(linuxfb->fd, FBIOPUT_VSCREENINFO, &linuxfb->vscreen_orig);
+		}
 		close(linuxfb->fd);
 	}
+	free(linuxfb->fbmem);
+	workqueue_completion_destroy(&linuxfb->convert_completion);
 	free(linuxfb);
 }
 
@@ -222,4 +371,4 @@ static const struct frontend_arg fargs[] = {
 	{ .name = "", .configure = NULL },
 };
 
-DECLARE_FRONTEND_SIG_ARGS(front_linuxfb, "Linux framebuffer frontend", &fops, fargs);
+DECLARE_FRONTEND_THREADABLE_SIG_ARGS(front_linuxfb, "Linux framebuffer frontend", &fops, fargs);
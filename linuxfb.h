@@ -1,8 +1,14 @@
 #ifndef _LINUXFB_H_
 #define _LINUXFB_H_
 
+#include <stdbool.h>
+
 #include "framebuffer.h"
 #include "frontend.h"
+#include "workqueue.h"
+
+// Lines per conversion job
+#define LINUXFB_CONVERT_LINES 16
 
 struct linuxfb {
 	struct frontend front;
@@ -11,7 +17,23 @@ struct linuxfb {
 	int fd;
 	char* fbmem;
 	struct fb_var_screeninfo vscreen;
+	struct fb_var_screeninfo vscreen_orig;
+	struct fb_fix_screeninfo fscreen;
 	unsigned int pixel_offset;
+
+	// Page flipping
+	bool flip;
+	bool vsync;
+	bool vscreen_changed;
+	unsigned int page;
+	char* fbmap;
+	size_t fbmap_len;
+
+	struct workqueue_completion convert_completion;
 };
 
+int linuxfb_alloc(struct frontend** ret, struct fb* fb, void* priv);
+void linuxfb_free(struct frontend* front);
+int linuxfb_update(struct frontend* front);
+
 #endif
@@ -56,9 +56,9 @@ void llist_append(struct llist* llist, struct llist_entry* entry) {
 	llist_unlock(llist);
 }
 
-void llist_remove(struct llist_entry* entry) {
+// Caller must hold the list lock
+void llist_remove_locked(struct llist_entry* entry) {
 	struct llist* llist = entry->list;
-	llist_lock(llist);
 	if(entry == llist->head) {
 		llist->head = entry->next;
 	}
@@ -74,6 +74,12 @@ void llist_remove(struct llist_entry* entry) {
 	entry->next = NULL;
 	entry->prev = NULL;
 	entry->list = NULL;
+}
+
+void llist_remove(struct llist_entry* entry) {
+	struct llist* llist = entry->list;
+	llist_lock(llist);
+	llist_remove_locked(entry);
 	llist_unlock(llist);
 }
 
@@ -12,34 +12,43 @@
 #include <getopt.h>
 #include <netdb.h>
 #include <time.h>
+#include <sys/un.h>
 
 #include "framebuffer.h"
 #ifdef FEATURE_SDL
 #include "sdl.h"
 #endif
 #include "network.h"
+#include "capture.h"
 #include "llist.h"
 #include "util.h"
 #include "frontend.h"
 #include "workqueue.h"
+#include "topology.h"
+#include "overlay.h"
+#include "trace.h"
 #ifdef FEATURE_TTF
 #include "textrender.h"
 #endif
 #ifdef FEATURE_STATISTICS
 #include "statistics.h"
+#include "heatmap.h"
 #endif
 
 
 #define PORT_DEFAULT "1234"
 #define LISTEN_DEFAULT "::"
+#define LISTEN_UNIX_PREFIX "unix:"
 #define RATE_DEFAULT 60
 #define WIDTH_DEFAULT 1024
 #define HEIGHT_DEFAULT 768
 #define RINGBUFFER_DEFAULT 65536
 #define LISTEN_THREADS_DEFAULT 10
+#define REBALANCE_INTERVAL_DEFAULT 1000
 #define MAX_STAT_LENGTH 265
 
 #define MAX_FRONTENDS 16
+#define MAX_LATENCY_SAMPLES 16
 
 #define REPO_URL "https://github.com/TobleMiner/shoreline"
 
@@ -55,12 +64,15 @@ void show_frontends() {
 	for(; front->def != NULL; front++) {
 		const struct frontend_arg* options = front->def->args;
 		fprintf(stderr, "\t%s: %s ", front->id, front->def->name);
-		if(options) {
+		if(options || front->def->threadable) {
 			fprintf(stderr, "(Options:");
-			while(strlen(options->name)) {
+			while(options && strlen(options->name)) {
 				fprintf(stderr, " %s", options->name);
 				options++;
 			}
+			if(front->def->threadable) {
+				fprintf(stderr, " thread rate");
+			}
 			fprintf(stderr, ")");
 		}
 		fprintf(stderr, "\n");
@@ -75,10 +87,11 @@ void doshutdown(int sig)
 
 void show_usage(char* binary) {
 	fprintf(stderr, "Usage: %s [-p <port>] [-b <bind address>] [-w <width>] [-h <height>] [-r <screen update rate>] "\
-		"[-s <ring buffer size>] [-l <number of listening threads>] [-f <frontend>] [-t <fontfile>] [-d <description>] [-?]\n", binary);
+		"[-s <ring buffer size>] [-l <number of listening threads>] [-f <frontend>] [-t <fontfile>] [-d <description>] "\
+		"[-L <latency sample interval>] [-H] [-c <capture directory>] [-C <capture limit>] [-A <role>=<cpus>] [-R <rebalance interval>] [-?]\n", binary);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -p <port>                        Port to listen on (default %s)\n", PORT_DEFAULT);
-	fprintf(stderr, "  -b <address>                     Address to listen on (default %s)\n", LISTEN_DEFAULT);
+	fprintf(stderr, "  -b <address>                     Address to listen on, unix:<path> for a unix socket (default %s)\n", LISTEN_DEFAULT);
 	fprintf(stderr, "  -w <width>                       Width of drawing surface (default %u)\n", WIDTH_DEFAULT);
 	fprintf(stderr, "  -h <height>                      Height of drawing surface (default %u)\n", HEIGHT_DEFAULT);
 	fprintf(stderr, "  -r <update rate>                 Screen update rate in HZ (default %u)\n", RATE_DEFAULT);
@@ -88,6 +101,13 @@ void show_usage(char* binary) {
 		"Use -f ? to list available frontends and options\n");
 	fprintf(stderr, "  -t <fontfile>                    Enable fancy text rendering using TTF, OTF or CFF font from <fontfile>\n");
 	fprintf(stderr, "  -d <description>                 Set description text to be displayed in upper left corner (default %s)\n", REPO_URL);
+	fprintf(stderr, "  -L <interval>                    Sample pixel latency on every <interval>th read of a connection (default 0, disabled)\n");
+	fprintf(stderr, "  -H                               Show activity heatmap on top of the canvas\n");
+	fprintf(stderr, "  -c <directory>                   Capture raw traffic of every connection to <directory>\n");
+	fprintf(stderr, "  -C <megabytes>                   Maximum size of a single connection capture (default %u)\n", CAPTURE_LIMIT_DEFAULT >> 20);
+	fprintf(stderr, "  -A <role>=<cpus>                 Run threads of <role> on <cpus>, e.g. connection=4-15. May be specified multiple times. "\
+		"Roles are listen, connection, compositor, frontend, statistics and workqueue (default automatic)\n");
+	fprintf(stderr, "  -R <milliseconds>                Interval of moving busy connections to less loaded CPUs, 0 to disable (default %u)\n", REBALANCE_INTERVAL_DEFAULT);
 	fprintf(stderr, "  -?                               Show this help\n");
 }
 
@@ -110,14 +130,50 @@ void resize_wq_cleanup(int err, void* priv) {
 	free(priv);
 }
 
+struct coalesce_wq_priv {
+	struct fb* fb;
+	struct llist* fbs;
+	uint32_t* tile_writes;
+};
+
+int coalesce_wq_cb(void* priv, unsigned int tile_row_start, unsigned int tile_row_end) {
+	struct coalesce_wq_priv* coalesce_priv = priv;
+	return fb_coalesce_rows(coalesce_priv->fb, coalesce_priv->fbs, coalesce_priv->tile_writes, tile_row_start, tile_row_end);
+}
+
+// Coalesce tile rows as separate jobs, idle workers steal rows from busy ones
+static int coalesce_parallel(struct fb* fb, struct llist* fbs, uint32_t* tile_writes, struct workqueue_completion* completion) {
+	struct coalesce_wq_priv coalesce_priv = {
+		.fb = fb,
+		.fbs = fbs,
+		.tile_writes = tile_writes,
+	};
+	int err, wait_err;
+
+	if(llist_is_empty(fbs)) {
+		return 0;
+	}
+	err = workqueue_parallel_for(fb->numa_node, completion, 0, fb->tiles.height, 1, &coalesce_priv, coalesce_wq_cb);
+	wait_err = workqueue_completion_wait(completion);
+	return err ? err : wait_err;
+}
+
 #ifdef FEATURE_SDL
+struct resize_cb_priv {
+	struct llist* fb_list;
+	struct fb* canvas;
+};
+
 int resize_cb(struct sdl* sdl, unsigned int width, unsigned int height) {
-	struct llist* fb_list = sdl->cb_private;
+	struct resize_cb_priv* priv = sdl->cb_private;
+	struct workqueue_completion completion;
 	struct llist_entry* cursor;
 	struct fb* fb;
-	int err = 0;
+	int err = 0, wait_err;
 
-	llist_for_each(fb_list, cursor) {
+	// Resize all NUMA local fbs in parallel, each on its own node
+	workqueue_completion_init(&completion);
+	llist_for_each(priv->fb_list, cursor) {
 		struct resize_wq_priv* resize_priv = malloc(sizeof(struct resize_wq_priv));
 		if(!resize_priv) {
 			err = -ENOMEM;
@@ -129,42 +185,70 @@ int resize_cb(struct sdl* sdl, unsigned int width, unsigned int height) {
 		fb = llist_entry_get_value(cursor, struct fb, list);
 		resize_priv->fb = fb;
 
-		// TODO: Add error callback
-		if((err = workqueue_enqueue(fb->numa_node, resize_priv, resize_wq_cb, resize_wq_err, resize_wq_cleanup))) {
+		if((err = workqueue_enqueue_completion(fb->numa_node, &completion, resize_priv, resize_wq_cb, resize_wq_err, resize_wq_cleanup))) {
 			free(resize_priv);
 			goto fail;
 		}
 	}
 
+	// The output frame follows the canvas on the next compose
+	err = fb_resize(priv->canvas, width, height);
+
 fail:
-	return err;
+	wait_err = workqueue_completion_wait(&completion);
+	workqueue_completion_destroy(&completion);
+	return err ? err : wait_err;
 }
 #endif
 
 #ifdef FEATURE_STATISTICS
 struct statistics stats = { 0 };
+struct heatmap* heatmap = NULL;
+static bool show_heatmap = false;
 #endif
 #ifdef FEATURE_TTF
 struct textrender* txtrndr = NULL;
 #endif
 char* description = REPO_URL;
 
-void draw_overlays(struct fb* fb) {
 #ifdef FEATURE_STATISTICS
-	char stat_line[MAX_STAT_LENGTH];
-	snprintf(stat_line, sizeof(stat_line), "Traffic: %.3f %sB / %.3f %sPixels "
-"Throughput: %.3f %sb/s / %.3f %sPixels/s FPS: %d frames/s %llu connections",
-		statistics_traffic_get_scaled(&stats), statistics_traffic_get_unit(&stats),
-		statistics_pixels_get_scaled(&stats), statistics_pixels_get_unit(&stats),
-		statistics_throughput_get_scaled(&stats), statistics_throughput_get_unit(&stats),
-		statistics_pps_get_scaled(&stats), statistics_pps_get_unit(&stats),
-		statistics_get_frames_per_second(&stats), stats.num_connections);
+static char stat_line[MAX_STAT_LENGTH];
+#endif
+#ifdef FEATURE_TTF
+static struct textrender_string description_str = { 0 };
+static struct overlay_item description_item = { 0 };
+#ifdef FEATURE_STATISTICS
+static struct textrender_string stat_str = { 0 };
+static struct overlay_item stat_item = { 0 };
+#endif
+
+static void update_overlay_string(struct overlay* overlay, struct overlay_item* item, struct textrender_string* str,
+	const char* text, unsigned int x, unsigned int y) {
+
+	int changed = textrender_string_update(txtrndr, str, text, 16);
+	if(changed < 0) {
+		return;
+	}
+	if(!item->list.list) {
+		overlay_add(overlay, item);
+	}
+	overlay_item_update(overlay, item, x + str->x_offset, y + str->y_offset, str->width, str->height, str->pixels, changed);
+}
+#endif
+
+// Overlays are placed relative to the canvas, their pixels only reach the output frame
+void draw_overlays(struct overlay* overlay, struct fb* fb) {
+#ifdef FEATURE_STATISTICS
+	// Drawn first to stay below text
+	if(show_heatmap) {
+		heatmap_draw_overlay(heatmap, overlay);
+	}
 #endif
 #ifdef FEATURE_TTF
 	if(txtrndr) {
-		textrender_draw_string(txtrndr, fb, 100, fb->size.height / 20, description, 16);
+		update_overlay_string(overlay, &description_item, &description_str, description, 100, fb->size.height / 20);
 #ifdef FEATURE_STATISTICS
-		textrender_draw_string(txtrndr, fb, 100, fb->size.height - fb->size.height / 10, stat_line, 16);
+		update_overlay_string(overlay, &stat_item, &stat_str, stat_line, 100, fb->size.height - fb->size.height / 10);
 #endif
 	}
 #endif
@@ -172,21 +256,25 @@ void draw_overlays(struct fb* fb) {
 
 int main(int argc, char** argv) {
 	int err, opt;
-	struct fb* fb;
+	struct fb* fb, *frame;
+	struct overlay* overlay;
 	struct llist fb_list;
 	struct sockaddr_storage* inaddr;
-	struct addrinfo* addr_list;
+	struct sockaddr_storage unix_addr;
+	struct addrinfo* addr_list = NULL;
 	struct net* net;
 	struct llist fronts;
 	struct llist_entry* cursor, *next;
 	struct frontend* front;
+	struct frontend_thread* front_thread;
+	struct fb* front_fb;
+	bool threaded;
+	unsigned int frontend_rate;
 #ifdef FEATURE_SDL
 	struct sdl_param sdl_param;
+	struct resize_cb_priv resize_priv;
 #endif
 	size_t addr_len;
-#ifdef FEATURE_STATISTICS
-	char stat_line[MAX_STAT_LENGTH];
-#endif
 	unsigned int frontend_cnt = 0;
 	char* frontend_names[MAX_FRONTENDS];
 	bool handle_signals = true;
@@ -199,12 +287,30 @@ int main(int argc, char** argv) {
 	int screen_update_rate = RATE_DEFAULT;
 
 	int ringbuffer_size = RINGBUFFER_DEFAULT;
+
+	char* capture_directory = NULL;
+	size_t capture_limit = CAPTURE_LIMIT_DEFAULT;
+	struct capture* capture = NULL;
 	int listen_threads = LISTEN_THREADS_DEFAULT;
+	struct topology* topology = NULL;
+	int rebalance_interval = REBALANCE_INTERVAL_DEFAULT;
 
 	struct timespec before, after;
+	struct workqueue_completion coalesce_completion;
+#ifdef FEATURE_STATISTICS
+	struct timespec now, update_start, last_heatmap_update;
+	unsigned int latency_sample_interval = 0;
+	uint64_t latency_samples[MAX_LATENCY_SAMPLES];
+	unsigned int num_latency_samples;
+#endif
 	long long time_delta;
 
-	while((opt = getopt(argc, argv, "p:b:w:h:r:s:l:f:t:d:?")) != -1) {
+	workqueue_completion_init(&coalesce_completion);
+	if((err = topology_alloc(&topology))) {
+		fprintf(stderr, "Failed to read CPU topology: %d => %s\n", err, strerror(-err));
+		goto fail;
+	}
+	while((opt = getopt(argc, argv, "p:b:w:h:r:s:l:f:t:d:L:Hc:C:A:R:?")) != -1) {
 		switch(opt) {
 			case('p'):
 				port = optarg;
@@ -286,6 +392,53 @@ int main(int argc, char** argv) {
 					goto fail;
 				}
 				break;
+			case('L'):
+#ifdef FEATURE_STATISTICS
+				if(atoi(optarg) < 0) {
+					fprintf(stderr, "Latency sample interval must be >= 0\n");
+					err = -EINVAL;
+					goto fail;
+				}
+				latency_sample_interval = atoi(optarg);
+#else
+				fprintf(stderr, "Shoreline was compiled without statistics support!\n");
+				err = -EINVAL;
+				goto fail;
+#endif
+				break;
+			case('H'):
+#ifdef FEATURE_STATISTICS
+				show_heatmap = true;
+#else
+				fprintf(stderr, "Shoreline was compiled without statistics support!\n");
+				err = -EINVAL;
+				goto fail;
+#endif
+				break;
+			case('c'):
+				capture_directory = optarg;
+				break;
+			case('C'):
+				if(atoi(optarg) <= 0) {
+					fprintf(stderr, "Capture limit must be > 0\n");
+					err = -EINVAL;
+					goto fail;
+				}
+				capture_limit = (size_t)atoi(optarg) << 20;
+				break;
+			case('A'):
+				if((err = topology_configure(topology, optarg))) {
+					goto fail;
+				}
+				break;
+			case('R'):
+				rebalance_interval = atoi(optarg);
+				if(rebalance_interval < 0) {
+					fprintf(stderr, "Rebalance interval must be >= 0\n");
+					err = -EINVAL;
+					goto fail;
+				}
+				break;
 			default:
 				show_usage(argv[0]);
 				err = -EINVAL;
@@ -297,7 +450,15 @@ int main(int argc, char** argv) {
 		printf("WARNING: No frontends specified, continuing without any frontends\n");
 	}
 
-	if((err = workqueue_init())) {
+	if((err = topology_plan(topology))) {
+		fprintf(stderr, "Failed to plan thread placement: %d => %s\n", err, strerror(-err));
+		goto fail;
+	}
+	topology_print(topology);
+	// Memory of the canvas is first touched from the compositor CPUs
+	topology_pin_self(topology, TOPOLOGY_ROLE_COMPOSITOR);
+
+	if((err = workqueue_init(topology))) {
 		fprintf(stderr, "Failed to initialize workqueues: %d => %s\n", err, strerror(-err));
 		goto fail;
 	}
@@ -307,9 +468,30 @@ int main(int argc, char** argv) {
 		goto fail;
 	}
 
+	// Frontends get the canvas with overlays composited on top
+	if((err = fb_alloc(&frame, width, height))) {
+		fprintf(stderr, "Failed to allocate output framebuffer: %d => %s\n", err, strerror(-err));
+		goto fail_fb;
+	}
+
+	if((err = overlay_alloc(&overlay))) {
+		fprintf(stderr, "Failed to allocate overlay: %d => %s\n", err, strerror(-err));
+		goto fail_frame;
+	}
+
+#ifdef FEATURE_STATISTICS
+	if((err = heatmap_alloc(&heatmap, HEATMAP_HALF_LIFE_MS_DEFAULT))) {
+		fprintf(stderr, "Failed to allocate heatmap: %d => %s\n", err, strerror(-err));
+		goto fail_overlay;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &last_heatmap_update);
+#endif
+
 	llist_init(&fb_list);
 #ifdef FEATURE_SDL
-	sdl_param.cb_private = &fb_list;
+	resize_priv.fb_list = &fb_list;
+	resize_priv.canvas = fb;
+	sdl_param.cb_private = &resize_priv;
 	sdl_param.resize_cb = resize_cb;
 #endif
 	llist_init(&fronts);
@@ -323,15 +505,40 @@ int main(int argc, char** argv) {
 			goto fail_fronts_free_name;
 		}
 		handle_signals = handle_signals && !frontdef->handles_signals;
+		// Threads created by the frontend inherit the affinity of the main thread
+		topology_pin_self(topology, strcmp(frontid, "statistics") ? TOPOLOGY_ROLE_FRONTEND : TOPOLOGY_ROLE_STATISTICS);
+		if((err = frontend_spec_extract_thread(options, &threaded, &frontend_rate))) {
+			fprintf(stderr, "Invalid threading options for frontend '%s'\n", frontdef->name);
+			goto fail_fronts_free_name;
+		}
+		front_thread = NULL;
+		front_fb = frame;
+		if(threaded) {
+			if(!frontdef->threadable) {
+				fprintf(stderr, "Frontend '%s' can not run on its own thread\n", frontdef->name);
+				err = -EINVAL;
+				goto fail_fronts_free_name;
+			}
+			if((err = frontend_thread_alloc(&front_thread, frame, frontend_rate))) {
+				fprintf(stderr, "Failed to allocate output thread for frontend '%s'\n", frontdef->name);
+				goto fail_fronts_free_name;
+			}
+			front_fb = front_thread->frame;
+		}
 #ifdef FEATURE_SDL
-		if((err = frontend_alloc(frontdef, &front, fb, &sdl_param))) {
+		if((err = frontend_alloc(frontdef, &front, front_fb, &sdl_param))) {
 #else
-		if((err = frontend_alloc(frontdef, &front, fb, NULL))) {
+		if((err = frontend_alloc(frontdef, &front, front_fb, NULL))) {
 #endif
 			fprintf(stderr, "Failed to allocate frontend '%s'\n", frontdef->name);
+			if(front_thread) {
+				frontend_thread_free(front_thread);
+			}
 			goto fail_fronts_free_name;
 		}
 		front->def = frontdef;
+		// Output thread is torn down along with the frontend from here on
+		front->thread = front_thread;
 		llist_append(&fronts, &front->list);
 
 		if(frontend_can_configure(front) && options) {
@@ -348,13 +555,35 @@ int main(int argc, char** argv) {
 			}
 		}
 
+		if(front_thread) {
+			if((err = frontend_thread_start(front, front_thread))) {
+				fprintf(stderr, "Failed to start output thread for frontend '%s'\n", frontdef->name);
+				goto fail_fronts_free_name;
+			}
+		}
+		topology_pin_self(topology, TOPOLOGY_ROLE_COMPOSITOR);
+
 		free(frontid);
 	}
 
+	if(capture_directory) {
+		if((err = capture_alloc(&capture, capture_directory, capture_limit, ringbuffer_size, width, height))) {
+			fprintf(stderr, "Failed to set up traffic capture: %d => %s\n", err, strerror(-err));
+			goto fail_fronts;
+		}
+		printf("Capturing traffic to %s\n", capture_directory);
+	}
+
 	if((err = net_alloc(&net, fb, &fb_list, &fb->size, ringbuffer_size))) {
 		fprintf(stderr, "Failed to initialize network: %d => %s\n", err, strerror(-err));
-		goto fail_fronts;
+		goto fail_capture;
 	}
+	net->capture = capture;
+	net->topology = topology;
+	net->rebalance_interval_ms = rebalance_interval;
+#ifdef FEATURE_STATISTICS
+	net->latency_sample_interval = latency_sample_interval;
+#endif
 	if(handle_signals) {
 		if(signal(SIGINT, doshutdown)) {
 			fprintf(stderr, "Failed to bind signal\n");
@@ -368,13 +597,29 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if((err = -getaddrinfo(listen_address, port, NULL, &addr_list))) {
-		fprintf(stderr, "Failed to resolve listen address '%s', %d => %s\n", listen_address, err, gai_strerror(-err));
-		goto fail_net;
-	}
+	if(!strncmp(listen_address, LISTEN_UNIX_PREFIX, strlen(LISTEN_UNIX_PREFIX))) {
+		struct sockaddr_un* addr_un = (struct sockaddr_un*)&unix_addr;
+		const char* path = listen_address + strlen(LISTEN_UNIX_PREFIX);
 
-	inaddr = (struct sockaddr_storage*)addr_list->ai_addr;
-	addr_len = addr_list->ai_addrlen;
+		if(!*path || strlen(path) >= sizeof(addr_un->sun_path)) {
+			fprintf(stderr, "Invalid unix socket path '%s'\n", path);
+			err = -EINVAL;
+			goto fail_net;
+		}
+		memset(&unix_addr, 0, sizeof(unix_addr));
+		addr_un->sun_family = AF_UNIX;
+		strcpy(addr_un->sun_path, path);
+		inaddr = &unix_addr;
+		addr_len = sizeof(struct sockaddr_un);
+	} else {
+		if((err = -getaddrinfo(listen_address, port, NULL, &addr_list))) {
+			fprintf(stderr, "Failed to resolve listen address '%s', %d => %s\n", listen_address, err, gai_strerror(-err));
+			goto fail_net;
+		}
+
+		inaddr = (struct sockaddr_storage*)addr_list->ai_addr;
+		addr_len = addr_list->ai_addrlen;
+	}
 
 	if((err = net_listen(net, listen_threads, inaddr, addr_len))) {
 		fprintf(stderr, "Failed to start listening: %d => %s\n", err, strerror(-err));
@@ -385,10 +630,31 @@ int main(int argc, char** argv) {
 	while(!do_exit) {
 		clock_gettime(CLOCK_MONOTONIC, &before);
 		llist_lock(&fb_list);
-		fb_coalesce(fb, &fb_list);
+#ifdef FEATURE_STATISTICS
+		num_latency_samples = statistics_latency_take(&fb_list, latency_samples, ARRAY_LEN(latency_samples));
+		if((err = heatmap_resize(heatmap, &fb->size))) {
+			llist_unlock(&fb_list);
+			fprintf(stderr, "Failed to resize heatmap, %d => %s, bailing out\n", err, strerror(-err));
+			doshutdown(SIGINT);
+			break;
+		}
+		TRACE(coalesce_start);
+		coalesce_parallel(fb, &fb_list, heatmap->writes, &coalesce_completion);
+		TRACE(coalesce_end);
+#else
+		TRACE(coalesce_start);
+		coalesce_parallel(fb, &fb_list, NULL, &coalesce_completion);
+		TRACE(coalesce_end);
+#endif
 		llist_unlock(&fb_list);
+		net_coalesce_done(net);
 #ifdef FEATURE_STATISTICS
-		statistics_update(&stats, net);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		histogram_record(&stats.coalesce_duration, get_timespec_diff(&now, &before));
+		heatmap_update(heatmap, get_timespec_diff(&now, &last_heatmap_update));
+		last_heatmap_update = now;
+		statistics_latency_record(&stats.latency_coalesce, latency_samples, num_latency_samples);
+		statistics_update(&stats, net, &fronts);
 		snprintf(stat_line, sizeof(stat_line), "Traffic: %.3f %sB / %.3f %sPixels "
 "Throughput: %.3f %sb/s / %.3f %sPixels/s FPS: %d frames/s %llu connections",
 			statistics_traffic_get_scaled(&stats), statistics_traffic_get_unit(&stats),
@@ -397,15 +663,12 @@ int main(int argc, char** argv) {
 			statistics_pps_get_scaled(&stats), statistics_pps_get_unit(&stats),
 			statistics_get_frames_per_second(&stats), stats.num_connections);
 #endif
-		draw_overlays(fb);
-#ifdef FEATURE_TTF
-		if(txtrndr) {
-			textrender_draw_string(txtrndr, fb, 100, fb->size.height / 20, description, 16);
-#ifdef FEATURE_STATISTICS
-			textrender_draw_string(txtrndr, fb, 100, fb->size.height - fb->size.height / 10, stat_line, 16);
-#endif
+		draw_overlays(overlay, fb);
+		if((err = overlay_compose(overlay, frame, fb))) {
+			fprintf(stderr, "Failed to compose output frame, %d => %s, bailing out\n", err, strerror(-err));
+			doshutdown(SIGINT);
+			break;
 		}
-#endif
 		llist_for_each(&fronts, cursor) {
 			front = llist_entry_get_value(cursor, struct frontend, list);
 #ifdef FEATURE_TTF
@@ -420,13 +683,30 @@ int main(int argc, char** argv) {
 #ifdef FEATURE_TTF
 			}
 #endif
-			if((err = frontend_update(front))) {
+			if(front->thread) {
+				err = frontend_thread_publish(front->thread, frame);
+			} else {
+#ifdef FEATURE_STATISTICS
+				clock_gettime(CLOCK_MONOTONIC, &update_start);
+#endif
+				TRACE1(frontend_update_start, front->def->name);
+				err = frontend_update(front);
+				TRACE2(frontend_update_end, front->def->name, err);
+#ifdef FEATURE_STATISTICS
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				histogram_record(&front->update_duration, get_timespec_diff(&now, &update_start));
+#endif
+			}
+			if(err) {
 				fprintf(stderr, "Failed to update frontend '%s', %d => %s, bailing out\n", front->def->name, err, strerror(-err));
 				doshutdown(SIGINT);
 				break;
 			}
 		}
+		fb_clear_dirty(fb);
+		fb_clear_dirty(frame);
 #ifdef FEATURE_STATISTICS
+		statistics_latency_record(&stats.latency_publish, latency_samples, num_latency_samples);
 		stats.num_frames++;
 #endif
 		clock_gettime(CLOCK_MONOTONIC, &after);
@@ -440,16 +720,36 @@ int main(int argc, char** argv) {
 
 	fb_free_all(&fb_list);
 fail_addrinfo:
-	freeaddrinfo(addr_list);
+	if(addr_list) {
+		freeaddrinfo(addr_list);
+	}
 fail_net:
 	net_free(net);
+fail_capture:
+	if(capture) {
+		capture_free(capture);
+	}
 fail_fronts:
 	llist_for_each_safe(&fronts, cursor, next) {
 		front = llist_entry_get_value(cursor, struct frontend, list);
 		printf("Shutting down frontend '%s'\n", front->def->name);
+		front_thread = front->thread;
+		if(front_thread) {
+			frontend_thread_stop(front_thread);
+		}
 		frontend_free(front);
+		if(front_thread) {
+			frontend_thread_free(front_thread);
+		}
 	}
-//fail_fb:
+#ifdef FEATURE_STATISTICS
+	heatmap_free(heatmap);
+fail_overlay:
+#endif
+	overlay_free(overlay);
+fail_frame:
+	fb_free(frame);
+fail_fb:
 	fb_free(fb);
 fail:
 	while(frontend_cnt > 0 && frontend_cnt--) {
@@ -457,13 +757,19 @@ fail:
 	}
 #ifdef FEATURE_TTF
 	if(txtrndr) {
+		textrender_string_free(&description_str);
+#ifdef FEATURE_STATISTICS
+		textrender_string_free(&stat_str);
+#endif
 		textrender_free(txtrndr);
 	}
 #endif
 	if(description && description != default_description) {
 		free(description);
 	}
+	workqueue_completion_destroy(&coalesce_completion);
 	workqueue_deinit();
+	topology_free(topology);
 	return err;
 
 fail_fronts_free_name:
@@ -2,9 +2,11 @@
 #define _MAIN_H_
 
 #include "framebuffer.h"
+#include "overlay.h"
 
 extern struct statistics stats;
+extern struct heatmap* heatmap;
 
-void draw_overlays(struct fb* fb);
+void draw_overlays(struct overlay* overlay, struct fb* fb);
 
 #endif
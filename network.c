@@ -15,17 +15,26 @@
 #include <netdb.h>
 #include <sched.h>
 #include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "network.h"
+#include "parser.h"
 #include "ring.h"
 #include "framebuffer.h"
 #include "llist.h"
+#include "trace.h"
 #include "util.h"
 
 #define CONNECTION_QUEUE_SIZE 16
 #define THREAD_NAME_MAX 16
-#define SCRATCH_STR_MAX 32
-#define WHITESPACE_SEARCH_GARBAGE_THRESHOLD 32
+
+// Connections moved per rebalancer run at most
+#define NET_REBALANCE_MOVES_MAX 4
+// Imbalance between two CPUs in bytes per second below which nothing is moved
+#define NET_REBALANCE_MIN_RATE 10000000ULL
+// Poll interval while a migrating connection waits for coalescing
+#define NET_MIGRATE_POLL_US 1000
 
 #if DEBUG > 1
 #define debug_printf(...) printf(__VA_ARGS__)
@@ -47,16 +56,32 @@
  *
  * The newly created thread then sets up a ring buffer to avoid
  * memmoves while parsing and starts reading data to it.
- * After receiving any number of bytes the thread tries to read
- * a valid command verb from the current read position in the
- * ring buffer. If that fails the thread tries to skip to the
- * next whitespace-separated token and tries to parse it as a
- * command verb. One a valid command verb is detected the
- * parser tries to fetch all arguments required to form a
- * complete command.
- * If there are any required parts missing from a command the
- * parser will assume that it has simply not been received yet
- * and go back to reading from the socket.
+ * After receiving any number of bytes the thread hands the ring
+ * to parser_parse, see parser.c. The parser consumes all
+ * complete commands and leaves incomplete ones in the ring for
+ * the next read.
+ *
+ * With latency sampling enabled every nth read of a connection
+ * is timestamped and passed to the parser.
+ * Unsampled reads only pay for a counter decrement.
+ *
+ * Every connection thread is pinned to a single CPU, see
+ * topology.c. A few greedy clients can overload some of those
+ * CPUs while others idle, so the rebalancer thread samples the
+ * bytes read by every connection periodically. It sums them up
+ * per CPU and moves the connection that best evens out the
+ * busiest CPU and the least loaded CPU of the same NUMA node,
+ * or of any node if nothing on the own node helps. It only asks
+ * the connection to move by setting migrate_cpu.
+ *
+ * The connection thread picks the request up after parsing, so
+ * socket, ring and parser state simply move along with it and
+ * nothing buffered is lost or reordered. When the new CPU is on
+ * another NUMA node the thread switches to the framebuffer of
+ * that node. Framebuffers are coalesced in random order, so it
+ * first waits until a complete coalescing pass has picked up all
+ * pixels it wrote to the old one. Meanwhile incoming data queues
+ * up in the socket.
  */
 static int one = 1;
 
@@ -96,6 +121,12 @@ static void net_kill_threads(struct net* net) {
 	int i = net->num_threads;
 	struct net_thread* thread;
 	net->state = NET_STATE_SHUTDOWN;
+	// Looks at connections, must be gone before their listeners
+	if(net->rebalancing) {
+		pthread_cancel(net->rebalance_thread);
+		pthread_join(net->rebalance_thread, NULL);
+		net->rebalancing = false;
+	}
 	while(i-- > 0) {
 		thread = &net->threads[i];
 		pthread_cancel(thread->thread);
@@ -103,147 +134,152 @@ static void net_kill_threads(struct net* net) {
 	}
 }
 
+// Remove the unix socket bound by net_listen, if any
+static void net_unlink_socket(struct net* net) {
+	if(net->unix_path[0]) {
+		unlink(net->unix_path);
+		net->unix_path[0] = '\0';
+	}
+}
+
 void net_shutdown(struct net* net) {
 	net_kill_threads(net);
 	shutdown(net->socket, SHUT_RDWR);
 	close(net->socket);
+	net_unlink_socket(net);
 	net->state = NET_STATE_EXIT;
 }
 
-static inline int net_is_newline(char c) {
-	return c == '\r' || c == '\n';
-}
-
-static inline int net_is_whitespace(char c) {
-	switch(c) {
-		case ' ':
-		case '\n':
-		case '\r':
-		case '\t':
-			return 1;
-	}
-	return 0;
-}
+// Write a parser response to the client
+static int net_parser_respond(struct parser* parser, const char* buf, size_t len) {
+	size_t write_cnt = 0;
 
-static int net_skip_whitespace(struct ring* ring) {
-	int cnt = 0;
-	char c;
-	while(ring_any_available(ring)) {
-		c = ring_peek_one(ring);
-		if(!net_is_whitespace(c)) {
-			goto done;
+	while(write_cnt < len) {
+		ssize_t write_len;
+		if((write_len = write(parser->socket, buf + write_cnt, len - write_cnt)) < 0) {
+			return -errno;
 		}
-		ring_inc_read(ring);
-		cnt++;
+		write_cnt += write_len;
 	}
-done:
-	return cnt ? cnt : -1;
+	return len;
 }
 
-static off_t net_next_whitespace(struct ring* ring) {
-	off_t offset = 0;
-	char c, *read_before = ring->ptr_read;
-	int err;
-	while(ring_any_available(ring)) {
-		c = ring_read_one(ring);
-		if(net_is_whitespace(c)) {
-			goto done;
-		}
-		if(offset++ >= WHITESPACE_SEARCH_GARBAGE_THRESHOLD) {
-			err = -EINVAL;
-			goto fail;
-		}
-	}
-	err = -1; // No next whitespace found
-	goto fail;
-
-done:
-	ring->ptr_read = read_before;
-	return offset;
-fail:
-	ring->ptr_read = read_before;
-	return err;
+static void net_connection_thread_cleanup_ring(void* args) {
+	struct net_connection_thread* thread = args;
+	ring_free(thread->ring);
 }
 
-static uint32_t net_str_to_uint32_10(struct ring* ring, ssize_t len) {
-	uint32_t val = 0;
-	int radix;
-	char c;
-	for(radix = 0; radix < len; radix++) {
-		c = ring_read_one(ring);
-		val = val * 10 + (c - '0');
+static void net_connection_thread_cleanup_capture(void* args) {
+	struct net_connection_thread* thread = args;
+	if(thread->capture) {
+		capture_conn_close(thread->capture);
 	}
-	return val;
 }
 
-// Separate implementation to keep performance high
-static uint32_t net_str_to_uint32_16(struct ring* ring, ssize_t len) {
-	uint32_t val = 0;
-	char c;
-	int radix, lower;
-	for(radix = 0; radix < len; radix++) {
-		// Could be replaced by a left shift
-		val *= 16;
-		c = ring_read_one(ring);
-		lower = c | 0x20;
-		if(lower >= 'a') {
-			val += lower - 'a' + 10;
-		} else {
-			val += lower - '0';
-		}
-	}
-	return val;
+static void net_connection_thread_cleanup_socket(void* args) {
+	struct net_connection_thread* thread = args;
+	TRACE1(net_close, thread->threadargs.socket);
+	shutdown(thread->threadargs.socket, SHUT_RDWR);
+	close(thread->threadargs.socket);
 }
 
-static ssize_t net_sock_printf(int socket, char* scratch_str, size_t scratch_len, char* fmt, ...) {
-	ssize_t ret;
-	size_t len;
-	off_t write_cnt = 0;
+static void net_connection_thread_cleanup_self(void* args) {
+	struct net_connection_thread* thread = args;
+	struct net_thread* net_thread = thread->threadargs.net_thread;
+	struct llist* threadlist = net_thread->threadlist;
 
-	va_list vargs;
-	va_start(vargs, fmt);
-	ret = vsnprintf(scratch_str, scratch_len, fmt, vargs);
-	va_end(vargs);
+	pthread_mutex_lock(&net_thread->list_lock);
+	llist_lock(threadlist);
+	// Fold counters into the listener thread atomically with leaving the list, statistics_update must see exactly one of both
+	net_thread->retired.bytes += thread->counters.bytes;
+	net_thread->retired.commands += thread->counters.commands;
+	net_thread->retired.parse_errors += thread->counters.parse_errors;
+	net_thread->retired.pixels += thread->counters.pixels;
+	net_thread->retired.pixels_oob += thread->counters.pixels_oob;
+	llist_remove_locked(&thread->list);
+	llist_unlock(threadlist);
+	pthread_mutex_unlock(&net_thread->list_lock);
+	topology_connection_release(thread->threadargs.net->topology, thread->cpu);
+	free(thread);
+}
 
-	if(ret >= scratch_len) {
-		ret = -ENOBUFS;
+/*
+ * CPU and NAPI instance (RX queue) the connection was received on. The kernel
+ * records them on every packet processed, for a freshly accepted socket they
+ * stem from the handshake. Not available on unix sockets and old kernels.
+ */
+static void net_connection_incoming(struct net_connection_thread* thread, int* cpu) {
+	int socket = thread->threadargs.socket;
+	socklen_t len = sizeof(*cpu);
+
+	*cpu = -1;
+	thread->napi_id = 0;
+#ifdef SO_INCOMING_CPU
+	if(getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, cpu, &len)) {
+		*cpu = -1;
 	}
-
-	if(ret < 0) {
-		goto out;
+#endif
+#ifdef SO_INCOMING_NAPI_ID
+	len = sizeof(thread->napi_id);
+	if(getsockopt(socket, SOL_SOCKET, SO_INCOMING_NAPI_ID, &thread->napi_id, &len)) {
+		thread->napi_id = 0;
 	}
+#endif
+	TRACE3(net_incoming, socket, *cpu, thread->napi_id);
+}
 
-	len = ret;
+// Framebuffer of a NUMA node, allocated on the calling thread's node if there is none yet
+static int net_get_fb_on_node(struct net* net, unsigned numa_node, struct fb** ret) {
+	int err = 0;
+	struct fb* fb;
 
-	while(write_cnt < len) {
-		ssize_t write_len;
-		if((write_len = write(socket, scratch_str + write_cnt, len - write_cnt)) < 0) {
-			ret = -errno;
-			goto out;
+	pthread_mutex_lock(&net->fb_lock);
+	fb = fb_get_fb_on_node(net->fb_list, numa_node);
+	if(!fb) {
+		printf("Failed to find fb on NUMA node %u, creating new fb\n", numa_node);
+		if((err = fb_alloc(&fb, net->fb_size->width, net->fb_size->height))) {
+			fprintf(stderr, "Failed to allocate fb on node\n");
+			goto fail;
 		}
-		write_cnt += write_len;
+		printf("Allocated fb on NUMA node %u\n", fb->numa_node);
+		llist_append(net->fb_list, &fb->list);
 	}
-out:
-	return ret;
+	*ret = fb;
+fail:
+	pthread_mutex_unlock(&net->fb_lock);
+	return err;
 }
 
-static void net_connection_thread_cleanup_ring(void* args) {
-	struct net_connection_thread* thread = args;
-	ring_free(thread->ring);
-}
+// Move the calling connection thread to the CPU requested by the rebalancer
+static void net_connection_migrate(struct net* net, struct net_connection_thread* thread, struct parser* parser) {
+	int cpu = __atomic_load_n(&thread->migrate_cpu, __ATOMIC_RELAXED);
+	int from = thread->cpu;
+	unsigned numa_node = topology_cpu_node(net->topology, cpu);
+	uint64_t generation;
+	struct fb* fb;
 
-static void net_connection_thread_cleanup_socket(void* args) {
-	struct net_connection_thread* thread = args;
-	shutdown(thread->threadargs.socket, SHUT_RDWR);
-	close(thread->threadargs.socket);
-}
+	if(topology_pin_cpu(cpu)) {
+		goto out;
+	}
+	topology_connection_move(net->topology, from, cpu);
+	__atomic_store_n(&thread->cpu, cpu, __ATOMIC_RELAXED);
+	TRACE3(net_migrate, parser->socket, from, cpu);
 
-static void net_connection_thread_cleanup_self(void* args) {
-	struct net_connection_thread* thread = args;
-	pthread_mutex_lock(&thread->threadargs.net_thread->list_lock);
-	llist_remove(&thread->list);
-	pthread_mutex_unlock(&thread->threadargs.net_thread->list_lock);
-	free(thread);
+	// Keep drawing to the old framebuffer if there is none on the new node
+	if(numa_node == parser->fb->numa_node || net_get_fb_on_node(net, numa_node, &fb)) {
+		goto out;
+	}
+	// A pass starting after this load picks up everything written so far, it is done two increments later
+	generation = __atomic_load_n(&net->coalesce_generation, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&net->coalesce_generation, __ATOMIC_SEQ_CST) < generation + 2 &&
+	      net->state != NET_STATE_SHUTDOWN) {
+		usleep(NET_MIGRATE_POLL_US);
+	}
+	parser->fb = fb;
+	__atomic_store_n(&thread->numa_node, fb->numa_node, __ATOMIC_RELAXED);
+
+out:
+	__atomic_store_n(&thread->migrate_cpu, -1, __ATOMIC_RELAXED);
 }
 
 static void* net_connection_thread(void* args) {
@@ -253,15 +289,15 @@ static void* net_connection_thread(void* args) {
 	struct net_connection_thread* thread =
 		container_of(threadargs, struct net_connection_thread, threadargs);
 
-	unsigned numa_node = get_numa_node();
+	int incoming_cpu;
 	struct fb* fb;
-	struct fb_size* fbsize;
-	union fb_pixel pixel;
-	unsigned int x, y;
+	struct parser parser = {
+		.fb_read = net->fb,
+		.respond = net_parser_respond,
+		.socket = socket,
+	};
 
-	off_t offset;
 	ssize_t read_len;
-	char* last_cmd;
 
 	/*
 		A small ring buffer (64kB * 64k connections = ~4GB at max) to prevent memmoves.
@@ -271,36 +307,27 @@ static void* net_connection_thread(void* args) {
 	*/
 	struct ring* ring;
 
-	char scratch_str[SCRATCH_STR_MAX];
+#ifdef FEATURE_STATISTICS
+	unsigned int sample_countdown = net->latency_sample_interval;
 
-#ifndef FEATURE_BROKEN_PTHREAD
-	cpu_set_t nodemask;
-	int cpuid = sched_getcpu();
-	if(cpuid < 0) {
-		fprintf(stderr, "Failed to get cpuid of network thread, continuing without affinity setting\n");
-	} else {
-		CPU_ZERO(&nodemask);
-		CPU_SET(cpuid, &nodemask);
-		if((err = pthread_setaffinity_np(pthread_self(), sizeof(nodemask), &nodemask))) {
-			fprintf(stderr, "Failed to set cpu affinity, continuing without affinity setting: %s (%d)\n", strerror(err), err);
-		}
-	}
+	parser.counters = &thread->counters;
+	parser.latency_write = &net->latency_write;
 #endif
 
-	pthread_mutex_lock(&net->fb_lock);
-	fb = fb_get_fb_on_node(net->fb_list, numa_node);
-	if(!fb) {
-		printf("Failed to find fb on NUMA node %u, creating new fb\n", numa_node);
-		if(fb_alloc(&fb, net->fb_size->width, net->fb_size->height)) {
-			fprintf(stderr, "Failed to allocate fb on node\n");
-			goto fail;
-		}
-		printf("Allocated fb on NUMA node %u\n", fb->numa_node);
-		llist_append(net->fb_list, &fb->list);
+	// Follow the CPU receiving the connection, the framebuffer is picked by its node
+	net_connection_incoming(thread, &incoming_cpu);
+	__atomic_store_n(&thread->cpu, topology_connection_place(net->topology, incoming_cpu), __ATOMIC_RELAXED);
+	TRACE3(net_place, socket, incoming_cpu, thread->cpu);
+	if(thread->cpu >= 0) {
+		topology_pin_cpu(thread->cpu);
 	}
-	pthread_mutex_unlock(&net->fb_lock);
 
-	fbsize = fb_get_size(fb);
+	if(net_get_fb_on_node(net, get_numa_node(), &fb)) {
+		topology_connection_release(net->topology, thread->cpu);
+		goto fail;
+	}
+	__atomic_store_n(&thread->numa_node, fb->numa_node, __ATOMIC_RELAXED);
+	parser.fb = fb;
 
 	pthread_cleanup_push(net_connection_thread_cleanup_self, thread);
 	pthread_cleanup_push(net_connection_thread_cleanup_socket, thread);
@@ -313,7 +340,13 @@ static void* net_connection_thread(void* args) {
 	thread->ring = ring;
 
 	pthread_cleanup_push(net_connection_thread_cleanup_ring, thread);
-recv:
+
+	// Capture failures are not fatal, the connection is simply not captured
+	if(net->capture) {
+		capture_conn_open(net->capture, &thread->capture);
+	}
+	pthread_cleanup_push(net_connection_thread_cleanup_capture, thread);
+
 	while(net->state != NET_STATE_SHUTDOWN) {
 		read_len = read(socket, ring->ptr_write, ring_free_space_contig(ring));
 		if(read_len <= 0) {
@@ -323,130 +356,33 @@ recv:
 			}
 			goto fail_ring;
 		}
+		// Counted without statistics as well, the rebalancer needs them
+		net_counter_add(&thread->counters.bytes, read_len);
 #ifdef FEATURE_STATISTICS
-		thread->byte_count += read_len;
+		__atomic_store_n(&thread->counters.ring_used, ring_available(ring) + read_len, __ATOMIC_RELAXED);
+		if(unlikely(sample_countdown) && !--sample_countdown) {
+			sample_countdown = net->latency_sample_interval;
+			parser.sample_read_ns = get_monotonic_ns();
+		}
 #endif
 		debug_printf("Read %zd bytes\n", read_len);
+		TRACE2(net_read, socket, read_len);
+		if(thread->capture) {
+			capture_conn_record(thread->capture, ring->ptr_write, read_len);
+		}
 		ring_advance_write(ring, read_len);
 
-		while(ring_any_available(ring)) {
-			last_cmd = ring->ptr_read;
-
-			if(!ring_memcmp(ring, "PX", strlen("PX"), NULL)) {
-				if((err = net_skip_whitespace(ring)) < 0) {
-					debug_fprintf(stderr, "No whitespace after PX cmd\n");
-					goto recv_more;
-				}
-				if((offset = net_next_whitespace(ring)) < 0) {
-					debug_fprintf(stderr, "No more whitespace found, missing X\n");
-					goto recv_more;
-				}
-				x = net_str_to_uint32_10(ring, offset);
-				if((err = net_skip_whitespace(ring)) < 0) {
-					debug_fprintf(stderr, "No whitespace after X coordinate\n");
-					goto recv_more;
-				}
-				if((offset = net_next_whitespace(ring)) < 0) {
-					debug_fprintf(stderr, "No more whitespace found, missing Y\n");
-					goto recv_more;
-				}
-				y = net_str_to_uint32_10(ring, offset);
-				if((err = net_skip_whitespace(ring)) < 0) {
-					debug_fprintf(stderr, "No whitespace after Y coordinate\n");
-					goto recv_more;
-				}
-				x += thread->offset.x;
-				y += thread->offset.y;
-				if(unlikely(net_is_newline(ring_peek_prev(ring)))) {
-					// Get pixel
-					if(x < fbsize->width && y < fbsize->height) {
-						if((err = net_sock_printf(socket, scratch_str, sizeof(scratch_str), "PX %u %u %06x\n",
-							x, y, fb_get_pixel(net->fb, x, y).abgr >> 8)) < 0) {
-							fprintf(stderr, "Failed to write out pixel value: %d => %s\n", err, strerror(-err));
-							goto fail_ring;
-						}
-					}
-				} else {
-					// Set pixel
-					if((offset = net_next_whitespace(ring)) < 0) {
-						debug_fprintf(stderr, "No more whitespace found, missing color\n");
-						goto recv_more;
-					}
-					if(offset > 6) {
-						pixel.abgr = net_str_to_uint32_16(ring, offset);
-					} else {
-						pixel.abgr = net_str_to_uint32_16(ring, offset) << 8;
-						pixel.color.alpha = 0xFF;
-					}
-
-					debug_printf("Got pixel command: PX %u %u %02x%02x%02x%02x\n", x, y,
-					             pixel.color.color_bgr.red, pixel.color.color_bgr.green,
-					             pixel.color.color_bgr.blue, pixel.color.alpha);
-					if(x < fbsize->width && y < fbsize->height) {
-#ifdef FEATURE_STATISTICS
-#ifdef FEATURE_PIXEL_COUNT
-						fb->pixel_count++;
-#endif
-#endif
-#ifdef FEATURE_ALPHA_BLENDING
-						if (pixel.color.alpha != 0xFF) {
-							union fb_pixel old_pixel = fb_get_pixel(fb, x, y);
-							FB_ALPHA_BLEND_PIXEL(pixel, pixel, old_pixel);
-						}
-#endif
-						fb_set_pixel(fb, x, y, &pixel);
-					} else {
-						debug_printf("Got pixel outside screen area: %u, %u outside %u, %u\n", x, y, fbsize->width, fbsize->height);
-					}
-				}
-			}
-#ifdef FEATURE_SIZE
-			else if(!ring_memcmp(ring, "SIZE", strlen("SIZE"), NULL)) {
-				if((err = net_sock_printf(socket, scratch_str, sizeof(scratch_str), "SIZE %u %u\n", fbsize->width, fbsize->height)) < 0) {
-					fprintf(stderr, "Failed to write out size: %d => %s\n", err, strerror(-err));
-					goto fail_ring;
-				}
-			}
-#endif
-#ifdef FEATURE_OFFSET
-			else if(!ring_memcmp(ring, "OFFSET", strlen("OFFSET"), NULL)) {
-				if((err = net_skip_whitespace(ring)) < 0) {
-					goto recv_more;
-				}
-				if((offset = net_next_whitespace(ring)) < 0) {
-					goto recv_more;
-				}
-				x = net_str_to_uint32_10(ring, offset);
-				if((err = net_skip_whitespace(ring)) < 0) {
-					goto recv_more;
-				}
-				if((offset = net_next_whitespace(ring)) < 0) {
-					goto recv_more;
-				}
-				y = net_str_to_uint32_10(ring, offset);
-				thread->offset.x = x;
-				thread->offset.y = y;
-			}
-#endif
-			else {
-				if((offset = net_next_whitespace(ring)) >= 0) {
-					debug_printf("Encountered unknown command\n");
-					ring_advance_read(ring, offset);
-				} else {
-					if(offset == -EINVAL) {
-						// We have a missbehaving client
-						goto fail_ring;
-					}
-					goto recv;
-				}
-			}
-
-			net_skip_whitespace(ring);
+		if((err = parser_parse(&parser, ring)) < 0) {
+			goto fail_ring;
+		}
+		if(unlikely(__atomic_load_n(&thread->migrate_cpu, __ATOMIC_RELAXED) >= 0)) {
+			net_connection_migrate(net, thread, &parser);
 		}
 	}
 
 fail_ring:
 	pthread_cleanup_pop(true);
+	pthread_cleanup_pop(true);
 fail_socket:
 	pthread_cleanup_pop(true);
 	pthread_cleanup_pop(true);
@@ -454,9 +390,6 @@ fail:
 	pthread_detach(pthread_self());
 	return NULL;
 
-recv_more:
-	ring->ptr_read = last_cmd;
-	goto recv;
 }
 
 static void net_listen_thread_cleanup_threadlist(void* args) {
@@ -486,6 +419,8 @@ static void* net_listen_thread(void* args) {
 	struct llist* threadlist;
 	struct net_connection_thread* conn_thread;
 	pthread_mutex_init(&thread->list_lock, NULL);
+	// Connection threads start with this affinity until they are placed
+	topology_pin_self(net->topology, TOPOLOGY_ROLE_LISTEN);
 
 	if((err = llist_alloc(&threadlist))) {
 		fprintf(stderr, "Failed to allocate thread list\n");
@@ -504,16 +439,25 @@ static void* net_listen_thread(void* args) {
 			goto fail_threadlist;
 		}
 		printf("Got a new connection\n");
+		TRACE1(net_accept, socket);
+#ifdef FEATURE_STATISTICS
+		__atomic_add_fetch(&thread->accept_count, 1, __ATOMIC_RELAXED);
+#endif
 
-		conn_thread = calloc(1, sizeof(struct net_connection_thread));
+		// Keep counters on a cache line of their own
+		conn_thread = aligned_alloc(NET_CACHELINE_SIZE, sizeof(struct net_connection_thread));
 		if(!conn_thread) {
 			fprintf(stderr, "Failed to allocate memory for connection thread\n");
 			goto fail_connection;
 		}
+		memset(conn_thread, 0, sizeof(struct net_connection_thread));
 		llist_entry_init(&conn_thread->list);
 		conn_thread->threadargs.socket = socket;
 		conn_thread->threadargs.net = net;
 		conn_thread->threadargs.net_thread = thread;
+		conn_thread->numa_node = -1;
+		conn_thread->cpu = -1;
+		conn_thread->migrate_cpu = -1;
 
 		pthread_mutex_lock(&thread->list_lock);
 		if((err = -pthread_create(&conn_thread->thread, NULL, net_connection_thread, &conn_thread->threadargs))) {
@@ -540,9 +484,209 @@ fail:
 
 }
 
+struct net_rebalance_conn {
+	struct net_connection_thread* thread;
+	int cpu;
+	uint64_t bytes;
+	bool movable;
+};
+
+struct net_rebalance {
+	uint64_t load[CPU_SETSIZE];
+	unsigned int connections[CPU_SETSIZE];
+	struct net_rebalance_conn* conns;
+	size_t num_conns;
+	size_t max_conns;
+	// Connection lists locked by the current run, listeners may still be starting
+	bool* locked;
+};
+
+// Sample bytes read since the previous run, called with all connection lists locked
+static int net_rebalance_sample(struct net* net, struct net_rebalance* rebalance) {
+	unsigned int i;
+	struct llist_entry* cursor;
+	struct net_connection_thread* conn_thread;
+	struct net_rebalance_conn* conn;
+	uint64_t bytes;
+
+	memset(rebalance->load, 0, sizeof(rebalance->load));
+	memset(rebalance->connections, 0, sizeof(rebalance->connections));
+	rebalance->num_conns = 0;
+	for(i = 0; i < net->num_threads; i++) {
+		if(!rebalance->locked[i]) {
+			continue;
+		}
+		llist_for_each(net->threads[i].threadlist, cursor) {
+			conn_thread = llist_entry_get_value(cursor, struct net_connection_thread, list);
+			if(rebalance->num_conns >= rebalance->max_conns) {
+				size_t max_conns = max(rebalance->max_conns * 2, 64);
+				conn = realloc(rebalance->conns, max_conns * sizeof(*conn));
+				if(!conn) {
+					return -ENOMEM;
+				}
+				rebalance->conns = conn;
+				rebalance->max_conns = max_conns;
+			}
+			conn = &rebalance->conns[rebalance->num_conns];
+			conn->thread = conn_thread;
+			conn->cpu = __atomic_load_n(&conn_thread->cpu, __ATOMIC_RELAXED);
+			bytes = net_counter_read(&conn_thread->counters.bytes);
+			conn->bytes = bytes - conn_thread->rebalance_bytes;
+			conn_thread->rebalance_bytes = bytes;
+			// Moves requested last time may still be pending
+			conn->movable = __atomic_load_n(&conn_thread->migrate_cpu, __ATOMIC_RELAXED) < 0;
+			if(conn->cpu < 0) {
+				continue;
+			}
+			rebalance->load[conn->cpu] += conn->bytes;
+			rebalance->connections[conn->cpu]++;
+			rebalance->num_conns++;
+		}
+	}
+	return 0;
+}
+
+// Least loaded connection CPU other than exclude, on node or on any node if node is negative
+static int net_rebalance_least_loaded(struct net* net, struct net_rebalance* rebalance, int node, int exclude) {
+	const cpu_set_t* set = &net->topology->roles[TOPOLOGY_ROLE_CONNECTION];
+	int cpu, best_cpu = -1;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, set) || cpu == exclude) {
+			continue;
+		}
+		if(node >= 0 && topology_cpu_node(net->topology, cpu) != node) {
+			continue;
+		}
+		if(best_cpu < 0 || rebalance->load[cpu] < rebalance->load[best_cpu]) {
+			best_cpu = cpu;
+		}
+	}
+	return best_cpu;
+}
+
+// Largest connection on busiest that leaves both CPUs below the current load of busiest
+static struct net_rebalance_conn* net_rebalance_pick(struct net_rebalance* rebalance, int busiest, int target, uint64_t min_bytes) {
+	struct net_rebalance_conn* conn = NULL, *candidate;
+	uint64_t gap;
+	size_t i;
+
+	if(target < 0 || rebalance->load[target] >= rebalance->load[busiest]) {
+		return NULL;
+	}
+	gap = rebalance->load[busiest] - rebalance->load[target];
+	if(gap < min_bytes || gap < rebalance->load[busiest] / 4) {
+		return NULL;
+	}
+	for(i = 0; i < rebalance->num_conns; i++) {
+		candidate = &rebalance->conns[i];
+		if(candidate->cpu != busiest || !candidate->movable || !candidate->bytes || candidate->bytes >= gap) {
+			continue;
+		}
+		if(!conn || candidate->bytes > conn->bytes) {
+			conn = candidate;
+		}
+	}
+	return conn;
+}
+
+static void net_rebalance_run(struct net* net, struct net_rebalance* rebalance) {
+	uint64_t min_bytes = NET_REBALANCE_MIN_RATE * net->rebalance_interval_ms / 1000;
+	unsigned int move;
+	int cpu, busiest, target;
+	struct net_rebalance_conn* conn;
+
+	for(move = 0; move < NET_REBALANCE_MOVES_MAX; move++) {
+		// A CPU serving a single connection can not be relieved
+		busiest = -1;
+		for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if(rebalance->connections[cpu] >= 2 && (busiest < 0 || rebalance->load[cpu] > rebalance->load[busiest])) {
+				busiest = cpu;
+			}
+		}
+		if(busiest < 0) {
+			return;
+		}
+		// Only cross nodes if the own node can not take the load, that costs a framebuffer switch
+		target = net_rebalance_least_loaded(net, rebalance, topology_cpu_node(net->topology, busiest), busiest);
+		if(!(conn = net_rebalance_pick(rebalance, busiest, target, min_bytes))) {
+			target = net_rebalance_least_loaded(net, rebalance, -1, busiest);
+			if(!(conn = net_rebalance_pick(rebalance, busiest, target, min_bytes))) {
+				return;
+			}
+		}
+
+		__atomic_store_n(&conn->thread->migrate_cpu, target, __ATOMIC_RELAXED);
+		conn->movable = false;
+		conn->cpu = target;
+		rebalance->load[busiest] -= conn->bytes;
+		rebalance->load[target] += conn->bytes;
+		rebalance->connections[busiest]--;
+		rebalance->connections[target]++;
+	}
+}
+
+static void net_rebalance_thread_cleanup(void* args) {
+	struct net_rebalance* rebalance = args;
+	free(rebalance->locked);
+	free(rebalance->conns);
+	free(rebalance);
+}
+
+static void* net_rebalance_thread(void* args) {
+	struct net* net = args;
+	struct net_rebalance* rebalance;
+	unsigned int i;
+	int err;
+
+	topology_pin_self(net->topology, TOPOLOGY_ROLE_STATISTICS);
+	rebalance = calloc(1, sizeof(*rebalance));
+	if(!rebalance) {
+		goto fail;
+	}
+	rebalance->locked = calloc(net->num_threads, sizeof(*rebalance->locked));
+	if(!rebalance->locked) {
+		goto fail_rebalance;
+	}
+	pthread_cleanup_push(net_rebalance_thread_cleanup, rebalance);
+
+	while(net->state != NET_STATE_SHUTDOWN) {
+		usleep(net->rebalance_interval_ms * 1000UL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		// Keeps connections from leaving the lists until their moves are requested
+		for(i = 0; i < net->num_threads; i++) {
+			rebalance->locked[i] = net->threads[i].initialized;
+			if(rebalance->locked[i]) {
+				llist_lock(net->threads[i].threadlist);
+			}
+		}
+		if((err = net_rebalance_sample(net, rebalance))) {
+			fprintf(stderr, "Failed to sample connections for rebalancing: %d => %s\n", err, strerror(-err));
+		} else {
+			net_rebalance_run(net, rebalance);
+		}
+		for(i = 0; i < net->num_threads; i++) {
+			if(rebalance->locked[i]) {
+				llist_unlock(net->threads[i].threadlist);
+			}
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	pthread_cleanup_pop(true);
+	return NULL;
+
+fail_rebalance:
+	free(rebalance);
+fail:
+	fprintf(stderr, "Failed to allocate connection rebalancer\n");
+	return NULL;
+}
+
 int net_listen(struct net* net, unsigned int num_threads, struct sockaddr_storage* addr, size_t addr_len) {
 	int err = 0, i;
 	char host_tmp[NI_MAXHOST], port_tmp[NI_MAXSERV];
+	struct stat path_stat;
 
 	assert(num_threads > 0);
 
@@ -558,14 +702,36 @@ int net_listen(struct net* net, unsigned int num_threads, struct sockaddr_storag
 	}
 	setsockopt(net->socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
 
-	assert(!getnameinfo((struct sockaddr*)addr, addr_len, host_tmp, NI_MAXHOST, port_tmp, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV));
+	if(addr->ss_family == AF_UNIX) {
+		const char* path = ((struct sockaddr_un*)addr)->sun_path;
+
+		snprintf(host_tmp, NI_MAXHOST, "unix:%s", path);
+		// Remove a stale socket left behind by a previous run, but nothing else
+		if(!lstat(path, &path_stat)) {
+			if(!S_ISSOCK(path_stat.st_mode)) {
+				fprintf(stderr, "Failed to bind to %s, path exists and is not a socket\n", host_tmp);
+				err = -EEXIST;
+				goto fail_socket;
+			}
+			unlink(path);
+		}
+	} else {
+		assert(!getnameinfo((struct sockaddr*)addr, addr_len, host_tmp, NI_MAXHOST, port_tmp, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV));
+	}
 
 	// Start listening
 	if(bind(net->socket, (struct sockaddr*)addr, addr_len) < 0) {
-		fprintf(stderr, "Failed to bind to %s:%s\n", host_tmp, port_tmp);
+		if(addr->ss_family == AF_UNIX) {
+			fprintf(stderr, "Failed to bind to %s\n", host_tmp);
+		} else {
+			fprintf(stderr, "Failed to bind to %s:%s\n", host_tmp, port_tmp);
+		}
 		err = -errno;
 		goto fail_socket;
 	}
+	if(addr->ss_family == AF_UNIX) {
+		strcpy(net->unix_path, ((struct sockaddr_un*)addr)->sun_path);
+	}
 
 	if(listen(net->socket, CONNECTION_QUEUE_SIZE)) {
 		fprintf(stderr, "Failed to start listening: %d => %s\n", errno, strerror(errno));
@@ -575,16 +741,19 @@ int net_listen(struct net* net, unsigned int num_threads, struct sockaddr_storag
 
 	if (addr->ss_family == AF_INET6) {
 		printf("Listening on [%s]:%s\n", host_tmp, port_tmp);
+	} else if (addr->ss_family == AF_UNIX) {
+		printf("Listening on %s\n", host_tmp);
 	} else {
 		printf("Listening on %s:%s\n", host_tmp, port_tmp);
 	}
 
 	// Allocate space for threads
-	net->threads = calloc(num_threads, sizeof(struct net_thread));
+	net->threads = aligned_alloc(NET_CACHELINE_SIZE, num_threads * sizeof(struct net_thread));
 	if(!net->threads) {
 		err = -ENOMEM;
 		goto fail_socket;
 	}
+	memset(net->threads, 0, num_threads * sizeof(struct net_thread));
 
 	for(i = 0; i < num_threads; i++) {
 		net->threads[i].threadargs.net = net;
@@ -606,6 +775,18 @@ int net_listen(struct net* net, unsigned int num_threads, struct sockaddr_storag
 #endif
 	}
 
+	// Connections are only pinned with a topology, without one there is nothing to rebalance
+	if(net->topology && net->rebalance_interval_ms) {
+		if((err = -pthread_create(&net->rebalance_thread, NULL, net_rebalance_thread, net))) {
+			fprintf(stderr, "Failed to start connection rebalancer, continuing without: %d => %s\n", err, strerror(-err));
+		} else {
+			net->rebalancing = true;
+#ifndef FEATURE_BROKEN_PTHREAD
+			pthread_setname_np(net->rebalance_thread, "rebalance");
+#endif
+		}
+	}
+
 	return 0;
 
 fail_pthread_create:
@@ -615,6 +796,7 @@ fail_pthread_create:
 fail_socket:
 	close(net->socket);
 	shutdown(net->socket, SHUT_RDWR);
+	net_unlink_socket(net);
 fail:
 	net->state = NET_STATE_IDLE;
 	return err;
@@ -4,14 +4,36 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <stdbool.h>
 
 struct net;
 
+#include "capture.h"
 #include "framebuffer.h"
+#include "histogram.h"
 #include "llist.h"
 #include "ring.h"
 #include "statistics.h"
+#include "topology.h"
+
+#define NET_CACHELINE_SIZE 64
+
+/*
+ * Cumulative counters of one connection. They are written only by the
+ * connection thread and read by statistics_update using relaxed atomic loads.
+ * Padding them to a cache line of their own keeps connections running on
+ * different cores from invalidating each others counters.
+ */
+struct net_counters {
+	uint64_t bytes;
+	uint64_t commands;
+	uint64_t parse_errors;
+	uint64_t pixels;
+	uint64_t pixels_oob;
+	// Unparsed bytes in the ring after the last read
+	uint64_t ring_used;
+} __attribute__((aligned(NET_CACHELINE_SIZE)));
 
 enum {
 	NET_STATE_IDLE,
@@ -29,16 +51,35 @@ struct net_thread {
 	struct net_threadargs threadargs;
 	bool initialized;
 	pthread_mutex_t list_lock;
+	uint64_t accept_count;
+	// Totals of closed connections, protected by the threadlist lock
+	struct net_counters retired;
 
 	struct llist* threadlist;
 };
 
 struct net {
 	size_t ring_size;
+	// Sample pixel latency on every nth read, 0 to disable
+	unsigned int latency_sample_interval;
+	// Time from read() to the framebuffer write of sampled pixels
+	struct histogram latency_write;
+	// Raw traffic capture, NULL if disabled
+	struct capture* capture;
+	// Thread placement, NULL to leave threads unpinned
+	struct topology* topology;
+	// Interval of connection rebalancing in ms, 0 to disable
+	unsigned int rebalance_interval_ms;
+	pthread_t rebalance_thread;
+	bool rebalancing;
+	// Number of coalescing passes over fb_list so far
+	uint64_t coalesce_generation;
 
 	unsigned int state;
 
 	int socket;
+	// Path of the listening unix socket, empty if listening on an IP address
+	char unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
 
 	struct fb* fb;
 
@@ -59,15 +100,37 @@ struct net_connection_thread {
 	pthread_t thread;
 	struct llist_entry list;
 	struct net_connection_threadargs threadargs;
-	struct {
-		unsigned int x;
-		unsigned int y;
-	} offset;
-	uint32_t byte_count;
-
 	struct ring* ring;
+	// NULL if not capturing
+	struct capture_conn* capture;
+	// NUMA node of the framebuffer drawn to, -1 until known
+	int numa_node;
+	// CPU the thread is placed on, -1 if not placed
+	int cpu;
+	// NAPI instance the connection is received on, 0 if unknown
+	unsigned int napi_id;
+	// CPU the rebalancer asked the thread to move to, -1 if none
+	int migrate_cpu;
+	// Bytes read as of the previous rebalancer run, only used by the rebalancer
+	uint64_t rebalance_bytes;
+
+	struct net_counters counters;
 };
 
+// Only to be used by the owner of the counter
+static inline void net_counter_add(uint64_t* counter, uint64_t val) {
+	__atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t net_counter_read(uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Call after every coalescing pass, connections moving to another NUMA node wait for it
+static inline void net_coalesce_done(struct net* net) {
+	__atomic_add_fetch(&net->coalesce_generation, 1, __ATOMIC_SEQ_CST);
+}
+
 #define likely(x)	__builtin_expect((x),1)
 #define unlikely(x)	__builtin_expect((x),0)
 
@@ -7,8 +7,10 @@
 #include <numa.h>
 #else
 #define numa_set_preferred(x) ((void)x)
-#define numa_available() ((int)false)
-#define numa_max_node() 1;
+#define numa_run_on_node(x) ((void)x)
+#define numa_available() (-1)
+#define numa_max_node() 0
+#define numa_distance(a, b) ((void)(a), (void)(b), 10)
 #endif
 
 #endif
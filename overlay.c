@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "overlay.h"
+#include "util.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * Overlays (text, statistics) never touch the canvas. They are kept as a
+ * sparse list of pixel rectangles and combined with the canvas into a
+ * separate output frame which is what frontends get to see.
+ *
+ * Composition only considers tiles that are dirty in the canvas or whose
+ * overlay content changed. Those tiles are copied from the canvas and the
+ * overlay items covering them are blended on top. An overlay that does not
+ * change costs nothing unless the canvas below it changes.
+ *
+ * Overlay pixels with an alpha of 0 are transparent, 0xff replaces the
+ * canvas pixel and anything in between is blended.
+ */
+
+int overlay_alloc(struct overlay** ret) {
+	struct overlay* overlay = calloc(1, sizeof(struct overlay));
+	if(!overlay) {
+		return -ENOMEM;
+	}
+
+	llist_init(&overlay->items);
+	*ret = overlay;
+	return 0;
+}
+
+void overlay_free(struct overlay* overlay) {
+	free(overlay->dirty);
+	free(overlay);
+}
+
+static void overlay_mark_dirty(struct overlay* overlay, int x, int y, unsigned int width, unsigned int height) {
+	int x_end = x + (int)width, y_end = y + (int)height;
+	unsigned int tile_x, tile_y;
+
+	// Nothing composed yet, the first compose marks everything
+	if(!overlay->dirty) {
+		return;
+	}
+
+	x = max(x, 0);
+	y = max(y, 0);
+	x_end = min(x_end, (int)overlay->size.width);
+	y_end = min(y_end, (int)overlay->size.height);
+	if(x_end <= x || y_end <= y) {
+		return;
+	}
+
+	for(tile_y = y / FB_TILE_SIZE; tile_y <= (y_end - 1) / FB_TILE_SIZE; tile_y++) {
+		for(tile_x = x / FB_TILE_SIZE; tile_x <= (x_end - 1) / FB_TILE_SIZE; tile_x++) {
+			overlay->dirty[tile_y * overlay->tiles.width + tile_x] = 1;
+		}
+	}
+}
+
+void overlay_add(struct overlay* overlay, struct overlay_item* item) {
+	llist_append(&overlay->items, &item->list);
+	overlay_mark_dirty(overlay, item->x, item->y, item->width, item->height);
+}
+
+void overlay_remove(struct overlay* overlay, struct overlay_item* item) {
+	llist_remove(&item->list);
+	overlay_mark_dirty(overlay, item->x, item->y, item->width, item->height);
+}
+
+// Mark a rectangle, relative to the item, as changed
+void overlay_item_mark_dirty(struct overlay* overlay, struct overlay_item* item, int x, int y,
+	unsigned int width, unsigned int height) {
+
+	overlay_mark_dirty(overlay, item->x + x, item->y + y, width, height);
+}
+
+/*
+ * Move or replace the contents of an item. Only marks tiles dirty if the
+ * geometry changed or the caller says the pixels changed.
+ */
+void overlay_item_update(struct overlay* overlay, struct overlay_item* item, int x, int y,
+	unsigned int width, unsigned int height, union fb_pixel* pixels, bool content_changed) {
+
+	if(!content_changed && item->x == x && item->y == y && item->width == width &&
+	   item->height == height && item->pixels == pixels) {
+		return;
+	}
+
+	overlay_mark_dirty(overlay, item->x, item->y, item->width, item->height);
+	item->x = x;
+	item->y = y;
+	item->width = width;
+	item->height = height;
+	item->pixels = pixels;
+	overlay_mark_dirty(overlay, item->x, item->y, item->width, item->height);
+}
+
+static void overlay_blit_rect(struct fb* frame, struct overlay_item* item, int x, int y, int x_end, int y_end) {
+	int line, col;
+
+	for(line = y; line < y_end; line++) {
+		union fb_pixel* dst = fb_get_line_base(frame, line);
+		union fb_pixel* src = &item->pixels[(line - item->y) * item->width + (x - item->x)];
+		for(col = x; col < x_end; col++) {
+			union fb_pixel px = src[col - x];
+			uint8_t alpha = is_big_endian() ? px.color_be.alpha : px.color.alpha;
+			if(!alpha) {
+				continue;
+			}
+			if(alpha == 0xff) {
+				dst[col] = px;
+			} else {
+				FB_ALPHA_BLEND_PIXEL(dst[col], px, dst[col]);
+			}
+		}
+	}
+}
+
+// Blend the parts of an item that lie in dirty tiles
+static void overlay_blit_item(struct overlay* overlay, struct fb* frame, struct overlay_item* item) {
+	int x = max(item->x, 0), y = max(item->y, 0);
+	int x_end = min(item->x + (int)item->width, (int)frame->size.width);
+	int y_end = min(item->y + (int)item->height, (int)frame->size.height);
+	unsigned int tile_x, tile_y;
+
+	if(x_end <= x || y_end <= y) {
+		return;
+	}
+
+	for(tile_y = y / FB_TILE_SIZE; tile_y <= (y_end - 1) / FB_TILE_SIZE; tile_y++) {
+		int tile_top = max((int)(tile_y * FB_TILE_SIZE), y);
+		int tile_bottom = min((int)((tile_y + 1) * FB_TILE_SIZE), y_end);
+		for(tile_x = x / FB_TILE_SIZE; tile_x <= (x_end - 1) / FB_TILE_SIZE; tile_x++) {
+			int run_start = tile_x * FB_TILE_SIZE;
+			if(!overlay->dirty[tile_y * overlay->tiles.width + tile_x]) {
+				continue;
+			}
+			// Blend runs of dirty tiles in one go
+			while(tile_x + 1 <= (x_end - 1) / FB_TILE_SIZE && overlay->dirty[tile_y * overlay->tiles.width + tile_x + 1]) {
+				tile_x++;
+			}
+			overlay_blit_rect(frame, item,
+				max(run_start, x), tile_top,
+				min((int)((tile_x + 1) * FB_TILE_SIZE), x_end), tile_bottom);
+		}
+	}
+}
+
+/*
+ * Update frame from canvas and overlay. Copies all tiles dirty in canvas or
+ * overlay and marks them dirty in frame. Resizes frame to match the canvas.
+ */
+int overlay_compose(struct overlay* overlay, struct fb* frame, struct fb* canvas) {
+	int err;
+	struct llist_entry* cursor;
+	size_t i, num_tiles = canvas->tiles.width * canvas->tiles.height;
+
+	if(!overlay->dirty || overlay->size.width != canvas->size.width || overlay->size.height != canvas->size.height) {
+		uint8_t* dirty = realloc(overlay->dirty, num_tiles);
+		if(!dirty) {
+			return -ENOMEM;
+		}
+		overlay->dirty = dirty;
+		overlay->size = canvas->size;
+		overlay->tiles = canvas->tiles;
+		memset(overlay->dirty, 1, num_tiles);
+	}
+
+	for(i = 0; i < num_tiles; i++) {
+		overlay->dirty[i] |= canvas->dirty[i];
+	}
+
+	if((err = fb_copy_tiles(frame, canvas, overlay->dirty))) {
+		return err;
+	}
+
+	llist_for_each(&overlay->items, cursor) {
+		overlay_blit_item(overlay, frame, llist_entry_get_value(cursor, struct overlay_item, list));
+	}
+
+	memset(overlay->dirty, 0, num_tiles);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _OVERLAY_H_
+#define _OVERLAY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "framebuffer.h"
+#include "llist.h"
+
+// Rectangle of pixels placed on top of the canvas, pixels are owned by the caller
+struct overlay_item {
+	struct llist_entry list;
+	int x;
+	int y;
+	unsigned int width;
+	unsigned int height;
+	union fb_pixel* pixels;
+};
+
+struct overlay {
+	struct llist items;
+	// Canvas geometry the dirty map was sized for
+	struct fb_size size;
+	struct fb_size tiles;
+	// Tiles whose overlay content changed since the last compose
+	uint8_t* dirty;
+};
+
+#define OVERLAY_ITEM_INIT ((struct overlay_item){ .list = LLIST_ENTRY_INIT })
+
+int overlay_alloc(struct overlay** ret);
+void overlay_free(struct overlay* overlay);
+
+void overlay_add(struct overlay* overlay, struct overlay_item* item);
+void overlay_remove(struct overlay* overlay, struct overlay_item* item);
+void overlay_item_update(struct overlay* overlay, struct overlay_item* item, int x, int y,
+	unsigned int width, unsigned int height, union fb_pixel* pixels, bool content_changed);
+void overlay_item_mark_dirty(struct overlay* overlay, struct overlay_item* item, int x, int y,
+	unsigned int width, unsigned int height);
+
+int overlay_compose(struct overlay* overlay, struct fb* frame, struct fb* canvas);
+
+#endif
@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parser.h"
+#include "network.h"
+#include "trace.h"
+#include "util.h"
+
+#define SCRATCH_STR_MAX 32
+#define WHITESPACE_SEARCH_GARBAGE_THRESHOLD 32
+
+#if DEBUG > 1
+#define debug_printf(...) printf(__VA_ARGS__)
+#define debug_fprintf(s, ...) fprintf(s, __VA_ARGS__)
+#else
+#define debug_printf(...)
+#define debug_fprintf(...)
+#endif
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * parser_parse consumes complete commands from a connection's ring buffer.
+ * It tries to read a valid command verb from the current read position in
+ * the ring buffer. If that fails it tries to skip to the next
+ * whitespace-separated token and tries to parse it as a command verb. Once a
+ * valid command verb is detected the parser tries to fetch all arguments
+ * required to form a complete command.
+ * If there are any required parts missing from a command the parser assumes
+ * that it has simply not been received yet. It rewinds to the start of the
+ * command and returns, the caller reads more data into the ring and calls
+ * again.
+ *
+ * The parser does not know about sockets. Responses go through the respond
+ * callback, which allows driving it from benchmarks and replays in-process.
+ *
+ * With latency sampling enabled the caller sets sample_read_ns after a read.
+ * The first pixel written afterwards records its read to write latency and
+ * leaves the read timestamp in its fb for the main loop to follow through
+ * coalesce and publish.
+ */
+
+static inline int parser_is_newline(char c) {
+	return c == '\r' || c == '\n';
+}
+
+static inline int parser_is_whitespace(char c) {
+	switch(c) {
+		case ' ':
+		case '\n':
+		case '\r':
+		case '\t':
+			return 1;
+	}
+	return 0;
+}
+
+static int parser_skip_whitespace(struct ring* ring) {
+	int cnt = 0;
+	char c;
+	while(ring_any_available(ring)) {
+		c = ring_peek_one(ring);
+		if(!parser_is_whitespace(c)) {
+			goto done;
+		}
+		ring_inc_read(ring);
+		cnt++;
+	}
+done:
+	return cnt ? cnt : -1;
+}
+
+static off_t parser_next_whitespace(struct ring* ring) {
+	off_t offset = 0;
+	char c, *read_before = ring->ptr_read;
+	int err;
+	while(ring_any_available(ring)) {
+		c = ring_read_one(ring);
+		if(parser_is_whitespace(c)) {
+			goto done;
+		}
+		if(offset++ >= WHITESPACE_SEARCH_GARBAGE_THRESHOLD) {
+			err = -EINVAL;
+			goto fail;
+		}
+	}
+	err = -1; // No next whitespace found
+	goto fail;
+
+done:
+	ring->ptr_read = read_before;
+	return offset;
+fail:
+	ring->ptr_read = read_before;
+	return err;
+}
+
+static uint32_t parser_str_to_uint32_10(struct ring* ring, ssize_t len) {
+	uint32_t val = 0;
+	int radix;
+	char c;
+	for(radix = 0; radix < len; radix++) {
+		c = ring_read_one(ring);
+		val = val * 10 + (c - '0');
+	}
+	return val;
+}
+
+// Separate implementation to keep performance high
+static uint32_t parser_str_to_uint32_16(struct ring* ring, ssize_t len) {
+	uint32_t val = 0;
+	char c;
+	int radix, lower;
+	for(radix = 0; radix < len; radix++) {
+		// Could be replaced by a left shift
+		val *= 16;
+		c = ring_read_one(ring);
+		lower = c | 0x20;
+		if(lower >= 'a') {
+			val += lower - 'a' + 10;
+		} else {
+			val += lower - '0';
+		}
+	}
+	return val;
+}
+
+static int parser_printf(struct parser* parser, char* fmt, ...) {
+	char scratch_str[SCRATCH_STR_MAX];
+	int ret;
+
+	va_list vargs;
+	va_start(vargs, fmt);
+	ret = vsnprintf(scratch_str, sizeof(scratch_str), fmt, vargs);
+	va_end(vargs);
+
+	if(ret >= sizeof(scratch_str)) {
+		return -ENOBUFS;
+	}
+	if(ret < 0) {
+		return ret;
+	}
+	return parser->respond(parser, scratch_str, ret);
+}
+
+#ifdef FEATURE_STATISTICS
+static void parser_latency_sample(struct parser* parser, struct fb* fb) {
+	uint64_t empty = 0;
+
+	histogram_record(parser->latency_write, get_monotonic_ns() - parser->sample_read_ns);
+	// Drop the sample if the main loop has not picked up the previous one yet
+	__atomic_compare_exchange_n(&fb->latency_sample, &empty, parser->sample_read_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#endif
+
+/*
+ * Returns 0 once all complete commands have been consumed, an incomplete
+ * command may be left in the ring. Returns a negative error code if the
+ * connection should be closed.
+ */
+int parser_parse(struct parser* parser, struct ring* ring) {
+	int err;
+	off_t offset;
+	char* last_cmd;
+	struct fb* fb = parser->fb;
+	struct fb_size* fbsize = fb_get_size(fb);
+	union fb_pixel pixel;
+	unsigned int x, y;
+
+	while(ring_any_available(ring)) {
+		last_cmd = ring->ptr_read;
+
+		if(!ring_memcmp(ring, "PX", strlen("PX"), NULL)) {
+			if((err = parser_skip_whitespace(ring)) < 0) {
+				debug_fprintf(stderr, "No whitespace after PX cmd\n");
+				goto recv_more;
+			}
+			if((offset = parser_next_whitespace(ring)) < 0) {
+				debug_fprintf(stderr, "No more whitespace found, missing X\n");
+				goto recv_more;
+			}
+			x = parser_str_to_uint32_10(ring, offset);
+			if((err = parser_skip_whitespace(ring)) < 0) {
+				debug_fprintf(stderr, "No whitespace after X coordinate\n");
+				goto recv_more;
+			}
+			if((offset = parser_next_whitespace(ring)) < 0) {
+				debug_fprintf(stderr, "No more whitespace found, missing Y\n");
+				goto recv_more;
+			}
+			y = parser_str_to_uint32_10(ring, offset);
+			if((err = parser_skip_whitespace(ring)) < 0) {
+				debug_fprintf(stderr, "No whitespace after Y coordinate\n");
+				goto recv_more;
+			}
+			x += parser->offset.x;
+			y += parser->offset.y;
+			if(unlikely(parser_is_newline(ring_peek_prev(ring)))) {
+				// Get pixel
+#ifdef FEATURE_STATISTICS
+				net_counter_add(&parser->counters->commands, 1);
+#endif
+				if(x < fbsize->width && y < fbsize->height) {
+					if((err = parser_printf(parser, "PX %u %u %06x\n",
+						x, y, fb_get_pixel(parser->fb_read, x, y).abgr >> 8)) < 0) {
+						fprintf(stderr, "Failed to write out pixel value: %d => %s\n", err, strerror(-err));
+						return err;
+					}
+				}
+			} else {
+				// Set pixel
+				if((offset = parser_next_whitespace(ring)) < 0) {
+					debug_fprintf(stderr, "No more whitespace found, missing color\n");
+					goto recv_more;
+				}
+#ifdef FEATURE_STATISTICS
+				// Only count complete commands, an incomplete one is parsed again
+				net_counter_add(&parser->counters->commands, 1);
+#endif
+				if(offset > 6) {
+					pixel.abgr = parser_str_to_uint32_16(ring, offset);
+				} else {
+					pixel.abgr = parser_str_to_uint32_16(ring, offset) << 8;
+					pixel.color.alpha = 0xFF;
+				}
+
+				debug_printf("Got pixel command: PX %u %u %02x%02x%02x%02x\n", x, y,
+				             pixel.color.color_bgr.red, pixel.color.color_bgr.green,
+				             pixel.color.color_bgr.blue, pixel.color.alpha);
+				if(x < fbsize->width && y < fbsize->height) {
+#ifdef FEATURE_STATISTICS
+					net_counter_add(&parser->counters->pixels, 1);
+#endif
+#ifdef FEATURE_ALPHA_BLENDING
+					if (pixel.color.alpha != 0xFF) {
+						union fb_pixel old_pixel = fb_get_pixel(fb, x, y);
+						FB_ALPHA_BLEND_PIXEL(pixel, pixel, old_pixel);
+					}
+#endif
+					fb_set_pixel(fb, x, y, &pixel);
+#ifdef FEATURE_STATISTICS
+					if(unlikely(parser->sample_read_ns)) {
+						parser_latency_sample(parser, fb);
+						parser->sample_read_ns = 0;
+					}
+#endif
+				} else {
+#ifdef FEATURE_STATISTICS
+					net_counter_add(&parser->counters->pixels_oob, 1);
+#endif
+					debug_printf("Got pixel outside screen area: %u, %u outside %u, %u\n", x, y, fbsize->width, fbsize->height);
+				}
+			}
+		}
+#ifdef FEATURE_SIZE
+		else if(!ring_memcmp(ring, "SIZE", strlen("SIZE"), NULL)) {
+#ifdef FEATURE_STATISTICS
+			net_counter_add(&parser->counters->commands, 1);
+#endif
+			if((err = parser_printf(parser, "SIZE %u %u\n", fbsize->width, fbsize->height)) < 0) {
+				fprintf(stderr, "Failed to write out size: %d => %s\n", err, strerror(-err));
+				return err;
+			}
+		}
+#endif
+#ifdef FEATURE_OFFSET
+		else if(!ring_memcmp(ring, "OFFSET", strlen("OFFSET"), NULL)) {
+			if((err = parser_skip_whitespace(ring)) < 0) {
+				goto recv_more;
+			}
+			if((offset = parser_next_whitespace(ring)) < 0) {
+				goto recv_more;
+			}
+			x = parser_str_to_uint32_10(ring, offset);
+			if((err = parser_skip_whitespace(ring)) < 0) {
+				goto recv_more;
+			}
+			if((offset = parser_next_whitespace(ring)) < 0) {
+				goto recv_more;
+			}
+			y = parser_str_to_uint32_10(ring, offset);
+#ifdef FEATURE_STATISTICS
+			net_counter_add(&parser->counters->commands, 1);
+#endif
+			parser->offset.x = x;
+			parser->offset.y = y;
+		}
+#endif
+		else {
+			if((offset = parser_next_whitespace(ring)) >= 0) {
+#ifdef FEATURE_STATISTICS
+				net_counter_add(&parser->counters->parse_errors, 1);
+#endif
+				debug_printf("Encountered unknown command\n");
+				TRACE1(net_parse_error, parser->socket);
+				ring_advance_read(ring, offset);
+			} else {
+				if(offset == -EINVAL) {
+					// We have a missbehaving client
+#ifdef FEATURE_STATISTICS
+					net_counter_add(&parser->counters->parse_errors, 1);
+#endif
+					TRACE1(net_parse_error, parser->socket);
+					return -EINVAL;
+				}
+				goto done;
+			}
+		}
+
+		parser_skip_whitespace(ring);
+	}
+	goto done;
+
+recv_more:
+	ring->ptr_read = last_cmd;
+done:
+	TRACE2(net_parse_done, parser->socket, ring_available(ring));
+	return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct parser;
+
+#include "framebuffer.h"
+#include "histogram.h"
+#include "ring.h"
+
+struct net_counters;
+
+// Send a response to the client, returns a negative error code on failure
+typedef int (*parser_respond_cb)(struct parser* parser, const char* buf, size_t len);
+
+/*
+ * Pixelflut command parser state of one connection. Owners fill in the
+ * framebuffers and callbacks and zero everything else.
+ */
+struct parser {
+	// Framebuffer pixels are drawn to
+	struct fb* fb;
+	// Canvas PX reads are answered from
+	struct fb* fb_read;
+	parser_respond_cb respond;
+	void* priv;
+	// Only used to tag tracepoints
+	int socket;
+
+	struct {
+		unsigned int x;
+		unsigned int y;
+	} offset;
+
+#ifdef FEATURE_STATISTICS
+	struct net_counters* counters;
+	// Read to write latency of sampled pixels, may be NULL if sampling is disabled
+	struct histogram* latency_write;
+	// Read timestamp of a pending latency sample, 0 if none
+	uint64_t sample_read_ns;
+#endif
+};
+
+int parser_parse(struct parser* parser, struct ring* ring);
+
+#endif
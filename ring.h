@@ -1,7 +1,11 @@
 #ifndef _RING_H_
 #define _RING_H_
 
+#include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
 
 struct ring {
 	size_t size;
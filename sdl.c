@@ -3,6 +3,8 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
 
 #include <SDL.h>
 
@@ -11,6 +13,26 @@
 #include "frontend.h"
 #include "util.h"
 
+// How often the render thread checks for window events while no frames arrive
+#define SDL_EVENT_POLL_INTERVAL_MS 50
+
+/* Theory Of Operation
+ * ===================
+ *
+ * All SDL calls are made from a dedicated render thread. SDL requires
+ * windows, renderers and event handling to stay on the thread that
+ * initialized video, so the render thread creates them itself.
+ *
+ * sdl_update runs in the compositor loop. It copies the tiles that changed
+ * since the last frame from the output frame into a private frame, marks them
+ * dirty there and wakes the render thread. The render thread uploads only
+ * the dirty parts of that frame into the streaming texture and presents it.
+ * Presenting waits for vsync, but that only ever blocks the render thread.
+ *
+ * Window events are handled on the render thread and forwarded to the
+ * compositor loop, which performs resizes and quits on its next update.
+ */
+
 static const struct frontend_ops fops = {
 	.alloc = sdl_alloc,
 	.free = sdl_free,
@@ -19,28 +41,16 @@ static const struct frontend_ops fops = {
 
 DECLARE_FRONTEND_NOSIG(front_sdl, "SDL2 Frontend", &fops);
 
-int sdl_alloc(struct frontend** ret, struct fb* fb, void* priv) {
+static int sdl_init_video(struct sdl* sdl) {
 	int err = 0;
-	struct sdl_param* params = priv;
-	struct sdl* sdl = calloc(1, sizeof(struct sdl));
-	struct fb_size* size;
-	if(!sdl) {
-		err = -ENOMEM;
-		goto fail;
-	}
-
-	sdl->fb = fb;
-	size = fb_get_size(fb);
-
-	sdl->cb_private = params->cb_private;
-	sdl->resize_cb = params->resize_cb;
+	struct fb_size* size = fb_get_size(sdl->frame);
 
 	SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "1");
 
 	if(SDL_Init(SDL_INIT_VIDEO)) {
 		err = -1;
 		fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
-		goto fail_sdl;
+		goto fail;
 	}
 
 	SDL_ShowCursor(0);
@@ -73,8 +83,7 @@ int sdl_alloc(struct frontend** ret, struct fb* fb, void* priv) {
 		fprintf(stderr, "Failed to create SDL texture: %s\n", SDL_GetError());
 		goto fail_sdl_renderer;
 	}
-
-	*ret = &sdl->front;
+	sdl->texture_size = *size;
 
 	return 0;
 
@@ -84,27 +93,19 @@ fail_sdl_window:
 	SDL_DestroyWindow(sdl->window);
 fail_sdl_init:
 	SDL_Quit();
-fail_sdl:
-	free(sdl);
 fail:
 	return err;
-};
+}
 
-void sdl_free(struct frontend* front) {
-	struct sdl* sdl = container_of(front, struct sdl, front);
+static void sdl_deinit_video(struct sdl* sdl) {
 	SDL_DestroyTexture(sdl->texture);
 	SDL_DestroyRenderer(sdl->renderer);
 	SDL_DestroyWindow(sdl->window);
 	SDL_Quit();
-	free(sdl);
 }
 
-
-int sdl_update(struct frontend* front) {
-	struct sdl* sdl = container_of(front, struct sdl, front);
-	struct fb_size* size = fb_get_size(sdl->fb);
-
-	int width, height, err;
+static void sdl_handle_events(struct sdl* sdl) {
+	int width, height;
 	SDL_Window* window;
 	SDL_Texture* texture;
 	SDL_Event event;
@@ -118,13 +119,6 @@ int sdl_update(struct frontend* front) {
 				SDL_GetWindowSize(window, &width, &height);
 				assert(width >= 0);
 				assert(height >= 0);
-				printf("Resizing to %dx%d px\n", width, height);
-
-				if(sdl->resize_cb) {
-					if((err = sdl->resize_cb(sdl, width, height))) {
-						return err;
-					}
-				}
 
 				texture = SDL_CreateTexture(sdl->renderer, SDL_PXFMT,
 					SDL_TEXTUREACCESS_STREAMING, width, height);
@@ -134,16 +128,226 @@ int sdl_update(struct frontend* front) {
 				}
 				SDL_DestroyTexture(sdl->texture);
 				sdl->texture = texture;
-				fb_resize(sdl->fb, width, height);
+				sdl->texture_size.width = width;
+				sdl->texture_size.height = height;
+
+				pthread_mutex_lock(&sdl->frame_lock);
+				// New texture has undefined contents
+				fb_mark_all_dirty(sdl->frame);
+				sdl->resize.width = width;
+				sdl->resize.height = height;
+				sdl->resize_pending = true;
+				pthread_mutex_unlock(&sdl->frame_lock);
 			}
 		} else if(event.type == SDL_QUIT) {
-			return 1;
+			pthread_mutex_lock(&sdl->frame_lock);
+			sdl->quit = true;
+			pthread_mutex_unlock(&sdl->frame_lock);
 		}
 	}
+}
+
+static bool sdl_tile_row_dirty(struct fb* frame, unsigned int tile_y, unsigned int* tile_x_min, unsigned int* tile_x_max) {
+	unsigned int tile_x;
+	bool dirty = false;
+
+	for(tile_x = 0; tile_x < frame->tiles.width; tile_x++) {
+		if(fb_tile_is_dirty(frame, tile_x, tile_y)) {
+			*tile_x_min = min(*tile_x_min, tile_x);
+			*tile_x_max = max(*tile_x_max, tile_x);
+			dirty = true;
+		}
+	}
+	return dirty;
+}
+
+// Upload dirty bands of tile rows to the texture, must be called with frame_lock held
+static void sdl_upload_frame(struct sdl* sdl) {
+	struct fb* frame = sdl->frame;
+	int width = min(frame->size.width, sdl->texture_size.width);
+	int height = min(frame->size.height, sdl->texture_size.height);
+	unsigned int tile_y = 0, band_start;
+	SDL_Rect rect;
+	void* pixels;
+	int pitch, y;
+
+	while(tile_y < frame->tiles.height) {
+		unsigned int tile_x_min = UINT_MAX, tile_x_max = 0;
+
+		band_start = tile_y;
+		while(tile_y < frame->tiles.height && sdl_tile_row_dirty(frame, tile_y, &tile_x_min, &tile_x_max)) {
+			tile_y++;
+		}
+		if(tile_y == band_start) {
+			tile_y++;
+			continue;
+		}
 
-	SDL_UpdateTexture(sdl->texture, NULL, sdl->fb->pixels, size->width * sizeof(union fb_pixel));
-	SDL_RenderCopy(sdl->renderer, sdl->texture, NULL, NULL);
-	SDL_RenderPresent(sdl->renderer);
+		rect.x = tile_x_min * FB_TILE_SIZE;
+		rect.y = band_start * FB_TILE_SIZE;
+		rect.w = min((int)((tile_x_max + 1) * FB_TILE_SIZE), width) - rect.x;
+		rect.h = min((int)(tile_y * FB_TILE_SIZE), height) - rect.y;
+		if(rect.w <= 0 || rect.h <= 0) {
+			continue;
+		}
+
+		if(SDL_LockTexture(sdl->texture, &rect, &pixels, &pitch)) {
+			fprintf(stderr, "Failed to lock SDL texture: %s\n", SDL_GetError());
+			break;
+		}
+		for(y = 0; y < rect.h; y++) {
+			memcpy((char*)pixels + y * pitch, fb_get_line_base(frame, rect.y + y) + rect.x, rect.w * sizeof(union fb_pixel));
+		}
+		SDL_UnlockTexture(sdl->texture);
+	}
+	fb_clear_dirty(frame);
+}
+
+static void* sdl_render_thread(void* priv) {
+	struct sdl* sdl = priv;
+	struct timespec timeout;
+	bool present;
+	int err;
+
+	err = sdl_init_video(sdl);
+
+	pthread_mutex_lock(&sdl->frame_lock);
+	sdl->init_err = err;
+	sdl->initialized = true;
+	pthread_cond_broadcast(&sdl->frame_cond);
+	if(err) {
+		pthread_mutex_unlock(&sdl->frame_lock);
+		return NULL;
+	}
+
+	while(!sdl->exit) {
+		if(!sdl->frame_ready) {
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_nsec += SDL_EVENT_POLL_INTERVAL_MS * 1000000L;
+			if(timeout.tv_nsec >= 1000000000L) {
+				timeout.tv_sec++;
+				timeout.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&sdl->frame_cond, &sdl->frame_lock, &timeout);
+		}
+		present = sdl->frame_ready;
+		if(present) {
+			sdl_upload_frame(sdl);
+			sdl->frame_ready = false;
+		}
+		pthread_mutex_unlock(&sdl->frame_lock);
+
+		sdl_handle_events(sdl);
+		if(present) {
+			SDL_RenderCopy(sdl->renderer, sdl->texture, NULL, NULL);
+			SDL_RenderPresent(sdl->renderer);
+		}
+
+		pthread_mutex_lock(&sdl->frame_lock);
+	}
+	pthread_mutex_unlock(&sdl->frame_lock);
+
+	sdl_deinit_video(sdl);
+	return NULL;
+}
+
+int sdl_alloc(struct frontend** ret, struct fb* fb, void* priv) {
+	int err = 0;
+	struct sdl_param* params = priv;
+	struct sdl* sdl = calloc(1, sizeof(struct sdl));
+	struct fb_size* size;
+	if(!sdl) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	sdl->fb = fb;
+	size = fb_get_size(fb);
+
+	sdl->cb_private = params->cb_private;
+	sdl->resize_cb = params->resize_cb;
+
+	if((err = fb_alloc(&sdl->frame, size->width, size->height))) {
+		goto fail_sdl;
+	}
+
+	pthread_mutex_init(&sdl->frame_lock, NULL);
+	pthread_cond_init(&sdl->frame_cond, NULL);
+
+	if((err = -pthread_create(&sdl->render_thread, NULL, sdl_render_thread, sdl))) {
+		fprintf(stderr, "Failed to create SDL render thread: %d => %s\n", err, strerror(-err));
+		goto fail_frame;
+	}
+
+	pthread_mutex_lock(&sdl->frame_lock);
+	while(!sdl->initialized) {
+		pthread_cond_wait(&sdl->frame_cond, &sdl->frame_lock);
+	}
+	err = sdl->init_err;
+	pthread_mutex_unlock(&sdl->frame_lock);
+	if(err) {
+		goto fail_thread;
+	}
+
+	*ret = &sdl->front;
 
 	return 0;
+
+fail_thread:
+	pthread_join(sdl->render_thread, NULL);
+fail_frame:
+	fb_free(sdl->frame);
+fail_sdl:
+	free(sdl);
+fail:
+	return err;
+};
+
+void sdl_free(struct frontend* front) {
+	struct sdl* sdl = container_of(front, struct sdl, front);
+	pthread_mutex_lock(&sdl->frame_lock);
+	sdl->exit = true;
+	pthread_cond_broadcast(&sdl->frame_cond);
+	pthread_mutex_unlock(&sdl->frame_lock);
+	pthread_join(sdl->render_thread, NULL);
+	fb_free(sdl->frame);
+	free(sdl);
+}
+
+
+int sdl_update(struct frontend* front) {
+	struct sdl* sdl = container_of(front, struct sdl, front);
+	struct fb_size resize;
+	bool resize_pending, quit;
+	int err;
+
+	pthread_mutex_lock(&sdl->frame_lock);
+	quit = sdl->quit;
+	resize_pending = sdl->resize_pending;
+	resize = sdl->resize;
+	sdl->resize_pending = false;
+	pthread_mutex_unlock(&sdl->frame_lock);
+
+	if(quit) {
+		return 1;
+	}
+
+	if(resize_pending) {
+		printf("Resizing to %ux%u px\n", resize.width, resize.height);
+		// Resizing the canvas is up to the callback, our fb follows it
+		if(sdl->resize_cb) {
+			if((err = sdl->resize_cb(sdl, resize.width, resize.height))) {
+				return err;
+			}
+		}
+	}
+
+	// Publish changes to the render thread, never waits for it to present
+	pthread_mutex_lock(&sdl->frame_lock);
+	err = fb_copy_dirty(sdl->frame, sdl->fb);
+	sdl->frame_ready = true;
+	pthread_cond_signal(&sdl->frame_cond);
+	pthread_mutex_unlock(&sdl->frame_lock);
+
+	return err;
 }
@@ -1,6 +1,9 @@
 #ifndef _SDL_H_
 #define _SDL_H_
 
+#include <pthread.h>
+#include <stdbool.h>
+
 #include <SDL.h>
 
 #include "framebuffer.h"
@@ -13,11 +16,29 @@ struct sdl;
 typedef int (*sdl_cb_resize)(struct sdl* sdl, unsigned int width, unsigned int height);
 
 struct sdl {
+	// Owned by the render thread
 	SDL_Window* window;
 	SDL_Renderer* renderer;
 	SDL_Texture* texture;
+	struct fb_size texture_size;
 
 	struct fb* fb;
+	// Latest published frame, dirty tiles are pending upload
+	struct fb* frame;
+
+	pthread_t render_thread;
+	pthread_mutex_t frame_lock;
+	pthread_cond_t frame_cond;
+	bool frame_ready;
+	bool exit;
+	// Render thread startup result
+	bool initialized;
+	int init_err;
+
+	// Events forwarded from the render thread
+	bool quit;
+	bool resize_pending;
+	struct fb_size resize;
 
 	sdl_cb_resize resize_cb;
 	void* cb_private;
@@ -0,0 +1,35 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Single writer sequence lock for data shared with other processes.
+ * The sequence counter is odd while the writer is updating the protected
+ * data. Readers retry if they observed an odd counter or the counter
+ * changed while they were reading.
+ */
+
+static inline void seqlock_write_begin(uint32_t* seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(uint32_t* seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Returns false if a write is in progress
+static inline bool seqlock_read_begin(const uint32_t* seq, uint32_t* start) {
+	*start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+	return !(*start & 1);
+}
+
+// Returns true if the data read since seqlock_read_begin may be inconsistent
+static inline bool seqlock_read_retry(const uint32_t* seq, uint32_t start) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
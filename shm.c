@@ -0,0 +1,253 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+#include "seqlock.h"
+#include "util.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * The shm frontend exports the canvas to local processes through a POSIX
+ * shared memory object. Readers map the object read-only and access frames
+ * in place, no syscalls are required per frame.
+ *
+ * Frames are written round robin to SHM_NUM_SLOTS slots. Each slot has its
+ * own sequence lock which is odd while the slot is being written. After a
+ * frame is complete its number is published in header->frame. A reader picks
+ * the slot of the latest frame, samples the slot sequence, processes the
+ * pixels directly from the mapping and checks the sequence again. Since the
+ * writer only comes back to a slot after SHM_NUM_SLOTS - 1 further frames a
+ * reader has that long to consume a frame before it is torn.
+ *
+ * Slots are sized for the current canvas. If the canvas grows the slots move
+ * to new offsets which overlap the old ones. Before the object is enlarged
+ * every slot is therefore invalidated under its sequence lock by clearing its
+ * frame number, aborting reads in progress. Readers skip slots whose frame
+ * number does not match the frame they are looking for and wait for the next
+ * frame. header->size is updated after the object has grown, readers remap
+ * on demand.
+ */
+
+#define SHM_NAME_DEFAULT "/shoreline"
+#define SHM_PAGE_SIZE 4096UL
+
+#define SHM_ALIGN(val) (((val) + SHM_PAGE_SIZE - 1) & ~(SHM_PAGE_SIZE - 1))
+#define SHM_DATA_OFFSET SHM_ALIGN(sizeof(struct shm_header))
+
+static int shm_alloc(struct frontend** ret, struct fb* fb, void* priv) {
+	int err;
+	struct shm* shm = calloc(1, sizeof(struct shm));
+	if(!shm) {
+		fprintf(stderr, "Failed to allocate shm frontend, out of memory\n");
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	shm->fb = fb;
+	shm->fd = -1;
+
+	*ret = &shm->front;
+	return 0;
+
+fail:
+	return err;
+}
+
+static size_t shm_slot_size(struct fb_size* size) {
+	return SHM_ALIGN((size_t)size->width * size->height * sizeof(union fb_pixel));
+}
+
+/*
+ * Invalidate all slots. Used when the slot layout changes, each slot stays
+ * invalid until it is written again.
+ */
+static void shm_invalidate_slots(struct shm_header* header) {
+	unsigned int i;
+
+	for(i = 0; i < SHM_NUM_SLOTS; i++) {
+		struct shm_slot* slot = &header->slots[i];
+
+		seqlock_write_begin(&slot->seq);
+		slot->frame = 0;
+		slot->width = 0;
+		slot->height = 0;
+		slot->stride = 0;
+		slot->offset = 0;
+		seqlock_write_end(&slot->seq);
+	}
+}
+
+/*
+ * Make sure the segment can hold frames of the given size. Grows the object
+ * and remaps it if necessary. All slots are invalidated before their layout
+ * changes, offsets are updated by the next write to each slot.
+ */
+static int shm_reserve(struct shm* shm, struct fb_size* fbsize) {
+	int err;
+	void* map;
+	size_t slot_size = shm_slot_size(fbsize);
+	size_t size = SHM_DATA_OFFSET + slot_size * SHM_NUM_SLOTS;
+
+	if(shm->header && slot_size <= shm->header->slot_size) {
+		return 0;
+	}
+
+	if(shm->header) {
+		shm_invalidate_slots(shm->header);
+	}
+
+	if(ftruncate(shm->fd, size)) {
+		err = -errno;
+		fprintf(stderr, "Failed to resize shared memory segment: %s(%d)\n", strerror(errno), errno);
+		goto fail;
+	}
+
+	if(shm->header) {
+		map = mremap(shm->header, shm->size, size, MREMAP_MAYMOVE);
+	} else {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	}
+	if(map == MAP_FAILED) {
+		err = -errno;
+		fprintf(stderr, "Failed to map shared memory segment: %s(%d)\n", strerror(errno), errno);
+		goto fail;
+	}
+
+	shm->header = map;
+	shm->size = size;
+	shm->header->slot_size = slot_size;
+	__atomic_store_n(&shm->header->size, size, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	return err;
+}
+
+static int shm_start(struct frontend* front) {
+	int err;
+	struct shm* shm = container_of(front, struct shm, front);
+	struct shm_header* header;
+	const char* name = shm->name ? shm->name : SHM_NAME_DEFAULT;
+
+	// Start from a fresh object, readers of a stale one will never see a new frame
+	shm_unlink(name);
+	shm->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(shm->fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to create shared memory segment %s: %s(%d)\n", name, strerror(errno), errno);
+		goto fail;
+	}
+
+	if((err = shm_reserve(shm, fb_get_size(shm->fb)))) {
+		goto fail_unlink;
+	}
+
+	header = shm->header;
+	header->version = SHM_VERSION;
+	header->format = SHM_FORMAT_RGBA8888;
+	header->num_slots = SHM_NUM_SLOTS;
+	// Readers must not touch the segment before the magic is visible
+	__atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+
+fail_unlink:
+	shm_unlink(name);
+	close(shm->fd);
+	shm->fd = -1;
+fail:
+	return err;
+}
+
+static int shm_update(struct frontend* front) {
+	int err;
+	struct shm* shm = container_of(front, struct shm, front);
+	struct fb_size* fbsize = fb_get_size(shm->fb);
+	struct shm_slot* slot;
+	uint64_t frame = shm->frame + 1;
+	size_t offset;
+
+	if((err = shm_reserve(shm, fbsize))) {
+		return err;
+	}
+
+	offset = SHM_DATA_OFFSET + (frame % SHM_NUM_SLOTS) * shm->header->slot_size;
+	slot = &shm->header->slots[frame % SHM_NUM_SLOTS];
+
+	seqlock_write_begin(&slot->seq);
+	slot->width = fbsize->width;
+	slot->height = fbsize->height;
+	slot->stride = fbsize->width * sizeof(union fb_pixel);
+	slot->frame = frame;
+	slot->offset = offset;
+	memcpy((char*)shm->header + offset, shm->fb->pixels, (size_t)slot->stride * slot->height);
+	seqlock_write_end(&slot->seq);
+
+	__atomic_store_n(&shm->header->frame, frame, __ATOMIC_RELEASE);
+	shm->frame = frame;
+	return 0;
+}
+
+static int configure_name(struct frontend* front, char* value) {
+	struct shm* shm = container_of(front, struct shm, front);
+	int err;
+	char* name;
+
+	if(!value) {
+		return -EINVAL;
+	}
+	if(value[0] != '/' || strchr(value + 1, '/')) {
+		fprintf(stderr, "Shared memory name must start with '/' and contain no further slashes\n");
+		err = -EINVAL;
+		goto fail;
+	}
+
+	name = strdup(value);
+	if(!name) {
+		fprintf(stderr, "Failed to allocate space for shared memory name, out of memory\n");
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	free(shm->name);
+	shm->name = name;
+	return 0;
+
+fail:
+	return err;
+}
+
+static void shm_free(struct frontend* front) {
+	struct shm* shm = container_of(front, struct shm, front);
+	if(shm->header) {
+		munmap(shm->header, shm->size);
+	}
+	if(shm->fd >= 0) {
+		shm_unlink(shm->name ? shm->name : SHM_NAME_DEFAULT);
+		close(shm->fd);
+	}
+	free(shm->name);
+	free(shm);
+}
+
+static const struct frontend_ops fops = {
+	.alloc = shm_alloc,
+	.start = shm_start,
+	.free = shm_free,
+	.update = shm_update,
+};
+
+static const struct frontend_arg fargs[] = {
+	{ .name = "name", .configure = configure_name },
+	{ .name = "", .configure = NULL },
+};
+
+DECLARE_FRONTEND_THREADABLE_NOSIG_ARGS(front_shm, "Shared memory frame export", &fops, fargs);
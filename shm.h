@@ -0,0 +1,64 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdint.h>
+
+#include "framebuffer.h"
+#include "frontend.h"
+
+/*
+ * Shared memory frame export
+ *
+ * The segment starts with a struct shm_header followed by SHM_NUM_SLOTS
+ * slots of slot_size bytes each. The pixels of a slot start at its offset
+ * field, counted from the start of the segment. Frame n is written to
+ * slot n % SHM_NUM_SLOTS, guarded by that slot's sequence lock.
+ * header->frame holds the number of the latest complete frame. A slot whose
+ * frame field does not match the frame a reader is looking for has been
+ * invalidated or reused and must not be read.
+ *
+ * Pixels are 32 bit words 0xRRGGBBAA in host byte order, i.e. bytes
+ * A, B, G, R on little endian machines.
+ *
+ * The segment may grow when the canvas is resized. All slots are invalidated
+ * when that happens. Readers must remap once header->size exceeds the size
+ * of their mapping.
+ */
+
+#define SHM_MAGIC 0x6c6e7273 // "srnl"
+#define SHM_VERSION 1
+#define SHM_NUM_SLOTS 3
+
+#define SHM_FORMAT_RGBA8888 1
+
+struct shm_slot {
+	uint32_t seq;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint64_t frame;
+	uint64_t offset;
+};
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t format;
+	uint32_t num_slots;
+	uint64_t size;
+	uint64_t slot_size;
+	uint64_t frame;
+	struct shm_slot slots[SHM_NUM_SLOTS];
+};
+
+struct shm {
+	struct frontend front;
+	struct fb* fb;
+	char* name;
+	int fd;
+	struct shm_header* header;
+	size_t size;
+	uint64_t frame;
+};
+
+#endif
@@ -1,16 +1,64 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include "statistics.h"
+#include "heatmap.h"
 #include "llist.h"
 #include "main.h"
+#include "seqlock.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * The main loop calls statistics_update once per frame. It collects the
+ * counters of all connections into per listener thread totals and takes
+ * snapshots of the duration histograms, so neither network threads nor
+ * frontends ever wait for a statistics consumer.
+ *
+ * Pixel latency is sampled by the network threads, see network.c. The main
+ * loop takes the samples left in the NUMA local framebuffers right before
+ * coalescing them and records their latency once coalesced and once all
+ * frontends have been updated or handed the frame.
+ *
+ * The statistics frontend copies the result on update. API clients are
+ * served from a private copy of that snapshot:
+ *
+ *   TCP API (port)        JSON summary, connection is closed afterwards
+ *   HTTP API (http_port)  /metrics in Prometheus text format
+ *                         /statistics.json, same as the TCP API
+ *                         /heatmap, pixel changes per second per tile
+ *                         /subscribe?interval=<ms>, one JSON line per interval
+ *
+ * Subscribers stay connected. They are grouped by their interval, rounded
+ * up to a multiple of STATISTICS_SUBSCRIBE_TICK_MS. On every tick the
+ * publish thread formats the JSON line once and pushes it to all groups that
+ * are due using non-blocking writes. Subscribers that can not keep up are
+ * dropped instead of holding up everybody else.
+ *
+ * Local consumers can skip sockets altogether. With the shm option the
+ * frontend additionally copies each update into a shared memory page
+ * guarded by a sequence lock, see statistics_shm.h. Readers neither take
+ * stats_lock nor make any syscalls.
+ */
 
 #define STATISTICS_API_LISTEN_PORT_DEFAULT "1235"
 #define STATISTICS_API_LISTEN_ADDRESS_DEFAULT "::"
+#define STATISTICS_HTTP_LISTEN_ADDRESS_DEFAULT "::"
+#define STATISTICS_SUBSCRIBE_TICK_MS 50
+#define STATISTICS_SUBSCRIBE_INTERVAL_DEFAULT_MS 1000
+#define STATISTICS_SHM_SIZE ((sizeof(struct statistics_shm) + 4095UL) & ~4095UL)
+
+// Histogram buckets exported to Prometheus, powers of two nanoseconds
+#define STATISTICS_HISTOGRAM_MIN_BITS 10
+#define STATISTICS_HISTOGRAM_MAX_BITS 34
 
 static const char* UNITS[] = {
 	"",
@@ -21,50 +69,125 @@ static const char* UNITS[] = {
 	"P"
 };
 
-void statistics_update(struct statistics* stats, struct net* net) {
+static void statistics_update_outputs(struct statistics* stats, struct llist* fronts) {
+	struct llist_entry* cursor;
+	unsigned int i, num_outputs = 0;
+
+	llist_for_each(fronts, cursor) {
+		struct frontend* front = llist_entry_get_value(cursor, struct frontend, list);
+		struct statistics_output* output = &stats->outputs[num_outputs];
+
+		if(num_outputs >= STATISTICS_MAX_OUTPUTS) {
+			break;
+		}
+		output->id = frontend_get_id(front->def);
+		output->instance = 0;
+		for(i = 0; i < num_outputs; i++) {
+			if(stats->outputs[i].id == output->id) {
+				output->instance++;
+			}
+		}
+		histogram_snapshot(&output->update_duration, &front->update_duration);
+		num_outputs++;
+	}
+	stats->num_outputs = num_outputs;
+}
+
+static void statistics_update_nodes(struct statistics* stats, struct llist* fb_list) {
+	struct llist_entry* cursor;
+	unsigned int num_nodes = 0;
+
+	llist_lock(fb_list);
+	llist_for_each(fb_list, cursor) {
+		struct fb* fb = llist_entry_get_value(cursor, struct fb, list);
+		struct statistics_node* node = &stats->nodes[num_nodes];
+
+		if(num_nodes >= STATISTICS_MAX_NODES) {
+			break;
+		}
+		node->numa_node = fb->numa_node;
+		node->connections = 0;
+		node->pixels_coalesced = fb->pixels_coalesced;
+		num_nodes++;
+	}
+	llist_unlock(fb_list);
+	stats->num_nodes = num_nodes;
+}
+
+static struct statistics_node* statistics_get_node(struct statistics* stats, int numa_node) {
+	unsigned int i;
+
+	for(i = 0; numa_node >= 0 && i < stats->num_nodes; i++) {
+		if(stats->nodes[i].numa_node == numa_node) {
+			return &stats->nodes[i];
+		}
+	}
+	return NULL;
+}
+
+static void statistics_worker_add(struct statistics_worker* worker, struct net_counters* counters) {
+	worker->bytes += net_counter_read(&counters->bytes);
+	worker->commands += net_counter_read(&counters->commands);
+	worker->parse_errors += net_counter_read(&counters->parse_errors);
+	worker->pixels += net_counter_read(&counters->pixels);
+	worker->pixels_oob += net_counter_read(&counters->pixels_oob);
+}
+
+void statistics_update(struct statistics* stats, struct net* net, struct llist* fronts) {
 	int i = net->num_threads;
 	struct timespec now;
 	unsigned long long bytes_prev = stats->num_bytes;
-	unsigned long long num_connections = 0;
-#ifdef FEATURE_PIXEL_COUNT
 	unsigned long long pixels_prev = stats->num_pixels;
-	struct llist_entry* cursor;
-#endif
+	unsigned long long num_bytes = 0, num_pixels = 0;
+	unsigned long long num_connections = 0;
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
+	statistics_update_nodes(stats, net->fb_list);
+	stats->ring_size = net->ring_size;
+	stats->num_workers = net->num_threads < STATISTICS_MAX_WORKERS ? net->num_threads : STATISTICS_MAX_WORKERS;
 	while(i-- > 0) {
 		struct net_thread* thread = &net->threads[i];
 		struct llist* threadlist = thread->threadlist;
 		struct llist_entry* cursor;
+		struct statistics_worker worker = { 0 };
 
+		worker.accepts = __atomic_load_n(&thread->accept_count, __ATOMIC_RELAXED);
 		if(thread->initialized) {
+			// The lock only keeps connections from leaving the list, counters are never reset
 			llist_lock(threadlist);
+			statistics_worker_add(&worker, &thread->retired);
 			llist_for_each(threadlist, cursor) {
 				struct net_connection_thread* conn_thread = llist_entry_get_value(cursor, struct net_connection_thread, list);
-				stats->num_bytes += conn_thread->byte_count;
-				conn_thread->byte_count = 0;
-				num_connections++;
+				unsigned long long ring_used = net_counter_read(&conn_thread->counters.ring_used);
+				struct statistics_node* node =
+					statistics_get_node(stats, __atomic_load_n(&conn_thread->numa_node, __ATOMIC_RELAXED));
+
+				statistics_worker_add(&worker, &conn_thread->counters);
+				worker.ring_used += ring_used;
+				if(ring_used > worker.ring_used_max) {
+					worker.ring_used_max = ring_used;
+				}
+				worker.connections++;
+				if(node) {
+					node->connections++;
+				}
 			}
 			llist_unlock(threadlist);
 		}
+		num_bytes += worker.bytes;
+		num_pixels += worker.pixels;
+		num_connections += worker.connections;
+		if(i < STATISTICS_MAX_WORKERS) {
+			stats->workers[i] = worker;
+		}
 	}
+	stats->num_bytes = num_bytes;
+	stats->num_pixels = num_pixels;
 	stats->num_connections = num_connections;
+	histogram_snapshot(&stats->latency_write, &net->latency_write);
+	statistics_update_outputs(stats, fronts);
 	stats->bytes_per_second[stats->average_index] = (stats->num_bytes - bytes_prev) * 1000000000UL / get_timespec_diff(&now, &stats->last_update);
-
-#ifdef FEATURE_PIXEL_COUNT
-	llist_lock(net->fb_list);
-	llist_for_each(net->fb_list, cursor) {
-		struct fb* fb = llist_entry_get_value(cursor, struct fb, list);
-		stats->num_pixels += fb->pixel_count;
-		fb->pixel_count = 0;
-	}
-	llist_unlock(net->fb_list);
 	stats->pixels_per_second[stats->average_index] = (stats->num_pixels - pixels_prev) * 1000000000UL / get_timespec_diff(&now, &stats->last_update);
-#else
-	// Do a crude estimation if actual pixel count is not available. Average Pixel is about |PX XXX YYY rrggbb\n| = 18 bytes
-	stats->num_pixels += (stats->num_bytes - bytes_prev) / 18;
-	stats->pixels_per_second[stats->average_index] = stats->bytes_per_second[stats->average_index] / 18;
-#endif
 	stats->frames_per_second[stats->average_index] = (stats->num_frames - stats->last_num_frames) * 1000000000UL / get_timespec_diff(&now, &stats->last_update);
 
 	stats->average_index++;
@@ -73,6 +196,37 @@ void statistics_update(struct statistics* stats, struct net* net) {
 	stats->last_num_frames = stats->num_frames;
 }
 
+// fb_list must be locked
+unsigned int statistics_latency_take(struct llist* fb_list, uint64_t* samples, unsigned int max_samples) {
+	struct llist_entry* cursor;
+	unsigned int num_samples = 0;
+
+	llist_for_each(fb_list, cursor) {
+		struct fb* fb = llist_entry_get_value(cursor, struct fb, list);
+		uint64_t sample;
+
+		if(num_samples >= max_samples) {
+			break;
+		}
+		if((sample = __atomic_exchange_n(&fb->latency_sample, 0, __ATOMIC_RELAXED))) {
+			samples[num_samples++] = sample;
+		}
+	}
+	return num_samples;
+}
+
+void statistics_latency_record(struct histogram* hist, uint64_t* samples, unsigned int num_samples) {
+	unsigned long long now;
+
+	if(!num_samples) {
+		return;
+	}
+	now = get_monotonic_ns();
+	while(num_samples--) {
+		histogram_record(hist, now - samples[num_samples]);
+	}
+}
+
 #define GET_AVERAGE(var, stats, field) \
 	do { \
 		int i_; \
@@ -166,20 +320,37 @@ static int statistics_frontend_alloc(struct frontend** ret, struct fb* fb, void*
 	sfront->socket = -1;
 	sfront->listen_port = STATISTICS_API_LISTEN_PORT_DEFAULT;
 	sfront->listen_address = STATISTICS_API_LISTEN_ADDRESS_DEFAULT;
+	sfront->http_listen_address = STATISTICS_HTTP_LISTEN_ADDRESS_DEFAULT;
+	sfront->shm_fd = -1;
 	pthread_mutex_init(&sfront->stats_lock, NULL);
+	pthread_mutex_init(&sfront->subscriptions_lock, NULL);
 	*ret = &sfront->front;
 	return 0;
 }
 
 #define API_STRBUF_LEN 1024
 
-static void* api_thread(void* args) {
-	struct statistics_frontend* sfront = args;
-	char strbuf[API_STRBUF_LEN];
+static int statistics_format_json(struct statistics* stats, char* strbuf, size_t len) {
 	unsigned long long bytes_per_second;
 	unsigned long long pixels_per_second;
 	unsigned long long frames_per_second;
 
+	GET_AVERAGE(bytes_per_second, stats, bytes_per_second);
+	GET_AVERAGE(pixels_per_second, stats, pixels_per_second);
+	GET_AVERAGE(frames_per_second, stats, frames_per_second);
+
+	return snprintf(strbuf, len, "{ \"traffic\": { \"bytes\": %llu, \"pixels\": %llu }, "
+"\"throughput\": { \"bytes\": %llu, \"pixels\": %llu }, \"connections\": %llu, \"fps\": %llu }\n",
+		stats->num_bytes, stats->num_pixels,
+		bytes_per_second, pixels_per_second,
+		stats->num_connections,
+		frames_per_second);
+}
+
+static void* api_thread(void* args) {
+	struct statistics_frontend* sfront = args;
+	char strbuf[API_STRBUF_LEN];
+
 	while(!sfront->exit) {
 		size_t len;
 		ssize_t write_len;
@@ -190,16 +361,7 @@ static void* api_thread(void* args) {
 			break;
 		}
 		pthread_mutex_lock(&sfront->stats_lock);
-		GET_AVERAGE(bytes_per_second, &sfront->stats, bytes_per_second);
-		GET_AVERAGE(pixels_per_second, &sfront->stats, pixels_per_second);
-		GET_AVERAGE(frames_per_second, &sfront->stats, frames_per_second);
-
-		len = snprintf(strbuf, sizeof(strbuf), "{ \"traffic\": { \"bytes\": %llu, \"pixels\": %llu }, "
-"\"throughput\": { \"bytes\": %llu, \"pixels\": %llu }, \"connections\": %llu, \"fps\": %llu }\n",
-			sfront->stats.num_bytes, sfront->stats.num_pixels,
-			bytes_per_second, pixels_per_second,
-			sfront->stats.num_connections,
-			frames_per_second);
+		len = statistics_format_json(&sfront->stats, strbuf, sizeof(strbuf));
 		pthread_mutex_unlock(&sfront->stats_lock);
 		while(len > 0) {
 			write_len = write(sock, buf, len);
@@ -216,6 +378,364 @@ static void* api_thread(void* args) {
 	return NULL;
 }
 
+#define PROM_HEADER(buf, name, type, help) \
+	httpd_buf_printf((buf), "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+#define PROM_WORKER_COUNTER(buf, stats, name, type, help, field) \
+	do { \
+		unsigned int i_; \
+		PROM_HEADER((buf), name, type, help); \
+		for(i_ = 0; i_ < (stats)->num_workers; i_++) { \
+			httpd_buf_printf((buf), name "{worker=\"%u\"} %llu\n", i_, (stats)->workers[i_].field); \
+		} \
+	} while(0)
+
+// Append cumulative buckets of a nanosecond histogram as seconds
+static void statistics_format_histogram(struct httpd_buf* buf, const char* name, const char* labels, struct histogram* hist) {
+	unsigned int bits;
+	const char* sep = *labels ? "," : "";
+
+	for(bits = STATISTICS_HISTOGRAM_MIN_BITS; bits <= STATISTICS_HISTOGRAM_MAX_BITS; bits++) {
+		httpd_buf_printf(buf, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+			(double)(1ULL << bits) / 1000000000.0, (unsigned long long)histogram_count_below(hist, 1ULL << bits));
+	}
+	httpd_buf_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)hist->count);
+	httpd_buf_printf(buf, "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+		(double)hist->sum / 1000000000.0);
+	httpd_buf_printf(buf, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+		(unsigned long long)hist->count);
+}
+
+static int statistics_format_prometheus(struct statistics* stats, struct httpd_buf* buf) {
+	unsigned int i;
+	char labels[128];
+
+	PROM_HEADER(buf, "shoreline_received_bytes_total", "counter", "Bytes received from pixelflut clients");
+	httpd_buf_printf(buf, "shoreline_received_bytes_total %llu\n", stats->num_bytes);
+	PROM_HEADER(buf, "shoreline_pixels_total", "counter", "Pixels drawn");
+	httpd_buf_printf(buf, "shoreline_pixels_total %llu\n", stats->num_pixels);
+	PROM_HEADER(buf, "shoreline_frames_total", "counter", "Frames output");
+	httpd_buf_printf(buf, "shoreline_frames_total %llu\n", stats->num_frames);
+	PROM_HEADER(buf, "shoreline_connections", "gauge", "Open pixelflut connections");
+	httpd_buf_printf(buf, "shoreline_connections %llu\n", stats->num_connections);
+	PROM_HEADER(buf, "shoreline_ring_size_bytes", "gauge", "Size of the per connection receive ring");
+	httpd_buf_printf(buf, "shoreline_ring_size_bytes %zu\n", stats->ring_size);
+
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_received_bytes_total", "counter",
+		"Bytes received by connections of a listener thread", bytes);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_commands_total", "counter",
+		"Commands parsed by connections of a listener thread", commands);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_parse_errors_total", "counter",
+		"Unknown commands and garbage skipped by connections of a listener thread", parse_errors);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_pixels_total", "counter",
+		"Pixels drawn by connections of a listener thread", pixels);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_pixels_out_of_bounds_total", "counter",
+		"Pixels dropped for lying outside the canvas", pixels_oob);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_accepted_connections_total", "counter",
+		"Connections accepted by a listener thread", accepts);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_connections", "gauge",
+		"Open connections of a listener thread", connections);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_ring_used_bytes", "gauge",
+		"Bytes buffered in the receive rings of a listener thread", ring_used);
+	PROM_WORKER_COUNTER(buf, stats, "shoreline_worker_ring_used_max_bytes", "gauge",
+		"Highest receive ring occupancy of a single connection of a listener thread", ring_used_max);
+
+	PROM_HEADER(buf, "shoreline_node_connections", "gauge", "Open connections drawing to a NUMA local framebuffer");
+	for(i = 0; i < stats->num_nodes; i++) {
+		httpd_buf_printf(buf, "shoreline_node_connections{node=\"%u\"} %llu\n",
+			stats->nodes[i].numa_node, stats->nodes[i].connections);
+	}
+	PROM_HEADER(buf, "shoreline_node_pixels_coalesced_total", "counter", "Pixels taken from a NUMA local framebuffer while coalescing");
+	for(i = 0; i < stats->num_nodes; i++) {
+		httpd_buf_printf(buf, "shoreline_node_pixels_coalesced_total{node=\"%u\"} %llu\n",
+			stats->nodes[i].numa_node, stats->nodes[i].pixels_coalesced);
+	}
+
+	PROM_HEADER(buf, "shoreline_coalesce_duration_seconds", "histogram", "Time taken to coalesce NUMA local framebuffers");
+	statistics_format_histogram(buf, "shoreline_coalesce_duration_seconds", "", &stats->coalesce_duration);
+
+	PROM_HEADER(buf, "shoreline_pixel_latency_seconds", "histogram", "Time from reading a sampled pixel to the stage");
+	statistics_format_histogram(buf, "shoreline_pixel_latency_seconds", "stage=\"write\"", &stats->latency_write);
+	statistics_format_histogram(buf, "shoreline_pixel_latency_seconds", "stage=\"coalesce\"", &stats->latency_coalesce);
+	statistics_format_histogram(buf, "shoreline_pixel_latency_seconds", "stage=\"publish\"", &stats->latency_publish);
+
+	PROM_HEADER(buf, "shoreline_frontend_update_duration_seconds", "histogram", "Time taken by frontend updates");
+	for(i = 0; i < stats->num_outputs; i++) {
+		struct statistics_output* output = &stats->outputs[i];
+		snprintf(labels, sizeof(labels), "frontend=\"%s\",instance=\"%u\"", output->id, output->instance);
+		statistics_format_histogram(buf, "shoreline_frontend_update_duration_seconds", labels, &output->update_duration);
+	}
+
+	return buf->err;
+}
+
+static int statistics_format_heatmap(struct httpd_buf* buf) {
+	int err;
+	struct fb_size tiles;
+	float* rates;
+	unsigned int x, y;
+
+	if((err = heatmap_snapshot(heatmap, &tiles, &rates))) {
+		return err;
+	}
+	httpd_buf_printf(buf, "{ \"tile_size\": %u, \"width\": %u, \"height\": %u, \"half_life_ms\": %u, \"rates\": [",
+		FB_TILE_SIZE, tiles.width, tiles.height, heatmap->half_life_ms);
+	for(y = 0; y < tiles.height; y++) {
+		httpd_buf_printf(buf, "%s\n  [", y ? "," : "");
+		for(x = 0; x < tiles.width; x++) {
+			httpd_buf_printf(buf, "%s%.1f", x ? ", " : " ", rates[y * tiles.width + x]);
+		}
+		httpd_buf_printf(buf, " ]");
+	}
+	httpd_buf_printf(buf, "\n] }\n");
+	free(rates);
+	return buf->err;
+}
+
+static int statistics_subscribe(struct statistics_frontend* sfront, struct httpd_request* req) {
+	unsigned long interval_ms = STATISTICS_SUBSCRIBE_INTERVAL_DEFAULT_MS;
+	unsigned int interval_ticks;
+	const char* param = httpd_query_param(req, "interval");
+	struct statistics_subscription* sub;
+
+	if(param) {
+		char* end;
+		interval_ms = strtoul(param, &end, 10);
+		if(end == param || (*end && *end != '&') || !interval_ms || interval_ms > 3600000UL) {
+			return httpd_respond_error(req->socket, 400);
+		}
+	}
+	interval_ticks = (interval_ms + STATISTICS_SUBSCRIBE_TICK_MS - 1) / STATISTICS_SUBSCRIBE_TICK_MS;
+
+	if(httpd_respond_header(req->socket, 200, "application/x-ndjson", -1)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&sfront->subscriptions_lock);
+	for(sub = sfront->subscriptions; sub; sub = sub->next) {
+		if(sub->interval_ticks == interval_ticks) {
+			break;
+		}
+	}
+	if(!sub) {
+		sub = calloc(1, sizeof(struct statistics_subscription));
+		if(!sub) {
+			goto fail;
+		}
+		sub->interval_ticks = interval_ticks;
+		httpd_stream_init(&sub->stream);
+		sub->next = sfront->subscriptions;
+		sfront->subscriptions = sub;
+	}
+	if(httpd_stream_add(&sub->stream, req->socket)) {
+		goto fail;
+	}
+	pthread_mutex_unlock(&sfront->subscriptions_lock);
+	return 1;
+
+fail:
+	// Headers are out already, all we can do is hang up
+	pthread_mutex_unlock(&sfront->subscriptions_lock);
+	return 0;
+}
+
+static void* statistics_publish_thread(void* args) {
+	struct statistics_frontend* sfront = args;
+	struct statistics* snapshot;
+	char strbuf[API_STRBUF_LEN];
+	unsigned long long tick = 0;
+	struct timespec next;
+
+	snapshot = malloc(sizeof(struct statistics));
+	if(!snapshot) {
+		fprintf(stderr, "Failed to allocate statistics snapshot, subscriptions disabled\n");
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(!sfront->exit) {
+		struct statistics_subscription** cursor;
+		int len = -1;
+
+		next.tv_nsec += STATISTICS_SUBSCRIBE_TICK_MS * 1000000L;
+		if(next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		tick++;
+
+		pthread_mutex_lock(&sfront->subscriptions_lock);
+		cursor = &sfront->subscriptions;
+		while(*cursor) {
+			struct statistics_subscription* sub = *cursor;
+
+			if(tick % sub->interval_ticks) {
+				cursor = &sub->next;
+				continue;
+			}
+			// Format once per tick, no matter how many groups are due
+			if(len < 0) {
+				pthread_mutex_lock(&sfront->stats_lock);
+				*snapshot = sfront->stats;
+				pthread_mutex_unlock(&sfront->stats_lock);
+				len = statistics_format_json(snapshot, strbuf, sizeof(strbuf));
+			}
+			if(!httpd_stream_broadcast(&sub->stream, strbuf, len)) {
+				*cursor = sub->next;
+				free(sub);
+				continue;
+			}
+			cursor = &sub->next;
+		}
+		pthread_mutex_unlock(&sfront->subscriptions_lock);
+	}
+
+	free(snapshot);
+	return NULL;
+}
+
+static int statistics_http_handle_request(struct httpd* httpd, struct httpd_request* req, void* priv) {
+	struct statistics_frontend* sfront = priv;
+	struct statistics* snapshot;
+	struct httpd_buf buf = { 0 };
+	char strbuf[API_STRBUF_LEN];
+	int err, len;
+
+	if(strcmp(req->method, "GET")) {
+		return httpd_respond_error(req->socket, 405);
+	}
+
+	if(!strcmp(req->path, "/subscribe")) {
+		return statistics_subscribe(sfront, req);
+	}
+
+	if(!strcmp(req->path, "/heatmap")) {
+		if(!(err = statistics_format_heatmap(&buf))) {
+			err = httpd_respond(req->socket, 200, "application/json", buf.data, buf.len);
+		}
+		httpd_buf_free(&buf);
+		return err;
+	}
+
+	if(strcmp(req->path, "/metrics") && strcmp(req->path, "/statistics.json")) {
+		return httpd_respond_error(req->socket, 404);
+	}
+
+	// Format from a private copy to keep the time spent holding stats_lock short
+	snapshot = malloc(sizeof(struct statistics));
+	if(!snapshot) {
+		return -ENOMEM;
+	}
+	pthread_mutex_lock(&sfront->stats_lock);
+	*snapshot = sfront->stats;
+	pthread_mutex_unlock(&sfront->stats_lock);
+
+	if(!strcmp(req->path, "/statistics.json")) {
+		len = statistics_format_json(snapshot, strbuf, sizeof(strbuf));
+		err = httpd_respond(req->socket, 200, "application/json", strbuf, len);
+		goto out;
+	}
+
+	if(!(err = statistics_format_prometheus(snapshot, &buf))) {
+		err = httpd_respond(req->socket, 200, "text/plain; version=0.0.4; charset=utf-8", buf.data, buf.len);
+	}
+	httpd_buf_free(&buf);
+
+out:
+	free(snapshot);
+	return err;
+}
+
+static int statistics_shm_start(struct statistics_frontend* sfront) {
+	int err;
+	void* map;
+	struct statistics_shm* shm;
+
+	// Start from a fresh object, readers of a stale one would never see an update
+	shm_unlink(sfront->shm_name);
+	sfront->shm_fd = shm_open(sfront->shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(sfront->shm_fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to create shared memory statistics page %s: %s(%d)\n", sfront->shm_name, strerror(errno), errno);
+		goto fail;
+	}
+
+	if(ftruncate(sfront->shm_fd, STATISTICS_SHM_SIZE)) {
+		err = -errno;
+		fprintf(stderr, "Failed to resize shared memory statistics page: %s(%d)\n", strerror(errno), errno);
+		goto fail_unlink;
+	}
+
+	map = mmap(NULL, STATISTICS_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sfront->shm_fd, 0);
+	if(map == MAP_FAILED) {
+		err = -errno;
+		fprintf(stderr, "Failed to map shared memory statistics page: %s(%d)\n", strerror(errno), errno);
+		goto fail_unlink;
+	}
+
+	shm = map;
+	shm->version = STATISTICS_SHM_VERSION;
+	// Readers must not touch the page before the magic is visible
+	__atomic_store_n(&shm->magic, STATISTICS_SHM_MAGIC, __ATOMIC_RELEASE);
+	sfront->shm = shm;
+	return 0;
+
+fail_unlink:
+	shm_unlink(sfront->shm_name);
+	close(sfront->shm_fd);
+	sfront->shm_fd = -1;
+fail:
+	return err;
+}
+
+static void statistics_shm_publish(struct statistics_shm* shm, struct statistics* stats) {
+	unsigned int i;
+	unsigned long long bytes_per_second;
+	unsigned long long pixels_per_second;
+	unsigned long long frames_per_second;
+
+	GET_AVERAGE(bytes_per_second, stats, bytes_per_second);
+	GET_AVERAGE(pixels_per_second, stats, pixels_per_second);
+	GET_AVERAGE(frames_per_second, stats, frames_per_second);
+
+	seqlock_write_begin(&shm->seq);
+	shm->update++;
+	shm->timestamp_ns = stats->last_update.tv_sec * 1000000000ULL + stats->last_update.tv_nsec;
+	shm->bytes_total = stats->num_bytes;
+	shm->pixels_total = stats->num_pixels;
+	shm->frames_total = stats->num_frames;
+	shm->connections = stats->num_connections;
+	shm->bytes_per_second = bytes_per_second;
+	shm->pixels_per_second = pixels_per_second;
+	shm->frames_per_second = frames_per_second;
+	shm->ring_size = stats->ring_size;
+
+	shm->num_workers = stats->num_workers;
+	for(i = 0; i < stats->num_workers; i++) {
+		struct statistics_worker* worker = &stats->workers[i];
+		struct statistics_shm_worker* shm_worker = &shm->workers[i];
+
+		shm_worker->bytes_total = worker->bytes;
+		shm_worker->commands_total = worker->commands;
+		shm_worker->parse_errors_total = worker->parse_errors;
+		shm_worker->pixels_total = worker->pixels;
+		shm_worker->pixels_oob_total = worker->pixels_oob;
+		shm_worker->accepts_total = worker->accepts;
+		shm_worker->connections = worker->connections;
+		shm_worker->ring_used = worker->ring_used;
+		shm_worker->ring_used_max = worker->ring_used_max;
+	}
+
+	shm->num_nodes = stats->num_nodes;
+	for(i = 0; i < stats->num_nodes; i++) {
+		shm->nodes[i].numa_node = stats->nodes[i].numa_node;
+		shm->nodes[i].connections = stats->nodes[i].connections;
+		shm->nodes[i].pixels_coalesced_total = stats->nodes[i].pixels_coalesced;
+	}
+	seqlock_write_end(&shm->seq);
+}
+
 static int statistics_frontend_start(struct frontend* front) {
 	struct statistics_frontend* sfront = container_of(front, struct statistics_frontend, front);
 	int err;
@@ -257,6 +777,24 @@ static int statistics_frontend_start(struct frontend* front) {
 	}
 	sfront->thread_created = true;
 
+	if(sfront->http_port) {
+		if((err = httpd_start(&sfront->httpd, sfront->http_listen_address, sfront->http_port, statistics_http_handle_request, sfront))) {
+			fprintf(stderr, "Failed to start statistics HTTP API on %s:%s, %d => %s\n",
+				sfront->http_listen_address, sfront->http_port, err, strerror(-err));
+			return err;
+		}
+		sfront->httpd_started = true;
+
+		if((err = -pthread_create(&sfront->publish_thread, NULL, statistics_publish_thread, sfront))) {
+			return err;
+		}
+		sfront->publish_thread_created = true;
+	}
+
+	if(sfront->shm_name) {
+		return statistics_shm_start(sfront);
+	}
+
 	return 0;
 
 fail_socket:
@@ -271,7 +809,20 @@ fail:
 
 static void statistics_frontend_free(struct frontend* front) {
 	struct statistics_frontend* sfront = container_of(front, struct statistics_frontend, front);
+	struct statistics_subscription* sub;
+
 	sfront->exit = true;
+	if(sfront->httpd_started) {
+		httpd_stop(&sfront->httpd);
+	}
+	if(sfront->publish_thread_created) {
+		pthread_join(sfront->publish_thread, NULL);
+	}
+	while((sub = sfront->subscriptions)) {
+		sfront->subscriptions = sub->next;
+		httpd_stream_close(&sub->stream);
+		free(sub);
+	}
 	if(sfront->thread_created) {
 		pthread_cancel(sfront->listen_thread);
 		pthread_join(sfront->listen_thread, NULL);
@@ -282,6 +833,13 @@ static void statistics_frontend_free(struct frontend* front) {
 	if(sfront->addr_list) {
 		freeaddrinfo(sfront->addr_list);
 	}
+	if(sfront->shm) {
+		munmap(sfront->shm, STATISTICS_SHM_SIZE);
+	}
+	if(sfront->shm_fd >= 0) {
+		shm_unlink(sfront->shm_name);
+		close(sfront->shm_fd);
+	}
 	free(sfront);
 }
 
@@ -290,6 +848,10 @@ static int statistics_frontend_update_statistics(struct frontend* front) {
 	pthread_mutex_lock(&sfront->stats_lock);
 	sfront->stats = stats;
 	pthread_mutex_unlock(&sfront->stats_lock);
+	// sfront->stats is only ever written here, no need to hold the lock for reading
+	if(sfront->shm) {
+		statistics_shm_publish(sfront->shm, &sfront->stats);
+	}
 	return 0;
 }
 
@@ -319,6 +881,44 @@ static int statistics_frontend_configure_listen_address(struct frontend* front,
 	return 0;
 }
 
+static int statistics_frontend_configure_http_port(struct frontend* front, char* value) {
+	struct statistics_frontend* sfront = container_of(front, struct statistics_frontend, front);
+	int port;
+
+	if(!value) {
+		return -EINVAL;
+	}
+
+	port = atoi(value);
+	if(port < 0 || port > 65535) {
+		return -EINVAL;
+	}
+
+	sfront->http_port = value;
+	return 0;
+}
+
+static int statistics_frontend_configure_http_listen_address(struct frontend* front, char* value) {
+	struct statistics_frontend* sfront = container_of(front, struct statistics_frontend, front);
+	if(!value) {
+		return -EINVAL;
+	}
+
+	sfront->http_listen_address = value;
+	return 0;
+}
+
+static int statistics_frontend_configure_shm(struct frontend* front, char* value) {
+	struct statistics_frontend* sfront = container_of(front, struct statistics_frontend, front);
+	if(!value || value[0] != '/' || strchr(value + 1, '/')) {
+		fprintf(stderr, "Shared memory name must start with '/' and contain no further slashes\n");
+		return -EINVAL;
+	}
+
+	sfront->shm_name = value;
+	return 0;
+}
+
 static const struct frontend_ops fops = {
 	.alloc = statistics_frontend_alloc,
 	.start = statistics_frontend_start,
@@ -329,7 +929,10 @@ static const struct frontend_ops fops = {
 static const struct frontend_arg fargs[] = {
 	{ .name = "port", .configure = statistics_frontend_configure_port },
 	{ .name = "listen", .configure = statistics_frontend_configure_listen_address },
+	{ .name = "http_port", .configure = statistics_frontend_configure_http_port },
+	{ .name = "http_listen", .configure = statistics_frontend_configure_http_listen_address },
+	{ .name = "shm", .configure = statistics_frontend_configure_shm },
 	{ .name = "", .configure = NULL },
 };
 
-DECLARE_FRONTEND_SIG_ARGS(front_statistics, "Statistics API provider frontend", &fops, fargs);
+DECLARE_FRONTEND_THREADABLE_SIG_ARGS(front_statistics, "Statistics API provider frontend", &fops, fargs);
@@ -6,9 +6,42 @@
 
 struct statistics;
 
+#include "histogram.h"
+#include "httpd.h"
 #include "network.h"
+#include "statistics_shm.h"
 
 #define STATISTICS_NUM_AVERAGES 20
+// Listener threads and frontends beyond these limits are not reported individually
+#define STATISTICS_MAX_WORKERS STATISTICS_SHM_MAX_WORKERS
+#define STATISTICS_MAX_NODES STATISTICS_SHM_MAX_NODES
+#define STATISTICS_MAX_OUTPUTS 16
+
+// Cumulative counters of one network listener thread and its connections
+struct statistics_worker {
+	unsigned long long bytes;
+	unsigned long long commands;
+	unsigned long long parse_errors;
+	unsigned long long pixels;
+	unsigned long long pixels_oob;
+	unsigned long long accepts;
+	unsigned long long connections;
+	unsigned long long ring_used;
+	unsigned long long ring_used_max;
+};
+
+// Counters of one NUMA local framebuffer
+struct statistics_node {
+	unsigned int numa_node;
+	unsigned long long connections;
+	unsigned long long pixels_coalesced;
+};
+
+struct statistics_output {
+	const char* id;
+	unsigned int instance;
+	struct histogram update_duration;
+};
 
 struct statistics {
 	unsigned long long num_bytes;
@@ -21,10 +54,31 @@ struct statistics {
 	unsigned long long last_num_frames;
 	unsigned long long num_frames;
 	struct timespec last_update;
+
+	size_t ring_size;
+	unsigned int num_workers;
+	struct statistics_worker workers[STATISTICS_MAX_WORKERS];
+	unsigned int num_nodes;
+	struct statistics_node nodes[STATISTICS_MAX_NODES];
+	// Recorded by the main loop
+	struct histogram coalesce_duration;
+	// Pixel latency from read() to framebuffer write, coalesce and frontend publish
+	struct histogram latency_write;
+	struct histogram latency_coalesce;
+	struct histogram latency_publish;
+	unsigned int num_outputs;
+	struct statistics_output outputs[STATISTICS_MAX_OUTPUTS];
 };
 
 #include "frontend.h"
 
+// All subscribers of one update interval
+struct statistics_subscription {
+	struct statistics_subscription* next;
+	unsigned int interval_ticks;
+	struct httpd_stream stream;
+};
+
 struct statistics_frontend {
 	struct frontend front;
 	int socket;
@@ -37,9 +91,27 @@ struct statistics_frontend {
 	struct statistics stats;
 	struct addrinfo* addr_list;
 	bool exit;
+
+	char* http_port;
+	char* http_listen_address;
+	struct httpd httpd;
+	bool httpd_started;
+
+	// Subscribers grouped by update interval, protected by subscriptions_lock
+	pthread_mutex_t subscriptions_lock;
+	struct statistics_subscription* subscriptions;
+	pthread_t publish_thread;
+	bool publish_thread_created;
+
+	// Shared memory statistics page, only written by update
+	char* shm_name;
+	int shm_fd;
+	struct statistics_shm* shm;
 };
 
-void statistics_update(struct statistics* stats, struct net* net);
+void statistics_update(struct statistics* stats, struct net* net, struct llist* fronts);
+unsigned int statistics_latency_take(struct llist* fb_list, uint64_t* samples, unsigned int max_samples);
+void statistics_latency_record(struct histogram* hist, uint64_t* samples, unsigned int num_samples);
 
 const char* statistics_traffic_get_unit(struct statistics* stats);
 double statistics_traffic_get_scaled(struct statistics* stats);
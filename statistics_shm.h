@@ -0,0 +1,70 @@
+#ifndef _STATISTICS_SHM_H_
+#define _STATISTICS_SHM_H_
+
+#include <stdint.h>
+
+/*
+ * Shared memory statistics page
+ *
+ * The statistics frontend publishes a struct statistics_shm at offset 0 of
+ * the shared memory object given by its shm option. The page is rewritten on
+ * every statistics update under the sequence lock seq, see seqlock.h. Readers
+ * copy the page, retry if the copy may be torn and never block shoreline.
+ *
+ * All counters ending in _total are cumulative since startup. Entries beyond
+ * num_workers and num_nodes are unused.
+ */
+
+#define STATISTICS_SHM_MAGIC 0x74737273 // "srst"
+#define STATISTICS_SHM_VERSION 1
+#define STATISTICS_SHM_MAX_WORKERS 64
+#define STATISTICS_SHM_MAX_NODES 16
+
+// Counters of one network listener thread and its connections
+struct statistics_shm_worker {
+	uint64_t bytes_total;
+	uint64_t commands_total;
+	uint64_t parse_errors_total;
+	uint64_t pixels_total;
+	uint64_t pixels_oob_total;
+	uint64_t accepts_total;
+	uint64_t connections;
+	uint64_t ring_used;
+	uint64_t ring_used_max;
+};
+
+// Counters of one NUMA local framebuffer
+struct statistics_shm_node {
+	uint32_t numa_node;
+	uint32_t reserved;
+	uint64_t connections;
+	// Pixels taken from this framebuffer while coalescing
+	uint64_t pixels_coalesced_total;
+};
+
+struct statistics_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t reserved;
+	// Number of updates so far and CLOCK_MONOTONIC time of the latest one
+	uint64_t update;
+	uint64_t timestamp_ns;
+
+	uint64_t bytes_total;
+	uint64_t pixels_total;
+	uint64_t frames_total;
+	uint64_t connections;
+	// Averaged over the last few seconds
+	uint64_t bytes_per_second;
+	uint64_t pixels_per_second;
+	uint64_t frames_per_second;
+	uint64_t ring_size;
+
+	uint32_t num_workers;
+	uint32_t num_nodes;
+	struct statistics_shm_worker workers[STATISTICS_SHM_MAX_WORKERS];
+	struct statistics_shm_node nodes[STATISTICS_SHM_MAX_NODES];
+};
+
+#endif
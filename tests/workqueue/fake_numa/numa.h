@@ -0,0 +1,58 @@
+#ifndef _FAKE_NUMA_H_
+#define _FAKE_NUMA_H_
+
+/*
+ * Stand-in for libnuma pretending to run on TEST_NUMA_NODES nodes, so work
+ * stealing across workqueues can be tested on any machine. Without cpumasks
+ * every node gets one unpinned worker per CPU.
+ */
+
+#include <stddef.h>
+
+struct bitmask {
+	unsigned long size;
+	unsigned long* maskp;
+};
+
+static inline int numa_available(void) {
+	return 0;
+}
+
+static inline int numa_max_node(void) {
+	return TEST_NUMA_NODES - 1;
+}
+
+static inline int numa_distance(int a, int b) {
+	return a == b ? 10 : 20;
+}
+
+static inline int numa_run_on_node(int node) {
+	(void)node;
+	return 0;
+}
+
+static inline void numa_set_preferred(int node) {
+	(void)node;
+}
+
+static inline struct bitmask* numa_allocate_cpumask(void) {
+	return NULL;
+}
+
+static inline void numa_free_cpumask(struct bitmask* mask) {
+	(void)mask;
+}
+
+static inline int numa_node_to_cpus(int node, struct bitmask* mask) {
+	(void)node;
+	(void)mask;
+	return -1;
+}
+
+static inline int numa_bitmask_isbitset(const struct bitmask* mask, unsigned int n) {
+	(void)mask;
+	(void)n;
+	return 0;
+}
+
+#endif
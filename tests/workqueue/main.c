@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../workqueue.h"
+
+#define NUM_PRODUCERS 4
+#define JOBS_PER_PRODUCER 100000
+#define FAILING_JOB_INTERVAL 1000
+#define RANGE_SIZE 100000
+#define RANGE_GRAIN 7
+#ifndef TEST_NUMA_NODES
+#define TEST_NUMA_NODES 1
+#endif
+
+struct producer {
+	pthread_t thread;
+	unsigned int id;
+	unsigned long long sum;
+	unsigned int cleanups;
+	int err;
+};
+
+static unsigned long long job_sum = 0;
+static unsigned char range_visits[RANGE_SIZE];
+
+static int job_cb(void* priv) {
+	uintptr_t value = (uintptr_t)priv;
+
+	__atomic_fetch_add(&job_sum, value, __ATOMIC_RELAXED);
+	return value % FAILING_JOB_INTERVAL ? 0 : -EIO;
+}
+
+static int range_cb(void* priv, unsigned int start, unsigned int end) {
+	unsigned int i;
+
+	if(end - start > RANGE_GRAIN) {
+		return -EINVAL;
+	}
+	for(i = start; i < end; i++) {
+		__atomic_fetch_add(&range_visits[i], 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+// Every item of a parallel_for must be visited exactly once, in chunks of at most grain items
+static int check_parallel_for() {
+	int err;
+	unsigned int i;
+	struct workqueue_completion completion;
+
+	workqueue_completion_init(&completion);
+	if((err = workqueue_parallel_for(0, &completion, 0, RANGE_SIZE, RANGE_GRAIN, NULL, range_cb))) {
+		fprintf(stderr, "Failed to submit parallel_for: %s\n", strerror(-err));
+		goto fail;
+	}
+	if((err = workqueue_completion_wait(&completion))) {
+		fprintf(stderr, "parallel_for chunk exceeded grain\n");
+		goto fail;
+	}
+	for(i = 0; i < RANGE_SIZE; i++) {
+		if(range_visits[i] != 1) {
+			fprintf(stderr, "parallel_for visited item %u %u times\n", i, range_visits[i]);
+			err = -EINVAL;
+			goto fail;
+		}
+	}
+	printf("parallel_for visited all %u items once\n", RANGE_SIZE);
+
+fail:
+	workqueue_completion_destroy(&completion);
+	return err;
+}
+
+static void* producer_thread(void* priv) {
+	struct producer* producer = priv;
+	struct workqueue_completion completion;
+	uintptr_t i, value;
+
+	workqueue_completion_init(&completion);
+	for(i = 0; i < JOBS_PER_PRODUCER; i++) {
+		value = producer->id * JOBS_PER_PRODUCER + i + 1;
+		// Jobs of other nodes get stolen and must go back to the pool of their node
+		if((producer->err = workqueue_enqueue_completion(producer->id % TEST_NUMA_NODES, &completion, (void*)value, job_cb, NULL, NULL))) {
+			fprintf(stderr, "Failed to enqueue job: %s\n", strerror(-producer->err));
+			goto fail;
+		}
+		producer->sum += value;
+	}
+	// Every FAILING_JOB_INTERVALth job fails, the completion reports it
+	if(workqueue_completion_wait(&completion) != -EIO) {
+		fprintf(stderr, "Completion of producer %u did not report job errors\n", producer->id);
+		producer->err = -EINVAL;
+	}
+	// An empty completion returns immediately
+	if(workqueue_completion_wait(&completion)) {
+		fprintf(stderr, "Reused completion of producer %u reported stale error\n", producer->id);
+		producer->err = -EINVAL;
+	}
+
+fail:
+	workqueue_completion_destroy(&completion);
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	int err;
+	unsigned int i;
+	unsigned long long expected = 0;
+	struct producer producers[NUM_PRODUCERS] = { 0 };
+
+	if((err = workqueue_init(NULL))) {
+		fprintf(stderr, "Failed to initialize workqueues: %s\n", strerror(-err));
+		goto fail;
+	}
+	printf("Running %u producers with %u workers on each of %u nodes\n", NUM_PRODUCERS, workqueue_num_workers(0), TEST_NUMA_NODES);
+
+	for(i = 0; i < NUM_PRODUCERS; i++) {
+		producers[i].id = i;
+		if((err = -pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]))) {
+			fprintf(stderr, "Failed to start producer: %s\n", strerror(-err));
+			goto fail_workqueue;
+		}
+	}
+	for(i = 0; i < NUM_PRODUCERS; i++) {
+		pthread_join(producers[i].thread, NULL);
+		expected += producers[i].sum;
+		err = err ? err : producers[i].err;
+	}
+	if(err) {
+		goto fail_workqueue;
+	}
+
+	if(job_sum != expected) {
+		fprintf(stderr, "Job sum mismatch, expected %llu, got %llu\n", expected, job_sum);
+		err = -EINVAL;
+		goto fail_workqueue;
+	}
+	printf("All %u jobs completed\n", NUM_PRODUCERS * JOBS_PER_PRODUCER);
+
+	err = check_parallel_for();
+
+fail_workqueue:
+	workqueue_deinit();
+fail:
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
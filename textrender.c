@@ -8,6 +8,7 @@
 #include "util.h"
 
 #define DEFAULT_FONT_SIZE 16
+// Number of per font size glyph caches allocated at once
 #define CACHE_CHUNK_SIZE 8
 
 #define TEXT_BORDER 3
@@ -56,89 +57,242 @@ int textrender_alloc(struct textrender** ret, char* fontfile) {
 }
 
 void textrender_free(struct textrender* txtrndr) {
+	size_t i, j;
+	for(i = 0; i < txtrndr->num_caches; i++) {
+		for(j = 0; j < TEXTRENDER_NUM_GLYPHS; j++) {
+			free(txtrndr->caches[i]->glyphs[j].bitmap);
+		}
+		free(txtrndr->caches[i]);
+	}
+	free(txtrndr->caches);
 	FT_Done_Face(txtrndr->ftface);
 	FT_Done_FreeType(txtrndr->ftlib);
 	free(txtrndr);
 }
 
-static int draw_bitmap(struct fb* fb, FT_Bitmap* ftbmp, unsigned int x, unsigned int y, unsigned int base) {
+static int textrender_get_cache(struct textrender* txtrndr, unsigned int size, struct textrender_glyph_cache** ret) {
 	size_t i;
+	struct textrender_glyph_cache* cache;
 
-	y -= base;
-
-	if(ftbmp->pixel_mode != FT_PIXEL_MODE_GRAY) {
-		return -EINVAL;
+	for(i = 0; i < txtrndr->num_caches; i++) {
+		if(txtrndr->caches[i]->size == size) {
+			*ret = txtrndr->caches[i];
+			return 0;
+		}
 	}
 
-	for(i = 0; i < ftbmp->rows; i++) {
-		union fb_pixel* line_base = fb_get_line_base(fb, y + i);
-		union fb_pixel* line_start = &line_base[x];
-		unsigned char* gray_base = &ftbmp->buffer[ftbmp->width * i];
-		if((y + i) < fb->size.height) {
-			size_t j;
-			for(j = 0; j < ftbmp->width; j++) {
-				if((x +j) < fb->size.width) {
-					line_start[j].abgr = FB_GRAY8_TO_PIXEL(gray_base[j]);
-				}
-			}
+	if(txtrndr->num_caches == txtrndr->caches_alloc) {
+		struct textrender_glyph_cache** caches = realloc(txtrndr->caches,
+			(txtrndr->caches_alloc + CACHE_CHUNK_SIZE) * sizeof(struct textrender_glyph_cache*));
+		if(!caches) {
+			return -ENOMEM;
 		}
+		txtrndr->caches = caches;
+		txtrndr->caches_alloc += CACHE_CHUNK_SIZE;
+	}
+
+	cache = calloc(1, sizeof(struct textrender_glyph_cache));
+	if(!cache) {
+		return -ENOMEM;
 	}
+	cache->size = size;
+	txtrndr->caches[txtrndr->num_caches++] = cache;
+	*ret = cache;
 	return 0;
 }
 
-int textrender_draw_string(struct textrender* txtrndr, struct fb* fb, unsigned int x, unsigned int y, const char* text, unsigned int size) {
-	int err = 0, i;
+// Get a rendered glyph, rendering it on first use. Must be called with font_lock held
+static int textrender_get_glyph(struct textrender* txtrndr, struct textrender_glyph_cache* cache, unsigned char c, struct textrender_glyph** ret) {
+	int err;
+	unsigned int i;
 	FT_Error fterr;
-	FT_GlyphSlot ftslot;
+	FT_GlyphSlot ftslot = txtrndr->ftface->glyph;
+	struct textrender_glyph* glyph = &cache->glyphs[c];
+
+	if(glyph->loaded) {
+		goto done;
+	}
+
+	if(txtrndr->char_size != cache->size) {
+		fterr = FT_Set_Char_Size(txtrndr->ftface, PIXEL_TO_CARTESIAN(cache->size), 0, DPI, DPI);
+		if(fterr) {
+			err = fterr;
+			fprintf(stderr, "Failed to set font size to %u: %s(%d)\n", cache->size, FT_Error_String(fterr), err);
+			return err;
+		}
+		txtrndr->char_size = cache->size;
+	}
+
+	glyph->loaded = true;
+	fterr = FT_Load_Char(txtrndr->ftface, c, FT_LOAD_RENDER);
+	if(fterr) {
+		fprintf(stderr, "Warning: Failed to find glyph for char '%c': %s(%d)\n", c, FT_Error_String(fterr), fterr);
+		goto done;
+	}
+	if(ftslot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
+		fprintf(stderr, "Warning: Unsupported pixel mode for char '%c'\n", c);
+		goto done;
+	}
+
+	glyph->bitmap = malloc(ftslot->bitmap.width * ftslot->bitmap.rows);
+	if(!glyph->bitmap && ftslot->bitmap.width && ftslot->bitmap.rows) {
+		glyph->loaded = false;
+		return -ENOMEM;
+	}
+	for(i = 0; i < ftslot->bitmap.rows; i++) {
+		memcpy(&glyph->bitmap[ftslot->bitmap.width * i], &ftslot->bitmap.buffer[ftslot->bitmap.pitch * i], ftslot->bitmap.width);
+	}
+	glyph->width = ftslot->bitmap.width;
+	glyph->rows = ftslot->bitmap.rows;
+	glyph->top = ftslot->bitmap_top;
+	glyph->left = ftslot->bitmap_left;
+	glyph->metrics_width = ftslot->metrics.width;
+	glyph->metrics_height = ftslot->metrics.height;
+	glyph->advance_x = ftslot->advance.x;
+	glyph->advance_y = ftslot->advance.y;
+	glyph->valid = true;
+
+done:
+	*ret = glyph;
+	return 0;
+}
+
+/*
+ * Rasterise text into str unless it already holds the same text at the same
+ * size. Returns 1 if the string was re-rasterised, 0 if it was unchanged.
+ */
+int textrender_string_update(struct textrender* txtrndr, struct textrender_string* str, const char* text, unsigned int size) {
+	int err;
+	size_t i, len = strlen(text);
+	struct textrender_glyph_cache* cache;
+	struct textrender_glyph* glyph;
+	// Zero length VLAs are undefined, keep one slot for empty text
+	struct textrender_glyph* glyphs[len ? len : 1];
 	FT_Vector ftpen;
-	unsigned int xmin = x, ymin = y, xmax = x, ymax = y;
+	int xmin = 0, ymin = 0, xmax = 0, ymax = 0;
+	unsigned int width, height;
+	union fb_pixel* pixels;
+	char* text_copy;
+
+	if(str->text && str->size == size && !strcmp(str->text, text)) {
+		return 0;
+	}
+
+	text_copy = strdup(text);
+	if(!text_copy) {
+		return -ENOMEM;
+	}
 
 	pthread_mutex_lock(&txtrndr->font_lock);
-	fterr = FT_Set_Char_Size(txtrndr->ftface, PIXEL_TO_CARTESIAN(size), 0, DPI, DPI);
-	if(fterr) {
-		err = fterr;
-		fprintf(stderr, "Failed to set font size to %u: %s(%d)\n", size, FT_Error_String(fterr), err);
+	if((err = textrender_get_cache(txtrndr, size, &cache))) {
 		goto fail;
 	}
 
-	ftslot = txtrndr->ftface->glyph;
-
 	ftpen.x = ftpen.y = 0;
-
-	for(i = 0; i < strlen(text); i++) {
-		fterr = FT_Load_Char(txtrndr->ftface, text[i], FT_LOAD_RENDER);
-		if(fterr) {
-			err = fterr;
-			fprintf(stderr, "Warning: Failed to find glyph for char '%c': %s(%d)\n", text[i], FT_Error_String(fterr), err);
+	for(i = 0; i < len; i++) {
+		if((err = textrender_get_glyph(txtrndr, cache, (unsigned char)text[i], &glyph))) {
+			goto fail;
+		}
+		glyphs[i] = glyph;
+		if(!glyph->valid) {
 			continue;
 		}
 
-		xmin = min(xmin, x + CARTESIAN_TO_PIXELS(ftpen.x));
-		ymin = min(ymin, y + CARTESIAN_TO_PIXELS(ftpen.y) - ftslot->bitmap_top);
-		xmax = max(xmax, x + CARTESIAN_TO_PIXELS(ftpen.x) + CARTESIAN_TO_PIXELS(ftslot->metrics.width) + ftslot->bitmap_left);
-		ymax = max(ymax, y + CARTESIAN_TO_PIXELS(ftpen.y) + CARTESIAN_TO_PIXELS(ftslot->metrics.height) - ftslot->bitmap_top);
-		ftpen.x += ftslot->advance.x;
-		ftpen.y += ftslot->advance.y;
+		xmax = max(xmax, CARTESIAN_TO_PIXELS(ftpen.x) + max((int)glyph->width, (int)CARTESIAN_TO_PIXELS(glyph->metrics_width) + glyph->left));
+		ymin = min(ymin, (int)CARTESIAN_TO_PIXELS(ftpen.y) - glyph->top);
+		ymax = max(ymax, (int)CARTESIAN_TO_PIXELS(ftpen.y) + max((int)glyph->rows, (int)CARTESIAN_TO_PIXELS(glyph->metrics_height)) - glyph->top);
+		ftpen.x += glyph->advance_x;
+		ftpen.y += glyph->advance_y;
 	}
 
-	fb_clear_rect(fb, xmin, ymin, xmax - xmin, ymax - ymin);
+	width = xmax - xmin;
+	height = ymax - ymin;
+	// Opaque black background keeps text readable on any canvas
+	pixels = malloc(width * height * sizeof(union fb_pixel));
+	if(!pixels && width && height) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	for(i = 0; i < width * height; i++) {
+		pixels[i].abgr = FB_GRAY8_TO_PIXEL(0);
+	}
 
 	ftpen.x = ftpen.y = 0;
-
-	for(i = 0; i < strlen(text); i++) {
-		fterr = FT_Load_Char(txtrndr->ftface, text[i], FT_LOAD_RENDER);
-		if(fterr) {
-			err = fterr;
-			fprintf(stderr, "Warning: Failed to find glyph for char '%c': %s(%d)\n", text[i], FT_Error_String(fterr), err);
+	for(i = 0; i < len; i++) {
+		unsigned int row, col;
+		int x, y;
+		glyph = glyphs[i];
+		if(!glyph->valid) {
 			continue;
 		}
 
-		draw_bitmap(fb, &ftslot->bitmap, x + CARTESIAN_TO_PIXELS(ftpen.x), y + CARTESIAN_TO_PIXELS(ftpen.y), ftslot->bitmap_top);
+		x = CARTESIAN_TO_PIXELS(ftpen.x) - xmin;
+		y = CARTESIAN_TO_PIXELS(ftpen.y) - glyph->top - ymin;
+		for(row = 0; row < glyph->rows; row++) {
+			union fb_pixel* line = &pixels[(y + row) * width + x];
+			unsigned char* gray = &glyph->bitmap[glyph->width * row];
+			for(col = 0; col < glyph->width; col++) {
+				line[col].abgr = FB_GRAY8_TO_PIXEL(gray[col]);
+			}
+		}
 
-		ftpen.x += ftslot->advance.x;
-		ftpen.y += ftslot->advance.y;
+		ftpen.x += glyph->advance_x;
+		ftpen.y += glyph->advance_y;
 	}
+	pthread_mutex_unlock(&txtrndr->font_lock);
+
+	free(str->text);
+	free(str->pixels);
+	str->text = text_copy;
+	str->size = size;
+	str->x_offset = xmin;
+	str->y_offset = ymin;
+	str->width = width;
+	str->height = height;
+	str->pixels = pixels;
+	return 1;
+
 fail:
 	pthread_mutex_unlock(&txtrndr->font_lock);
+	free(text_copy);
 	return err;
 }
+
+// Blit a rasterised string with its pen origin at (x, y)
+void textrender_string_draw(struct textrender_string* str, struct fb* fb, unsigned int x, unsigned int y) {
+	int left = (int)x + str->x_offset, top = (int)y + str->y_offset;
+	int right = min(left + (int)str->width, (int)fb->size.width);
+	int bottom = min(top + (int)str->height, (int)fb->size.height);
+	int skip_x = max(0, -left), skip_y = max(0, -top);
+	int line;
+
+	left = max(left, 0);
+	top = max(top, 0);
+	if(right <= left || bottom <= top) {
+		return;
+	}
+
+	for(line = top; line < bottom; line++) {
+		memcpy(fb_get_line_base(fb, line) + left, &str->pixels[(line - top + skip_y) * str->width + skip_x],
+			(right - left) * sizeof(union fb_pixel));
+	}
+	fb_mark_dirty(fb, left, top, right - left, bottom - top);
+}
+
+void textrender_string_free(struct textrender_string* str) {
+	free(str->text);
+	free(str->pixels);
+	*str = TEXTRENDER_STRING_INIT;
+}
+
+int textrender_draw_string(struct textrender* txtrndr, struct fb* fb, unsigned int x, unsigned int y, const char* text, unsigned int size) {
+	int err;
+	struct textrender_string str = TEXTRENDER_STRING_INIT;
+
+	if((err = textrender_string_update(txtrndr, &str, text, size)) < 0) {
+		return err;
+	}
+	textrender_string_draw(&str, fb, x, y);
+	textrender_string_free(&str);
+	return 0;
+}
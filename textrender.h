@@ -2,22 +2,67 @@
 #define _TEXTRENDER_H_
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include "framebuffer.h"
+
 // FT_Error_String is not supported by older libfreetype2 versions
 #ifndef FT_Error_String
 #define FT_Error_String(_) ("FT_Error_String not supported")
 #endif
 
+#define TEXTRENDER_NUM_GLYPHS 256
+
+struct textrender_glyph {
+	bool loaded;
+	// False if the font has no glyph for this char
+	bool valid;
+	unsigned int width;
+	unsigned int rows;
+	int top;
+	int left;
+	FT_Pos metrics_width;
+	FT_Pos metrics_height;
+	FT_Pos advance_x;
+	FT_Pos advance_y;
+	unsigned char* bitmap;
+};
+
+// Rendered glyphs of one font size
+struct textrender_glyph_cache {
+	unsigned int size;
+	struct textrender_glyph glyphs[TEXTRENDER_NUM_GLYPHS];
+};
+
 struct textrender {
 	pthread_mutex_t font_lock;
 	FT_Library ftlib;
 	FT_Face ftface;
+	unsigned int char_size;
+	struct textrender_glyph_cache** caches;
+	size_t num_caches;
+	size_t caches_alloc;
+};
+
+// A string rasterised once and blitted until its text changes
+struct textrender_string {
+	char* text;
+	unsigned int size;
+	// Offset of the top left corner relative to the pen origin
+	int x_offset;
+	int y_offset;
+	unsigned int width;
+	unsigned int height;
+	union fb_pixel* pixels;
 };
 
+#define TEXTRENDER_STRING_INIT ((struct textrender_string){ 0 })
+
 // Management
 int textrender_alloc(struct textrender** ret, char* fontfile);
 void textrender_free(struct textrender* txtrndr);
@@ -25,4 +70,8 @@ void textrender_free(struct textrender* txtrndr);
 // Drawing
 int textrender_draw_string(struct textrender* txtrndr, struct fb* fb, unsigned int x, unsigned int y, const char* text, unsigned int size);
 
+int textrender_string_update(struct textrender* txtrndr, struct textrender_string* str, const char* text, unsigned int size);
+void textrender_string_draw(struct textrender_string* str, struct fb* fb, unsigned int x, unsigned int y);
+void textrender_string_free(struct textrender_string* str);
+
 #endif
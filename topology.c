@@ -0,0 +1,451 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topology.h"
+#include "util.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * At startup the machine layout is read from sysfs: online CPUs, the NUMA
+ * node of every CPU and the CPUs isolated from the scheduler. Together with
+ * the affinity shoreline was started with this yields the usable CPUs.
+ *
+ * Every thread of shoreline belongs to a role. Roles can be assigned CPUs on
+ * the command line, all others are planned automatically:
+ *
+ *  - The compositor gets the first usable CPU.
+ *  - Frontends and statistics share the second usable CPU, or run on the
+ *    compositor CPU on machines with less than four usable CPUs.
+ *  - Connections get all other usable CPUs, listeners use the same CPUs.
+ *  - Workqueue workers run on all usable CPUs, most of their work happens
+ *    while the compositor waits for it.
+ *
+ * Isolated CPUs are never planned automatically, but may be named explicitly.
+ *
+ * Threads of all roles except connections and workqueue workers are pinned to
+ * the whole CPU set of their role. Connections and workers are pinned to a
+ * single CPU each.
+ *
+ * New connections go to the CPU their packets are received on, as reported by
+ * SO_INCOMING_CPU. That keeps socket buffers in the cache of the CPU that
+ * processed them in softirq context and the framebuffer on the node of the
+ * NIC queue. A single RX queue, e.g. on loopback, would put all connections on
+ * one CPU though. Once the incoming CPU carries more than
+ * TOPOLOGY_INCOMING_SLACK connections above the least loaded connection CPU of
+ * its node, or if it is not a connection CPU at all, the connection goes to
+ * that least loaded CPU instead. Connections without an incoming CPU go to the
+ * least loaded connection CPU of any node.
+ */
+
+static const char* role_names[TOPOLOGY_NUM_ROLES] = {
+	[TOPOLOGY_ROLE_LISTEN] = "listen",
+	[TOPOLOGY_ROLE_CONNECTION] = "connection",
+	[TOPOLOGY_ROLE_COMPOSITOR] = "compositor",
+	[TOPOLOGY_ROLE_FRONTEND] = "frontend",
+	[TOPOLOGY_ROLE_STATISTICS] = "statistics",
+	[TOPOLOGY_ROLE_WORKQUEUE] = "workqueue",
+};
+
+const char* topology_role_name(enum topology_role role) {
+	return role_names[role];
+}
+
+// Parse a kernel style cpulist like 0-3,8,10-11
+static int parse_cpulist(const char* list, cpu_set_t* set) {
+	char* end;
+	unsigned long first, last, cpu;
+
+	CPU_ZERO(set);
+	while(isspace(*list)) {
+		list++;
+	}
+	while(*list && *list != '\n') {
+		if(!isdigit(*list)) {
+			return -EINVAL;
+		}
+		first = strtoul(list, &end, 10);
+		last = first;
+		if(*end == '-') {
+			if(!isdigit(end[1])) {
+				return -EINVAL;
+			}
+			last = strtoul(end + 1, &end, 10);
+		}
+		if(last < first || last >= CPU_SETSIZE) {
+			return -EINVAL;
+		}
+		for(cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		if(*end == ',') {
+			end++;
+		} else if(*end && *end != '\n') {
+			return -EINVAL;
+		}
+		list = end;
+	}
+	return 0;
+}
+
+static void format_cpulist(const cpu_set_t* set, char* buf, size_t len) {
+	int cpu, last;
+	size_t pos = 0;
+
+	buf[0] = '\0';
+	for(cpu = 0; cpu < CPU_SETSIZE && pos < len; cpu++) {
+		if(!CPU_ISSET(cpu, set)) {
+			continue;
+		}
+		for(last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set); last++);
+		if(last == cpu) {
+			pos += snprintf(buf + pos, len - pos, "%s%d", pos ? "," : "", cpu);
+		} else {
+			pos += snprintf(buf + pos, len - pos, "%s%d-%d", pos ? "," : "", cpu, last);
+		}
+		cpu = last;
+	}
+	if(!pos) {
+		snprintf(buf, len, "none");
+	}
+}
+
+// Missing files leave the set empty
+static int read_cpulist(const char* path, cpu_set_t* set) {
+	char buf[4096];
+	FILE* file;
+	int err;
+
+	CPU_ZERO(set);
+	file = fopen(path, "r");
+	if(!file) {
+		return -errno;
+	}
+	if(!fgets(buf, sizeof(buf), file)) {
+		buf[0] = '\0';
+	}
+	fclose(file);
+	if((err = parse_cpulist(buf, set))) {
+		fprintf(stderr, "Failed to parse cpu list in %s\n", path);
+	}
+	return err;
+}
+
+static void read_nodes(struct topology* topo) {
+	DIR* dir;
+	struct dirent* dirent;
+	char path[PATH_MAX];
+	cpu_set_t cpus;
+	unsigned long node;
+	char* end;
+	int cpu;
+
+	topo->num_nodes = 1;
+	dir = opendir(TOPOLOGY_SYSFS_NODE);
+	if(!dir) {
+		return;
+	}
+	while((dirent = readdir(dir))) {
+		if(strncmp(dirent->d_name, "node", 4) || !isdigit(dirent->d_name[4])) {
+			continue;
+		}
+		node = strtoul(dirent->d_name + 4, &end, 10);
+		if(*end) {
+			continue;
+		}
+		snprintf(path, sizeof(path), TOPOLOGY_SYSFS_NODE "/%s/cpulist", dirent->d_name);
+		if(read_cpulist(path, &cpus)) {
+			continue;
+		}
+		for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if(CPU_ISSET(cpu, &cpus)) {
+				topo->cpu_node[cpu] = node;
+			}
+		}
+		topo->num_nodes = max(topo->num_nodes, node + 1);
+	}
+	closedir(dir);
+}
+
+int topology_alloc(struct topology** ret) {
+	int err;
+	struct topology* topo = calloc(1, sizeof(*topo));
+	if(!topo) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if(read_cpulist(TOPOLOGY_SYSFS_CPU "/online", &topo->online) || !CPU_COUNT(&topo->online)) {
+		fprintf(stderr, "Failed to read online CPUs, assuming CPU 0 only\n");
+		CPU_SET(0, &topo->online);
+	}
+	// Only present on kernels with isolcpus support
+	read_cpulist(TOPOLOGY_SYSFS_CPU "/isolated", &topo->isolated);
+	if(sched_getaffinity(0, sizeof(topo->allowed), &topo->allowed)) {
+		err = -errno;
+		fprintf(stderr, "Failed to get CPU affinity: %s (%d)\n", strerror(errno), err);
+		goto fail_topo;
+	}
+	read_nodes(topo);
+
+	*ret = topo;
+	return 0;
+
+fail_topo:
+	free(topo);
+fail:
+	return err;
+}
+
+void topology_free(struct topology* topo) {
+	free(topo);
+}
+
+int topology_configure(struct topology* topo, const char* spec) {
+	const char* cpus = strchr(spec, '=');
+	cpu_set_t set, available;
+	size_t name_len;
+	int role, cpu;
+
+	if(!cpus) {
+		fprintf(stderr, "Invalid placement '%s', expected <role>=<cpulist>\n", spec);
+		return -EINVAL;
+	}
+	name_len = cpus - spec;
+	for(role = 0; role < TOPOLOGY_NUM_ROLES; role++) {
+		if(strlen(role_names[role]) == name_len && !strncmp(spec, role_names[role], name_len)) {
+			break;
+		}
+	}
+	if(role == TOPOLOGY_NUM_ROLES) {
+		fprintf(stderr, "Unknown thread role '%.*s', valid roles are", (int)name_len, spec);
+		for(role = 0; role < TOPOLOGY_NUM_ROLES; role++) {
+			fprintf(stderr, " %s", role_names[role]);
+		}
+		fprintf(stderr, "\n");
+		return -EINVAL;
+	}
+	if(parse_cpulist(cpus + 1, &set) || !CPU_COUNT(&set)) {
+		fprintf(stderr, "Invalid cpu list '%s' for role %s\n", cpus + 1, role_names[role]);
+		return -EINVAL;
+	}
+
+	CPU_AND(&available, &topo->online, &topo->allowed);
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu, &set) && !CPU_ISSET(cpu, &available)) {
+			fprintf(stderr, "CPU %d of role %s is offline or outside the allowed CPUs\n", cpu, role_names[role]);
+			return -EINVAL;
+		}
+	}
+
+	CPU_AND(&available, &set, &topo->isolated);
+	if(CPU_COUNT(&available)) {
+		printf("Role %s uses isolated CPUs, the scheduler will not balance its threads there\n", role_names[role]);
+	}
+
+	topo->roles[role] = set;
+	topo->configured[role] = true;
+	return 0;
+}
+
+// Returns the nth CPU in set, -1 if there are less
+static int nth_cpu(const cpu_set_t* set, unsigned int n) {
+	int cpu;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu, set) && !n--) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+static void plan_role(struct topology* topo, enum topology_role role, const cpu_set_t* set) {
+	if(!topo->configured[role]) {
+		topo->roles[role] = *set;
+	}
+}
+
+int topology_plan(struct topology* topo) {
+	cpu_set_t usable, housekeeping, single, rest;
+	int compositor_cpu, aux_cpu;
+
+	CPU_AND(&usable, &topo->online, &topo->allowed);
+	if(!CPU_COUNT(&usable)) {
+		fprintf(stderr, "No usable CPUs\n");
+		return -EINVAL;
+	}
+	// Started on isolated CPUs only, presumably on purpose
+	CPU_XOR(&rest, &usable, &topo->isolated);
+	CPU_AND(&rest, &rest, &usable);
+	if(CPU_COUNT(&rest)) {
+		usable = rest;
+	}
+
+	compositor_cpu = nth_cpu(&usable, 0);
+	aux_cpu = CPU_COUNT(&usable) >= 4 ? nth_cpu(&usable, 1) : compositor_cpu;
+
+	CPU_ZERO(&single);
+	CPU_SET(compositor_cpu, &single);
+	plan_role(topo, TOPOLOGY_ROLE_COMPOSITOR, &single);
+	CPU_ZERO(&single);
+	CPU_SET(aux_cpu, &single);
+	plan_role(topo, TOPOLOGY_ROLE_FRONTEND, &single);
+	plan_role(topo, TOPOLOGY_ROLE_STATISTICS, &single);
+
+	CPU_OR(&housekeeping, &topo->roles[TOPOLOGY_ROLE_COMPOSITOR], &topo->roles[TOPOLOGY_ROLE_FRONTEND]);
+	CPU_OR(&housekeeping, &housekeeping, &topo->roles[TOPOLOGY_ROLE_STATISTICS]);
+	CPU_XOR(&rest, &usable, &housekeeping);
+	CPU_AND(&rest, &rest, &usable);
+	if(CPU_COUNT(&usable) < 4 || !CPU_COUNT(&rest)) {
+		rest = usable;
+	}
+	plan_role(topo, TOPOLOGY_ROLE_CONNECTION, &rest);
+	plan_role(topo, TOPOLOGY_ROLE_LISTEN, &topo->roles[TOPOLOGY_ROLE_CONNECTION]);
+	plan_role(topo, TOPOLOGY_ROLE_WORKQUEUE, &usable);
+
+	return 0;
+}
+
+void topology_print(struct topology* topo) {
+	char cpus[1024], nodes[256];
+	size_t pos;
+	unsigned int node;
+	int role, cpu;
+	cpu_set_t on_node;
+
+	format_cpulist(&topo->online, cpus, sizeof(cpus));
+	printf("CPU topology: %u NUMA node(s), online CPUs %s", topo->num_nodes, cpus);
+	if(CPU_COUNT(&topo->isolated)) {
+		format_cpulist(&topo->isolated, cpus, sizeof(cpus));
+		printf(", isolated CPUs %s", cpus);
+	}
+	printf("\n");
+
+	for(role = 0; role < TOPOLOGY_NUM_ROLES; role++) {
+		pos = 0;
+		nodes[0] = '\0';
+		for(node = 0; node < topo->num_nodes && pos < sizeof(nodes); node++) {
+			CPU_ZERO(&on_node);
+			for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if(CPU_ISSET(cpu, &topo->roles[role]) && topo->cpu_node[cpu] == node) {
+					CPU_SET(cpu, &on_node);
+				}
+			}
+			if(CPU_COUNT(&on_node)) {
+				pos += snprintf(nodes + pos, sizeof(nodes) - pos, "%s%u", pos ? "," : "", node);
+			}
+		}
+		format_cpulist(&topo->roles[role], cpus, sizeof(cpus));
+		printf("  %-10s CPUs %s (node %s)%s\n", role_names[role], cpus, nodes,
+			topo->configured[role] ? "" : ", automatic");
+	}
+}
+
+int topology_pin_self(struct topology* topo, enum topology_role role) {
+#ifndef FEATURE_BROKEN_PTHREAD
+	int err;
+
+	if(!topo) {
+		return 0;
+	}
+	if((err = pthread_setaffinity_np(pthread_self(), sizeof(topo->roles[role]), &topo->roles[role]))) {
+		fprintf(stderr, "Failed to pin %s thread, continuing without affinity setting: %s (%d)\n",
+			role_names[role], strerror(err), err);
+		return -err;
+	}
+#endif
+	return 0;
+}
+
+int topology_pin_cpu(int cpu) {
+#ifndef FEATURE_BROKEN_PTHREAD
+	cpu_set_t set;
+	int err;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+		fprintf(stderr, "Failed to pin thread to CPU %d, continuing without affinity setting: %s (%d)\n",
+			cpu, strerror(err), err);
+		return -err;
+	}
+#endif
+	return 0;
+}
+
+unsigned int topology_role_cpus_on_node(struct topology* topo, enum topology_role role, unsigned int node, int* cpus, unsigned int max_cpus) {
+	unsigned int num_cpus = 0;
+	int cpu;
+
+	for(cpu = 0; cpu < CPU_SETSIZE && num_cpus < max_cpus; cpu++) {
+		if(CPU_ISSET(cpu, &topo->roles[role]) && topo->cpu_node[cpu] == node) {
+			cpus[num_cpus++] = cpu;
+		}
+	}
+	return num_cpus;
+}
+
+unsigned int topology_cpu_node(struct topology* topo, int cpu) {
+	if(cpu < 0 || cpu >= CPU_SETSIZE) {
+		return 0;
+	}
+	return topo->cpu_node[cpu];
+}
+
+int topology_connection_place(struct topology* topo, int incoming_cpu) {
+	const cpu_set_t* set;
+	unsigned int load, best_load = UINT_MAX, node_load = UINT_MAX;
+	int cpu, best_cpu = -1, node_cpu = -1;
+	bool local;
+
+	if(!topo) {
+		return -1;
+	}
+	set = &topo->roles[TOPOLOGY_ROLE_CONNECTION];
+	local = incoming_cpu >= 0 && incoming_cpu < CPU_SETSIZE && CPU_ISSET(incoming_cpu, &topo->online);
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, set)) {
+			continue;
+		}
+		load = __atomic_load_n(&topo->connections[cpu], __ATOMIC_RELAXED);
+		if(load < best_load) {
+			best_load = load;
+			best_cpu = cpu;
+		}
+		if(local && topo->cpu_node[cpu] == topo->cpu_node[incoming_cpu] && load < node_load) {
+			node_load = load;
+			node_cpu = cpu;
+		}
+	}
+	if(local && CPU_ISSET(incoming_cpu, set) &&
+	   __atomic_load_n(&topo->connections[incoming_cpu], __ATOMIC_RELAXED) <= node_load + TOPOLOGY_INCOMING_SLACK) {
+		best_cpu = incoming_cpu;
+	} else if(node_cpu >= 0) {
+		best_cpu = node_cpu;
+	}
+	// Racing placements may pick the same CPU, that only costs a little balance
+	if(best_cpu >= 0) {
+		__atomic_add_fetch(&topo->connections[best_cpu], 1, __ATOMIC_RELAXED);
+	}
+	return best_cpu;
+}
+
+void topology_connection_release(struct topology* topo, int cpu) {
+	if(topo && cpu >= 0) {
+		__atomic_sub_fetch(&topo->connections[cpu], 1, __ATOMIC_RELAXED);
+	}
+}
+
+void topology_connection_move(struct topology* topo, int from, int to) {
+	topology_connection_release(topo, from);
+	if(topo && to >= 0) {
+		__atomic_add_fetch(&topo->connections[to], 1, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+
+#define TOPOLOGY_SYSFS_CPU "/sys/devices/system/cpu"
+#define TOPOLOGY_SYSFS_NODE "/sys/devices/system/node"
+// Connections the CPU receiving a connection may carry above the least loaded CPU of its node
+#define TOPOLOGY_INCOMING_SLACK 2
+
+enum topology_role {
+	// Threads accepting connections
+	TOPOLOGY_ROLE_LISTEN,
+	// Per connection threads, one CPU each
+	TOPOLOGY_ROLE_CONNECTION,
+	// Main thread, coalescing and overlay composition
+	TOPOLOGY_ROLE_COMPOSITOR,
+	// Output threads and threads started by frontends
+	TOPOLOGY_ROLE_FRONTEND,
+	// Statistics API and publishing threads
+	TOPOLOGY_ROLE_STATISTICS,
+	// Workqueue workers, one CPU each
+	TOPOLOGY_ROLE_WORKQUEUE,
+	TOPOLOGY_NUM_ROLES
+};
+
+struct topology {
+	unsigned int num_nodes;
+	// NUMA node of each online CPU
+	unsigned int cpu_node[CPU_SETSIZE];
+	cpu_set_t online;
+	// CPUs isolated from the scheduler, only used if a role names them explicitly
+	cpu_set_t isolated;
+	// Affinity shoreline was started with, e.g. by taskset or numactl
+	cpu_set_t allowed;
+
+	cpu_set_t roles[TOPOLOGY_NUM_ROLES];
+	bool configured[TOPOLOGY_NUM_ROLES];
+
+	// Connections currently placed on each CPU
+	unsigned int connections[CPU_SETSIZE];
+};
+
+int topology_alloc(struct topology** ret);
+void topology_free(struct topology* topo);
+// Parse a placement of the form <role>=<cpulist>, e.g. connection=4-31,36-63
+int topology_configure(struct topology* topo, const char* spec);
+// Assign CPUs to all roles not configured explicitly
+int topology_plan(struct topology* topo);
+void topology_print(struct topology* topo);
+
+const char* topology_role_name(enum topology_role role);
+int topology_pin_self(struct topology* topo, enum topology_role role);
+int topology_pin_cpu(int cpu);
+// Fills cpus with up to max_cpus CPUs of role on node, returns their number
+unsigned int topology_role_cpus_on_node(struct topology* topo, enum topology_role role, unsigned int node, int* cpus, unsigned int max_cpus);
+unsigned int topology_cpu_node(struct topology* topo, int cpu);
+
+// Pick a CPU for a connection received on incoming_cpu (-1 if unknown), returns -1 if there is none
+int topology_connection_place(struct topology* topo, int incoming_cpu);
+void topology_connection_release(struct topology* topo, int cpu);
+void topology_connection_move(struct topology* topo, int from, int to);
+
+#endif
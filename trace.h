@@ -0,0 +1,29 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Static tracepoints for perf, bpftrace and SystemTap
+ *
+ * With FEATURE_USDT every TRACE macro emits a USDT probe in the provider
+ * "shoreline". A probe site is a single nop plus an ELF note describing the
+ * location of the arguments, attaching to it does not require a rebuild.
+ * Without FEATURE_USDT the macros expand to nothing and arguments are not
+ * evaluated.
+ */
+
+#ifdef FEATURE_USDT
+#include <sys/sdt.h>
+
+#define TRACE(name) DTRACE_PROBE(shoreline, name)
+#define TRACE1(name, a1) DTRACE_PROBE1(shoreline, name, a1)
+#define TRACE2(name, a1, a2) DTRACE_PROBE2(shoreline, name, a1, a2)
+#define TRACE3(name, a1, a2, a3) DTRACE_PROBE3(shoreline, name, a1, a2, a3)
+#else
+// sizeof keeps variables only used for tracing from triggering unused warnings
+#define TRACE(name) do { } while(0)
+#define TRACE1(name, a1) do { (void)sizeof(a1); } while(0)
+#define TRACE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while(0)
+#define TRACE3(name, a1, a2, a3) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while(0)
+#endif
+
+#endif
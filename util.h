@@ -49,6 +49,12 @@ static inline long long int get_timespec_diff(struct timespec* a, struct timespe
 	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
 }
 
+static inline unsigned long long get_monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 static inline bool is_big_endian() {
 	return htobe32(0x11223344) == 0x11223344;
 }
@@ -1,7 +1,6 @@
 #include <errno.h>
 #include <stdio.h>
 
-#include "main.h"
 #include "vnc.h"
 #include "framebuffer.h"
 
@@ -20,7 +19,7 @@ static const struct frontend_arg fargs[] = {
 	{ .name = "", .configure = NULL },
 };
 
-DECLARE_FRONTEND_SIG_ARGS(front_vnc, "VNC server frontend", &fops, fargs);
+DECLARE_FRONTEND_THREADABLE_SIG_ARGS(front_vnc, "VNC server frontend", &fops, fargs);
 
 static void set_shared(struct vnc* vnc, bool shared) {
 	vnc->server->alwaysShared = shared ? TRUE : FALSE;
@@ -29,9 +28,9 @@ static void set_shared(struct vnc* vnc, bool shared) {
 
 static void pre_display_cb(struct _rfbClientRec* client) {
 	struct vnc* vnc = client->screen->screenData;
+	// Frames come with overlays composed, just keep vnc_update from copying mid send
 	if(vnc->front.sync_overlay_draw) {
 		pthread_mutex_lock(&vnc->draw_lock);
-		draw_overlays(vnc->fb_overlay);
 	}
 }
 
@@ -111,13 +110,10 @@ void vnc_free(struct frontend* front) {
 
 int vnc_update(struct frontend* front) {
 	struct vnc* vnc = container_of(front, struct vnc, front);
-	if(front->sync_overlay_draw) {
-		pthread_mutex_lock(&vnc->draw_lock);
-	}
+	// May run on an output thread while the main thread draws strings
+	pthread_mutex_lock(&vnc->draw_lock);
 	fb_copy(vnc->fb_overlay, vnc->fb);
-	if(front->sync_overlay_draw) {
-		pthread_mutex_unlock(&vnc->draw_lock);
-	}
+	pthread_mutex_unlock(&vnc->draw_lock);
 	rfbMarkRectAsModified(vnc->server, 0, 0, vnc->fb->size.width, vnc->fb->size.height);
 	return !rfbIsActive(vnc->server);
 }
@@ -128,8 +124,10 @@ int vnc_draw_string(struct frontend* front, unsigned x, unsigned y, char* str) {
 	if(vnc->font) {
 		space = rfbWidthOfString(vnc->font, " ");
 		width = rfbWidthOfString(vnc->font, str);
+		pthread_mutex_lock(&vnc->draw_lock);
 		rfbFillRect(vnc->server, x, y, x + width + 2 * space, y + VNC_FONT_HEIGHT + 4, 0x00000000);
 		rfbDrawString(vnc->server, vnc->font, x + space, y + VNC_FONT_HEIGHT + 2, str, 0xffffffff);
+		pthread_mutex_unlock(&vnc->draw_lock);
 	}
 	return 0;
 }
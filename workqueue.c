@@ -2,78 +2,641 @@
 
 #include <errno.h>
 #include "numa.h"
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "topology.h"
+#include "trace.h"
+#include "util.h"
+
+/*
+ * Theory Of Operation
+ * ===================
+ *
+ * There is one workqueue per NUMA node, each with one worker thread per core
+ * of that node. Every worker owns two queues:
+ *
+ *  - An intrusive multi producer single consumer inbox for jobs submitted from
+ *    outside the pool. Producers pick a worker round robin and push with a
+ *    single atomic exchange on the inbox head. Consuming requires the
+ *    inbox_busy flag. Usually the owner holds it, but an idle worker may take
+ *    it to steal from the inbox of a busy one.
+ *
+ *  - A Chase-Lev work stealing deque. Only the owner pushes to it, the owner
+ *    takes from the bottom while other workers steal from the top. parallel_for
+ *    jobs split their range in halves and push the upper halves to the deque
+ *    of the worker running them, so idle workers steal large chunks first and
+ *    the owner continues on cache warm small ones.
+ *
+ * A worker looking for work checks its own deque, its own inbox, the workers
+ * of its own node and then the workers of other nodes ordered by NUMA
+ * distance. Stealing from the local node first keeps jobs close to the memory
+ * they were submitted for, crossing nodes only happens when the local node is
+ * busy.
+ *
+ * Workers that found nothing increment the sleeping count of their workqueue,
+ * look for work once more and then wait on the wake semaphore. Producers
+ * first publish a job and then check for sleepers, waking one on the target
+ * node or, if none sleeps there, one on the nearest other node. Both sides use
+ * sequentially consistent operations in between, so either the producer sees
+ * the sleeper or the sleeper sees the job. A push into an inbox takes two
+ * steps, exchanging the head and linking the previous head. A worker that
+ * runs into a half linked inbox or loses a race for a busy flag or a steal
+ * retries instead of going to sleep.
+ *
+ * Entries come from a per node pool. The free list is a stack of pool indices
+ * with an ABA tag that is incremented on every pop, so a pop can not succeed
+ * on a stale head. The pool array is never freed while the workqueue runs,
+ * reading the next index of an entry that was taken by someone else is
+ * harmless. Entries stolen by another node are returned to the pool they
+ * were taken from. If the pool is exhausted entries are allocated with malloc.
+ *
+ * Jobs can be grouped by a completion to fan out bulk work and wait for it.
+ */
 
 static struct workqueue* workqueues;
-static int num_workqueues = 0;
+static unsigned num_workqueues = 0;
+// Placement of workers, NULL to use all CPUs of each node
+static struct topology* topology;
 
-static int num_workqueue_items = 0;
+static __thread struct workqueue_worker* current_worker = NULL;
 
-static void* work_thread(void* priv) {
+#define POOL_NONE -1
+#define POOL_HEAD(tag, index) (((uint64_t)(tag) << 32) | (uint32_t)(index))
+#define POOL_HEAD_INDEX(head) ((int32_t)(uint32_t)(head))
+#define POOL_HEAD_TAG(head) ((uint32_t)((head) >> 32))
+
+#define DEQUE_SLOT(deque, index) (&(deque)->entries[(index) & (WORKQUEUE_DEQUE_SIZE - 1)])
+
+static struct workqueue_entry* pool_get(struct workqueue* wqueue) {
+	uint64_t head, new_head;
+	struct workqueue_entry* entry;
+
+	head = __atomic_load_n(&wqueue->pool_free, __ATOMIC_ACQUIRE);
+	do {
+		if(POOL_HEAD_INDEX(head) == POOL_NONE) {
+			entry = malloc(sizeof(*entry));
+			if(entry) {
+				entry->pool_index = POOL_NONE;
+			}
+			return entry;
+		}
+		entry = &wqueue->pool[POOL_HEAD_INDEX(head)];
+		new_head = POOL_HEAD(POOL_HEAD_TAG(head) + 1, __atomic_load_n(&entry->pool_next, __ATOMIC_RELAXED));
+	} while(!__atomic_compare_exchange_n(&wqueue->pool_free, &head, new_head, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return entry;
+}
+
+// Stolen entries go back to the pool of the node they came from
+static void pool_put(struct workqueue_entry* entry) {
+	struct workqueue* wqueue = entry->pool_owner;
+	uint64_t head, new_head;
+
+	if(entry->pool_index == POOL_NONE) {
+		free(entry);
+		return;
+	}
+
+	head = __atomic_load_n(&wqueue->pool_free, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&entry->pool_next, POOL_HEAD_INDEX(head), __ATOMIC_RELAXED);
+		new_head = POOL_HEAD(POOL_HEAD_TAG(head), entry->pool_index);
+	} while(!__atomic_compare_exchange_n(&wqueue->pool_free, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Leaves the pool fields alone, pool_next may still be read by a racing pool_get
+static void entry_init(struct workqueue_entry* entry, void* priv, struct workqueue_completion* completion) {
+	entry->cb = NULL;
+	entry->err = NULL;
+	entry->cleanup = NULL;
+	entry->range_cb = NULL;
+	entry->priv = priv;
+	entry->completion = completion;
+}
+
+static void inbox_push(struct workqueue_worker* worker, struct workqueue_entry* entry) {
+	struct workqueue_entry* prev;
+
+	__atomic_store_n(&entry->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&worker->head, entry, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, entry, __ATOMIC_RELEASE);
+}
+
+// Caller must hold inbox_busy. Returns NULL if the inbox is empty or a push is in progress
+static struct workqueue_entry* inbox_pop(struct workqueue_worker* worker, bool* retry) {
+	struct workqueue_entry* tail = __atomic_load_n(&worker->tail, __ATOMIC_RELAXED);
+	struct workqueue_entry* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if(tail == &worker->stub) {
+		if(!next) {
+			if(__atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) != tail) {
+				*retry = true;
+			}
+			return NULL;
+		}
+		__atomic_store_n(&worker->tail, next, __ATOMIC_RELAXED);
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if(next) {
+		__atomic_store_n(&worker->tail, next, __ATOMIC_RELAXED);
+		return tail;
+	}
+	if(tail != __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE)) {
+		*retry = true;
+		return NULL;
+	}
+	inbox_push(worker, &worker->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next) {
+		__atomic_store_n(&worker->tail, next, __ATOMIC_RELAXED);
+		return tail;
+	}
+	*retry = true;
+	return NULL;
+}
+
+static struct workqueue_entry* inbox_try_pop(struct workqueue_worker* worker, bool* retry) {
+	struct workqueue_entry* entry;
+
+	// Cheap check first, most inboxes a thief looks at are empty
+	if(__atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == &worker->stub &&
+		__atomic_load_n(&worker->tail, __ATOMIC_RELAXED) == &worker->stub) {
+		return NULL;
+	}
+	if(__atomic_exchange_n(&worker->inbox_busy, true, __ATOMIC_ACQUIRE)) {
+		*retry = true;
+		return NULL;
+	}
+	entry = inbox_pop(worker, retry);
+	__atomic_store_n(&worker->inbox_busy, false, __ATOMIC_RELEASE);
+	return entry;
+}
+
+// Owner only, returns false if the deque is full
+static bool deque_push(struct workqueue_deque* deque, struct workqueue_entry* entry) {
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if(bottom - top >= WORKQUEUE_DEQUE_SIZE) {
+		return false;
+	}
+	__atomic_store_n(DEQUE_SLOT(deque, bottom), entry, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Owner only
+static struct workqueue_entry* deque_take(struct workqueue_deque* deque) {
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t top;
+	struct workqueue_entry* entry = NULL;
+
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	if(top <= bottom) {
+		entry = __atomic_load_n(DEQUE_SLOT(deque, bottom), __ATOMIC_RELAXED);
+		if(top == bottom) {
+			// Last entry, race against thieves
+			if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				entry = NULL;
+			}
+			__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return entry;
+}
+
+static struct workqueue_entry* deque_steal(struct workqueue_deque* deque, bool* retry) {
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	int64_t bottom;
+	struct workqueue_entry* entry;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if(top >= bottom) {
+		return NULL;
+	}
+	entry = __atomic_load_n(DEQUE_SLOT(deque, top), __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		*retry = true;
+		return NULL;
+	}
+	return entry;
+}
+
+// Decrement sleeping if it is non-zero
+static bool claim_sleeper(struct workqueue* wqueue) {
+	unsigned int sleeping = __atomic_load_n(&wqueue->sleeping, __ATOMIC_SEQ_CST);
+
+	while(sleeping) {
+		if(__atomic_compare_exchange_n(&wqueue->sleeping, &sleeping, sleeping - 1, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Must be called after publishing a job on wqueue
+static void wake_one(struct workqueue* wqueue) {
+	struct workqueue* other;
+	unsigned i;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(claim_sleeper(wqueue)) {
+		sem_post(&wqueue->wake);
+		return;
+	}
+	// Nobody idle on the node, let the nearest idle node steal
+	for(i = 0; i < num_workqueues - 1; i++) {
+		other = &workqueues[wqueue->steal_order[i]];
+		if(claim_sleeper(other)) {
+			sem_post(&other->wake);
+			return;
+		}
+	}
+}
+
+static void completion_add(struct workqueue_completion* completion) {
+	__atomic_fetch_add(&completion->pending, 1, __ATOMIC_RELAXED);
+}
+
+static void completion_done(struct workqueue_completion* completion, int err) {
+	unsigned int pending = __atomic_load_n(&completion->pending, __ATOMIC_RELAXED);
+	int no_err = 0;
+
+	if(err) {
+		__atomic_compare_exchange_n(&completion->err, &no_err, err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	/*
+	 * The final decrement happens under the lock. Once the waiter saw zero it
+	 * may free the completion, so nothing may touch it after the unlock.
+	 */
+	while(pending > 1) {
+		if(__atomic_compare_exchange_n(&completion->pending, &pending, pending - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+	pthread_mutex_lock(&completion->lock);
+	if(!__atomic_sub_fetch(&completion->pending, 1, __ATOMIC_ACQ_REL)) {
+		pthread_cond_broadcast(&completion->cond);
+	}
+	pthread_mutex_unlock(&completion->lock);
+}
+
+static void finish_entry(struct workqueue_entry* entry, int err) {
+	struct workqueue_completion* completion = entry->completion;
+
+	if(entry->cleanup) {
+		entry->cleanup(err, entry->priv);
+	}
+	pool_put(entry);
+	if(completion) {
+		completion_done(completion, err);
+	}
+}
+
+// Split off upper halves until at most grain items are left
+static void split_range(struct workqueue_worker* worker, struct workqueue_entry* entry) {
+	struct workqueue* wqueue = worker->wqueue;
+	struct workqueue_entry* split;
+	unsigned int mid;
+
+	while(entry->end - entry->start > entry->grain) {
+		split = pool_get(wqueue);
+		if(!split) {
+			break;
+		}
+		mid = entry->start + (entry->end - entry->start) / 2;
+		entry_init(split, entry->priv, entry->completion);
+		split->range_cb = entry->range_cb;
+		split->start = mid;
+		split->end = entry->end;
+		split->grain = entry->grain;
+		// Accounted before a thief can finish it, the parent keeps pending above zero
+		if(split->completion) {
+			completion_add(split->completion);
+		}
+		if(!deque_push(&worker->deque, split)) {
+			finish_entry(split, 0);
+			break;
+		}
+		wake_one(wqueue);
+		entry->end = mid;
+	}
+}
+
+static void run_entry(struct workqueue_worker* worker, struct workqueue_entry* entry) {
+	struct workqueue* wqueue = worker->wqueue;
 	int err;
-	struct workqueue* wqueue = (struct workqueue*)priv;
+
+	if(entry->range_cb) {
+		split_range(worker, entry);
+		TRACE2(workqueue_job_start, wqueue->numa_node, entry->range_cb);
+		err = entry->range_cb(entry->priv, entry->start, entry->end);
+	} else {
+		TRACE2(workqueue_job_start, wqueue->numa_node, entry->cb);
+		err = entry->cb(entry->priv);
+	}
+	TRACE2(workqueue_job_end, wqueue->numa_node, err);
+	if(err && entry->err) {
+		err = entry->err(err, entry->priv);
+	}
+	finish_entry(entry, err);
+}
+
+static struct workqueue_entry* steal_from(struct workqueue_worker* thief, struct workqueue* victims, bool* retry) {
+	unsigned int i;
+	struct workqueue_worker* victim;
+	struct workqueue_entry* entry;
+
+	for(i = 0; i < victims->num_workers; i++) {
+		victim = &victims->workers[(thief->index + i) % victims->num_workers];
+		if(victim == thief) {
+			continue;
+		}
+		if((entry = deque_steal(&victim->deque, retry)) || (entry = inbox_try_pop(victim, retry))) {
+			TRACE2(workqueue_steal, thief->wqueue->numa_node, victims->numa_node);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Sets retry if there may be work that could not be taken right now
+static struct workqueue_entry* find_work(struct workqueue_worker* worker, bool* retry) {
+	struct workqueue* wqueue = worker->wqueue;
+	struct workqueue_entry* entry;
+	unsigned i;
+
+	*retry = false;
+	if((entry = deque_take(&worker->deque))) {
+		return entry;
+	}
+	if((entry = inbox_try_pop(worker, retry))) {
+		return entry;
+	}
+	if((entry = steal_from(worker, wqueue, retry))) {
+		return entry;
+	}
+	for(i = 0; i < num_workqueues - 1; i++) {
+		if((entry = steal_from(worker, &workqueues[wqueue->steal_order[i]], retry))) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void wait_wake(struct workqueue* wqueue) {
+	while(sem_wait(&wqueue->wake)) {
+		if(errno != EINTR) {
+			fprintf(stderr, "Failed to wait for work on NUMA node %u: %s (%d)\n", wqueue->numa_node, strerror(errno), errno);
+			// Do not spin on a broken semaphore
+			sleep(1);
+			return;
+		}
+	}
+}
+
+static void* work_thread(void* priv) {
+	struct workqueue_worker* worker = priv;
+	struct workqueue* wqueue = worker->wqueue;
+	struct workqueue_entry* entry;
+	bool retry;
+
+	current_worker = worker;
 	// If there is more than one workqueue we need to take care of allocation policies
 	if(num_workqueues > 1) {
+		numa_run_on_node(wqueue->numa_node);
 		numa_set_preferred(wqueue->numa_node);
 	}
-	pthread_mutex_lock(&wqueue->lock);
-	while(!wqueue->do_exit) {
-		pthread_cond_wait(&wqueue->cond, &wqueue->lock);
-		while(!(llist_is_empty(&wqueue->entries) || wqueue->do_exit)) {
-			struct llist_entry* llentry = llist_get_entry(&wqueue->entries, 0);
-			struct workqueue_entry* entry = llist_entry_get_value(llentry, struct workqueue_entry, list);
-			llist_remove(llentry);
-			num_workqueue_items--;
-			if((err = entry->cb(entry->priv))) {
-				if(!entry->err) {
-					if(entry->cleanup) {
-						entry->cleanup(err, entry->priv);
-					}
-					goto next;
-				}
-				if(entry->err(err, entry->priv)) {
-					if(entry->cleanup) {
-						entry->cleanup(err, entry->priv);
+	if(worker->cpu >= 0) {
+		topology_pin_cpu(worker->cpu);
+	}
+	while(!__atomic_load_n(&wqueue->do_exit, __ATOMIC_ACQUIRE)) {
+		if((entry = find_work(worker, &retry))) {
+			run_entry(worker, entry);
+			continue;
+		}
+		if(retry) {
+			sched_yield();
+			continue;
+		}
+
+		__atomic_fetch_add(&wqueue->sleeping, 1, __ATOMIC_SEQ_CST);
+		entry = find_work(worker, &retry);
+		if(entry || retry || __atomic_load_n(&wqueue->do_exit, __ATOMIC_ACQUIRE)) {
+			// A producer may have claimed our sleep already, consume its wake
+			if(!claim_sleeper(wqueue)) {
+				wait_wake(wqueue);
+			}
+			if(entry) {
+				run_entry(worker, entry);
+			}
+			continue;
+		}
+		wait_wake(wqueue);
+	}
+
+	return NULL;
+}
+
+// Workqueue CPUs of the topology, a node without any uses those of all nodes
+static unsigned int topology_workers(unsigned numa_node, int* cpus) {
+	unsigned int node, num_cpus = 0;
+
+	if(num_workqueues > 1) {
+		num_cpus = topology_role_cpus_on_node(topology, TOPOLOGY_ROLE_WORKQUEUE, numa_node, cpus, WORKQUEUE_WORKERS_MAX);
+		if(num_cpus) {
+			return num_cpus;
+		}
+	}
+	for(node = 0; node < topology->num_nodes && num_cpus < WORKQUEUE_WORKERS_MAX; node++) {
+		num_cpus += topology_role_cpus_on_node(topology, TOPOLOGY_ROLE_WORKQUEUE, node, cpus + num_cpus,
+			WORKQUEUE_WORKERS_MAX - num_cpus);
+	}
+	return num_cpus;
+}
+
+// Fills cpus with the CPU of each worker, -1 if it should not be pinned
+static unsigned int count_workers(unsigned numa_node, int* cpus) {
+	long num_cpus = 0;
+	unsigned int i;
+#ifdef FEATURE_NUMA
+	struct bitmask* cpumask;
+#endif
+
+	if(topology && (num_cpus = topology_workers(numa_node, cpus))) {
+		return num_cpus;
+	}
+#ifdef FEATURE_NUMA
+	if(numa_available() >= 0) {
+		cpumask = numa_allocate_cpumask();
+		if(cpumask) {
+			if(!numa_node_to_cpus(numa_node, cpumask)) {
+				for(i = 0; i < cpumask->size && num_cpus < WORKQUEUE_WORKERS_MAX; i++) {
+					if(numa_bitmask_isbitset(cpumask, i)) {
+						cpus[num_cpus++] = i;
 					}
-					pthread_mutex_unlock(&wqueue->lock);
-					free(entry);
-					goto fail;
 				}
 			}
-next:
-			free(entry);
+			numa_free_cpumask(cpumask);
 		}
 	}
+	if(num_cpus > 0) {
+		return num_cpus;
+	}
+#endif
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_cpus <= 0) {
+		num_cpus = 1;
+	}
+	num_cpus = min(num_cpus, WORKQUEUE_WORKERS_MAX);
+	for(i = 0; i < num_cpus; i++) {
+		cpus[i] = -1;
+	}
+	return num_cpus;
+}
 
-fail:
-	return NULL;
+static void drain_entries(struct workqueue* wqueue, struct workqueue_worker* worker) {
+	struct workqueue_entry* entry;
+	bool retry;
+
+	while((entry = deque_take(&worker->deque))) {
+		finish_entry(entry, -ECANCELED);
+	}
+	while((entry = inbox_pop(worker, &retry))) {
+		finish_entry(entry, -ECANCELED);
+	}
 }
 
-static void stop_workqueue(struct workqueue* wqueue) {
-	wqueue->do_exit = true;
-	pthread_cond_broadcast(&wqueue->cond);
-	pthread_join(wqueue->thread, NULL);
-	while(!llist_is_empty(&wqueue->entries)) {
-		struct llist_entry* llentry = llist_get_entry(&wqueue->entries, 0);
-		struct workqueue_entry* entry = llist_entry_get_value(llentry, struct workqueue_entry, list);
-		llist_remove(llentry);
-		if(entry->cleanup) {
-			entry->cleanup(0, entry->priv);
+static void stop_workqueue(struct workqueue* wqueue, unsigned int num_started) {
+	unsigned int i;
+
+	__atomic_store_n(&wqueue->do_exit, true, __ATOMIC_RELEASE);
+	for(i = 0; i < num_started; i++) {
+		sem_post(&wqueue->wake);
+	}
+	for(i = 0; i < num_started; i++) {
+		pthread_join(wqueue->workers[i].thread, NULL);
+	}
+}
+
+static void free_workqueue(struct workqueue* wqueue) {
+	unsigned int i;
+
+	// All producers and workers are gone by now, pending pushes are complete
+	for(i = 0; i < wqueue->num_workers; i++) {
+		drain_entries(wqueue, &wqueue->workers[i]);
+	}
+	sem_destroy(&wqueue->wake);
+	free(wqueue->steal_order);
+	free(wqueue->workers);
+	free(wqueue->pool);
+}
+
+static int setup_steal_order(struct workqueue* wqueue) {
+	unsigned i, j, node;
+
+	wqueue->steal_order = calloc(max(num_workqueues - 1, 1), sizeof(*wqueue->steal_order));
+	if(!wqueue->steal_order) {
+		return -ENOMEM;
+	}
+	// Insertion sort of the other nodes by distance
+	for(i = 0, node = 0; node < num_workqueues; node++) {
+		if(node == wqueue->numa_node) {
+			continue;
 		}
-		free(entry);
+		for(j = i; j > 0 && numa_distance(wqueue->numa_node, wqueue->steal_order[j - 1]) > numa_distance(wqueue->numa_node, node); j--) {
+			wqueue->steal_order[j] = wqueue->steal_order[j - 1];
+		}
+		wqueue->steal_order[j] = node;
+		i++;
+	}
+	return 0;
+}
+
+static int alloc_workqueue(struct workqueue* wqueue, unsigned numa_node) {
+	int err;
+	unsigned int i;
+	int cpus[WORKQUEUE_WORKERS_MAX];
+	struct workqueue_worker* worker;
+
+	wqueue->numa_node = numa_node;
+	wqueue->num_workers = count_workers(numa_node, cpus);
+	sem_init(&wqueue->wake, 0, 0);
+
+	if((err = setup_steal_order(wqueue))) {
+		goto fail;
+	}
+
+	wqueue->pool = calloc(WORKQUEUE_POOL_SIZE, sizeof(*wqueue->pool));
+	if(!wqueue->pool) {
+		err = -ENOMEM;
+		goto fail_steal_order;
 	}
+	for(i = 0; i < WORKQUEUE_POOL_SIZE; i++) {
+		wqueue->pool[i].pool_index = i;
+		wqueue->pool[i].pool_owner = wqueue;
+		wqueue->pool[i].pool_next = i + 1 < WORKQUEUE_POOL_SIZE ? i + 1 : POOL_NONE;
+	}
+	wqueue->pool_free = POOL_HEAD(0, 0);
+
+	wqueue->workers = aligned_alloc(64, wqueue->num_workers * sizeof(*wqueue->workers));
+	if(!wqueue->workers) {
+		err = -ENOMEM;
+		goto fail_pool;
+	}
+	memset(wqueue->workers, 0, wqueue->num_workers * sizeof(*wqueue->workers));
+	for(i = 0; i < wqueue->num_workers; i++) {
+		worker = &wqueue->workers[i];
+		worker->wqueue = wqueue;
+		worker->index = i;
+		worker->cpu = cpus[i];
+		worker->head = &worker->stub;
+		worker->tail = &worker->stub;
+	}
+
+	return 0;
+
+fail_pool:
+	free(wqueue->pool);
+fail_steal_order:
+	free(wqueue->steal_order);
+fail:
+	sem_destroy(&wqueue->wake);
+	return err;
 }
 
+static int start_workqueue(struct workqueue* wqueue) {
+	int err;
+	unsigned int i;
+
+	for(i = 0; i < wqueue->num_workers; i++) {
+		if((err = -pthread_create(&wqueue->workers[i].thread, NULL, work_thread, &wqueue->workers[i]))) {
+			stop_workqueue(wqueue, i);
+			return err;
+		}
+	}
+	return 0;
+}
 
 // TODO: Handle CPU hotplug?
-int workqueue_init() {
-	int err = 0, i;
+int workqueue_init(struct topology* topo) {
+	int err = 0;
+	unsigned i, num_allocated = 0, num_started = 0;
 
+	topology = topo;
 	num_workqueues = 1;
-	if(numa_available()) {
-		num_workqueues = numa_max_node();
+	if(numa_available() >= 0) {
+		num_workqueues = numa_max_node() + 1;
 	}
 
 	workqueues = calloc(num_workqueues, sizeof(struct workqueue));
@@ -82,62 +645,168 @@ int workqueue_init() {
 		goto fail;
 	}
 
-	for(i = 0; i < num_workqueues; i++) {
-		struct workqueue* wqueue = &workqueues[i];
-		wqueue->numa_node = i;
-		pthread_mutex_init(&wqueue->lock, NULL);
-		pthread_cond_init(&wqueue->cond, NULL);
-		llist_init(&wqueue->entries);
-
-		if((err = -pthread_create(&wqueue->thread, NULL, work_thread, wqueue))) {
-			goto fail_threads;
+	// Workers steal across nodes, all workqueues must exist before any worker runs
+	for(num_allocated = 0; num_allocated < num_workqueues; num_allocated++) {
+		if((err = alloc_workqueue(&workqueues[num_allocated], num_allocated))) {
+			goto fail_workqueues;
+		}
+	}
+	for(num_started = 0; num_started < num_workqueues; num_started++) {
+		if((err = start_workqueue(&workqueues[num_started]))) {
+			goto fail_workqueues;
 		}
 	}
 
 	return 0;
 
-fail_threads:
-	while(i-- > 0) {
-		stop_workqueue(&workqueues[i]);
+fail_workqueues:
+	for(i = 0; i < num_started; i++) {
+		stop_workqueue(&workqueues[i], workqueues[i].num_workers);
+	}
+	for(i = 0; i < num_allocated; i++) {
+		free_workqueue(&workqueues[i]);
 	}
 	free(workqueues);
+	workqueues = NULL;
 fail:
+	num_workqueues = 0;
 	return err;
 }
 
 void workqueue_deinit() {
-	int i;
+	unsigned i;
+
+	// Workers of other nodes may still steal, stop all before freeing any
 	for(i = 0; i < num_workqueues; i++) {
-		stop_workqueue(&workqueues[i]);
+		stop_workqueue(&workqueues[i], workqueues[i].num_workers);
+	}
+	for(i = 0; i < num_workqueues; i++) {
+		free_workqueue(&workqueues[i]);
 	}
 	num_workqueues = 0;
 	free(workqueues);
+	workqueues = NULL;
 }
 
-int workqueue_enqueue(unsigned numa_node, void* priv, wqueue_cb cb, wqueue_err err, wqueue_cleanup cleanup) {
+static struct workqueue* get_workqueue(unsigned numa_node) {
+	// Without NUMA support all nodes share one workqueue
+	if(num_workqueues == 1) {
+		return &workqueues[0];
+	}
+	if(numa_node >= num_workqueues) {
+		return NULL;
+	}
+	return &workqueues[numa_node];
+}
+
+unsigned int workqueue_num_workers(unsigned numa_node) {
+	struct workqueue* wqueue;
+
+	if(!num_workqueues) {
+		return 0;
+	}
+	wqueue = get_workqueue(numa_node);
+	return wqueue ? wqueue->num_workers : 0;
+}
+
+static void submit(struct workqueue* wqueue, struct workqueue_entry* entry) {
+	struct workqueue_worker* worker;
+
+	if(entry->completion) {
+		completion_add(entry->completion);
+	}
+	// Jobs submitted by a worker of the same node stay with it unless stolen
+	if(current_worker && current_worker->wqueue == wqueue && deque_push(&current_worker->deque, entry)) {
+		wake_one(wqueue);
+		return;
+	}
+	worker = &wqueue->workers[__atomic_fetch_add(&wqueue->next_worker, 1, __ATOMIC_RELAXED) % wqueue->num_workers];
+	inbox_push(worker, entry);
+	wake_one(wqueue);
+}
+
+int workqueue_enqueue_completion(unsigned numa_node, struct workqueue_completion* completion, void* priv,
+	wqueue_cb cb, wqueue_err err, wqueue_cleanup cleanup) {
 	struct workqueue* wqueue;
 	struct workqueue_entry* entry;
 
-	if(numa_node >= num_workqueues) {
+	if(!num_workqueues) {
+		return -EINVAL;
+	}
+	wqueue = get_workqueue(numa_node);
+	if(!wqueue) {
 		return -EINVAL;
 	}
 
-	entry = calloc(1, sizeof(struct workqueue_entry));
+	entry = pool_get(wqueue);
 	if(!entry) {
 		return -ENOMEM;
 	}
 
-	entry->priv = priv;
+	entry_init(entry, priv, completion);
 	entry->cb = cb;
 	entry->err = err;
 	entry->cleanup = cleanup;
+	submit(wqueue, entry);
+
+	return 0;
+}
+
+int workqueue_enqueue(unsigned numa_node, void* priv, wqueue_cb cb, wqueue_err err, wqueue_cleanup cleanup) {
+	return workqueue_enqueue_completion(numa_node, NULL, priv, cb, err, cleanup);
+}
+
+/*
+ * Run cb over [start, end) in chunks of at most grain items. Workers split
+ * the range lazily, so idle workers can steal from busy ones. Without
+ * workqueues, e.g. in tools, the whole range runs on the calling thread and
+ * its error is returned directly.
+ */
+int workqueue_parallel_for(unsigned numa_node, struct workqueue_completion* completion, unsigned int start, unsigned int end,
+	unsigned int grain, void* priv, wqueue_range_cb cb) {
+	struct workqueue* wqueue;
+	struct workqueue_entry* entry;
+
+	if(start >= end) {
+		return 0;
+	}
+	if(!num_workqueues || !(wqueue = get_workqueue(numa_node)) || !(entry = pool_get(wqueue))) {
+		return cb(priv, start, end);
+	}
 
-	wqueue = &workqueues[numa_node];
-	pthread_mutex_lock(&wqueue->lock);
-	llist_append(&wqueue->entries, &entry->list);
-	num_workqueue_items++;
-	pthread_mutex_unlock(&wqueue->lock);
-	pthread_cond_broadcast(&wqueue->cond);
+	entry_init(entry, priv, completion);
+	entry->range_cb = cb;
+	entry->start = start;
+	entry->end = end;
+	entry->grain = max(grain, 1);
+	submit(wqueue, entry);
 
 	return 0;
 }
+
+void workqueue_completion_init(struct workqueue_completion* completion) {
+	completion->pending = 0;
+	completion->err = 0;
+	pthread_mutex_init(&completion->lock, NULL);
+	pthread_cond_init(&completion->cond, NULL);
+}
+
+void workqueue_completion_destroy(struct workqueue_completion* completion) {
+	pthread_cond_destroy(&completion->cond);
+	pthread_mutex_destroy(&completion->lock);
+}
+
+// Wait for all jobs of the completion, returns the first error of any of them
+int workqueue_completion_wait(struct workqueue_completion* completion) {
+	int err;
+
+	pthread_mutex_lock(&completion->lock);
+	while(__atomic_load_n(&completion->pending, __ATOMIC_ACQUIRE)) {
+		pthread_cond_wait(&completion->cond, &completion->lock);
+	}
+	err = completion->err;
+	completion->err = 0;
+	pthread_mutex_unlock(&completion->lock);
+
+	return err;
+}
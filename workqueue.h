@@ -2,35 +2,116 @@
 #define _WORKQUEUE_H_
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#include "llist.h"
+#include "topology.h"
+
+// Entries preallocated per NUMA node, enqueueing falls back to malloc once they are used up
+#define WORKQUEUE_POOL_SIZE 1024
+// Upper limit for workers per NUMA node, there is one worker per core up to this
+#define WORKQUEUE_WORKERS_MAX 64
+// Capacity of the per worker deques, must be a power of two
+#define WORKQUEUE_DEQUE_SIZE 256
 
 typedef int (*wqueue_cb)(void* priv);
 typedef int (*wqueue_err)(int err, void* priv);
 typedef void (*wqueue_cleanup)(int err, void* priv);
+// Process items [start, end) of a parallel_for
+typedef int (*wqueue_range_cb)(void* priv, unsigned int start, unsigned int end);
+
+/*
+ * Completion handle for fanned out jobs
+ *
+ * Every job enqueued with a completion increments its pending count, the
+ * count is decremented once the job has run or was discarded. A completion
+ * is reusable after workqueue_completion_wait returned. Jobs must not wait
+ * for completions themselves.
+ */
+struct workqueue_completion {
+	unsigned int pending;
+	// First error returned by any job of the completion
+	int err;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
 
 struct workqueue_entry {
-	int (*cb)(void* priv);
-	int (*err)(int err, void* priv);
-	void (*cleanup)(int err, void* priv);
+	wqueue_cb cb;
+	wqueue_err err;
+	wqueue_cleanup cleanup;
 	void* priv;
+	struct workqueue_completion* completion;
+
+	// Set instead of cb for parallel_for jobs
+	wqueue_range_cb range_cb;
+	unsigned int start;
+	unsigned int end;
+	unsigned int grain;
+
+	// MPSC queue linkage
+	struct workqueue_entry* next;
+	// Index of the next free pool entry, -1 if not pooled
+	int32_t pool_next;
+	int32_t pool_index;
+	// Workqueue whose pool the entry belongs to
+	struct workqueue* pool_owner;
+};
 
-	struct llist_entry list;
+// Chase-Lev deque, the owner pushes and takes at the bottom, thieves steal from the top
+struct workqueue_deque {
+	int64_t top __attribute__((aligned(64)));
+	int64_t bottom __attribute__((aligned(64)));
+	struct workqueue_entry* entries[WORKQUEUE_DEQUE_SIZE];
 };
 
+struct workqueue_worker {
+	struct workqueue* wqueue;
+	unsigned int index;
+	// CPU the worker is pinned to, -1 if not pinned
+	int cpu;
+	// MPSC inbox for jobs from outside the pool, head is pushed to by producers
+	struct workqueue_entry* head;
+	struct workqueue_entry* tail;
+	struct workqueue_entry stub;
+	// Held by whoever consumes from the inbox, the owner or a thief
+	bool inbox_busy;
+	struct workqueue_deque deque;
+	pthread_t thread;
+} __attribute__((aligned(64)));
+
 struct workqueue {
-	struct llist entries;
 	unsigned numa_node;
+	unsigned int num_workers;
+	struct workqueue_worker* workers;
+	// Round robin distribution of jobs over worker inboxes
+	unsigned int next_worker;
 	bool do_exit;
 
-	pthread_t thread;
-	pthread_cond_t cond;
-	pthread_mutex_t lock;
+	// Workers that found nothing to do and wait for wake
+	unsigned int sleeping;
+	sem_t wake;
+
+	// Other workqueues ordered by NUMA distance, stealing tries them in this order
+	unsigned* steal_order;
+
+	struct workqueue_entry* pool;
+	// Free list of pool entries, ABA tag in upper 32 bits, index in lower 32 bits
+	uint64_t pool_free;
 };
 
-int workqueue_init();
+int workqueue_init(struct topology* topo);
 void workqueue_deinit();
+unsigned int workqueue_num_workers(unsigned numa_node);
 int workqueue_enqueue(unsigned numa_node, void* priv, wqueue_cb cb, wqueue_err err, wqueue_cleanup cleanup);
+int workqueue_enqueue_completion(unsigned numa_node, struct workqueue_completion* completion, void* priv,
+	wqueue_cb cb, wqueue_err err, wqueue_cleanup cleanup);
+int workqueue_parallel_for(unsigned numa_node, struct workqueue_completion* completion, unsigned int start, unsigned int end,
+	unsigned int grain, void* priv, wqueue_range_cb cb);
+
+void workqueue_completion_init(struct workqueue_completion* completion);
+void workqueue_completion_destroy(struct workqueue_completion* completion);
+int workqueue_completion_wait(struct workqueue_completion* completion);
 
 #endif